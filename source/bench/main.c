@@ -0,0 +1,128 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "../lib/fluxfs.h"
+
+static const char *backendNames[] = { "pread", "mmap" };
+
+static void usage(const char *name) {
+	printf("Usage: %s [options] <input.vf>...\n", name);
+	printf("  Times random reads of virtual files through each source I/O backend,\n");
+	printf("  to choose the source_io mount option for a library\n");
+	printf("  -n <reads>     Reads per backend (default 10000)\n");
+	printf("  -s <bytes>     Bytes per read (default 131072)\n");
+}
+
+// The same offsets are read through every backend
+static uint64_t next_random(uint64_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+// Seconds taken by the reads, negative if a file failed to load or read.
+// Adds the bytes read to *bytes.
+static double run_backend(char **paths, int count, long reads, size_t size, char *buf, uint64_t *bytes) {
+	struct fluxfs_vf **vfs = calloc(count, sizeof(struct fluxfs_vf *));
+	double seconds = -1;
+	if (!vfs) {
+		return -1;
+	}
+	for (int i = 0; i < count; i++) {
+		vfs[i] = fluxfs_load_vf(paths[i]);
+		if (!vfs[i]) {
+			fprintf(stderr, "Failed to load %s\n", paths[i]);
+			goto done;
+		}
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t state = 88172645463325252ull;
+	for (long r = 0; r < reads; r++) {
+		struct fluxfs_vf *vf = vfs[next_random(&state) % count];
+		uint64_t offset = vf->size > size ? next_random(&state) % (vf->size - size) : 0;
+		int got = fluxfs_read_from_vf(vf, buf, size, offset);
+		if (got < 0) {
+			fprintf(stderr, "Read failed at %" PRIu64 "\n", offset);
+			goto done;
+		}
+		*bytes += got;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+done:
+	for (int i = 0; i < count; i++) {
+		fluxfs_free_vf(vfs[i]);
+	}
+	free(vfs);
+	return seconds;
+}
+
+int main(int argc, char *argv[]) {
+	long reads = 10000;
+	size_t size = 131072;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			reads = atol(optarg);
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc || reads < 1 || size < 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	char *buf = malloc(size);
+	if (!buf) {
+		perror("malloc failed");
+		return EXIT_FAILURE;
+	}
+
+	// A first pass with the default backend brings the sources into the page
+	// cache, so the backends are compared on equal terms
+	uint64_t bytes = 0;
+	if (run_backend(argv + optind, argc - optind, reads, size, buf, &bytes) < 0) {
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	const char *best = NULL;
+	double bestSeconds = 0;
+	for (size_t b = 0; b < sizeof(backendNames) / sizeof(backendNames[0]); b++) {
+		fluxfs_source_set_backend(fluxfs_source_backend(backendNames[b]));
+		bytes = 0;
+		double seconds = run_backend(argv + optind, argc - optind, reads, size, buf, &bytes);
+		if (seconds < 0) {
+			free(buf);
+			return EXIT_FAILURE;
+		}
+		printf("%-6s %10.0f reads/s %10.1f MB/s\n", backendNames[b], reads / seconds,
+			bytes / seconds / 1e6);
+		if (!best || seconds < bestSeconds) {
+			best = backendNames[b];
+			bestSeconds = seconds;
+		}
+	}
+	fluxfs_source_set_backend(NULL);
+	printf("Fastest: -o source_io=%s\n", best);
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,277 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+// Loaded VFs, most recently used first. Entries in the list can be found by
+// path, stale entries are unlinked and only reachable from their handles.
+static struct vf_cache_entry *head = NULL;
+static struct vf_cache_entry *tail = NULL;
+static size_t count = 0;
+static size_t memory = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const size_t max_count = VF_CACHE_MAX_COUNT;
+static const size_t max_memory = VF_CACHE_MAX_MEMORY;
+static const int idle_seconds = VF_CACHE_IDLE_SECONDS;
+
+static void unlink_entry(struct vf_cache_entry *entry) {
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		tail = entry->prev;
+	}
+	entry->prev = NULL;
+	entry->next = NULL;
+	count--;
+	memory -= entry->memory;
+}
+
+static void link_entry(struct vf_cache_entry *entry) {
+	entry->prev = NULL;
+	entry->next = head;
+	if (head) {
+		head->prev = entry;
+	} else {
+		tail = entry;
+	}
+	head = entry;
+	count++;
+	memory += entry->memory;
+}
+
+static void free_entry(struct vf_cache_entry *entry) {
+	fluxfs_free_vf(entry->vf);
+	pthread_rwlock_destroy(&entry->lock);
+	free(entry->real_path);
+	free(entry);
+}
+
+// Remove an entry whose .vf changed on disk, handles still using it keep the
+// old copy until they are released. Called with the cache locked.
+static void retire_entry(struct vf_cache_entry *entry) {
+	unlink_entry(entry);
+	if (entry->refs == 0) {
+		free_entry(entry);
+	} else {
+		entry->stale = 1;
+	}
+}
+
+// Free unused entries from the least recently used end until within limits,
+// called with the cache locked
+static void enforce_limits(void) {
+	struct vf_cache_entry *entry = tail;
+	while (entry && (count > max_count || memory > max_memory)) {
+		struct vf_cache_entry *prev = entry->prev;
+		if (entry->refs == 0) {
+			unlink_entry(entry);
+			free_entry(entry);
+		}
+		entry = prev;
+	}
+	// Then entries in use give back the index pages they decoded, unless
+	// they are being read or changed right now
+	for (entry = tail; entry && memory > max_memory; entry = entry->prev) {
+		size_t pages = atomic_load(&entry->page_memory);
+		if (pages && pthread_rwlock_trywrlock(&entry->lock) == 0) {
+			fluxfs_vf_drop_pages(entry->vf);
+			pthread_rwlock_unlock(&entry->lock);
+			atomic_store(&entry->page_memory, 0);
+			entry->memory -= pages;
+			memory -= pages;
+		}
+	}
+}
+
+static struct vf_cache_entry *find_entry(const char *real_path) {
+	for (struct vf_cache_entry *entry = head; entry; entry = entry->next) {
+		if (strcmp(entry->real_path, real_path) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static int same_mtime(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+void overlay_key_init(struct overlay_key *key, const struct stat *st) {
+	memset(key, 0, sizeof(*key));
+	if (st) {
+		key->inode = st->st_ino;
+		key->size = st->st_size;
+		key->mtime = st->st_mtim;
+	}
+}
+
+static int same_overlay(const struct overlay_key *a, const struct overlay_key *b) {
+	return a->inode == b->inode && a->size == b->size && same_mtime(&a->mtime, &b->mtime);
+}
+
+// The overlay of a .vf as it is now, appended to by tools as well as the mount
+static void stat_overlay(const char *real_path, struct overlay_key *key) {
+	char *path = fluxfs_overlay_path(real_path);
+	struct stat st;
+	overlay_key_init(key, path && stat(path, &st) == 0 ? &st : NULL);
+	free(path);
+}
+
+// Get the loaded VF of a .vf file or pack record, loading it with its overlay applied if it
+// is not cached or either changed on disk since. Release it with vf_cache_release.
+struct vf_cache_entry *vf_cache_acquire(const char *real_path) {
+	struct stat st;
+	if (fluxfs_vf_stat(real_path, &st) != 0) {
+		return NULL;
+	}
+	// Taken before loading, so records appended meanwhile reload it next time
+	struct overlay_key overlay;
+	stat_overlay(real_path, &overlay);
+
+	pthread_mutex_lock(&cache_lock);
+	struct vf_cache_entry *entry = find_entry(real_path);
+	if (entry && (!same_mtime(&entry->mtime, &st.st_mtim) || !same_overlay(&entry->overlay, &overlay))) {
+		retire_entry(entry);
+		entry = NULL;
+	}
+	if (entry) {
+		entry->refs++;
+		entry->last_used = time(NULL);
+		unlink_entry(entry);
+		link_entry(entry);
+		pthread_mutex_unlock(&cache_lock);
+		return entry;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	// Load without the cache locked so other files are not held up
+	struct fluxfs_vf *vf = fluxfs_load_vf(real_path);
+	if (!vf) {
+		return NULL;
+	}
+	if (fluxfs_overlay_apply(vf, real_path) != 0) {
+		fluxfs_free_vf(vf);
+		return NULL;
+	}
+
+	struct vf_cache_entry *loaded = calloc(1, sizeof(struct vf_cache_entry));
+	if (!loaded || !(loaded->real_path = strdup(real_path))) {
+		free(loaded);
+		fluxfs_free_vf(vf);
+		return NULL;
+	}
+	pthread_rwlock_init(&loaded->lock, NULL);
+	loaded->vf = vf;
+	loaded->mtime = st.st_mtim;
+	loaded->overlay = overlay;
+	loaded->memory = fluxfs_vf_memory(vf);
+	atomic_init(&loaded->page_memory, fluxfs_vf_page_memory(vf));
+	loaded->refs = 1;
+	loaded->last_used = time(NULL);
+
+	pthread_mutex_lock(&cache_lock);
+	entry = find_entry(real_path);
+	if (entry && same_mtime(&entry->mtime, &loaded->mtime) && same_overlay(&entry->overlay, &loaded->overlay)) {
+		// Another thread loaded it first
+		entry->refs++;
+		pthread_mutex_unlock(&cache_lock);
+		free_entry(loaded);
+		return entry;
+	}
+	if (entry) {
+		retire_entry(entry);
+	}
+	link_entry(loaded);
+	enforce_limits();
+	pthread_mutex_unlock(&cache_lock);
+
+	return loaded;
+}
+
+void vf_cache_release(struct vf_cache_entry *entry) {
+	pthread_mutex_lock(&cache_lock);
+	entry->refs--;
+	entry->last_used = time(NULL);
+	if (entry->refs == 0 && entry->stale) {
+		free_entry(entry);
+	} else {
+		enforce_limits();
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// Count the index pages decoded by reads of an entry, page_memory as read
+// with the entry locked. Called without the entry locked, so its pages
+// can be dropped if the cache is over its memory limit.
+void vf_cache_charge(struct vf_cache_entry *entry, size_t page_memory) {
+	if (page_memory < atomic_load(&entry->page_memory) + VF_CACHE_CHARGE_STEP) {
+		return;
+	}
+	pthread_mutex_lock(&cache_lock);
+	size_t charged = atomic_load(&entry->page_memory);
+	if (page_memory > charged) {
+		if (!entry->stale) {
+			memory += page_memory - charged;
+		}
+		entry->memory += page_memory - charged;
+		atomic_store(&entry->page_memory, page_memory);
+		enforce_limits();
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// Recount the memory of an entry after its VF was changed, called with the
+// entry locked. The change was logged to the overlay as before became
+// after; when the entry had replayed the overlay up to before, it now holds
+// after too. Otherwise someone else appended and the entry is reloaded by
+// the next acquire.
+void vf_cache_update(struct vf_cache_entry *entry, const struct overlay_key *before, const struct overlay_key *after) {
+	size_t size = fluxfs_vf_memory(entry->vf);
+	size_t pages = fluxfs_vf_page_memory(entry->vf);
+	pthread_mutex_lock(&cache_lock);
+	if (!entry->stale) {
+		memory = memory - entry->memory + size;
+		if (before && after && same_overlay(&entry->overlay, before)) {
+			entry->overlay = *after;
+		}
+	}
+	entry->memory = size;
+	atomic_store(&entry->page_memory, pages);
+	enforce_limits();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// The .vf was replaced, such as by folding its overlay, so load it again on
+// the next acquire. Handles using the old VF keep it until released.
+void vf_cache_retire(const char *real_path) {
+	pthread_mutex_lock(&cache_lock);
+	struct vf_cache_entry *entry = find_entry(real_path);
+	if (entry) {
+		retire_entry(entry);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// Free entries nobody has used for the idle time
+void vf_cache_evict_idle(time_t now) {
+	pthread_mutex_lock(&cache_lock);
+	struct vf_cache_entry *entry = tail;
+	while (entry) {
+		struct vf_cache_entry *prev = entry->prev;
+		if (entry->refs == 0 && now - entry->last_used >= idle_seconds) {
+			unlink_entry(entry);
+			free_entry(entry);
+		}
+		entry = prev;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
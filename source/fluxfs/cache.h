@@ -0,0 +1,57 @@
+#ifndef FLUXFS_CACHE_H
+#define FLUXFS_CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../lib/fluxfs.h"
+
+// Default limits for released VFs kept loaded
+#define VF_CACHE_MAX_COUNT 64
+#define VF_CACHE_MAX_MEMORY (256 * 1024 * 1024)
+#define VF_CACHE_IDLE_SECONDS 300
+// Index pages decoded by reads are counted once they add up to this much
+#define VF_CACHE_CHARGE_STEP (1024 * 1024)
+
+// The overlay journal a cached VF has replayed, all zero while there is none
+struct overlay_key {
+	ino_t inode;
+	off_t size;
+	struct timespec mtime;
+};
+
+// A loaded VF shared by every open handle of one .vf file
+struct vf_cache_entry {
+	char *real_path;
+	struct timespec mtime;
+	struct overlay_key overlay;
+	struct fluxfs_vf *vf;
+	// Held for reading while vf is read, which the library allows on several
+	// threads at once, and for writing while it is changed
+	pthread_rwlock_t lock;
+	// Approximate memory held by vf, as last counted
+	size_t memory;
+	// Part of memory in decoded index pages, which grows as vf is read and
+	// is given back when the pages are dropped
+	atomic_size_t page_memory;
+	// Open handles, the entry is only evicted at 0
+	int refs;
+	// Set when the .vf changed on disk, freed on the last release
+	int stale;
+	time_t last_used;
+	struct vf_cache_entry *prev;
+	struct vf_cache_entry *next;
+};
+
+struct vf_cache_entry *vf_cache_acquire(const char *real_path);
+void vf_cache_release(struct vf_cache_entry *entry);
+void vf_cache_charge(struct vf_cache_entry *entry, size_t page_memory);
+void overlay_key_init(struct overlay_key *key, const struct stat *st);
+void vf_cache_update(struct vf_cache_entry *entry, const struct overlay_key *before, const struct overlay_key *after);
+void vf_cache_retire(const char *real_path);
+void vf_cache_evict_idle(time_t now);
+
+#endif // !FLUXFS_CACHE_H
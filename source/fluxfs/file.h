@@ -0,0 +1,26 @@
+#ifndef FLUXFS_FILE_H
+#define FLUXFS_FILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+// State of one .vf file. States outlive directory snapshots, so overlays
+// and sizes carry over a rescan.
+struct fluxfs_file {
+	char *real_path;
+	uint64_t size;
+	// Reported modification time, the .vf mtime until the file is written
+	time_t mtime;
+	// Guards the size and overlay state, taken before a cache entry lock
+	pthread_mutex_t lock;
+	// Overlay log of writes not yet compacted into the .vf
+	FILE *overlay;
+	int dirty;
+	time_t modified;
+	// Set for the records of a pack, which are read only
+	int packed;
+};
+
+#endif // !FLUXFS_FILE_H
@@ -0,0 +1,907 @@
+
+#define _GNU_SOURCE // accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
+#include "../lib/fluxfs.h"
+#include "cache.h"
+#include "tree.h"
+#include "file.h"
+#include "http.h"
+
+// Largest request head accepted, longer requests are answered with 431
+#define HTTP_REQUEST_SIZE 8192
+// Buffer for response heads and entries that cannot be sent from a source
+#define HTTP_BUFFER_SIZE (64 * 1024)
+// Most bytes sent for one connection before others get a turn
+#define HTTP_SEND_CHUNK (1024 * 1024)
+// Seconds an idle connection is kept open
+#define HTTP_IDLE_TIMEOUT 60
+#define HTTP_MAX_EVENTS 64
+// Threads answering connections, so a read of a cold source holds up one
+// connection instead of the event loop
+#define HTTP_WORKERS 4
+
+// One client connection. A connection reads a request head, then sends the
+// buffered response head and body before reading the next request. The
+// buffers are only allocated while they are in use, so idle keep-alive
+// connections stay small.
+struct connection {
+	int fd;
+	int sending;
+	int keep_alive;
+	time_t last_active;
+	// Set while queued for or handled by a worker, the event loop leaves it be
+	int busy;
+	uint32_t events;
+	struct connection *ready_next;
+	char *request;
+	size_t request_used;
+	// Pending bytes of the response head, or a read from the VF
+	char *buffer;
+	char *out;
+	size_t out_length;
+	size_t out_sent;
+	// Generated directory listing, owned by the connection
+	char *body;
+	// Remaining virtual range of the response body
+	struct vf_cache_entry *entry;
+	uint64_t position;
+	uint64_t end;
+	struct connection *prev;
+	struct connection *next;
+};
+
+// Open connections and the ones with events for the workers, under lock
+static struct connection *connections = NULL;
+static struct connection *ready_head = NULL;
+static struct connection *ready_tail = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+static int epoll_fd = -1;
+
+static const struct {
+	const char *extension;
+	const char *type;
+} content_types[] = {
+	{ ".mkv", "video/x-matroska" },
+	{ ".mp4", "video/mp4" },
+	{ ".m4v", "video/mp4" },
+	{ ".m2ts", "video/mp2t" },
+	{ ".ts", "video/mp2t" },
+	{ ".mpg", "video/mpeg" },
+	{ ".mpeg", "video/mpeg" },
+	{ ".avi", "video/x-msvideo" },
+	{ ".webm", "video/webm" },
+	{ ".mp3", "audio/mpeg" },
+	{ ".flac", "audio/flac" },
+	{ ".iso", "application/x-iso9660-image" },
+	{ ".txt", "text/plain" },
+};
+
+static const char *content_type(const char *name) {
+	const char *extension = strrchr(name, '.');
+	if (extension) {
+		for (size_t i = 0; i < sizeof(content_types) / sizeof(content_types[0]); i++) {
+			if (strcasecmp(extension, content_types[i].extension) == 0) {
+				return content_types[i].type;
+			}
+		}
+	}
+	return "application/octet-stream";
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c = tolower((unsigned char)c);
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+// Decode a request target in place, dropping the query. Returns 1 for a
+// malformed escape or an embedded NUL.
+static int decode_target(char *target) {
+	char *in = target;
+	char *out = target;
+	while (*in && *in != '?' && *in != '#') {
+		if (*in == '%') {
+			int high = hex_value(in[1]);
+			int low = high < 0 ? -1 : hex_value(in[2]);
+			if (low < 0 || (high == 0 && low == 0)) {
+				return 1;
+			}
+			*out++ = (char)(high << 4 | low);
+			in += 3;
+		} else {
+			*out++ = *in++;
+		}
+	}
+	*out = '\0';
+	return 0;
+}
+
+// Append to a growing buffer, returns 1 if out of memory
+static int append_text(char **text, size_t *length, size_t *capacity, const char *add, size_t size) {
+	if (*length + size + 1 > *capacity) {
+		size_t grown = *capacity ? *capacity * 2 : 4096;
+		while (grown < *length + size + 1) {
+			grown *= 2;
+		}
+		char *resized = realloc(*text, grown);
+		if (!resized) {
+			return 1;
+		}
+		*text = resized;
+		*capacity = grown;
+	}
+	memcpy(*text + *length, add, size);
+	*length += size;
+	(*text)[*length] = '\0';
+	return 0;
+}
+
+// Append a name escaped for HTML text, or percent encoded for a link with
+// any separators kept
+static int append_name(char **text, size_t *length, size_t *capacity, const char *name, int link) {
+	for (const char *c = name; *c; c++) {
+		char escaped[8];
+		unsigned char u = (unsigned char)*c;
+		if (link && !(isalnum(u) || strchr("-._~/", u))) {
+			snprintf(escaped, sizeof(escaped), "%%%02X", u);
+		} else if (!link && u == '&') {
+			strcpy(escaped, "&amp;");
+		} else if (!link && u == '<') {
+			strcpy(escaped, "&lt;");
+		} else if (!link && u == '>') {
+			strcpy(escaped, "&gt;");
+		} else if (!link && u == '"') {
+			strcpy(escaped, "&quot;");
+		} else {
+			escaped[0] = *c;
+			escaped[1] = '\0';
+		}
+		if (append_text(text, length, capacity, escaped, strlen(escaped)) != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int append_entry_link(char **text, size_t *length, size_t *capacity, const char *name, int dir) {
+	const char *suffix = dir ? "/" : "";
+	return append_text(text, length, capacity, "<a href=\"", 9) ||
+		append_name(text, length, capacity, name, 1) ||
+		append_text(text, length, capacity, suffix, strlen(suffix)) ||
+		append_text(text, length, capacity, "\">", 2) ||
+		append_name(text, length, capacity, name, 0) ||
+		append_text(text, length, capacity, suffix, strlen(suffix)) ||
+		append_text(text, length, capacity, "</a>\n", 5);
+}
+
+// HTML index of a directory, NULL if out of memory
+static char *list_directory(const struct tree *tree, const struct tree_dir *dir, const char *path, size_t *length) {
+	char *text = NULL;
+	size_t capacity = 0;
+	*length = 0;
+
+	int failed = append_text(&text, length, &capacity, "<html><head><title>", 19) ||
+		append_name(&text, length, &capacity, path, 0) ||
+		append_text(&text, length, &capacity, "</title></head><body><pre>\n", 27);
+	if (!failed && dir != &tree->dirs[0]) {
+		failed = append_text(&text, length, &capacity, "<a href=\"../\">../</a>\n", 22);
+	}
+	for (uint32_t i = 0; !failed && i < dir->dir_count; i++) {
+		failed = append_entry_link(&text, length, &capacity, tree_name(tree, tree->dirs[dir->first_dir + i].name), 1);
+	}
+	for (uint32_t i = 0; !failed && i < dir->file_count; i++) {
+		failed = append_entry_link(&text, length, &capacity, tree_name(tree, tree->files[dir->first_file + i].name), 0);
+	}
+	if (!failed) {
+		failed = append_text(&text, length, &capacity, "</pre></body></html>\n", 21);
+	}
+
+	if (failed) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+// Parse a single byte range of a file of the given size. Returns 0 with the
+// inclusive range set, 1 to ignore the header and 2 if it cannot be satisfied.
+static int parse_range(const char *value, uint64_t size, uint64_t *first, uint64_t *last) {
+	if (strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ',')) {
+		return 1;
+	}
+	value += 6;
+
+	char *end;
+	if (*value == '-') {
+		// The final n bytes
+		errno = 0;
+		unsigned long long count = strtoull(value + 1, &end, 10);
+		if (end == value + 1 || errno) {
+			return 1;
+		}
+		if (count == 0 || size == 0) {
+			return 2;
+		}
+		*first = count < size ? size - count : 0;
+		*last = size - 1;
+	} else {
+		errno = 0;
+		unsigned long long start = strtoull(value, &end, 10);
+		if (end == value || *end != '-' || errno) {
+			return 1;
+		}
+		const char *rest = end + 1;
+		unsigned long long stop = size ? size - 1 : 0;
+		if (*rest && *rest != ' ' && *rest != '\t') {
+			stop = strtoull(rest, &end, 10);
+			if (end == rest || errno || stop < start) {
+				return 1;
+			}
+			if (stop >= size) {
+				stop = size - 1;
+			}
+		}
+		if (start >= size) {
+			return 2;
+		}
+		*first = start;
+		*last = stop;
+	}
+	return 0;
+}
+
+// Find a header in the request head, returns its value with trailing space
+// removed or NULL
+static char *find_header(char *headers, const char *name, char *value, size_t size) {
+	size_t name_length = strlen(name);
+	for (char *line = headers; line && *line; ) {
+		char *next = strstr(line, "\r\n");
+		if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':') {
+			char *start = line + name_length + 1;
+			while (*start == ' ' || *start == '\t') {
+				start++;
+			}
+			size_t length = next ? (size_t)(next - start) : strlen(start);
+			while (length && (start[length - 1] == ' ' || start[length - 1] == '\t')) {
+				length--;
+			}
+			if (length >= size) {
+				length = size - 1;
+			}
+			memcpy(value, start, length);
+			value[length] = '\0';
+			return value;
+		}
+		line = next ? next + 2 : NULL;
+	}
+	return NULL;
+}
+
+// Queue a response head, plus an optional body held by the connection
+static void queue_head(struct connection *conn, int status, const char *reason, const char *headers, uint64_t length) {
+	conn->out_length = conn->out_sent = 0;
+	if (!conn->buffer && !(conn->buffer = malloc(HTTP_BUFFER_SIZE))) {
+		conn->keep_alive = 0;
+		return;
+	}
+	int size = snprintf(conn->buffer, HTTP_BUFFER_SIZE,
+		"HTTP/1.1 %d %s\r\n"
+		"Server: fluxfs\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"Content-Length: %llu\r\n"
+		"%s"
+		"Connection: %s\r\n"
+		"\r\n",
+		status, reason, (unsigned long long)length, headers ? headers : "",
+		conn->keep_alive ? "keep-alive" : "close");
+	if (size < 0 || size >= HTTP_BUFFER_SIZE) {
+		size = 0;
+	}
+	conn->out = conn->buffer;
+	conn->out_length = size;
+	conn->out_sent = 0;
+}
+
+static void queue_error(struct connection *conn, int status, const char *reason) {
+	queue_head(conn, status, reason, "Content-Type: text/plain\r\n", 0);
+}
+
+// Queue the response to a complete request head
+static void handle_request(struct connection *conn, char *head) {
+	char *headers = strstr(head, "\r\n");
+	*headers = '\0';
+	headers += 2;
+
+	char method[16];
+	char version[16];
+	char *target = malloc(strlen(head) + 1);
+	if (!target) {
+		conn->keep_alive = 0;
+		queue_error(conn, 500, "Internal Server Error");
+		return;
+	}
+	if (sscanf(head, "%15s %s %15s", method, target, version) != 3 || strncmp(version, "HTTP/1.", 7) != 0) {
+		free(target);
+		conn->keep_alive = 0;
+		queue_error(conn, 400, "Bad Request");
+		return;
+	}
+
+	char value[256];
+	if (find_header(headers, "Connection", value, sizeof(value))) {
+		conn->keep_alive = strcasecmp(value, "close") != 0 && (strcmp(version, "HTTP/1.0") != 0 || strcasecmp(value, "keep-alive") == 0);
+	} else {
+		conn->keep_alive = strcmp(version, "HTTP/1.0") != 0;
+	}
+
+	int head_only = strcmp(method, "HEAD") == 0;
+	if (!head_only && strcmp(method, "GET") != 0) {
+		free(target);
+		// A request body would be taken for the next request
+		conn->keep_alive = 0;
+		queue_head(conn, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n", 0);
+		return;
+	}
+	if (target[0] != '/' || decode_target(target) != 0) {
+		free(target);
+		queue_error(conn, 400, "Bad Request");
+		return;
+	}
+
+	unsigned slot;
+	const struct tree *tree = tree_enter(&slot);
+	const struct tree_dir *dir;
+	const struct tree_file *tree_file;
+	if (tree_lookup(tree, target, &dir, &tree_file) != 0) {
+		tree_exit(slot);
+		free(target);
+		queue_error(conn, 404, "Not Found");
+		return;
+	}
+
+	if (dir) {
+		size_t target_length = strlen(target);
+		if (target[target_length - 1] != '/') {
+			// Relative links in the listing need the trailing slash
+			tree_exit(slot);
+			char *location = NULL;
+			size_t length = 0;
+			size_t capacity = 0;
+			int failed = append_text(&location, &length, &capacity, "Location: ", 10) ||
+				append_name(&location, &length, &capacity, target, 1) ||
+				append_text(&location, &length, &capacity, "/\r\n", 3);
+			free(target);
+			if (failed) {
+				free(location);
+				queue_error(conn, 500, "Internal Server Error");
+				return;
+			}
+			queue_head(conn, 301, "Moved Permanently", location, 0);
+			free(location);
+			return;
+		}
+
+		size_t length;
+		char *body = list_directory(tree, dir, target, &length);
+		tree_exit(slot);
+		free(target);
+		if (!body) {
+			queue_error(conn, 500, "Internal Server Error");
+			return;
+		}
+		queue_head(conn, 200, "OK", "Content-Type: text/html; charset=utf-8\r\n", length);
+		if (head_only || !conn->buffer) {
+			free(body);
+		} else {
+			conn->body = body;
+			conn->end = length;
+		}
+		return;
+	}
+
+	// File states outlive snapshots, so the file is safe to use after exit
+	struct fluxfs_file *file = tree_file->file;
+	const char *type = content_type(tree_name(tree, tree_file->name));
+	tree_exit(slot);
+	free(target);
+
+	// Compaction rewrites the .vf with the file locked
+	pthread_mutex_lock(&file->lock);
+	struct vf_cache_entry *entry = vf_cache_acquire(file->real_path);
+	uint64_t size = file->size;
+	time_t mtime = file->mtime;
+	pthread_mutex_unlock(&file->lock);
+	if (!entry) {
+		queue_error(conn, 500, "Internal Server Error");
+		return;
+	}
+
+	char modified[64];
+	struct tm tm;
+	strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&mtime, &tm));
+
+	uint64_t first = 0;
+	uint64_t last = size ? size - 1 : 0;
+	int ranged = 1;
+	if (find_header(headers, "Range", value, sizeof(value))) {
+		ranged = parse_range(value, size, &first, &last);
+	}
+
+	char extra[512];
+	if (ranged == 2) {
+		vf_cache_release(entry);
+		snprintf(extra, sizeof(extra), "Content-Range: bytes */%llu\r\n", (unsigned long long)size);
+		queue_head(conn, 416, "Range Not Satisfiable", extra, 0);
+		return;
+	}
+
+	uint64_t length = size ? last - first + 1 : 0;
+	if (ranged == 0) {
+		snprintf(extra, sizeof(extra), "Content-Type: %s\r\nLast-Modified: %s\r\nContent-Range: bytes %llu-%llu/%llu\r\n",
+			type, modified, (unsigned long long)first, (unsigned long long)last, (unsigned long long)size);
+		queue_head(conn, 206, "Partial Content", extra, length);
+	} else {
+		snprintf(extra, sizeof(extra), "Content-Type: %s\r\nLast-Modified: %s\r\n", type, modified);
+		queue_head(conn, 200, "OK", extra, length);
+	}
+
+	if (head_only || length == 0 || !conn->buffer) {
+		vf_cache_release(entry);
+		return;
+	}
+	conn->entry = entry;
+	conn->position = first;
+	conn->end = first + length;
+}
+
+// Take a connection off the list, called with lock held
+static void unlink_connection(struct connection *conn) {
+	if (conn->prev) {
+		conn->prev->next = conn->next;
+	} else {
+		connections = conn->next;
+	}
+	if (conn->next) {
+		conn->next->prev = conn->prev;
+	}
+}
+
+static void free_connection(struct connection *conn) {
+	if (conn->entry) {
+		vf_cache_release(conn->entry);
+	}
+	free(conn->body);
+	free(conn->request);
+	free(conn->buffer);
+	close(conn->fd);
+	free(conn);
+}
+
+static void close_connection(struct connection *conn) {
+	pthread_mutex_lock(&lock);
+	unlink_connection(conn);
+	pthread_mutex_unlock(&lock);
+	free_connection(conn);
+}
+
+// Read part of the body range into the buffer to send, through the block
+// cache, the I/O scheduler and the replicas like any FUSE read. Returns the
+// bytes read or -1 on error.
+static ssize_t read_body(struct connection *conn, uint64_t length) {
+	struct vf_cache_entry *entry = conn->entry;
+	if (length > HTTP_BUFFER_SIZE) {
+		length = HTTP_BUFFER_SIZE;
+	}
+	if (!conn->buffer && !(conn->buffer = malloc(HTTP_BUFFER_SIZE))) {
+		return -1;
+	}
+	pthread_rwlock_rdlock(&entry->lock);
+	int bytes = fluxfs_read_from_vf(entry->vf, conn->buffer, length, conn->position);
+	size_t page_memory = fluxfs_vf_page_memory(entry->vf);
+	pthread_rwlock_unlock(&entry->lock);
+	vf_cache_charge(entry, page_memory);
+	if (bytes <= 0) {
+		return -1;
+	}
+	conn->out = conn->buffer;
+	conn->out_length = bytes;
+	conn->out_sent = 0;
+	conn->position += bytes;
+	return bytes;
+}
+
+// Send part of the body range, at most HTTP_SEND_CHUNK bytes. Returns the
+// bytes sent, 0 if the socket is full or -1 on error.
+static ssize_t send_body(struct connection *conn) {
+	struct vf_cache_entry *entry = conn->entry;
+	uint64_t length = conn->end - conn->position;
+	if (length > HTTP_SEND_CHUNK) {
+		length = HTTP_SEND_CHUNK;
+	}
+
+	pthread_rwlock_rdlock(&entry->lock);
+	struct fluxfs_segment segment;
+	if (fluxfs_vf_get_segment(entry->vf, conn->position, &segment) != 0) {
+		// The file shrank since the response head was sent
+		pthread_rwlock_unlock(&entry->lock);
+		return -1;
+	}
+	size_t page_memory = fluxfs_vf_page_memory(entry->vf);
+	if (length > segment.length) {
+		length = segment.length;
+	}
+
+	ssize_t sent;
+	if (segment.bytes) {
+		// Changes free embedded bytes, they are sent with the entry locked
+		sent = send(conn->fd, segment.bytes, length, MSG_NOSIGNAL);
+		pthread_rwlock_unlock(&entry->lock);
+		vf_cache_charge(entry, page_memory);
+	} else {
+		pthread_rwlock_unlock(&entry->lock);
+		vf_cache_charge(entry, page_memory);
+		if (segment.fd < 0) {
+			// Decoded entries and sources that cannot be copied directly
+			return read_body(conn, length);
+		}
+		// Straight from the source file, without copying through the daemon.
+		// The descriptor stays open while the connection holds the entry.
+		off_t offset = segment.fileOffset;
+		sent = sendfile(conn->fd, segment.fd, &offset, length);
+		if (sent == 0 || (sent < 0 && errno == EIO)) {
+			// The source failed or ends before the reference does, a read
+			// through the library reports it or finds another replica
+			return read_body(conn, length);
+		}
+	}
+
+	if (sent < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	}
+	conn->position += sent;
+	return sent;
+}
+
+// Events of a connection are reported once, then it is handed to a worker
+// until the worker watches it again
+static int watch(struct connection *conn, uint32_t events, int op) {
+	struct epoll_event event = { .events = events | EPOLLONESHOT, .data.ptr = conn };
+	return epoll_ctl(epoll_fd, op, conn->fd, &event);
+}
+
+// Take the next complete request from the read buffer, returns 1 if there
+// is none yet and -1 if the connection must close
+static int next_request(struct connection *conn) {
+	if (!conn->request) {
+		return 1;
+	}
+	conn->request[conn->request_used] = '\0';
+	char *end = strstr(conn->request, "\r\n\r\n");
+	if (!end) {
+		if (conn->request_used >= HTTP_REQUEST_SIZE - 1) {
+			conn->keep_alive = 0;
+			queue_error(conn, 431, "Request Header Fields Too Large");
+			conn->sending = 1;
+			return 0;
+		}
+		return 1;
+	}
+
+	// Requests are heads only, bodies are not accepted
+	size_t head_length = end + 4 - conn->request;
+	end[2] = '\0';
+	handle_request(conn, conn->request);
+	memmove(conn->request, conn->request + head_length, conn->request_used - head_length);
+	conn->request_used -= head_length;
+	conn->sending = 1;
+	return 0;
+}
+
+// Send what is pending, returns 1 when the response is done and -1 if the
+// connection must close
+static int flush_response(struct connection *conn) {
+	for (;;) {
+		if (conn->out_sent < conn->out_length) {
+			ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_length - conn->out_sent, MSG_NOSIGNAL);
+			if (sent < 0) {
+				return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+			}
+			conn->out_sent += sent;
+			continue;
+		}
+		if (conn->body && conn->out != conn->body) {
+			conn->out = conn->body;
+			conn->out_length = conn->end;
+			conn->out_sent = 0;
+			continue;
+		}
+		if (conn->entry && conn->position < conn->end) {
+			ssize_t sent = send_body(conn);
+			if (sent <= 0) {
+				return sent;
+			}
+			// Let other connections have a turn between chunks
+			return 0;
+		}
+		break;
+	}
+
+	free(conn->body);
+	conn->body = NULL;
+	free(conn->buffer);
+	conn->buffer = NULL;
+	if (conn->entry) {
+		vf_cache_release(conn->entry);
+		conn->entry = NULL;
+	}
+	conn->out_length = conn->out_sent = 0;
+	conn->sending = 0;
+	return conn->keep_alive ? 1 : -1;
+}
+
+// Read and answer requests until the socket would block. Returns the events
+// to wait for, 0 once the connection is closed.
+static uint32_t service(struct connection *conn, uint32_t events) {
+	conn->last_active = time(NULL);
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		close_connection(conn);
+		return 0;
+	}
+
+	for (;;) {
+		if (conn->sending) {
+			int result = flush_response(conn);
+			if (result < 0) {
+				close_connection(conn);
+				return 0;
+			}
+			if (result == 0) {
+				// Wait for room in the socket, or give other connections a turn
+				return EPOLLOUT;
+			}
+		}
+
+		int result = next_request(conn);
+		if (result == 0) {
+			continue;
+		}
+		if (!conn->request && !(conn->request = malloc(HTTP_REQUEST_SIZE))) {
+			close_connection(conn);
+			return 0;
+		}
+		ssize_t received = recv(conn->fd, conn->request + conn->request_used, HTTP_REQUEST_SIZE - 1 - conn->request_used, 0);
+		if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			close_connection(conn);
+			return 0;
+		}
+		if (received < 0) {
+			if (conn->request_used == 0) {
+				free(conn->request);
+				conn->request = NULL;
+			}
+			return EPOLLIN;
+		}
+		conn->request_used += received;
+	}
+}
+
+// Hand a connection with events to the workers
+static void queue_ready(struct connection *conn, uint32_t events) {
+	pthread_mutex_lock(&lock);
+	conn->busy = 1;
+	conn->events = events;
+	conn->ready_next = NULL;
+	if (ready_tail) {
+		ready_tail->ready_next = conn;
+	} else {
+		ready_head = conn;
+	}
+	ready_tail = conn;
+	pthread_cond_signal(&ready_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static void *worker(__attribute__((unused)) void *arg) {
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (!ready_head) {
+			pthread_cond_wait(&ready_cond, &lock);
+		}
+		struct connection *conn = ready_head;
+		ready_head = conn->ready_next;
+		if (!ready_head) {
+			ready_tail = NULL;
+		}
+		pthread_mutex_unlock(&lock);
+
+		uint32_t events = service(conn, conn->events);
+		if (events) {
+			// Watched again with the lock held, so the idle sweep cannot
+			// close it in between
+			pthread_mutex_lock(&lock);
+			conn->busy = 0;
+			int failed = watch(conn, events, EPOLL_CTL_MOD) != 0;
+			if (failed) {
+				unlink_connection(conn);
+			}
+			pthread_mutex_unlock(&lock);
+			if (failed) {
+				free_connection(conn);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void accept_connections(int listener) {
+	for (;;) {
+		int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("accept");
+			}
+			return;
+		}
+		struct connection *conn = calloc(1, sizeof(struct connection));
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->last_active = time(NULL);
+		pthread_mutex_lock(&lock);
+		conn->next = connections;
+		if (connections) {
+			connections->prev = conn;
+		}
+		connections = conn;
+		int failed = watch(conn, EPOLLIN, EPOLL_CTL_ADD) != 0;
+		if (failed) {
+			unlink_connection(conn);
+		}
+		pthread_mutex_unlock(&lock);
+		if (failed) {
+			free_connection(conn);
+		}
+	}
+}
+
+static int open_listener(const char *address, unsigned port) {
+	char service_name[16];
+	snprintf(service_name, sizeof(service_name), "%u", port);
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+	struct addrinfo *addresses;
+	int error = getaddrinfo(address, service_name, &hints, &addresses);
+	if (error != 0) {
+		fprintf(stderr, "%s: %s\n", address, gai_strerror(error));
+		return -1;
+	}
+
+	int listener = -1;
+	for (struct addrinfo *ai = addresses; ai && listener < 0; ai = ai->ai_next) {
+		listener = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+		if (listener < 0) {
+			continue;
+		}
+		int on = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(listener, ai->ai_addr, ai->ai_addrlen) != 0 || listen(listener, SOMAXCONN) != 0) {
+			close(listener);
+			listener = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+	if (listener < 0) {
+		perror("Failed to listen");
+	}
+	return listener;
+}
+
+// Serve the virtual tree over HTTP/1.1 with byte ranges, until an error.
+// Reference entries are sent with sendfile straight from their sources. The
+// calling thread waits for events and HTTP_WORKERS threads answer them.
+int http_serve(const char *address, unsigned port) {
+	// sendfile raises SIGPIPE on a closed socket, it has no MSG_NOSIGNAL
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = open_listener(address, port);
+	if (listener < 0) {
+		return 1;
+	}
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		close(listener);
+		return 1;
+	}
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event) != 0) {
+		perror("epoll_ctl");
+		close(epoll_fd);
+		close(listener);
+		return 1;
+	}
+	for (int i = 0; i < HTTP_WORKERS; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+			perror("pthread_create");
+			close(epoll_fd);
+			close(listener);
+			return 1;
+		}
+		pthread_detach(thread);
+	}
+	printf("Serving HTTP on %s port %u\n", address, port);
+
+	struct epoll_event events[HTTP_MAX_EVENTS];
+	time_t last_sweep = time(NULL);
+	for (;;) {
+		int count = epoll_wait(epoll_fd, events, HTTP_MAX_EVENTS, 1000);
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			break;
+		}
+		for (int i = 0; i < count; i++) {
+			if (!events[i].data.ptr) {
+				accept_connections(listener);
+			} else {
+				queue_ready(events[i].data.ptr, events[i].events);
+			}
+		}
+
+		time_t now = time(NULL);
+		if (now != last_sweep) {
+			last_sweep = now;
+			struct connection *idle = NULL;
+			pthread_mutex_lock(&lock);
+			struct connection *conn = connections;
+			while (conn) {
+				struct connection *next = conn->next;
+				// Also drops clients that stopped reading a response
+				if (!conn->busy && now - conn->last_active >= HTTP_IDLE_TIMEOUT) {
+					unlink_connection(conn);
+					conn->next = idle;
+					idle = conn;
+				}
+				conn = next;
+			}
+			pthread_mutex_unlock(&lock);
+			while (idle) {
+				struct connection *next = idle->next;
+				free_connection(idle);
+				idle = next;
+			}
+		}
+	}
+
+	// Workers may still be answering, the process exits after this
+	close(epoll_fd);
+	close(listener);
+	return 1;
+}
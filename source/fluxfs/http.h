@@ -0,0 +1,9 @@
+#ifndef FLUXFS_HTTP_H
+#define FLUXFS_HTTP_H
+
+// Address the HTTP server mode listens on unless --http-address is given
+#define HTTP_DEFAULT_ADDRESS "0.0.0.0"
+
+int http_serve(const char *address, unsigned port);
+
+#endif // !FLUXFS_HTTP_H
@@ -6,96 +6,167 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+#include <stddef.h>
+#include <fcntl.h>
 
 #define FUSE_USE_VERSION 30
 #include <fuse.h>
 
 #include "../lib/fluxfs.h"
+#include "cache.h"
+#include "tree.h"
+#include "file.h"
+#include "http.h"
+#include "warmup.h"
+
+// Seconds between passes of the maintenance thread
+#define MAINTENANCE_INTERVAL 10
+// Seconds a file must go unwritten before its overlay is compacted
+#define COMPACT_DELAY 30
+
+// Page cache policies
+#define CACHE_KERNEL 0
+#define CACHE_DIRECT 1
+#define CACHE_AUTO 2
+
+// Files at least this large bypass the page cache in auto mode
+#define CACHE_AUTO_THRESHOLD (64 * 1024 * 1024)
+// Source bytes read ahead of direct reads
+#define DIRECT_READAHEAD (8 * 1024 * 1024)
+// Read ahead windows end on this boundary
+#define READAHEAD_ALIGN (1024 * 1024)
+// Default cap of the SSD block cache
+#define SSD_CACHE_SIZE (16UL * 1024 * 1024 * 1024)
+// Sequential reads after which a handle is treated as a stream
+#define STREAM_SEQUENTIAL_READS 4
+// Milliseconds a streaming read may queue before it goes first
+#define IO_STREAM_DEADLINE 50
+
+// Mount options, given as -o cache=kernel|direct|auto and so on. --http=port
+// serves the tree over HTTP instead of mounting it.
+struct fluxfs_options {
+	char *cache;
+	unsigned long cache_threshold;
+	unsigned long readahead;
+	char *ssd_cache;
+	unsigned long ssd_cache_size;
+	unsigned long warmup;
+	unsigned long warmup_rate;
+	int io_sched;
+	unsigned io_deadline;
+	char *source_io;
+	unsigned http_port;
+	char *http_address;
+};
 
-struct fluxfs_file {
-	char *real_path;
-	char *name;
-	uint64_t size;
-	struct fluxfs_vf *vf;
-	struct fluxfs_file *next;
+static struct fluxfs_options options = {
+	.cache_threshold = CACHE_AUTO_THRESHOLD,
+	.readahead = DIRECT_READAHEAD,
+	.ssd_cache_size = SSD_CACHE_SIZE,
+	.warmup_rate = WARMUP_RATE,
+	.io_deadline = IO_STREAM_DEADLINE,
 };
 
-struct fluxfs_dir {
-	char *name;
-	struct fluxfs_dir *parent;
-	struct fluxfs_dir *subdirs;
-	struct fluxfs_dir *next;
-	struct fluxfs_file *files;
+static const struct fuse_opt option_spec[] = {
+	{ "cache=%s", offsetof(struct fluxfs_options, cache), 0 },
+	{ "cache_threshold=%lu", offsetof(struct fluxfs_options, cache_threshold), 0 },
+	{ "readahead=%lu", offsetof(struct fluxfs_options, readahead), 0 },
+	{ "ssd_cache=%s", offsetof(struct fluxfs_options, ssd_cache), 0 },
+	{ "ssd_cache_size=%lu", offsetof(struct fluxfs_options, ssd_cache_size), 0 },
+	{ "warmup=%lu", offsetof(struct fluxfs_options, warmup), 0 },
+	{ "warmup_rate=%lu", offsetof(struct fluxfs_options, warmup_rate), 0 },
+	{ "io_sched", offsetof(struct fluxfs_options, io_sched), 1 },
+	{ "io_deadline=%u", offsetof(struct fluxfs_options, io_deadline), 0 },
+	{ "source_io=%s", offsetof(struct fluxfs_options, source_io), 0 },
+	{ "--http=%u", offsetof(struct fluxfs_options, http_port), 0 },
+	{ "--http-address=%s", offsetof(struct fluxfs_options, http_address), 0 },
+	FUSE_OPT_END
 };
 
-static struct fluxfs_dir *root = NULL;
+static int cache_policy = CACHE_AUTO;
 
-// Get a directory
-struct fluxfs_dir *get_directory(struct fluxfs_dir *parent, const char *dirname) {
-	// Search for existing directory
-	struct fluxfs_dir *current = parent->subdirs;
-	while (current) {
-		if (strcmp(current->name, dirname) == 0) {
-			return current;
-		}
-		current = current->next;
-	}
+// With -o io_sched, streams get most of a disk and jump the queue once
+// their deadline passes, scans and the warm-up get what is left
+static struct fluxfs_io_share io_shares[FLUXFS_IO_CLASSES] = {
+	[FLUXFS_IO_STREAMING] = { .weight = 8, .depth = 4 },
+	[FLUXFS_IO_INTERACTIVE] = { .weight = 4, .depth = 2 },
+	[FLUXFS_IO_BACKGROUND] = { .weight = 1, .depth = 1 },
+};
 
-	return NULL;
-}
+// Reported for directories, so their attributes stay stable
+static time_t mount_time;
+
+// File states by real path, only used by rescans
+static struct fluxfs_file **file_states = NULL;
+static size_t file_state_slots = 0;
+static size_t file_state_count = 0;
+
+// Directories from scan.conf, made absolute before the daemon changes directory
+static char **scan_directories = NULL;
+static size_t scan_directory_count = 0;
+static pthread_mutex_t rescan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// What a scan of the directories found
+struct scan_result {
+	char **virtual_files;
+	size_t file_count;
+	char **packs;
+	size_t pack_count;
+};
 
-// Get or create a directory
-struct fluxfs_dir *goc_directory(struct fluxfs_dir *parent, const char *dirname) {
-	// Search for existing directory
-	struct fluxfs_dir *current = parent->subdirs;
-	while (current) {
-		if (strcmp(current->name, dirname) == 0) {
-			return current;
-		}
-		current = current->next;
+static size_t hash_path(const char *path) {
+	size_t hash = 5381;
+	while (*path) {
+		hash = hash * 33 + (unsigned char)*path++;
 	}
-
-	// If directory doesn't exist, create it
-	struct fluxfs_dir *newdir = malloc(sizeof(struct fluxfs_dir));
-	memset(newdir, 0, sizeof(struct fluxfs_dir));
-	newdir->name = strdup(dirname);
-	newdir->parent = parent;
-	newdir->next = parent->subdirs;
-	parent->subdirs = newdir;
-
-	return newdir;
-}
-
-struct fluxfs_file *add_file_to_directory(struct fluxfs_dir *dir, const char *real_path, const char *filename, uint64_t size) {
-	struct fluxfs_file *newfile = malloc(sizeof(struct fluxfs_file));
-
-	newfile->real_path = strdup(real_path);
-	newfile->name = strdup(filename);
-	newfile->size = size;
-	newfile->next = dir->files;
-	dir->files = newfile;
-
-	return newfile;
+	return hash;
 }
 
-int add_virtual_file(const char *real_path, const char *vpath, uint64_t size) {
-	struct fluxfs_dir *current = root;
-	char *path = strdup(vpath);
-	char *token = strtok(path, "/");
+// Get or create the state of a .vf file, called with rescan_lock held
+struct fluxfs_file *get_file_state(const char *real_path) {
+	if (file_state_count * 2 >= file_state_slots) {
+		size_t slots = file_state_slots ? file_state_slots * 2 : 1024;
+		struct fluxfs_file **temp = calloc(slots, sizeof(struct fluxfs_file *));
+		if (!temp) {
+			return NULL;
+		}
+		for (size_t i = 0; i < file_state_slots; i++) {
+			if (file_states[i]) {
+				size_t s = hash_path(file_states[i]->real_path) & (slots - 1);
+				while (temp[s]) {
+					s = (s + 1) & (slots - 1);
+				}
+				temp[s] = file_states[i];
+			}
+		}
+		free(file_states);
+		file_states = temp;
+		file_state_slots = slots;
+	}
 
-	while (token) {
-		char *next_token = strtok(NULL, "/");
-		if (next_token) {
-			current = goc_directory(current, token);
-		} else {
-			add_file_to_directory(current, real_path, token, size);
+	size_t s = hash_path(real_path) & (file_state_slots - 1);
+	while (file_states[s]) {
+		if (strcmp(file_states[s]->real_path, real_path) == 0) {
+			return file_states[s];
 		}
-		token = next_token;
+		s = (s + 1) & (file_state_slots - 1);
 	}
 
-	return EXIT_SUCCESS;
+	struct fluxfs_file *file = calloc(1, sizeof(struct fluxfs_file));
+	if (!file || !(file->real_path = strdup(real_path))) {
+		free(file);
+		return NULL;
+	}
+	pthread_mutex_init(&file->lock, NULL);
+	file_states[s] = file;
+	file_state_count++;
+	return file;
 }
 
 char **get_scan_directories(size_t *line_count) {
@@ -149,7 +220,21 @@ char **get_scan_directories(size_t *line_count) {
 	return lines;
 }
 
-void scan_directory(const char *dir_path, char ***virtual_files, size_t *count) {
+// Append a path to a list grown one at a time
+static int add_path(char ***paths, size_t *count, char *path) {
+	char **temp = realloc(*paths, (*count + 1) * sizeof(char *));
+	if (!temp) {
+		perror("Memory allocation failed");
+		return 1;
+	}
+	*paths = temp;
+	(*paths)[*count] = path;
+	(*count)++;
+	return 0;
+}
+
+// Find the .vf files and packs below a directory
+void scan_directory(const char *dir_path, struct scan_result *result) {
 	DIR *dir = opendir(dir_path);
 	if (!dir) {
 		perror("Could not open directory");
@@ -176,23 +261,19 @@ void scan_directory(const char *dir_path, char ***virtual_files, size_t *count)
 		if (stat(full_path, &path_stat) == 0) {
 			if (S_ISDIR(path_stat.st_mode)) {
 				// If it's a directory, recurse into it
-				scan_directory(full_path, virtual_files, count);
+				scan_directory(full_path, result);
 			} else if (S_ISREG(path_stat.st_mode)) {
 				// If it's a regular file, check for ".vf" extension
 				size_t len = strlen(entry->d_name);
+				size_t pack_len = sizeof(FLUXFS_PACK_EXTENSION) - 1;
 				if (len > 3 && strcmp(entry->d_name + len - 3, ".vf") == 0) {
-					// Resize virtual_files array
-					char **temp = realloc(*virtual_files, (*count + 1) * sizeof(char *));
-					if (!temp) {
-						perror("Memory allocation failed");
-						free(full_path);
+					if (add_path(&result->virtual_files, &result->file_count, full_path) == 0) {
+						continue;
+					}
+				} else if (len > pack_len && strcmp(entry->d_name + len - pack_len, FLUXFS_PACK_EXTENSION) == 0) {
+					if (add_path(&result->packs, &result->pack_count, full_path) == 0) {
 						continue;
 					}
-					*virtual_files = temp;
-
-					(*virtual_files)[*count] = full_path;
-					(*count)++;
-					continue;
 				}
 			}
 		}
@@ -201,43 +282,32 @@ void scan_directory(const char *dir_path, char ***virtual_files, size_t *count)
 	closedir(dir);
 }
 
-char **find_virtual_files(char **directories, size_t dir_count, size_t *file_count) {
-	char **virtual_files = NULL;
-	*file_count = 0;
+void find_virtual_files(char **directories, size_t dir_count, struct scan_result *result) {
+	memset(result, 0, sizeof(*result));
 
 	for (size_t i = 0; i < dir_count; i++) {
-		scan_directory(directories[i], &virtual_files, file_count);
+		scan_directory(directories[i], result);
 	}
-
-	return virtual_files;
 }
 
-void print_fs(struct fluxfs_dir *dir, int depth) {
-	if (dir == NULL) {
-		return;
-	}
-
+void print_fs(const struct tree *tree, const struct tree_dir *dir, int depth) {
 	// Indentation for visual hierarchy
 	for (int i = 0; i < depth; ++i) {
 		printf("  ");
 	}
-	printf("[DIR] %s\n", dir->name);
+	printf("[DIR] %s\n", tree_name(tree, dir->name));
 
 	// Print all files in this directory
-	struct fluxfs_file *file = dir->files;
-	while (file != NULL) {
+	for (uint32_t f = 0; f < dir->file_count; f++) {
 		for (int i = 0; i < depth + 1; ++i) {
 			printf("  ");
 		}
-		printf("- %s\n", file->name);
-		file = file->next;
+		printf("- %s\n", tree_name(tree, tree->files[dir->first_file + f].name));
 	}
 
 	// Recursively print all subdirectories
-	struct fluxfs_dir *subdir = dir->subdirs;
-	while (subdir != NULL) {
-		print_fs(subdir, depth + 1);
-		subdir = subdir->next;
+	for (uint32_t d = 0; d < dir->dir_count; d++) {
+		print_fs(tree, &tree->dirs[dir->first_dir + d], depth + 1);
 	}
 }
 
@@ -245,78 +315,33 @@ static int do_getattr(const char *path, struct stat *st) {
 	printf("[getattr] Called\n");
 	printf("\tAttributes of %s requested\n", path);
 
-	if (strcmp(path, "/") == 0) {
+	unsigned slot;
+	const struct tree *tree = tree_enter(&slot);
+	const struct tree_dir *dir;
+	const struct tree_file *file;
+	int found = tree_lookup(tree, path, &dir, &file) == 0;
+
+	// Changing times would make the kernel drop cached pages
+	if (found && dir) {
 		st->st_mode = S_IFDIR | 0755;
 		st->st_nlink = 2;
-		st->st_uid = getuid();
-		st->st_gid = getgid();
-		st->st_atime = time(NULL);
-		st->st_mtime = time(NULL);
-		return 0;
-	}
-
-	struct fluxfs_dir *current = root;
-	char *lpath = strdup(path);
-	char *token, *saveptr;
-
-	token = strtok_r(lpath, "/", &saveptr);
-	char *filename = NULL;
-
-	while (token) {
-		char *next_token = strtok_r(NULL, "/", &saveptr);
-		if (next_token) {
-			current = get_directory(current, token);
-			if (!current) {
-				free(lpath);
-				return -ENOENT;
-			}
-		}
-		if (!next_token) {
-			filename = token;
-		}
-		token = next_token;
-	}
-
-	int found = 0;
-
-	if (current->subdirs) {
-		struct fluxfs_dir *subdir = current->subdirs;
-		while (subdir) {
-			if (strcmp(subdir->name, filename) == 0) {
-				st->st_mode = S_IFDIR | 0755;
-				st->st_nlink = 2;
-				found = 1;
-				break;
-			}
-			subdir = subdir->next;
-		}
-	}
-
-	if (!found && current->files) {
-		struct fluxfs_file *file = current->files;
-		while (file) {
-			if (strcmp(file->name, filename) == 0) {
-				st->st_mode = S_IFREG | 0644;
-				st->st_nlink = 1;
-				st->st_size = file->size;
-				found = 1;
-				break;
-			}
-			file = file->next;
-		}
+		st->st_mtime = mount_time;
+	} else if (found) {
+		st->st_mode = S_IFREG | 0644;
+		st->st_nlink = 1;
+		st->st_size = file->file->size;
+		st->st_mtime = file->file->mtime;
 	}
+	tree_exit(slot);
 
 	if (!found) {
-		free(lpath);
 		return -ENOENT;
 	}
 
 	st->st_uid = getuid();
 	st->st_gid = getgid();
-	st->st_atime = time(NULL);
-	st->st_mtime = time(NULL);
-
-	free(lpath);
+	st->st_atime = st->st_mtime;
+	st->st_ctime = st->st_mtime;
 
 	return 0;
 }
@@ -330,90 +355,63 @@ static int do_readdir(
 {
 	printf("--> Getting The List of Files of %s\n", path);
 
-	struct fluxfs_dir *current = root;
-	char *lpath = strdup(path);
-	char *token, *saveptr;
-
-	token = strtok_r(lpath, "/", &saveptr);
-	while (token) {
-		current = get_directory(current, token);
-		if (!current) {
-			free(lpath);
-			return -ENOENT;
-		}
-		token = strtok_r(NULL, "/", &saveptr);
+	unsigned slot;
+	const struct tree *tree = tree_enter(&slot);
+	const struct tree_dir *dir;
+	const struct tree_file *file;
+	if (tree_lookup(tree, path, &dir, &file) != 0 || !dir) {
+		tree_exit(slot);
+		return -ENOENT;
 	}
 
-	printf("Found: %s\n", current ? current->name : "NULL");
-
 	filler(buffer, ".", NULL, 0);
 	filler(buffer, "..", NULL, 0);
 
-	if (current->subdirs) {
-		struct fluxfs_dir *subdir = current->subdirs;
-		while (subdir) {
-			filler(buffer, subdir->name, NULL, 0);
-			subdir = subdir->next;
-		}
+	for (uint32_t i = 0; i < dir->dir_count; i++) {
+		filler(buffer, tree_name(tree, tree->dirs[dir->first_dir + i].name), NULL, 0);
 	}
-
-	if (current->files) {
-		struct fluxfs_file *file = current->files;
-		while (file) {
-			filler(buffer, file->name, NULL, 0);
-			file = file->next;
-		}
+	for (uint32_t i = 0; i < dir->file_count; i++) {
+		filler(buffer, tree_name(tree, tree->files[dir->first_file + i].name), NULL, 0);
 	}
-
-	free(lpath);
+	tree_exit(slot);
 
 	return 0;
 }
 
+// File states are never freed, so one can be used after leaving the snapshot
 struct fluxfs_file *get_file(const char *path) {
-	struct fluxfs_dir *curdir = root;
-	char *lpath = strdup(path);
-	char *token, *saveptr;
-
-	token = strtok_r(lpath, "/", &saveptr);
-	char *filename = NULL;
-
-	while (token) {
-		char *next_token = strtok_r(NULL, "/", &saveptr);
-		if (next_token) {
-			curdir = get_directory(curdir, token);
-			if (!curdir) {
-				free(lpath);
-				return NULL;
-			}
-		}
-		if (!next_token) {
-			filename = token;
-		}
-		token = next_token;
+	unsigned slot;
+	const struct tree *tree = tree_enter(&slot);
+	const struct tree_dir *dir;
+	const struct tree_file *file;
+	struct fluxfs_file *state = NULL;
+	if (tree_lookup(tree, path, &dir, &file) == 0 && file) {
+		state = file->file;
 	}
+	tree_exit(slot);
 
-	struct fluxfs_file *file = NULL;
-	if (curdir->files) {
-		struct fluxfs_file *curfile = curdir->files;
-		while (curfile) {
-			if (strcmp(curfile->name, filename) == 0) {
-				file = curfile;
-				break;
-			}
-			curfile = curfile->next;
-		}
-	}
+	return state;
+}
 
-	free(lpath);
+// An open handle, kept in fi->fh
+struct fluxfs_handle {
+	struct vf_cache_entry *entry;
+	int direct;
+	// Guards the read pattern below, the kernel may read one handle on
+	// several threads
+	pthread_mutex_t lock;
+	// End of the source range already advised for read ahead
+	uint64_t readahead_end;
+	// Where the next read starts if the reader is streaming
+	uint64_t next_offset;
+	unsigned sequential;
+};
 
-	return file;
+static struct fluxfs_handle *get_handle(struct fuse_file_info *fi) {
+	return (struct fluxfs_handle *)(uintptr_t)fi->fh;
 }
 
-static int do_open(
-	const char *path,
-	__attribute__((unused)) struct fuse_file_info *fi)
-{
+static int do_open(const char *path, struct fuse_file_info *fi) {
 	printf("[open] Called\n");
 	printf("Open of %s requested\n", path);
 
@@ -422,29 +420,43 @@ static int do_open(
 		return -ENOENT;
 	}
 
-	if (!file->vf) {
-		file->vf = fluxfs_load_vf(file->real_path);
+	struct fluxfs_handle *handle = calloc(1, sizeof(struct fluxfs_handle));
+	if (!handle) {
+		return -ENOMEM;
+	}
+
+	// Compaction rewrites the .vf with the file locked
+	pthread_mutex_lock(&file->lock);
+	handle->entry = vf_cache_acquire(file->real_path);
+	uint64_t size = file->size;
+	pthread_mutex_unlock(&file->lock);
+	if (!handle->entry) {
+		free(handle);
+		return -EIO;
+	}
+	pthread_mutex_init(&handle->lock, NULL);
+
+	// Large streams skip the page cache in auto mode, their source pages
+	// are cached already. Small files keep their pages across opens.
+	handle->direct = cache_policy == CACHE_DIRECT || (cache_policy == CACHE_AUTO && size >= options.cache_threshold);
+	if (handle->direct) {
+		fi->direct_io = 1;
+	} else {
+		fi->keep_cache = 1;
 	}
+	fi->fh = (uintptr_t)handle;
 
 	return 0;
 }
 
-static int do_release(
-	const char *path,
-	__attribute__((unused)) struct fuse_file_info *fi)
-{
+static int do_release(const char *path, struct fuse_file_info *fi) {
 	printf("[release] Called\n");
 	printf("Release of %s requested\n", path);
 
-	struct fluxfs_file *file = get_file(path);
-	if (!file) {
-		return -ENOENT;
-	}
-
-	if (file->vf) {
-		fluxfs_free_vf(file->vf);
-		file->vf = NULL;
-	}
+	struct fluxfs_handle *handle = get_handle(fi);
+	vf_cache_release(handle->entry);
+	pthread_mutex_destroy(&handle->lock);
+	free(handle);
 
 	return 0;
 }
@@ -454,21 +466,375 @@ static int do_read(
 	char *buffer,
 	size_t size,
 	off_t offset,
-	__attribute__((unused)) struct fuse_file_info *fi)
+	struct fuse_file_info *fi)
 {
 	printf("[read] Called\n");
 	printf("Read of %s requested\n", path);
 
+	struct fluxfs_handle *handle = get_handle(fi);
+	struct vf_cache_entry *entry = handle->entry;
+	pthread_mutex_lock(&handle->lock);
+	// Players read on from where they stopped, scans and seeks jump
+	if ((uint64_t)offset == handle->next_offset && offset > 0) {
+		handle->sequential++;
+	} else {
+		handle->sequential = 0;
+	}
+	handle->next_offset = offset + size;
+	int io_class = handle->sequential >= STREAM_SEQUENTIAL_READS ? FLUXFS_IO_STREAMING : FLUXFS_IO_INTERACTIVE;
+
+	// Without the kernel reading ahead, ask for the sources ahead of the
+	// reader once it is half way through the advised window. A seek back
+	// before the window starts a new one from the reader.
+	uint64_t end = offset + size;
+	uint64_t advise_start = 0;
+	uint64_t advise_length = 0;
+	if ((uint64_t)offset + options.readahead < handle->readahead_end) {
+		handle->readahead_end = 0;
+	}
+	if (handle->direct && options.readahead && end + options.readahead / 2 > handle->readahead_end) {
+		uint64_t start = end > handle->readahead_end ? end : handle->readahead_end;
+		uint64_t limit = (end + options.readahead + READAHEAD_ALIGN - 1) / READAHEAD_ALIGN * READAHEAD_ALIGN;
+		if (limit > start) {
+			advise_start = start;
+			advise_length = limit - start;
+			handle->readahead_end = limit;
+		}
+	}
+	pthread_mutex_unlock(&handle->lock);
+
+	// Readers of one VF share it, each waits only for its own turn at the
+	// sources and not behind the others' reads
+	fluxfs_io_set_class(io_class);
+	pthread_rwlock_rdlock(&entry->lock);
+	int result = fluxfs_read_from_vf(entry->vf, buffer, size, offset);
+	if (advise_length) {
+		fluxfs_vf_advise(entry->vf, advise_start, advise_length, POSIX_FADV_WILLNEED);
+	}
+	size_t page_memory = fluxfs_vf_page_memory(entry->vf);
+	pthread_rwlock_unlock(&entry->lock);
+	vf_cache_charge(entry, page_memory);
+
+	return result < 0 ? -EIO : result;
+}
+
+// Log a change to the overlay of a file, called with the file locked
+int open_file_overlay(struct fluxfs_file *file) {
+	if (!file->overlay) {
+		file->overlay = fluxfs_overlay_open(file->real_path);
+		if (!file->overlay) {
+			return -EIO;
+		}
+	}
+	file->dirty = 1;
+	file->modified = time(NULL);
+	file->mtime = file->modified;
+	return 0;
+}
+
+static int overlay_exists(const char *real_path) {
+	char *path = fluxfs_overlay_path(real_path);
+	int exists = path && access(path, F_OK) == 0;
+	free(path);
+	return exists;
+}
+
+// Log a write or truncate to an overlay. before and after get the overlay
+// around the record, after is left zero when a tool appended since.
+static int log_change(FILE *overlay, const char *buffer, size_t size, off_t offset, int truncate,
+	struct overlay_key *before, struct overlay_key *after) {
+	int fd = fileno(overlay);
+	struct stat st;
+	// Held from the stat until the record is written
+	flock(fd, LOCK_EX);
+	overlay_key_init(before, fstat(fd, &st) == 0 ? &st : NULL);
+	int failed = truncate ? fluxfs_overlay_truncate(overlay, offset) : fluxfs_overlay_write(overlay, buffer, size, offset);
+	flock(fd, LOCK_UN);
+	long end = ftell(overlay);
+	overlay_key_init(after, !failed && fstat(fd, &st) == 0 && st.st_size == end ? &st : NULL);
+	return failed;
+}
+
+// Apply a write or truncate to a file through its cache entry
+int change_file(struct fluxfs_file *file, struct vf_cache_entry *entry, const char *buffer, size_t size, off_t offset, int truncate) {
+	pthread_mutex_lock(&file->lock);
+	struct overlay_key before, after;
+	int created = !file->overlay && !overlay_exists(file->real_path);
+	int result = open_file_overlay(file);
+	if (result == 0 && log_change(file->overlay, buffer, size, offset, truncate, &before, &after) != 0) {
+		// A tool folding the overlay unlinks it, log to the next one
+		fclose(file->overlay);
+		file->overlay = NULL;
+		created = !overlay_exists(file->real_path);
+		result = open_file_overlay(file);
+		if (result == 0 && log_change(file->overlay, buffer, size, offset, truncate, &before, &after) != 0) {
+			result = -EIO;
+		}
+	}
+	// An overlay started by this change follows an entry loaded without one
+	if (created) {
+		overlay_key_init(&before, NULL);
+	}
+
+	pthread_rwlock_wrlock(&entry->lock);
+	if (result == 0) {
+		if (truncate) {
+			result = fluxfs_vf_truncate(entry->vf, offset) ? -ENOMEM : 0;
+		} else {
+			result = fluxfs_vf_write(entry->vf, buffer, size, offset) ? -ENOMEM : 0;
+		}
+	}
+	file->size = entry->vf->size;
+	vf_cache_update(entry, result == 0 ? &before : NULL, &after);
+	pthread_rwlock_unlock(&entry->lock);
+
+	pthread_mutex_unlock(&file->lock);
+	return result;
+}
+
+// Writes become embedded entries, the referenced data is never copied
+static int do_write(
+	const char *path,
+	const char *buffer,
+	size_t size,
+	off_t offset,
+	struct fuse_file_info *fi)
+{
+	printf("[write] Called\n");
+	printf("Write of %s requested\n", path);
+
+	struct fluxfs_file *file = get_file(path);
+	if (!file) {
+		return -ENOENT;
+	}
+	if (file->packed) {
+		return -EROFS;
+	}
+
+	int result = change_file(file, get_handle(fi)->entry, buffer, size, offset, 0);
+
+	return result == 0 ? (int)size : result;
+}
+
+static int do_truncate(const char *path, off_t length) {
+	printf("[truncate] Called\n");
+	printf("Truncate of %s requested\n", path);
+
 	struct fluxfs_file *file = get_file(path);
 	if (!file) {
 		return -ENOENT;
 	}
+	if (file->packed) {
+		return -EROFS;
+	}
+
+	pthread_mutex_lock(&file->lock);
+	struct vf_cache_entry *entry = vf_cache_acquire(file->real_path);
+	pthread_mutex_unlock(&file->lock);
+	if (!entry) {
+		return -EIO;
+	}
+	int result = change_file(file, entry, NULL, 0, length, 1);
+	vf_cache_release(entry);
+
+	return result;
+}
+
+// Fold the overlay of a file into its .vf, called with the file locked
+int compact_file(struct fluxfs_file *file) {
+	if (file->overlay) {
+		fclose(file->overlay);
+		file->overlay = NULL;
+	}
+	if (!overlay_exists(file->real_path)) {
+		file->dirty = 0;
+		return 0;
+	}
+	if (fluxfs_overlay_compact(file->real_path) != 0) {
+		fprintf(stderr, "Failed to compact overlay of %s\n", file->real_path);
+		return 1;
+	}
+	// The overlay may hold records of tools the cached VF never saw
+	vf_cache_retire(file->real_path);
+	file->dirty = 0;
+	return 0;
+}
+
+// Fold idle overlays into their .vf files, and busy ones that grew long
+void compact_files(time_t now) {
+	unsigned slot;
+	const struct tree *tree = tree_enter(&slot);
+	for (uint32_t i = 0; i < tree->file_count; i++) {
+		struct fluxfs_file *file = tree->files[i].file;
+		pthread_mutex_lock(&file->lock);
+		if (file->dirty && (now - file->modified >= COMPACT_DELAY ||
+			(file->overlay && ftell(file->overlay) >= FLUXFS_OVERLAY_FOLD_SIZE))) {
+			compact_file(file);
+		}
+		pthread_mutex_unlock(&file->lock);
+	}
+	tree_exit(slot);
+}
+
+// Print how long the reads of each I/O class queued since the last report
+static void report_io(void) {
+	static const char *names[FLUXFS_IO_CLASSES] = { "streaming", "interactive", "background" };
+	static struct fluxfs_io_stats last[FLUXFS_IO_CLASSES];
+	struct fluxfs_io_stats stats[FLUXFS_IO_CLASSES];
+	fluxfs_io_get_stats(stats);
+	for (int c = 0; c < FLUXFS_IO_CLASSES; c++) {
+		uint64_t reads = stats[c].reads - last[c].reads;
+		if (reads) {
+			printf("I/O %s: %llu reads, %.1f MB, %.1f ms average queued, %.1f ms longest, %llu late\n", names[c],
+				(unsigned long long)reads, (stats[c].bytes - last[c].bytes) / 1e6,
+				(stats[c].waitMicros - last[c].waitMicros) / 1e3 / reads, stats[c].maxWaitMicros / 1e3,
+				(unsigned long long)(stats[c].late - last[c].late));
+		}
+	}
+	memcpy(last, stats, sizeof(last));
+}
+
+// Compacts overlays, frees cached VFs left idle and reports I/O queueing
+void *maintenance_thread(__attribute__((unused)) void *arg) {
+	for (;;) {
+		sleep(MAINTENANCE_INTERVAL);
+		time_t now = time(NULL);
+		compact_files(now);
+		vf_cache_evict_idle(now);
+		if (options.io_sched) {
+			report_io();
+		}
+	}
+	return NULL;
+}
 
-	if (!file->vf) {
+// Add the records of a pack from its index, without opening them. Returns
+// the number added.
+size_t add_pack(struct tree_builder *builder, const char *pack_path) {
+	struct stat st;
+	struct fluxfs_pack *pack = stat(pack_path, &st) == 0 ? fluxfs_pack_open(pack_path) : NULL;
+	if (!pack) {
 		return 0;
 	}
 
-	return fluxfs_read_from_vf(file->vf, buffer, size, offset);
+	size_t added = 0;
+	size_t pack_len = strlen(pack_path);
+	for (uint64_t i = 0; i < pack->count; i++) {
+		const struct fluxfs_pack_record *record = &pack->records[i];
+		const char *name = fluxfs_pack_name(pack, record);
+		char *real_path = malloc(pack_len + strlen(name) + 2);
+		if (!real_path) {
+			break;
+		}
+		sprintf(real_path, "%s/%s", pack_path, name);
+		struct fluxfs_file *file = get_file_state(real_path);
+		free(real_path);
+		if (!file) {
+			continue;
+		}
+
+		pthread_mutex_lock(&file->lock);
+		file->packed = 1;
+		file->size = record->size;
+		file->mtime = st.st_mtime;
+		pthread_mutex_unlock(&file->lock);
+		if (tree_builder_add(builder, fluxfs_pack_vpath(pack, record), file) == 0) {
+			added++;
+		}
+	}
+	fluxfs_pack_close(pack);
+	return added;
+}
+
+// Scan for virtual files and publish a new directory tree. Operations in
+// flight finish on the previous tree.
+int rescan(void) {
+	pthread_mutex_lock(&rescan_lock);
+
+	struct scan_result scan;
+	find_virtual_files(scan_directories, scan_directory_count, &scan);
+	char **virtual_files = scan.virtual_files;
+	size_t file_count = scan.file_count;
+	struct tree_builder *builder = tree_builder_create();
+	if (!builder) {
+		pthread_mutex_unlock(&rescan_lock);
+		return 1;
+	}
+
+	for (size_t i = 0; i < scan.pack_count; i++) {
+		file_count += add_pack(builder, scan.packs[i]);
+		free(scan.packs[i]);
+	}
+	free(scan.packs);
+
+	for (size_t i = 0; i < scan.file_count; i++) {
+		struct fluxfs_file *file = get_file_state(virtual_files[i]);
+		if (file) {
+			pthread_mutex_lock(&file->lock);
+			// Files being written keep the size of their loaded VF
+			if (!file->dirty) {
+				compact_file(file);
+				file->size = fluxfs_get_vf_size(file->real_path);
+				struct stat st;
+				if (stat(file->real_path, &st) == 0) {
+					file->mtime = st.st_mtime;
+				}
+			}
+			pthread_mutex_unlock(&file->lock);
+
+			char *vpath = fluxfs_get_vpath(virtual_files[i]);
+			if (vpath) {
+				tree_builder_add(builder, vpath, file);
+				free(vpath);
+			}
+		}
+		free(virtual_files[i]);
+	}
+	free(virtual_files);
+
+	struct tree *tree = tree_builder_finish(builder);
+	if (tree) {
+		tree_publish(tree);
+		printf("Scanned %zu virtual files\n", file_count);
+	}
+
+	pthread_mutex_unlock(&rescan_lock);
+	return tree ? 0 : 1;
+}
+
+// SIGUSR1 is blocked in every thread and taken here, so a rescan never
+// runs inside a signal handler
+void *rescan_thread(__attribute__((unused)) void *arg) {
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	for (;;) {
+		int sig;
+		if (sigwait(&set, &sig) == 0) {
+			rescan();
+		}
+	}
+	return NULL;
+}
+
+static void start_threads(void) {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, maintenance_thread, NULL) == 0) {
+		pthread_detach(thread);
+	}
+	if (pthread_create(&thread, NULL, rescan_thread, NULL) == 0) {
+		pthread_detach(thread);
+	}
+	// Reads ahead of the first library scan after a mount
+	if (options.warmup) {
+		warmup_start(options.warmup, options.warmup_rate);
+	}
+}
+
+// Threads started before fuse_main forks into the background would be lost
+static void *do_init(__attribute__((unused)) struct fuse_conn_info *conn) {
+	start_threads();
+	return NULL;
 }
 
 static struct fuse_operations operations = {
@@ -476,11 +842,14 @@ static struct fuse_operations operations = {
 	.readdir	= do_readdir,
 	.open           = do_open,
 	.read	        = do_read,
+	.write          = do_write,
+	.truncate       = do_truncate,
 	.release        = do_release,
+	.init           = do_init,
 };
 
 int main(int argc, char *argv[]) {
-	size_t dir_count, file_count;
+	size_t dir_count;
 	char **directories = get_scan_directories(&dir_count);
 
 	if (!directories) {
@@ -490,39 +859,90 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
-	char **virtual_files = find_virtual_files(directories, dir_count, &file_count);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (fuse_opt_parse(&args, &options, option_spec, NULL) != 0) {
+		return EXIT_FAILURE;
+	}
+	if (!options.cache || strcmp(options.cache, "auto") == 0) {
+		cache_policy = CACHE_AUTO;
+	} else if (strcmp(options.cache, "kernel") == 0) {
+		cache_policy = CACHE_KERNEL;
+	} else if (strcmp(options.cache, "direct") == 0) {
+		cache_policy = CACHE_DIRECT;
+	} else {
+		fprintf(stderr, "Unknown cache policy %s, use kernel, direct or auto\n", options.cache);
+		return EXIT_FAILURE;
+	}
+	if (options.source_io) {
+		const struct fluxfs_source_backend *backend = fluxfs_source_backend(options.source_io);
+		if (!backend) {
+			fprintf(stderr, "Unknown source I/O %s, use pread or mmap\n", options.source_io);
+			return EXIT_FAILURE;
+		}
+		fluxfs_source_set_backend(backend);
+	}
+	mount_time = time(NULL);
 
-	if (virtual_files) {
-		printf("Found Files:\n");
-		for (size_t i = 0; i < file_count; i++) {
-			printf("%s\n", virtual_files[i]);
+	scan_directories = malloc(dir_count * sizeof(char *));
+	if (!scan_directories) {
+		perror("Memory allocation failed");
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < dir_count; i++) {
+		char *absolute = realpath(directories[i], NULL);
+		if (!absolute) {
+			perror(directories[i]);
+			continue;
 		}
-	} else {
-		printf("No virtual files found.\n");
+		scan_directories[scan_directory_count++] = absolute;
 	}
 
-	root = malloc(sizeof(struct fluxfs_dir));
-	memset(root, 0, sizeof(struct fluxfs_dir));
+	// Blocks stored by an earlier run are served again
+	if (options.ssd_cache && fluxfs_block_cache_open(options.ssd_cache, options.ssd_cache_size) != 0) {
+		fprintf(stderr, "Failed to open the SSD cache %s\n", options.ssd_cache);
+		return EXIT_FAILURE;
+	}
 
-	printf("Virtual Paths:\n");
-	for (size_t i = 0; i < file_count; i++) {
-		char *vpath = fluxfs_get_vpath(virtual_files[i]);
-		if (vpath) {
-			printf("%s\n", vpath);
-			size_t size = fluxfs_get_vf_size(virtual_files[i]);
-			add_virtual_file(virtual_files[i], vpath, size);
-		}
+	if (options.io_sched) {
+		io_shares[FLUXFS_IO_STREAMING].deadline = options.io_deadline;
+		fluxfs_io_scheduler_enable(io_shares);
 	}
 
-	printf("FluxFS File System:\n");
-	print_fs(root, 0);
+	// Overlays left by an earlier run are folded in before sizes are read
+	if (rescan() != 0) {
+		fprintf(stderr, "Failed to build the directory tree\n");
+		return EXIT_FAILURE;
+	}
 
-	fuse_main(argc, argv, &operations, NULL);
+	printf("FluxFS File System:\n");
+	unsigned slot;
+	const struct tree *tree = tree_enter(&slot);
+	print_fs(tree, &tree->dirs[0], 0);
+	tree_exit(slot);
+
+	// Send SIGUSR1 to rescan, the mask is inherited by every FUSE thread
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	int status = EXIT_SUCCESS;
+	if (options.http_port) {
+		// Serves in the foreground without a mount
+		start_threads();
+		const char *address = options.http_address ? options.http_address : HTTP_DEFAULT_ADDRESS;
+		if (http_serve(address, options.http_port) != 0) {
+			status = EXIT_FAILURE;
+		}
+	} else {
+		fuse_main(args.argc, args.argv, &operations, NULL);
+	}
+	fuse_opt_free_args(&args);
 
 	for (size_t i = 0; i < dir_count; i++) {
 		free(directories[i]);
 	}
 	free(directories);
 
-	return EXIT_SUCCESS;
+	return status;
 }
@@ -0,0 +1,388 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "tree.h"
+
+// Virtual paths are gathered, sorted and laid out in one pass when the
+// builder finishes, so no per node allocations are made.
+struct builder_entry {
+	union {
+		size_t offset;
+		const char *vpath;
+	} path;
+	struct fluxfs_file *file;
+};
+
+struct tree_builder {
+	struct builder_entry *entries;
+	size_t count;
+	size_t capacity;
+	// Normalized virtual paths, NULL separated
+	char *paths;
+	size_t paths_used;
+	size_t paths_capacity;
+};
+
+// Distinct names of the tree being laid out
+struct string_table {
+	char *bytes;
+	size_t used;
+	size_t capacity;
+	uint32_t *slots;
+	size_t slot_count;
+	size_t names;
+};
+
+static int grow(void **array, size_t *capacity, size_t needed, size_t item_size) {
+	if (needed <= *capacity) {
+		return 0;
+	}
+	size_t capacity_new = *capacity ? *capacity : 64;
+	while (capacity_new < needed) {
+		capacity_new *= 2;
+	}
+	void *temp = realloc(*array, capacity_new * item_size);
+	if (!temp) {
+		return 1;
+	}
+	*array = temp;
+	*capacity = capacity_new;
+	return 0;
+}
+
+struct tree_builder *tree_builder_create(void) {
+	return calloc(1, sizeof(struct tree_builder));
+}
+
+static void tree_builder_free(struct tree_builder *builder) {
+	free(builder->entries);
+	free(builder->paths);
+	free(builder);
+}
+
+// Add a file, empty path components are dropped as strtok would
+int tree_builder_add(struct tree_builder *builder, const char *vpath, struct fluxfs_file *file) {
+	size_t len = strlen(vpath);
+	if (grow((void **)&builder->paths, &builder->paths_capacity, builder->paths_used + len + 1, 1) != 0 ||
+		grow((void **)&builder->entries, &builder->capacity, builder->count + 1, sizeof(struct builder_entry)) != 0) {
+		return 1;
+	}
+
+	char *out = builder->paths + builder->paths_used;
+	size_t used = 0;
+	for (const char *p = vpath; *p; p++) {
+		if (*p == '/' && (used == 0 || out[used - 1] == '/')) {
+			continue;
+		}
+		out[used++] = *p;
+	}
+	if (used && out[used - 1] == '/') {
+		used--;
+	}
+	if (used == 0) {
+		return 1;
+	}
+	out[used] = 0;
+
+	builder->entries[builder->count].path.offset = builder->paths_used;
+	builder->entries[builder->count].file = file;
+	builder->count++;
+	builder->paths_used += used + 1;
+	return 0;
+}
+
+// Order paths component by component, so every directory is one run
+static int compare_entries(const void *a, const void *b) {
+	const unsigned char *x = (const unsigned char *)((const struct builder_entry *)a)->path.vpath;
+	const unsigned char *y = (const unsigned char *)((const struct builder_entry *)b)->path.vpath;
+	while (*x && *x == *y) {
+		x++;
+		y++;
+	}
+	int cx = (*x == '/') ? 1 : (*x ? *x + 1 : 0);
+	int cy = (*y == '/') ? 1 : (*y ? *y + 1 : 0);
+	return cx - cy;
+}
+
+static uint32_t hash_name(const char *name, size_t len) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Offset of a name in the table, adding it if needed. Slots hold offset + 1.
+static int intern_name(struct string_table *table, const char *name, size_t len, uint32_t *offset) {
+	if (table->names * 2 >= table->slot_count) {
+		size_t slot_count = table->slot_count ? table->slot_count * 2 : 1024;
+		uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+		if (!slots) {
+			return 1;
+		}
+		for (size_t i = 0; i < table->slot_count; i++) {
+			if (table->slots[i]) {
+				const char *existing = table->bytes + table->slots[i] - 1;
+				size_t s = hash_name(existing, strlen(existing)) & (slot_count - 1);
+				while (slots[s]) {
+					s = (s + 1) & (slot_count - 1);
+				}
+				slots[s] = table->slots[i];
+			}
+		}
+		free(table->slots);
+		table->slots = slots;
+		table->slot_count = slot_count;
+	}
+
+	size_t s = hash_name(name, len) & (table->slot_count - 1);
+	while (table->slots[s]) {
+		const char *existing = table->bytes + table->slots[s] - 1;
+		if (strncmp(existing, name, len) == 0 && existing[len] == 0) {
+			*offset = table->slots[s] - 1;
+			return 0;
+		}
+		s = (s + 1) & (table->slot_count - 1);
+	}
+
+	if (table->used + len + 1 > UINT32_MAX - 1 ||
+		grow((void **)&table->bytes, &table->capacity, table->used + len + 1, 1) != 0) {
+		return 1;
+	}
+	memcpy(table->bytes + table->used, name, len);
+	table->bytes[table->used + len] = 0;
+	*offset = table->used;
+	table->slots[s] = table->used + 1;
+	table->used += len + 1;
+	table->names++;
+	return 0;
+}
+
+// Range of sorted entries under a directory and the length of its path prefix
+struct dir_range {
+	size_t lo;
+	size_t hi;
+	size_t prefix;
+};
+
+// Lay out the added files as one snapshot and free the builder
+struct tree *tree_builder_finish(struct tree_builder *builder) {
+	for (size_t i = 0; i < builder->count; i++) {
+		builder->entries[i].path.vpath = builder->paths + builder->entries[i].path.offset;
+	}
+	qsort(builder->entries, builder->count, sizeof(struct builder_entry), compare_entries);
+
+	struct string_table strings = { 0 };
+	struct tree_dir *dirs = NULL;
+	struct dir_range *ranges = NULL;
+	struct tree_file *files = NULL;
+	size_t dir_count = 0, dir_capacity = 0, range_capacity = 0;
+	size_t file_count = 0, file_capacity = 0;
+	struct tree *tree = NULL;
+	int failed = 0;
+
+	// The root is named by the empty string
+	uint32_t root_name;
+	failed |= intern_name(&strings, "", 0, &root_name);
+	failed |= grow((void **)&dirs, &dir_capacity, 1, sizeof(struct tree_dir));
+	failed |= grow((void **)&ranges, &range_capacity, 1, sizeof(struct dir_range));
+	if (!failed) {
+		memset(&dirs[0], 0, sizeof(struct tree_dir));
+		dirs[0].name = root_name;
+		ranges[0] = (struct dir_range){ 0, builder->count, 0 };
+		dir_count = 1;
+	}
+
+	// Breadth first, appending the children of each directory as a run
+	for (size_t d = 0; d < dir_count && !failed; d++) {
+		struct dir_range range = ranges[d];
+		dirs[d].first_dir = dir_count;
+		dirs[d].first_file = file_count;
+
+		size_t i = range.lo;
+		while (i < range.hi && !failed) {
+			const char *component = builder->entries[i].path.vpath + range.prefix;
+			size_t len = strcspn(component, "/");
+			uint32_t name;
+			if (intern_name(&strings, component, len, &name) != 0) {
+				failed = 1;
+				break;
+			}
+
+			if (component[len] == 0) {
+				// Only the first of several files with one path is kept
+				if (dirs[d].file_count == 0 || files[file_count - 1].name != name) {
+					if (grow((void **)&files, &file_capacity, file_count + 1, sizeof(struct tree_file)) != 0) {
+						failed = 1;
+						break;
+					}
+					files[file_count].name = name;
+					files[file_count].file = builder->entries[i].file;
+					file_count++;
+					dirs[d].file_count++;
+				}
+				i++;
+				continue;
+			}
+
+			size_t j = i + 1;
+			while (j < range.hi) {
+				const char *next = builder->entries[j].path.vpath + range.prefix;
+				if (strncmp(next, component, len) != 0 || next[len] != '/') {
+					break;
+				}
+				j++;
+			}
+			if (grow((void **)&dirs, &dir_capacity, dir_count + 1, sizeof(struct tree_dir)) != 0 ||
+				grow((void **)&ranges, &range_capacity, dir_count + 1, sizeof(struct dir_range)) != 0) {
+				failed = 1;
+				break;
+			}
+			memset(&dirs[dir_count], 0, sizeof(struct tree_dir));
+			dirs[dir_count].name = name;
+			ranges[dir_count] = (struct dir_range){ i, j, range.prefix + len + 1 };
+			dir_count++;
+			dirs[d].dir_count++;
+			i = j;
+		}
+	}
+
+	if (!failed) {
+		size_t dirs_size = dir_count * sizeof(struct tree_dir);
+		size_t files_size = file_count * sizeof(struct tree_file);
+		tree = malloc(sizeof(struct tree) + dirs_size + files_size + strings.used);
+	}
+	if (tree) {
+		char *arena = (char *)(tree + 1);
+		tree->dirs = (struct tree_dir *)arena;
+		tree->files = (struct tree_file *)(arena + dir_count * sizeof(struct tree_dir));
+		tree->strings = (char *)tree->files + file_count * sizeof(struct tree_file);
+		tree->dir_count = dir_count;
+		tree->file_count = file_count;
+		memcpy(tree->dirs, dirs, dir_count * sizeof(struct tree_dir));
+		memcpy(tree->files, files, file_count * sizeof(struct tree_file));
+		memcpy((char *)tree->strings, strings.bytes, strings.used);
+	}
+
+	free(dirs);
+	free(ranges);
+	free(files);
+	free(strings.bytes);
+	free(strings.slots);
+	tree_builder_free(builder);
+	return tree;
+}
+
+// Compare a stored name with a path component that is not NULL-terminated
+static int compare_component(const char *name, const char *component, size_t len) {
+	int c = strncmp(name, component, len);
+	if (c != 0) {
+		return c;
+	}
+	return name[len] != 0;
+}
+
+static const struct tree_dir *find_dir(const struct tree *tree, const struct tree_dir *dir, const char *component, size_t len) {
+	uint32_t lo = dir->first_dir;
+	uint32_t hi = dir->first_dir + dir->dir_count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int c = compare_component(tree_name(tree, tree->dirs[mid].name), component, len);
+		if (c == 0) {
+			return &tree->dirs[mid];
+		}
+		if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+static const struct tree_file *find_file(const struct tree *tree, const struct tree_dir *dir, const char *component, size_t len) {
+	uint32_t lo = dir->first_file;
+	uint32_t hi = dir->first_file + dir->file_count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int c = compare_component(tree_name(tree, tree->files[mid].name), component, len);
+		if (c == 0) {
+			return &tree->files[mid];
+		}
+		if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+// Find the directory or file at a path, returns 1 if there is none
+int tree_lookup(const struct tree *tree, const char *path, const struct tree_dir **dir, const struct tree_file **file) {
+	const struct tree_dir *current = &tree->dirs[0];
+	*dir = NULL;
+	*file = NULL;
+
+	while (*path == '/') {
+		path++;
+	}
+	while (*path) {
+		size_t len = strcspn(path, "/");
+		const char *rest = path + len;
+		while (*rest == '/') {
+			rest++;
+		}
+
+		const struct tree_dir *subdir = find_dir(tree, current, path, len);
+		if (*rest == 0 && !subdir) {
+			*file = find_file(tree, current, path, len);
+			return *file ? 0 : 1;
+		}
+		if (!subdir) {
+			return 1;
+		}
+		current = subdir;
+		path = rest;
+	}
+
+	*dir = current;
+	return 0;
+}
+
+// Readers announce themselves in one of two counters picked by the epoch.
+// A publisher swaps the snapshot, then flips the epoch and waits for each
+// counter to drain in turn, after which no reader can hold the old one.
+static _Atomic(struct tree *) current_tree = NULL;
+static atomic_uint epoch = 0;
+static atomic_uint readers[2];
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Start using the current snapshot, pass slot to tree_exit when done
+const struct tree *tree_enter(unsigned *slot) {
+	*slot = atomic_load(&epoch) & 1;
+	atomic_fetch_add(&readers[*slot], 1);
+	return atomic_load(&current_tree);
+}
+
+void tree_exit(unsigned slot) {
+	atomic_fetch_sub(&readers[slot], 1);
+}
+
+// Make a snapshot current and free the previous one once unused
+void tree_publish(struct tree *tree) {
+	pthread_mutex_lock(&publish_lock);
+	struct tree *old = atomic_exchange(&current_tree, tree);
+	for (int phase = 0; phase < 2; phase++) {
+		unsigned slot = atomic_fetch_add(&epoch, 1) & 1;
+		while (atomic_load(&readers[slot]) != 0) {
+			sched_yield();
+		}
+	}
+	pthread_mutex_unlock(&publish_lock);
+	free(old);
+}
@@ -0,0 +1,50 @@
+#ifndef FLUXFS_TREE_H
+#define FLUXFS_TREE_H
+
+#include <stdint.h>
+
+struct fluxfs_file;
+
+// An immutable snapshot of the virtual directory tree held in one
+// allocation. Directories are stored breadth first so the subdirectories
+// and files of a directory are contiguous and sorted by name. Names are
+// offsets into a string table where each distinct name is stored once.
+struct tree_dir {
+	uint32_t name;
+	uint32_t first_dir;
+	uint32_t dir_count;
+	uint32_t first_file;
+	uint32_t file_count;
+};
+
+struct tree_file {
+	uint32_t name;
+	struct fluxfs_file *file;
+};
+
+struct tree {
+	// dirs[0] is the root
+	struct tree_dir *dirs;
+	struct tree_file *files;
+	const char *strings;
+	uint32_t dir_count;
+	uint32_t file_count;
+};
+
+struct tree_builder;
+
+struct tree_builder *tree_builder_create(void);
+int tree_builder_add(struct tree_builder *builder, const char *vpath, struct fluxfs_file *file);
+struct tree *tree_builder_finish(struct tree_builder *builder);
+
+static inline const char *tree_name(const struct tree *tree, uint32_t name) {
+	return tree->strings + name;
+}
+
+int tree_lookup(const struct tree *tree, const char *path, const struct tree_dir **dir, const struct tree_file **file);
+
+const struct tree *tree_enter(unsigned *slot);
+void tree_exit(unsigned slot);
+void tree_publish(struct tree *tree);
+
+#endif // !FLUXFS_TREE_H
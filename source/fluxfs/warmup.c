@@ -0,0 +1,215 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "../lib/fluxfs.h"
+#include "file.h"
+#include "tree.h"
+#include "warmup.h"
+
+// The idle I/O class only gets the disk when nothing else wants it
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+// A source range read by the warm-up
+struct warmup_range {
+	uint32_t source;
+	dev_t device;
+	// Where the range starts on the device, or its file offset if unknown
+	uint64_t physical;
+	uint64_t offset;
+	uint64_t length;
+};
+
+struct warmup {
+	uint64_t bytes;
+	uint64_t rate;
+	struct warmup_range *ranges;
+	size_t count;
+	size_t capacity;
+};
+
+// Keeps the source open after its VF is freed
+static void add_range(void *arg, uint32_t source, uint64_t offset, uint64_t length) {
+	struct warmup *warmup = arg;
+	if (warmup->count == warmup->capacity) {
+		size_t capacity = warmup->capacity ? warmup->capacity * 2 : 1024;
+		struct warmup_range *ranges = realloc(warmup->ranges, capacity * sizeof(struct warmup_range));
+		if (!ranges) {
+			return;
+		}
+		warmup->ranges = ranges;
+		warmup->capacity = capacity;
+	}
+	fluxfs_source_retain(source);
+	struct warmup_range *range = &warmup->ranges[warmup->count++];
+	memset(range, 0, sizeof(*range));
+	range->source = source;
+	range->offset = offset;
+	range->length = length;
+}
+
+// Find where a file offset lives on its device with FIEMAP
+static void locate_range(struct warmup_range *range) {
+	int fd = fluxfs_source_fd(range->source);
+	struct stat st;
+	range->physical = range->offset;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		return;
+	}
+	range->device = st.st_dev;
+
+	struct {
+		struct fiemap map;
+		struct fiemap_extent extent;
+	} query;
+	memset(&query, 0, sizeof(query));
+	query.map.fm_start = range->offset;
+	query.map.fm_length = 1;
+	query.map.fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, &query.map) == 0 && query.map.fm_mapped_extents == 1 &&
+		!(query.extent.fe_flags & FIEMAP_EXTENT_UNKNOWN) && query.extent.fe_logical <= range->offset) {
+		range->physical = query.extent.fe_physical + (range->offset - query.extent.fe_logical);
+	}
+}
+
+static int compare_ranges(const void *a, const void *b) {
+	const struct warmup_range *ra = a;
+	const struct warmup_range *rb = b;
+	if (ra->device != rb->device) {
+		return ra->device < rb->device ? -1 : 1;
+	}
+	if (ra->physical != rb->physical) {
+		return ra->physical < rb->physical ? -1 : 1;
+	}
+	if (ra->source != rb->source) {
+		return ra->source < rb->source ? -1 : 1;
+	}
+	return ra->offset < rb->offset ? -1 : (ra->offset > rb->offset);
+}
+
+// Collect the source ranges behind the first and last bytes of every file
+static void collect_ranges(struct warmup *warmup) {
+	unsigned slot;
+	const struct tree *tree = tree_enter(&slot);
+	size_t file_count = tree->file_count;
+	struct fluxfs_file **files = malloc((file_count ? file_count : 1) * sizeof(struct fluxfs_file *));
+	for (size_t i = 0; files && i < file_count; i++) {
+		files[i] = tree->files[i].file;
+	}
+	tree_exit(slot);
+	if (!files) {
+		return;
+	}
+
+	// File states outlive the snapshot, so the paths stay valid
+	for (size_t i = 0; i < file_count; i++) {
+		struct fluxfs_vf *vf = fluxfs_load_vf(files[i]->real_path);
+		if (!vf) {
+			continue;
+		}
+		if (vf->size <= warmup->bytes * 2) {
+			fluxfs_vf_source_ranges(vf, 0, vf->size, add_range, warmup);
+		} else {
+			fluxfs_vf_source_ranges(vf, 0, warmup->bytes, add_range, warmup);
+			fluxfs_vf_source_ranges(vf, vf->size - warmup->bytes, warmup->bytes, add_range, warmup);
+		}
+		fluxfs_free_vf(vf);
+	}
+	free(files);
+}
+
+// Sleep until reading done bytes since start is within the rate
+static void throttle(const struct timespec *start, uint64_t done, uint64_t rate) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+	double ahead = (double)done / rate - elapsed;
+	if (ahead > 0) {
+		struct timespec delay = { (time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9) };
+		nanosleep(&delay, NULL);
+	}
+}
+
+// Read the ranges in device order, so a cold disk sweeps across them once
+// instead of seeking for every file a library scan opens
+static void *warmup_thread(void *arg) {
+	struct warmup *warmup = arg;
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+	fluxfs_io_set_class(FLUXFS_IO_BACKGROUND);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	collect_ranges(warmup);
+	for (size_t i = 0; i < warmup->count; i++) {
+		locate_range(&warmup->ranges[i]);
+	}
+	qsort(warmup->ranges, warmup->count, sizeof(struct warmup_range), compare_ranges);
+
+	uint8_t *buf = malloc(WARMUP_READ_SIZE);
+	uint64_t done = 0;
+	size_t read_count = 0;
+	for (size_t i = 0; i < warmup->count; i++) {
+		struct warmup_range *range = &warmup->ranges[i];
+		uint64_t offset = range->offset;
+		uint64_t end_offset = range->offset + range->length;
+		// Overlapping ranges of one source are read once
+		while (i + 1 < warmup->count && range[1].source == range->source &&
+			range[1].offset >= range->offset && range[1].offset <= end_offset) {
+			if (range[1].offset + range[1].length > end_offset) {
+				end_offset = range[1].offset + range[1].length;
+			}
+			fluxfs_source_release(range->source);
+			range++;
+			i++;
+		}
+		while (buf && offset < end_offset) {
+			size_t size = end_offset - offset < WARMUP_READ_SIZE ? end_offset - offset : WARMUP_READ_SIZE;
+			if (fluxfs_source_read(range->source, buf, size, offset) != 0) {
+				break;
+			}
+			offset += size;
+			done += size;
+			throttle(&start, done, warmup->rate);
+		}
+		fluxfs_source_release(range->source);
+		read_count++;
+	}
+	free(buf);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Warmed up %zu source ranges, %llu bytes in %.1f s\n", read_count, (unsigned long long)done, seconds);
+
+	free(warmup->ranges);
+	free(warmup);
+	return NULL;
+}
+
+// Prefetch the first and last bytes of every virtual file in the background,
+// at most rate bytes per second at idle I/O priority
+void warmup_start(uint64_t bytes, uint64_t rate) {
+	struct warmup *warmup = calloc(1, sizeof(struct warmup));
+	if (!warmup) {
+		return;
+	}
+	warmup->bytes = bytes;
+	warmup->rate = rate ? rate : WARMUP_RATE;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, warmup_thread, warmup) == 0) {
+		pthread_detach(thread);
+	} else {
+		free(warmup);
+	}
+}
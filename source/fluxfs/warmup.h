@@ -0,0 +1,13 @@
+#ifndef FLUXFS_WARMUP_H
+#define FLUXFS_WARMUP_H
+
+#include <stdint.h>
+
+// Default rate of the warm-up reads in bytes per second
+#define WARMUP_RATE (16 * 1024 * 1024)
+// Bytes read from a source at a time by the warm-up
+#define WARMUP_READ_SIZE (256 * 1024)
+
+void warmup_start(uint64_t bytes, uint64_t rate);
+
+#endif // !FLUXFS_WARMUP_H
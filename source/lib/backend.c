@@ -0,0 +1,135 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fluxfs.h"
+#include "source.h"
+
+static struct fluxfs_source_file *pread_open(const char *path) {
+	struct fluxfs_source_file *file = malloc(sizeof(struct fluxfs_source_file));
+	if (!file) {
+		return NULL;
+	}
+	file->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (file->fd < 0) {
+		int error = errno;
+		free(file);
+		errno = error;
+		return NULL;
+	}
+	return file;
+}
+
+static ssize_t pread_read_at(struct fluxfs_source_file *file, void *buf, size_t size, uint64_t offset) {
+	return pread(file->fd, buf, size, offset);
+}
+
+static void pread_advise(struct fluxfs_source_file *file, uint64_t offset, uint64_t length, int advice) {
+	posix_fadvise(file->fd, offset, length, advice);
+}
+
+static void pread_close(struct fluxfs_source_file *file) {
+	close(file->fd);
+	free(file);
+}
+
+const struct fluxfs_source_backend fluxfs_pread_backend = {
+	"pread", pread_open, pread_read_at, pread_advise, pread_close
+};
+
+// A large source read by copying from a shared read only mapping, which
+// saves a system call per read once the pages are resident. A source that
+// is truncated while mapped raises SIGBUS on the pages cut off, the same
+// as for any mapped file, so this backend suits libraries whose sources
+// are only ever replaced by renaming.
+struct mapped_file {
+	struct fluxfs_source_file file;
+	// NULL for files below FLUXFS_MMAP_MIN_SIZE, read with pread
+	uint8_t *map;
+	uint64_t size;
+};
+
+static struct fluxfs_source_file *mmap_open(const char *path) {
+	struct mapped_file *mapped = calloc(1, sizeof(struct mapped_file));
+	if (!mapped) {
+		return NULL;
+	}
+	mapped->file.fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (mapped->file.fd < 0 || fstat(mapped->file.fd, &st) != 0) {
+		int error = errno;
+		if (mapped->file.fd >= 0) {
+			close(mapped->file.fd);
+		}
+		free(mapped);
+		errno = error;
+		return NULL;
+	}
+	if (S_ISREG(st.st_mode) && (uint64_t)st.st_size >= FLUXFS_MMAP_MIN_SIZE && (uint64_t)st.st_size <= SIZE_MAX) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, mapped->file.fd, 0);
+		if (map != MAP_FAILED) {
+			// Media is mostly streamed front to back
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			mapped->map = map;
+			mapped->size = st.st_size;
+		}
+	}
+	return &mapped->file;
+}
+
+static ssize_t mmap_read_at(struct fluxfs_source_file *file, void *buf, size_t size, uint64_t offset) {
+	struct mapped_file *mapped = (struct mapped_file *)file;
+	if (!mapped->map) {
+		return pread(file->fd, buf, size, offset);
+	}
+	if (offset >= mapped->size) {
+		return 0;
+	}
+	if (size > mapped->size - offset) {
+		size = mapped->size - offset;
+	}
+	memcpy(buf, mapped->map + offset, size);
+	return size;
+}
+
+static void mmap_advise(struct fluxfs_source_file *file, uint64_t offset, uint64_t length, int advice) {
+	struct mapped_file *mapped = (struct mapped_file *)file;
+	posix_fadvise(file->fd, offset, length, advice);
+	if (mapped->map && advice == POSIX_FADV_WILLNEED && offset < mapped->size) {
+		uint64_t page = sysconf(_SC_PAGESIZE);
+		uint64_t start = offset & ~(page - 1);
+		uint64_t end = length && length < mapped->size - offset ? offset + length : mapped->size;
+		madvise(mapped->map + start, end - start, MADV_WILLNEED);
+	}
+}
+
+static void mmap_close(struct fluxfs_source_file *file) {
+	struct mapped_file *mapped = (struct mapped_file *)file;
+	if (mapped->map) {
+		munmap(mapped->map, mapped->size);
+	}
+	close(file->fd);
+	free(mapped);
+}
+
+static const struct fluxfs_source_backend mmapBackend = {
+	"mmap", mmap_open, mmap_read_at, mmap_advise, mmap_close
+};
+
+// A built in backend by name, "pread" or "mmap". NULL for any other name.
+const struct fluxfs_source_backend *fluxfs_source_backend(const char *name) {
+	if (strcmp(name, fluxfs_pread_backend.name) == 0) {
+		return &fluxfs_pread_backend;
+	}
+	if (strcmp(name, mmapBackend.name) == 0) {
+		return &mmapBackend;
+	}
+	return NULL;
+}
@@ -0,0 +1,480 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fluxfs.h"
+#include "blob.h"
+
+// Embedded bytes shared by every loaded VF holding the same content. A blob
+// is found by content when bytes are interned and by address when they are
+// released.
+struct blob {
+	uint64_t hash;
+	uint64_t length;
+	uint8_t *bytes;
+	uint32_t refs;
+	// Set when bytes point into a pack mapping, which outlives the blob
+	uint8_t mapped;
+	struct blob *contentNext;
+	struct blob *addressNext;
+};
+
+static struct blob **byContent = NULL;
+static struct blob **byAddress = NULL;
+static size_t blobSlots = 0;
+static size_t blobCount = 0;
+static uint64_t blobBytes = 0;
+static uint64_t sharedBytes = 0;
+static pthread_mutex_t blobLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Each record of a pack is a hash, a length and the bytes
+struct pack_header {
+	char signature[8];
+};
+
+struct pack_record_header {
+	uint64_t hash;
+	uint64_t length;
+};
+
+struct pack_record {
+	uint64_t hash;
+	uint64_t length;
+	// Position of the bytes in the pack, 0 for a free slot
+	uint64_t position;
+};
+
+// Addresses reserved for mapping a pack, the file is mapped into the range
+// as it grows so each byte is mapped once and keeps its address. A pack
+// that outgrows the range gets a new one twice its size. Blobs point into
+// mappings, so they are kept until the process exits.
+#define BLOB_PACK_RESERVE (sizeof(void *) >= 8 ? 1ull << 36 : 1ull << 26)
+
+struct pack_mapping {
+	uint8_t *base;
+	uint64_t reserved;
+	// Bytes of the pack mapped at base
+	uint64_t size;
+	struct pack_mapping *next;
+};
+
+struct blob_pack {
+	char *path;
+	int fd;
+	int writable;
+	// Open addressed by hash
+	struct pack_record *records;
+	size_t recordSlots;
+	size_t recordCount;
+	// End of the records read so far
+	uint64_t end;
+	// Newest first, the first maps every record read
+	struct pack_mapping *mappings;
+	pthread_mutex_t lock;
+	struct blob_pack *next;
+};
+
+static struct blob_pack *packs = NULL;
+static pthread_mutex_t packLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t mix64(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDull;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+// Eight bytes at a time, the tail is padded with zeros
+uint64_t blob_hash(const uint8_t *bytes, uint64_t length) {
+	uint64_t hash = 0x9E3779B97F4A7C15ull ^ length;
+	uint64_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		hash = (hash ^ mix64(word)) * 0x9E3779B97F4A7C15ull;
+	}
+	uint64_t word = 0;
+	memcpy(&word, bytes + i, length - i);
+	return mix64(hash ^ mix64(word));
+}
+
+static size_t address_slot(const uint8_t *bytes, size_t slots) {
+	return mix64((uintptr_t)bytes) & (slots - 1);
+}
+
+// Double both tables once there are as many blobs as slots
+static int grow_blobs(void) {
+	size_t slots = blobSlots ? blobSlots * 2 : 1024;
+	struct blob **content = calloc(slots, sizeof(struct blob *));
+	struct blob **address = calloc(slots, sizeof(struct blob *));
+	if (!content || !address) {
+		free(content);
+		free(address);
+		return 1;
+	}
+	for (size_t i = 0; i < blobSlots; i++) {
+		while (byContent[i]) {
+			struct blob *blob = byContent[i];
+			byContent[i] = blob->contentNext;
+			size_t s = blob->hash & (slots - 1);
+			blob->contentNext = content[s];
+			content[s] = blob;
+			s = address_slot(blob->bytes, slots);
+			blob->addressNext = address[s];
+			address[s] = blob;
+		}
+	}
+	free(byContent);
+	free(byAddress);
+	byContent = content;
+	byAddress = address;
+	blobSlots = slots;
+	return 0;
+}
+
+// Find a blob with the same content or add one holding bytes. Called with
+// the blob lock held.
+static struct blob *intern(uint64_t hash, uint8_t *bytes, uint64_t length, int mapped) {
+	if (blobSlots) {
+		for (struct blob *blob = byContent[hash & (blobSlots - 1)]; blob; blob = blob->contentNext) {
+			if (blob->hash == hash && blob->length == length && memcmp(blob->bytes, bytes, length) == 0) {
+				blob->refs++;
+				sharedBytes += length;
+				return blob;
+			}
+		}
+	}
+	if (blobCount >= blobSlots && grow_blobs() != 0) {
+		return NULL;
+	}
+	struct blob *blob = malloc(sizeof(struct blob));
+	if (!blob) {
+		return NULL;
+	}
+	blob->hash = hash;
+	blob->length = length;
+	blob->bytes = bytes;
+	blob->refs = 1;
+	blob->mapped = mapped;
+	size_t s = hash & (blobSlots - 1);
+	blob->contentNext = byContent[s];
+	byContent[s] = blob;
+	s = address_slot(bytes, blobSlots);
+	blob->addressNext = byAddress[s];
+	byAddress[s] = blob;
+	blobCount++;
+	blobBytes += length;
+	return blob;
+}
+
+uint8_t *blob_adopt(uint8_t *bytes, uint64_t length) {
+	uint64_t hash = blob_hash(bytes, length);
+	pthread_mutex_lock(&blobLock);
+	struct blob *blob = intern(hash, bytes, length, 0);
+	pthread_mutex_unlock(&blobLock);
+	if (blob && blob->bytes != bytes) {
+		free(bytes);
+	}
+	return blob ? blob->bytes : NULL;
+}
+
+void blob_release(uint8_t *bytes) {
+	pthread_mutex_lock(&blobLock);
+	struct blob **link = blobSlots ? &byAddress[address_slot(bytes, blobSlots)] : NULL;
+	while (link && *link && (*link)->bytes != bytes) {
+		link = &(*link)->addressNext;
+	}
+	struct blob *blob = link ? *link : NULL;
+	if (blob && --blob->refs) {
+		sharedBytes -= blob->length;
+		blob = NULL;
+	} else if (blob) {
+		*link = blob->addressNext;
+		struct blob **content = &byContent[blob->hash & (blobSlots - 1)];
+		while (*content != blob) {
+			content = &(*content)->contentNext;
+		}
+		*content = blob->contentNext;
+		blobCount--;
+		blobBytes -= blob->length;
+	}
+	pthread_mutex_unlock(&blobLock);
+
+	if (blob) {
+		if (!blob->mapped) {
+			free(blob->bytes);
+		}
+		free(blob);
+	}
+}
+
+// Embedded bytes held once for every VF sharing them
+void fluxfs_blob_stats(struct fluxfs_blob_stats *stats) {
+	pthread_mutex_lock(&blobLock);
+	stats->blobs = blobCount;
+	stats->bytes = blobBytes;
+	stats->savedBytes = sharedBytes;
+	pthread_mutex_unlock(&blobLock);
+}
+
+static struct pack_record *find_record(struct blob_pack *pack, uint64_t hash, uint64_t length) {
+	if (!pack->recordSlots) {
+		return NULL;
+	}
+	size_t s = hash & (pack->recordSlots - 1);
+	while (pack->records[s].position) {
+		if (pack->records[s].hash == hash && pack->records[s].length == length) {
+			return &pack->records[s];
+		}
+		s = (s + 1) & (pack->recordSlots - 1);
+	}
+	return NULL;
+}
+
+static int add_record(struct blob_pack *pack, uint64_t hash, uint64_t length, uint64_t position) {
+	if (find_record(pack, hash, length)) {
+		// A later copy, the first one is used
+		return 0;
+	}
+	if ((pack->recordCount + 1) * 2 > pack->recordSlots) {
+		size_t slots = pack->recordSlots ? pack->recordSlots * 2 : 1024;
+		struct pack_record *records = calloc(slots, sizeof(struct pack_record));
+		if (!records) {
+			return 1;
+		}
+		for (size_t i = 0; i < pack->recordSlots; i++) {
+			if (pack->records[i].position) {
+				size_t s = pack->records[i].hash & (slots - 1);
+				while (records[s].position) {
+					s = (s + 1) & (slots - 1);
+				}
+				records[s] = pack->records[i];
+			}
+		}
+		free(pack->records);
+		pack->records = records;
+		pack->recordSlots = slots;
+	}
+	size_t s = hash & (pack->recordSlots - 1);
+	while (pack->records[s].position) {
+		s = (s + 1) & (pack->recordSlots - 1);
+	}
+	pack->records[s].hash = hash;
+	pack->records[s].length = length;
+	pack->records[s].position = position;
+	pack->recordCount++;
+	return 0;
+}
+
+// Map the pack up to its end, extending the current mapping in place.
+// Called with the pack locked.
+static int map_pack(struct blob_pack *pack) {
+	struct pack_mapping *mapping = pack->mappings;
+	if (!mapping || mapping->reserved < pack->end) {
+		uint64_t reserve = mapping ? mapping->reserved * 2 : BLOB_PACK_RESERVE;
+		while (reserve < pack->end) {
+			reserve *= 2;
+		}
+		mapping = reserve <= SIZE_MAX ? malloc(sizeof(struct pack_mapping)) : NULL;
+		if (!mapping) {
+			return 1;
+		}
+		mapping->base = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mapping->base == MAP_FAILED) {
+			free(mapping);
+			return 1;
+		}
+		mapping->reserved = reserve;
+		mapping->size = 0;
+		mapping->next = pack->mappings;
+		pack->mappings = mapping;
+	}
+
+	// The last page mapped so far is mapped again with the bytes after it
+	uint64_t start = mapping->size & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+	if (mmap(mapping->base + start, pack->end - start, PROT_READ, MAP_SHARED | MAP_FIXED, pack->fd, start) == MAP_FAILED) {
+		if (mapping->size == 0) {
+			// The reservation is dropped, the previous mapping stays current
+			pack->mappings = mapping->next;
+			munmap(mapping->base, mapping->reserved);
+			free(mapping);
+		}
+		return 1;
+	}
+	mapping->size = pack->end;
+	return 0;
+}
+
+// Read the records added since the last refresh, by this or another
+// process, and map them. Called with the pack locked.
+static int refresh_pack(struct blob_pack *pack) {
+	struct stat st;
+	if (fstat(pack->fd, &st) != 0) {
+		return 1;
+	}
+	uint64_t size = st.st_size;
+	while (pack->end + sizeof(struct pack_record_header) <= size) {
+		struct pack_record_header header;
+		if (pread(pack->fd, &header, sizeof(header), pack->end) != sizeof(header)) {
+			return 1;
+		}
+		uint64_t position = pack->end + sizeof(header);
+		if (header.length > size - position) {
+			// Torn by a writer that stopped, or still being written
+			break;
+		}
+		if (add_record(pack, header.hash, header.length, position) != 0) {
+			return 1;
+		}
+		pack->end = position + header.length;
+	}
+
+	if (!pack->mappings || pack->mappings->size < pack->end) {
+		return map_pack(pack);
+	}
+	return 0;
+}
+
+// Bytes of a record, NULL if they are not mapped
+static uint8_t *record_bytes(struct blob_pack *pack, struct pack_record *record) {
+	struct pack_mapping *mapping = pack->mappings;
+	if (!record || !mapping || record->position + record->length > mapping->size) {
+		return NULL;
+	}
+	return mapping->base + record->position;
+}
+
+static struct blob_pack *open_pack(const char *path, int create) {
+	int writable = 1;
+	int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+	if (fd < 0 && !create) {
+		writable = 0;
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0) {
+		return NULL;
+	}
+
+	// The first writer adds the signature
+	struct pack_header header;
+	memset(&header, 0, sizeof(header));
+	strcpy(header.signature, FLUXFS_BLOB_PACK_SIGNATURE);
+	struct pack_header found;
+	flock(fd, writable ? LOCK_EX : LOCK_SH);
+	struct stat st;
+	int valid = fstat(fd, &st) == 0;
+	if (valid && st.st_size == 0 && writable) {
+		valid = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	} else if (valid) {
+		valid = pread(fd, &found, sizeof(found), 0) == sizeof(found) && memcmp(&found, &header, sizeof(header)) == 0;
+	}
+	flock(fd, LOCK_UN);
+
+	struct blob_pack *pack = valid ? calloc(1, sizeof(struct blob_pack)) : NULL;
+	if (!pack || !(pack->path = strdup(path))) {
+		if (!valid) {
+			fprintf(stderr, "Invalid blob pack %s\n", path);
+		}
+		free(pack);
+		close(fd);
+		return NULL;
+	}
+	pack->fd = fd;
+	pack->writable = writable;
+	pack->end = sizeof(struct pack_header);
+	pthread_mutex_init(&pack->lock, NULL);
+	return pack;
+}
+
+struct blob_pack *blob_pack_get(const char *directory, int create) {
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", directory, FLUXFS_BLOB_PACK_NAME) >= (int)sizeof(path)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&packLock);
+	struct blob_pack *pack = packs;
+	while (pack && strcmp(pack->path, path) != 0) {
+		pack = pack->next;
+	}
+	if (!pack) {
+		pack = open_pack(path, create);
+		if (pack) {
+			pack->next = packs;
+			packs = pack;
+		}
+	}
+	pthread_mutex_unlock(&packLock);
+	return pack && (!create || pack->writable) ? pack : NULL;
+}
+
+uint8_t *blob_pack_load(struct blob_pack *pack, uint64_t hash, uint64_t length) {
+	pthread_mutex_lock(&pack->lock);
+	struct pack_record *record = find_record(pack, hash, length);
+	if (!record && refresh_pack(pack) == 0) {
+		record = find_record(pack, hash, length);
+	}
+	uint8_t *bytes = record_bytes(pack, record);
+	pthread_mutex_unlock(&pack->lock);
+
+	if (!bytes) {
+		return NULL;
+	}
+
+	// Records loaded before were checked then
+	pthread_mutex_lock(&blobLock);
+	struct blob *blob = blobSlots ? byAddress[address_slot(bytes, blobSlots)] : NULL;
+	while (blob && blob->bytes != bytes) {
+		blob = blob->addressNext;
+	}
+	if (blob) {
+		blob->refs++;
+		sharedBytes += length;
+	}
+	pthread_mutex_unlock(&blobLock);
+	if (blob) {
+		return bytes;
+	}
+
+	// A damaged record is not served
+	if (blob_hash(bytes, length) != hash) {
+		return NULL;
+	}
+	pthread_mutex_lock(&blobLock);
+	blob = intern(hash, bytes, length, 1);
+	pthread_mutex_unlock(&blobLock);
+	return blob ? blob->bytes : NULL;
+}
+
+int blob_pack_store(struct blob_pack *pack, const uint8_t *bytes, uint64_t length, uint64_t *hash) {
+	*hash = blob_hash(bytes, length);
+	pthread_mutex_lock(&pack->lock);
+	flock(pack->fd, LOCK_EX);
+	int result = refresh_pack(pack);
+	struct pack_record *record = result ? NULL : find_record(pack, *hash, length);
+	if (record) {
+		uint8_t *packed = record_bytes(pack, record);
+		result = !packed || memcmp(packed, bytes, length) != 0;
+	} else if (!result) {
+		// A record torn by a writer that stopped is cut off first
+		struct pack_record_header header = { .hash = *hash, .length = length };
+		result = ftruncate(pack->fd, pack->end) != 0 ||
+			pwrite(pack->fd, &header, sizeof(header), pack->end) != sizeof(header) ||
+			pwrite(pack->fd, bytes, length, pack->end + sizeof(header)) != (ssize_t)length ||
+			refresh_pack(pack) != 0;
+	}
+	flock(pack->fd, LOCK_UN);
+	pthread_mutex_unlock(&pack->lock);
+	return result;
+}
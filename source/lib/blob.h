@@ -0,0 +1,30 @@
+#ifndef FLUXFS_BLOB_H
+#define FLUXFS_BLOB_H
+
+#include <stdint.h>
+
+struct blob_pack;
+
+// Content hash naming a blob in memory and in packs
+uint64_t blob_hash(const uint8_t *bytes, uint64_t length);
+
+// Share malloc'd bytes with the blob holding the same content, taking
+// ownership of them. The returned bytes are read only and counted once
+// for the caller, NULL if they could not be interned.
+uint8_t *blob_adopt(uint8_t *bytes, uint64_t length);
+
+// Drop the caller's count of shared bytes from blob_adopt or blob_pack_load
+void blob_release(uint8_t *bytes);
+
+// The blob pack of a directory, opened once per process and never closed.
+// NULL if it does not exist and create is 0, or cannot be opened.
+struct blob_pack *blob_pack_get(const char *directory, int create);
+
+// Shared bytes of a packed blob, NULL if the pack does not hold it intact
+uint8_t *blob_pack_load(struct blob_pack *pack, uint64_t hash, uint64_t length);
+
+// Add bytes to a pack unless it holds them already. Returns 1 if they
+// cannot be stored, also when another blob has the same hash.
+int blob_pack_store(struct blob_pack *pack, const uint8_t *bytes, uint64_t length, uint64_t *hash);
+
+#endif // !FLUXFS_BLOB_H
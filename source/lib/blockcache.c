@@ -0,0 +1,454 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "fluxfs.h"
+#include "source.h"
+#include "blockcache.h"
+
+// Blocks are stored one per file as <dir>/<xx>/<identity>-<block>, so the
+// cache survives restarts and a torn write only loses one block
+#define BLOCK_CACHE_SIGNATURE "FluxFSB"
+#define BLOCK_CACHE_SUBDIRS 256
+// Blocks missed once are remembered here, a second miss admits them
+#define BLOCK_CACHE_GHOST_SLOTS 65536
+
+struct block_header {
+	char signature[8];
+	uint64_t identity;
+	uint64_t block;
+	uint32_t length;
+	uint32_t crc;
+};
+
+struct cached_block {
+	uint64_t identity;
+	uint64_t block;
+	// Bytes the file takes on disk, header included
+	uint64_t size;
+	struct cached_block *hashNext;
+	struct cached_block *prev;
+	struct cached_block *next;
+};
+
+static char *cacheDir = NULL;
+static uint64_t maxBytes = 0;
+static uint64_t usedBytes = 0;
+static struct cached_block **table = NULL;
+static size_t tableSlots = 0;
+static size_t blockCount = 0;
+// Most recently used first
+static struct cached_block *head = NULL;
+static struct cached_block *tail = NULL;
+static uint64_t *ghosts = NULL;
+static uint64_t tempCounter = 0;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t mix64(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDull;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+static uint64_t block_hash(uint64_t identity, uint64_t block) {
+	return mix64(identity ^ mix64(block + 1));
+}
+
+static void block_path(char *path, size_t size, uint64_t identity, uint64_t block) {
+	snprintf(path, size, "%s/%02x/%016" PRIx64 "-%" PRIx64, cacheDir,
+		(unsigned)(block_hash(identity, block) % BLOCK_CACHE_SUBDIRS), identity, block);
+}
+
+static struct cached_block **find_slot(uint64_t identity, uint64_t block) {
+	struct cached_block **slot = &table[block_hash(identity, block) & (tableSlots - 1)];
+	while (*slot && ((*slot)->identity != identity || (*slot)->block != block)) {
+		slot = &(*slot)->hashNext;
+	}
+	return slot;
+}
+
+static void unlink_lru(struct cached_block *entry) {
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		tail = entry->prev;
+	}
+}
+
+static void link_lru(struct cached_block *entry) {
+	entry->prev = NULL;
+	entry->next = head;
+	if (head) {
+		head->prev = entry;
+	} else {
+		tail = entry;
+	}
+	head = entry;
+}
+
+static int grow_table(void) {
+	size_t slots = tableSlots ? tableSlots * 2 : 4096;
+	struct cached_block **grown = calloc(slots, sizeof(struct cached_block *));
+	if (!grown) {
+		return 1;
+	}
+	for (size_t i = 0; i < tableSlots; i++) {
+		struct cached_block *entry = table[i];
+		while (entry) {
+			struct cached_block *next = entry->hashNext;
+			struct cached_block **slot = &grown[block_hash(entry->identity, entry->block) & (slots - 1)];
+			entry->hashNext = *slot;
+			*slot = entry;
+			entry = next;
+		}
+	}
+	free(table);
+	table = grown;
+	tableSlots = slots;
+	return 0;
+}
+
+// Drop an entry and its file, called with the cache locked
+static void remove_block(struct cached_block *entry) {
+	struct cached_block **slot = find_slot(entry->identity, entry->block);
+	*slot = entry->hashNext;
+	unlink_lru(entry);
+	usedBytes -= entry->size;
+	blockCount--;
+
+	char path[PATH_MAX];
+	block_path(path, sizeof(path), entry->identity, entry->block);
+	unlink(path);
+	free(entry);
+}
+
+// Track a stored block as the most recently used and evict past the cap,
+// called with the cache locked. Entries are added oldest first when loading.
+static int add_block(uint64_t identity, uint64_t block, uint64_t size) {
+	struct cached_block **slot = find_slot(identity, block);
+	if (*slot) {
+		usedBytes = usedBytes - (*slot)->size + size;
+		(*slot)->size = size;
+		unlink_lru(*slot);
+		link_lru(*slot);
+	} else {
+		if (blockCount >= tableSlots && grow_table() != 0) {
+			return 1;
+		}
+		struct cached_block *entry = calloc(1, sizeof(struct cached_block));
+		if (!entry) {
+			return 1;
+		}
+		entry->identity = identity;
+		entry->block = block;
+		entry->size = size;
+		slot = find_slot(identity, block);
+		entry->hashNext = *slot;
+		*slot = entry;
+		link_lru(entry);
+		usedBytes += size;
+		blockCount++;
+	}
+	while (usedBytes > maxBytes && tail) {
+		remove_block(tail);
+	}
+	return 0;
+}
+
+// A block is admitted on its second miss, so one pass over a stream does
+// not flush blocks that are read again and again
+static int admit_block(uint64_t identity, uint64_t block) {
+	uint64_t fingerprint = block_hash(identity, block) | 1;
+	uint64_t *ghost = &ghosts[(fingerprint >> 1) % BLOCK_CACHE_GHOST_SLOTS];
+	if (*ghost == fingerprint) {
+		*ghost = 0;
+		return 1;
+	}
+	*ghost = fingerprint;
+	return 0;
+}
+
+struct loaded_block {
+	uint64_t identity;
+	uint64_t block;
+	uint64_t size;
+	struct timespec mtime;
+};
+
+static int compare_loaded(const void *a, const void *b) {
+	const struct loaded_block *la = a;
+	const struct loaded_block *lb = b;
+	if (la->mtime.tv_sec != lb->mtime.tv_sec) {
+		return la->mtime.tv_sec < lb->mtime.tv_sec ? -1 : 1;
+	}
+	if (la->mtime.tv_nsec != lb->mtime.tv_nsec) {
+		return la->mtime.tv_nsec < lb->mtime.tv_nsec ? -1 : 1;
+	}
+	return 0;
+}
+
+// Index the blocks an earlier run stored, oldest first so the newest end up
+// most recently used. Temporary files of interrupted writes are removed.
+static int load_blocks(void) {
+	struct loaded_block *loaded = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	char path[PATH_MAX];
+
+	for (unsigned sub = 0; sub < BLOCK_CACHE_SUBDIRS; sub++) {
+		snprintf(path, sizeof(path), "%s/%02x", cacheDir, sub);
+		if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+			perror(path);
+			free(loaded);
+			return 1;
+		}
+		DIR *dir = opendir(path);
+		if (!dir) {
+			continue;
+		}
+		struct dirent *ent;
+		while ((ent = readdir(dir))) {
+			char file[PATH_MAX + sizeof(ent->d_name)];
+			snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+			if (strncmp(ent->d_name, ".tmp-", 5) == 0) {
+				unlink(file);
+				continue;
+			}
+			uint64_t identity;
+			uint64_t block;
+			int used = 0;
+			struct stat st;
+			if (sscanf(ent->d_name, "%16" SCNx64 "-%" SCNx64 "%n", &identity, &block, &used) != 2 ||
+				ent->d_name[used] != 0 || stat(file, &st) != 0) {
+				continue;
+			}
+			if (count == capacity) {
+				capacity = capacity ? capacity * 2 : 1024;
+				struct loaded_block *grown = realloc(loaded, capacity * sizeof(struct loaded_block));
+				if (!grown) {
+					closedir(dir);
+					free(loaded);
+					return 1;
+				}
+				loaded = grown;
+			}
+			loaded[count].identity = identity;
+			loaded[count].block = block;
+			loaded[count].size = st.st_size;
+			loaded[count].mtime = st.st_mtim;
+			count++;
+		}
+		closedir(dir);
+	}
+
+	if (count) {
+		qsort(loaded, count, sizeof(struct loaded_block), compare_loaded);
+	}
+	int result = 0;
+	for (size_t i = 0; i < count && result == 0; i++) {
+		result = add_block(loaded[i].identity, loaded[i].block, loaded[i].size);
+	}
+	free(loaded);
+	return result;
+}
+
+// Keep blocks of source files in directory, normally on a local SSD, up to
+// maxSize bytes. Reads through fluxfs_source_read are served from it first.
+int fluxfs_block_cache_open(const char *directory, uint64_t maxSize) {
+	fluxfs_block_cache_close();
+	if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+		perror(directory);
+		return 1;
+	}
+
+	pthread_mutex_lock(&cacheLock);
+	cacheDir = resolve_path(NULL, directory);
+	ghosts = calloc(BLOCK_CACHE_GHOST_SLOTS, sizeof(uint64_t));
+	maxBytes = maxSize;
+	int result = (!cacheDir || !ghosts || grow_table() != 0 || load_blocks() != 0);
+	pthread_mutex_unlock(&cacheLock);
+
+	if (result) {
+		fluxfs_block_cache_close();
+	}
+	return result;
+}
+
+// Stop using the cache, the stored blocks are kept for the next open
+void fluxfs_block_cache_close(void) {
+	pthread_mutex_lock(&cacheLock);
+	while (head) {
+		struct cached_block *next = head->next;
+		free(head);
+		head = next;
+	}
+	tail = NULL;
+	free(table);
+	table = NULL;
+	tableSlots = 0;
+	blockCount = 0;
+	usedBytes = 0;
+	free(ghosts);
+	ghosts = NULL;
+	free(cacheDir);
+	cacheDir = NULL;
+	pthread_mutex_unlock(&cacheLock);
+}
+
+int block_cache_enabled(void) {
+	pthread_mutex_lock(&cacheLock);
+	int enabled = cacheDir != NULL;
+	pthread_mutex_unlock(&cacheLock);
+	return enabled;
+}
+
+// Copy part of a stored block, returns 1 if it is missing or damaged
+static int read_block(uint64_t identity, uint64_t block, uint8_t *data, uint8_t *buf, size_t within, size_t part) {
+	char path[PATH_MAX];
+	pthread_mutex_lock(&cacheLock);
+	if (!cacheDir) {
+		pthread_mutex_unlock(&cacheLock);
+		return 1;
+	}
+	block_path(path, sizeof(path), identity, block);
+	pthread_mutex_unlock(&cacheLock);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 1;
+	}
+	struct block_header header;
+	int result = read_full(fd, (uint8_t *)&header, sizeof(header), 0) != 0 ||
+		memcmp(header.signature, BLOCK_CACHE_SIGNATURE, sizeof(header.signature)) != 0 ||
+		header.identity != identity || header.block != block ||
+		header.length > FLUXFS_BLOCK_CACHE_BLOCK_SIZE || within + part > header.length ||
+		read_full(fd, data, header.length, sizeof(header)) != 0 ||
+		fluxfs_crc32c(0, data, header.length) != header.crc;
+	close(fd);
+	if (result == 0) {
+		memcpy(buf, data + within, part);
+	}
+	return result;
+}
+
+// Store a block under a temporary name and rename it into place
+static void store_block(uint64_t identity, uint64_t block, const uint8_t *data, uint32_t length) {
+	char path[PATH_MAX];
+	char temp[PATH_MAX];
+	pthread_mutex_lock(&cacheLock);
+	if (!cacheDir) {
+		pthread_mutex_unlock(&cacheLock);
+		return;
+	}
+	block_path(path, sizeof(path), identity, block);
+	snprintf(temp, sizeof(temp), "%s/%02x/.tmp-%ld-%" PRIu64, cacheDir,
+		(unsigned)(block_hash(identity, block) % BLOCK_CACHE_SUBDIRS), (long)getpid(), tempCounter++);
+	pthread_mutex_unlock(&cacheLock);
+
+	struct block_header header = { .signature = BLOCK_CACHE_SIGNATURE };
+	header.identity = identity;
+	header.block = block;
+	header.length = length;
+	header.crc = fluxfs_crc32c(0, data, length);
+
+	int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return;
+	}
+	int failed = write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+		write(fd, data, length) != (ssize_t)length;
+	failed |= close(fd) != 0;
+	if (failed || rename(temp, path) != 0) {
+		unlink(temp);
+		return;
+	}
+
+	pthread_mutex_lock(&cacheLock);
+	if (!cacheDir || add_block(identity, block, sizeof(header) + length) != 0) {
+		unlink(path);
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+int block_cache_read(uint64_t identity, uint64_t fileSize, uint32_t source, uint8_t *buf, size_t size, uint64_t offset) {
+	uint8_t *data = NULL;
+	while (size) {
+		uint64_t block = offset / FLUXFS_BLOCK_CACHE_BLOCK_SIZE;
+		uint64_t blockStart = block * FLUXFS_BLOCK_CACHE_BLOCK_SIZE;
+		size_t within = offset - blockStart;
+		size_t part = FLUXFS_BLOCK_CACHE_BLOCK_SIZE - within;
+		if (part > size) {
+			part = size;
+		}
+
+		pthread_mutex_lock(&cacheLock);
+		int cached = 0;
+		int admit = 0;
+		if (cacheDir && blockStart < fileSize) {
+			struct cached_block *entry = *find_slot(identity, block);
+			if (entry) {
+				unlink_lru(entry);
+				link_lru(entry);
+				cached = 1;
+			} else {
+				admit = admit_block(identity, block);
+			}
+		}
+		pthread_mutex_unlock(&cacheLock);
+
+		if ((cached || admit) && !data) {
+			data = malloc(FLUXFS_BLOCK_CACHE_BLOCK_SIZE);
+			if (!data) {
+				cached = admit = 0;
+			}
+		}
+		if (cached && read_block(identity, block, data, buf, within, part) != 0) {
+			// Removed or damaged underneath us, read it from the source
+			cached = 0;
+			admit = 1;
+		}
+
+		if (!cached) {
+			uint64_t blockLength = fileSize - blockStart;
+			if (blockLength > FLUXFS_BLOCK_CACHE_BLOCK_SIZE) {
+				blockLength = FLUXFS_BLOCK_CACHE_BLOCK_SIZE;
+			}
+			if (admit && within + part <= blockLength) {
+				// One read of the whole block, then it is served locally
+				if (read_source(source, data, blockLength, blockStart) != 0) {
+					free(data);
+					return 1;
+				}
+				memcpy(buf, data + within, part);
+				store_block(identity, block, data, blockLength);
+			} else if (read_source(source, buf, part, offset) != 0) {
+				free(data);
+				return 1;
+			}
+		}
+
+		buf += part;
+		size -= part;
+		offset += part;
+	}
+	free(data);
+	return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef FLUXFS_BLOCKCACHE_H
+#define FLUXFS_BLOCKCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Nonzero while a cache directory is open
+int block_cache_enabled(void);
+
+// Read size bytes at offset of a source, serving cached blocks and
+// admitting blocks read from the source. identity names the file and its
+// version, fileSize is its size when identity was taken. Returns 1 if the
+// bytes could not be read.
+int block_cache_read(uint64_t identity, uint64_t fileSize, uint32_t source, uint8_t *buf, size_t size, uint64_t offset);
+
+#endif // !FLUXFS_BLOCKCACHE_H
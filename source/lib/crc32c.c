@@ -0,0 +1,130 @@
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "fluxfs.h"
+
+// CRC32C (Castagnoli), reflected polynomial
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Slice-by-8 software fallback
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+	while (len && ((uintptr_t)p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint32_t lo, hi;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = crc32c_table[7][lo & 0xFF] ^
+			crc32c_table[6][(lo >> 8) & 0xFF] ^
+			crc32c_table[5][(lo >> 16) & 0xFF] ^
+			crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xFF] ^
+			crc32c_table[2][(hi >> 8) & 0xFF] ^
+			crc32c_table[1][(hi >> 16) & 0xFF] ^
+			crc32c_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+// SSE4.2 crc32 instruction, 8 bytes per step
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+	uint64_t c = crc;
+	while (len && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while (len >= 32) {
+		uint64_t v[4];
+		memcpy(v, p, 32);
+		c = _mm_crc32_u64(c, v[0]);
+		c = _mm_crc32_u64(c, v[1]);
+		c = _mm_crc32_u64(c, v[2]);
+		c = _mm_crc32_u64(c, v[3]);
+		p += 32;
+		len -= 32;
+	}
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		c = _mm_crc32_u8(c, *p++);
+	}
+	return c;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+// ARMv8 crc32c instructions
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+	while (len && ((uintptr_t)p & 7)) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc = __crc32cb(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+		}
+		crc32c_table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int j = 1; j < 8; j++) {
+			crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xFF] ^ (crc32c_table[j - 1][i] >> 8);
+		}
+	}
+
+	crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_impl = crc32c_hw;
+	}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	crc32c_impl = crc32c_hw;
+#endif
+}
+
+// Continue a CRC32C, pass 0 to start a new one
+uint32_t fluxfs_crc32c(uint32_t crc, const void *data, size_t length) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_impl(~crc, data, length);
+}
@@ -0,0 +1,295 @@
+
+#define _GNU_SOURCE // copy_file_range
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "fluxfs.h"
+#include "vf.h"
+
+// A run of one entry written to the exported file by one worker
+struct export_job {
+	struct vf_entry *entry;
+	uint64_t entryOffset;
+	uint64_t length;
+	// Offset of the run in the exported file
+	uint64_t offset;
+};
+
+struct export_state {
+	struct fluxfs_vf *vf;
+	int fd;
+	// Block size of the exported file, reflinks must be aligned to it
+	uint64_t blockSize;
+	struct export_job *jobs;
+	size_t jobCount;
+	atomic_size_t nextJob;
+	atomic_int failed;
+	// Cleared once the file system refuses a reflink or an in-kernel copy
+	atomic_int canClone;
+	atomic_int canCopy;
+	atomic_uint_least64_t cloned;
+	atomic_uint_least64_t copied;
+	atomic_uint_least64_t written;
+};
+
+static int write_full(int fd, const uint8_t *buf, uint64_t size, uint64_t offset) {
+	while (size) {
+		ssize_t done = pwrite(fd, buf, size, offset);
+		if (done < 0 && errno == EINTR) {
+			continue;
+		}
+		if (done <= 0) {
+			return 1;
+		}
+		buf += done;
+		size -= done;
+		offset += done;
+	}
+	return 0;
+}
+
+// Errors that mean the file systems cannot do it, rather than a failed copy
+static int unsupported(int error) {
+	return error == EOPNOTSUPP || error == ENOTTY || error == EXDEV || error == EINVAL || error == ENOSYS || error == EPERM;
+}
+
+// Copy a source range in the kernel, or through a buffer where the file
+// systems cannot
+static int copy_source(struct export_state *state, uint32_t source, uint64_t sourceOffset, uint64_t offset, uint64_t length) {
+	while (length && atomic_load(&state->canCopy)) {
+		loff_t in = sourceOffset;
+		loff_t out = offset;
+		ssize_t done = copy_file_range(fluxfs_source_fd(source), &in, state->fd, &out, length, 0);
+		if (done < 0 && errno == EINTR) {
+			continue;
+		}
+		if (done < 0 && unsupported(errno)) {
+			atomic_store(&state->canCopy, 0);
+			break;
+		}
+		if (done <= 0) {
+			// An error, or the source ends before the reference does
+			return 1;
+		}
+		atomic_fetch_add(&state->copied, done);
+		sourceOffset += done;
+		offset += done;
+		length -= done;
+	}
+
+	if (!length) {
+		return 0;
+	}
+	size_t bufSize = length < FLUXFS_EXPORT_BUFFER_SIZE ? length : FLUXFS_EXPORT_BUFFER_SIZE;
+	uint8_t *buf = malloc(bufSize);
+	if (!buf) {
+		return 1;
+	}
+	while (length) {
+		size_t size = length < bufSize ? length : bufSize;
+		if (fluxfs_source_read(source, buf, size, sourceOffset) != 0 || write_full(state->fd, buf, size, offset) != 0) {
+			free(buf);
+			return 1;
+		}
+		atomic_fetch_add(&state->written, size);
+		sourceOffset += size;
+		offset += size;
+		length -= size;
+	}
+	free(buf);
+	return 0;
+}
+
+// Share the blocks of a source range with the exported file where both sit
+// on a file system with reflinks, copying the unaligned ends
+static int export_source(struct export_state *state, uint32_t source, uint64_t sourceOffset, uint64_t offset, uint64_t length) {
+	uint64_t block = state->blockSize;
+	uint64_t head = (block - offset % block) % block;
+	if (atomic_load(&state->canClone) && sourceOffset % block == offset % block && head < length && length - head >= block) {
+		uint64_t cloneLength = (length - head) / block * block;
+		struct file_clone_range range = {
+			.src_fd = fluxfs_source_fd(source),
+			.src_offset = sourceOffset + head,
+			.src_length = cloneLength,
+			.dest_offset = offset + head
+		};
+		if (ioctl(state->fd, FICLONERANGE, &range) == 0) {
+			atomic_fetch_add(&state->cloned, cloneLength);
+			uint64_t tail = head + cloneLength;
+			return copy_source(state, source, sourceOffset, offset, head) ||
+				copy_source(state, source, sourceOffset + tail, offset + tail, length - tail);
+		}
+		if (unsupported(errno)) {
+			atomic_store(&state->canClone, 0);
+		}
+	}
+	return copy_source(state, source, sourceOffset, offset, length);
+}
+
+static int export_job(struct export_state *state, struct export_job *job) {
+	struct fluxfs_vf *vf = state->vf;
+	struct vf_entry *entry = job->entry;
+	if (entry->type == FLUXFS_ENTRY_ZERO) {
+		// The file was extended to its size, so zeros are already a hole
+		return 0;
+	}
+	if (entry->type == FLUXFS_ENTRY_DATA) {
+		atomic_fetch_add(&state->written, job->length);
+		return write_full(state->fd, entry->data.bytes + job->entryOffset, job->length, job->offset);
+	}
+
+	if (entry->type == FLUXFS_ENTRY_REFERENCE || entry->type == FLUXFS_ENTRY_PATCH) {
+		if (entry->pathIndex >= vf->sourceCount) {
+			return 1;
+		}
+		uint64_t sourceOffset = entry->type == FLUXFS_ENTRY_PATCH ? entry->data.patched->offset : entry->data.offset;
+		if (export_source(state, vf->sources[entry->pathIndex], sourceOffset + job->entryOffset, job->offset, job->length) != 0) {
+			return 1;
+		}
+		if (entry->type == FLUXFS_ENTRY_REFERENCE) {
+			return 0;
+		}
+
+		// Patches go over the copied range
+		struct vf_patched *patched = entry->data.patched;
+		uint64_t end = job->entryOffset + job->length;
+		for (uint32_t i = find_patch(patched, job->entryOffset); i < patched->patchCount && patched->patches[i].offset < end; i++) {
+			struct vf_patch *patch = &patched->patches[i];
+			uint64_t from = patch->offset > job->entryOffset ? patch->offset : job->entryOffset;
+			uint64_t to = patch->offset + patch->length < end ? patch->offset + patch->length : end;
+			if (write_full(state->fd, patched->bytes + patch->start + (from - patch->offset), to - from,
+				job->offset + (from - job->entryOffset)) != 0) {
+				return 1;
+			}
+			atomic_fetch_add(&state->written, to - from);
+		}
+		return 0;
+	}
+
+	// Compressed and pattern entries are decoded through a buffer
+	size_t bufSize = job->length < FLUXFS_EXPORT_BUFFER_SIZE ? job->length : FLUXFS_EXPORT_BUFFER_SIZE;
+	uint8_t *buf = malloc(bufSize);
+	if (!buf) {
+		return 1;
+	}
+	for (uint64_t done = 0; done < job->length;) {
+		size_t size = job->length - done < bufSize ? job->length - done : bufSize;
+		if (read_entry_bytes(vf, entry, buf, job->entryOffset + done, size) != 0 ||
+			write_full(state->fd, buf, size, job->offset + done) != 0) {
+			free(buf);
+			return 1;
+		}
+		done += size;
+	}
+	atomic_fetch_add(&state->written, job->length);
+	free(buf);
+	return 0;
+}
+
+static void *export_worker(void *arg) {
+	struct export_state *state = arg;
+	while (!atomic_load(&state->failed)) {
+		size_t i = atomic_fetch_add(&state->nextJob, 1);
+		if (i >= state->jobCount) {
+			break;
+		}
+		if (export_job(state, &state->jobs[i]) != 0) {
+			atomic_store(&state->failed, 1);
+		}
+	}
+	return NULL;
+}
+
+// Split the entries into jobs of at most FLUXFS_EXPORT_JOB_SIZE bytes, a
+// multiple of any block size, so large references are shared by workers
+static int build_jobs(struct export_state *state) {
+	size_t count = 0;
+	for (struct vf_entry *entry = state->vf->head; entry; entry = entry->next) {
+		count += entry->length / FLUXFS_EXPORT_JOB_SIZE + 1;
+	}
+	state->jobs = malloc((count ? count : 1) * sizeof(struct export_job));
+	if (!state->jobs) {
+		return 1;
+	}
+
+	uint64_t offset = 0;
+	for (struct vf_entry *entry = state->vf->head; entry; entry = entry->next) {
+		for (uint64_t done = 0; done < entry->length; done += FLUXFS_EXPORT_JOB_SIZE) {
+			struct export_job *job = &state->jobs[state->jobCount++];
+			job->entry = entry;
+			job->entryOffset = done;
+			job->length = entry->length - done < FLUXFS_EXPORT_JOB_SIZE ? entry->length - done : FLUXFS_EXPORT_JOB_SIZE;
+			job->offset = offset + done;
+		}
+		offset += entry->length;
+	}
+	return 0;
+}
+
+// Write the bytes of a virtual file to a standalone file at filePath. Source
+// ranges are reflinked where the file system supports it and otherwise
+// copied in the kernel, embedded bytes are written directly and every run is
+// exported in parallel by threads workers. stats may be NULL.
+int fluxfs_vf_export(struct fluxfs_vf *vf, const char *filePath, int threads, struct fluxfs_export_stats *stats) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return 1;
+	}
+
+	struct export_state state;
+	memset(&state, 0, sizeof(state));
+	state.vf = vf;
+	atomic_init(&state.canClone, 1);
+	atomic_init(&state.canCopy, 1);
+	state.fd = open(filePath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (state.fd < 0) {
+		perror("Error opening file");
+		return 1;
+	}
+
+	struct stat st;
+	int result = fstat(state.fd, &st) != 0 || ftruncate(state.fd, vf->size) != 0 || build_jobs(&state) != 0;
+	if (!result) {
+		state.blockSize = st.st_blksize > 0 ? st.st_blksize : 4096;
+		if (threads < 1) {
+			threads = 1;
+		}
+		pthread_t *workers = malloc(threads * sizeof(pthread_t));
+		int started = 0;
+		while (workers && started < threads && pthread_create(&workers[started], NULL, export_worker, &state) == 0) {
+			started++;
+		}
+		if (started == 0) {
+			export_worker(&state);
+		}
+		for (int i = 0; i < started; i++) {
+			pthread_join(workers[i], NULL);
+		}
+		free(workers);
+		result = atomic_load(&state.failed);
+	}
+	free(state.jobs);
+
+	if (close(state.fd) != 0) {
+		result = 1;
+	}
+	if (result) {
+		perror("Error exporting file");
+	}
+	if (stats) {
+		stats->cloned = atomic_load(&state.cloned);
+		stats->copied = atomic_load(&state.copied);
+		stats->written = atomic_load(&state.written);
+	}
+	return result;
+}
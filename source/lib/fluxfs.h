@@ -3,12 +3,143 @@
 
 #include <stdint.h>
 #include <inttypes.h>
+#include <sys/types.h>
 
-struct vf_strings {
-	uint8_t cnt;
-	char *paths[256];
+// Virtual file format versions
+#define FLUXFS_VF_VERSION_1 1
+#define FLUXFS_VF_VERSION_2 2
+
+// Largest number of path strings a version 1 file can hold
+#define FLUXFS_VF_V1_MAX_PATHS 255
+
+// Entry types
+#define FLUXFS_ENTRY_DATA 0
+#define FLUXFS_ENTRY_REFERENCE 1
+#define FLUXFS_ENTRY_COMPRESSED 2
+#define FLUXFS_ENTRY_ZERO 3
+#define FLUXFS_ENTRY_PATTERN 4
+#define FLUXFS_ENTRY_PATCH 5
+// Embedded data kept in the blob pack beside the file, loaded as data
+#define FLUXFS_ENTRY_BLOB 6
+
+// Version 2 type byte bit marking an entry followed by a CRC32C
+#define FLUXFS_TYPE_CHECKSUM 0x80
+// Version 2 type byte starting the index section after the last entry
+#define FLUXFS_TYPE_INDEX 0x7F
+
+// Entries per page of the index section
+#define FLUXFS_INDEX_PAGE_ENTRIES 1024
+// Ends the footer that locates the index section
+#define FLUXFS_INDEX_SIGNATURE "FluxIDX"
+
+// Entry flags
+#define FLUXFS_ENTRY_FLAG_CHECKSUM 0x01
+
+// Bytes read at a time when checksumming an entry
+#define FLUXFS_CHECKSUM_BLOCK_SIZE (1024 * 1024)
+
+// Longest repeating pattern of a pattern entry
+#define FLUXFS_MAX_PATTERN_LENGTH 4096
+
+// I/O classes of source reads, set per thread with fluxfs_io_set_class
+#define FLUXFS_IO_STREAMING 0
+#define FLUXFS_IO_INTERACTIVE 1
+#define FLUXFS_IO_BACKGROUND 2
+#define FLUXFS_IO_CLASSES 3
+// Reads in flight on one source device at most while the scheduler is on
+#define FLUXFS_IO_DEVICE_DEPTH 4
+// Source devices the scheduler keeps queues for, others are not scheduled
+#define FLUXFS_IO_MAX_DEVICES 64
+
+// Largest run of an entry exported by one worker
+#define FLUXFS_EXPORT_JOB_SIZE (64 * 1024 * 1024)
+// Bytes copied at a time when an export cannot copy in the kernel
+#define FLUXFS_EXPORT_BUFFER_SIZE (1024 * 1024)
+
+// Uncompressed bytes per chunk of a compressed entry
+#define FLUXFS_COMPRESSED_CHUNK_SIZE 65536
+// Largest chunk size accepted when loading
+#define FLUXFS_COMPRESSED_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+// Decompressed chunks kept per virtual file
+#define FLUXFS_CHUNK_CACHE_SLOTS 8
+
+// Smallest embedded entry shared with equal ones and stored in blob packs
+#define FLUXFS_BLOB_MIN_SIZE 256
+// File in the directory of a virtual file holding its packed blobs
+#define FLUXFS_BLOB_PACK_NAME ".fluxfs-blobs"
+#define FLUXFS_BLOB_PACK_SIGNATURE "FluxBLB"
+
+// Files bundling many virtual files, mounted like a tree of .vf files. A
+// record is opened by the path it had before packing with the pack file
+// name in place of its directory, like library.vfpack/movies/a.vf.
+#define FLUXFS_PACK_EXTENSION ".vfpack"
+#define FLUXFS_PACK_SIGNATURE "FluxFS VP"
+#define FLUXFS_PACK_INDEX_SIGNATURE "FluxPAK"
+
+// Largest embedded entry that sequential writes keep growing
+#define FLUXFS_WRITE_MERGE_SIZE (1024 * 1024)
+
+// Source ID that names no file
+#define FLUXFS_SOURCE_NONE UINT32_MAX
+
+// Most replica paths a source may have
+#define FLUXFS_MAX_REPLICAS 8
+
+// Bytes of a source file stored per block of the block cache
+#define FLUXFS_BLOCK_CACHE_BLOCK_SIZE (256 * 1024)
+
+// Smallest source file the mmap backend maps, smaller ones use pread
+#define FLUXFS_MMAP_MIN_SIZE (16 * 1024 * 1024)
+
+// Overlay record types
+#define FLUXFS_OVERLAY_WRITE 1
+#define FLUXFS_OVERLAY_TRUNCATE 2
+#define FLUXFS_OVERLAY_INSERT 3
+#define FLUXFS_OVERLAY_DELETE 4
+
+// Overlay size at which tools fold it into the virtual file
+#define FLUXFS_OVERLAY_FOLD_SIZE (4 * 1024 * 1024)
+
+struct vf_compressed {
+	// Uncompressed bytes per chunk, the last chunk may be shorter
+	uint32_t chunkSize;
+	uint32_t chunkCount;
+	// Start of each chunk in payload, chunkCount + 1 values
+	uint64_t *chunkOffsets;
+	// Set for chunks stored uncompressed
+	uint8_t *chunkRaw;
+	uint8_t *payload;
+};
+
+struct vf_pattern {
+	uint32_t length;
+	uint8_t bytes[];
 };
 
+// Bytes of a patch entry that differ from its source range
+struct vf_patch {
+	// Offset into the entry
+	uint64_t offset;
+	// Start of the patch bytes in the bytes of the entry
+	uint64_t start;
+	uint64_t length;
+};
+
+struct vf_patched {
+	// Offset into the external file for this entry
+	uint64_t offset;
+	// Sorted by offset, never overlapping
+	struct vf_patch *patches;
+	uint32_t patchCount;
+	uint32_t patchCapacity;
+	uint8_t *bytes;
+	uint64_t byteCount;
+};
+
+struct vf_chunk_cache;
+struct vf_index;
+struct blob_pack;
+
 struct vf_entry {
 	// Type of entry
 	uint8_t type;
@@ -19,32 +150,222 @@ struct vf_entry {
 		uint8_t *bytes;
 		// Offset into the external file for this entry
 		uint64_t offset;
+		// Chunked payload of a compressed entry
+		struct vf_compressed *compressed;
+		// Repeating bytes of a pattern entry
+		struct vf_pattern *pattern;
+		// Source range and overrides of a patch entry
+		struct vf_patched *patched;
 	} data;
-	// Index into the paths strings
-	uint8_t pathIndex;
+	// Index into the sources of the VF
+	uint32_t pathIndex;
+	uint8_t flags;
+	// Set when the bytes of a data entry are a shared blob, read only
+	uint8_t shared;
+	// CRC32C of the entry bytes when FLUXFS_ENTRY_FLAG_CHECKSUM is set
+	uint32_t checksum;
 	// Next entry in the linked list
 	struct vf_entry *next;
 };
 
+// A run of virtual file bytes that lives in one place
+struct fluxfs_segment {
+	uint64_t length;
+	// Source file descriptor and offset of reference data that may be read
+	// straight from the source, otherwise -1
+	int fd;
+	uint64_t fileOffset;
+	// Embedded data, otherwise NULL
+	const uint8_t *bytes;
+};
+
 struct fluxfs_vf {
-	FILE *files[256];
 	char *vpath;
-	struct vf_strings *strings;
+	// Interned source IDs by path index. Sources are shared by every VF in
+	// the process, fluxfs_source_path gives the absolute path of each.
+	uint32_t *sources;
+	uint32_t sourceCount;
+	uint32_t sourceCapacity;
 	struct vf_entry *head;
 	struct vf_entry *tail;
 	uint64_t size;
+	struct vf_chunk_cache *chunkCache;
+	// Set while the entries of an indexed file are decoded a page at a
+	// time. head and tail are NULL until fluxfs_vf_load_entries.
+	struct vf_index *index;
+	// Blob pack beside the file, opened when the first blob entry is read
+	struct blob_pack *blobPack;
+	// Set to save large embedded entries to the blob pack, and when loaded
+	// from one
+	uint8_t packBlobs;
+	// Format version used when saving
+	uint8_t version;
+};
+
+// Embedded bytes shared by the loaded VFs
+struct fluxfs_blob_stats {
+	uint64_t blobs;
+	uint64_t bytes;
+	// Bytes that would be held again without sharing
+	uint64_t savedBytes;
 };
 
+// Receives one source range of a virtual range
+typedef void (*fluxfs_range_fn)(void *arg, uint32_t source, uint64_t offset, uint64_t length);
+
 void fluxfs_free_vf(struct fluxfs_vf *vf);
 char *fluxfs_get_vpath(const char *filePath);
 uint64_t fluxfs_get_vf_size(const char *filePath);
 struct fluxfs_vf *fluxfs_load_vf(const char *filePath);
+int fluxfs_vf_load_entries(struct fluxfs_vf *vf);
+size_t fluxfs_vf_page_memory(struct fluxfs_vf *vf);
+void fluxfs_vf_drop_pages(struct fluxfs_vf *vf);
+size_t fluxfs_vf_memory(struct fluxfs_vf *vf);
 struct fluxfs_vf *fluxfs_create_vf(char *path);
-uint8_t fluxfs_vf_add_path(struct fluxfs_vf *vf, const char *filePath);
+uint32_t fluxfs_vf_add_path(struct fluxfs_vf *vf, const char *filePath);
+uint32_t fluxfs_vf_add_mirrored_path(struct fluxfs_vf *vf, const char *const *paths, uint32_t count);
 struct vf_entry *fluxfs_vf_add_data(struct fluxfs_vf *vf, uint64_t length, const char *data);
-struct vf_entry *fluxfs_vf_add_file_offset(struct fluxfs_vf *vf, uint8_t fileIndex, uint64_t length, uint64_t offset);
+struct vf_entry *fluxfs_vf_add_compressed_data(struct fluxfs_vf *vf, uint64_t length, const char *data);
+struct vf_entry *fluxfs_vf_add_zero(struct fluxfs_vf *vf, uint64_t length);
+struct vf_entry *fluxfs_vf_add_pattern(struct fluxfs_vf *vf, uint64_t length, const char *pattern, uint32_t patternLength);
+struct vf_entry *fluxfs_vf_add_file_offset(struct fluxfs_vf *vf, uint32_t fileIndex, uint64_t length, uint64_t offset);
+void fluxfs_vf_pack_blobs(struct fluxfs_vf *vf);
+int fluxfs_vf_extend_reference(struct fluxfs_vf *vf, const char *patch, uint64_t patchLength, uint64_t length);
+int fluxfs_vf_append_range(struct fluxfs_vf *dst, struct fluxfs_vf *src, uint64_t offset, uint64_t length);
+int fluxfs_vf_write(struct fluxfs_vf *vf, const char *buf, size_t size, uint64_t offset);
+int fluxfs_vf_truncate(struct fluxfs_vf *vf, uint64_t length);
+int fluxfs_vf_insert(struct fluxfs_vf *vf, const char *buf, size_t size, uint64_t offset);
+int fluxfs_vf_delete(struct fluxfs_vf *vf, uint64_t offset, uint64_t length);
 int fluxfs_save_vf(struct fluxfs_vf *vf, const char *filePath) ;
+// Reads, segments, advice and source ranges may run on several threads at
+// once for one VF, but not alongside a change to it
 int fluxfs_read_from_vf(struct fluxfs_vf *vf, char *buf, size_t size, uint64_t offset);
+int fluxfs_vf_get_segment(struct fluxfs_vf *vf, uint64_t offset, struct fluxfs_segment *segment);
+void fluxfs_vf_advise(struct fluxfs_vf *vf, uint64_t offset, uint64_t length, int advice);
+int fluxfs_vf_source_ranges(struct fluxfs_vf *vf, uint64_t offset, uint64_t length, fluxfs_range_fn fn, void *arg);
+uint32_t fluxfs_crc32c(uint32_t crc, const void *data, size_t length);
+int fluxfs_vf_compute_checksums(struct fluxfs_vf *vf);
+int fluxfs_vf_verify(struct fluxfs_vf *vf);
 void fluxfs_print_vf(struct fluxfs_vf *vf);
 
+// Share of one I/O class on each source device
+struct fluxfs_io_share {
+	// Relative share of the bytes read while classes compete
+	unsigned weight;
+	// Reads of the class in flight on one device at most
+	unsigned depth;
+	// Milliseconds a queued read may wait before it goes ahead of the
+	// other classes, 0 for none
+	unsigned deadline;
+};
+
+// Reads of one I/O class and the time they spent queued
+struct fluxfs_io_stats {
+	uint64_t reads;
+	uint64_t bytes;
+	uint64_t waitMicros;
+	uint64_t maxWaitMicros;
+	// Reads that waited longer than their deadline
+	uint64_t late;
+};
+
+// A source file opened by a backend
+struct fluxfs_source_file {
+	// Read only descriptor of the file, for fstat, sendfile and kernel
+	// copies. Reads of the library go through the backend.
+	int fd;
+};
+
+// How source files are opened and read, chosen per process before the
+// sources are opened. Every function may be called from any thread.
+struct fluxfs_source_backend {
+	const char *name;
+	// NULL with errno set if the file cannot be opened
+	struct fluxfs_source_file *(*open)(const char *path);
+	// Like pread, may return fewer bytes than asked
+	ssize_t (*read_at)(struct fluxfs_source_file *file, void *buf, size_t size, uint64_t offset);
+	// A POSIX_FADV_ hint for a range
+	void (*advise)(struct fluxfs_source_file *file, uint64_t offset, uint64_t length, int advice);
+	void (*close)(struct fluxfs_source_file *file);
+};
+
+// Bytes of an export shared with sources, copied in the kernel and written
+struct fluxfs_export_stats {
+	uint64_t cloned;
+	uint64_t copied;
+	uint64_t written;
+};
+
+int fluxfs_vf_export(struct fluxfs_vf *vf, const char *filePath, int threads, struct fluxfs_export_stats *stats);
+
+// A virtual file in a pack. Names are offsets into the string table.
+struct fluxfs_pack_record {
+	// Where the bytes of the .vf are in the pack
+	uint64_t offset;
+	uint64_t length;
+	// Size of the virtual file
+	uint64_t size;
+	uint32_t vpath;
+	// Path of the .vf relative to the directory of the pack
+	uint32_t name;
+};
+
+// The index of a pack, mapped read only
+struct fluxfs_pack {
+	void *map;
+	size_t mapLength;
+	// Sorted by vpath
+	const struct fluxfs_pack_record *records;
+	// Record numbers sorted by name
+	const uint32_t *byName;
+	const char *strings;
+	uint64_t count;
+};
+
+struct stat;
+
+struct fluxfs_pack *fluxfs_pack_open(const char *filePath);
+void fluxfs_pack_close(struct fluxfs_pack *pack);
+const char *fluxfs_pack_vpath(const struct fluxfs_pack *pack, const struct fluxfs_pack_record *record);
+const char *fluxfs_pack_name(const struct fluxfs_pack *pack, const struct fluxfs_pack_record *record);
+const struct fluxfs_pack_record *fluxfs_pack_find(const struct fluxfs_pack *pack, const char *vpath);
+const struct fluxfs_pack_record *fluxfs_pack_find_name(const struct fluxfs_pack *pack, const char *name);
+int fluxfs_pack_create(const char *filePath, char *const *vfPaths, size_t count);
+int fluxfs_pack_extract(const char *filePath);
+int fluxfs_vf_stat(const char *filePath, struct stat *st);
+
+uint32_t fluxfs_source_acquire(const char *baseDir, const char *path);
+uint32_t fluxfs_source_acquire_replicas(const char *baseDir, const char *const *paths, uint32_t count);
+void fluxfs_source_retain(uint32_t id);
+void fluxfs_source_release(uint32_t id);
+const char *fluxfs_source_path(uint32_t id);
+uint32_t fluxfs_source_replica_count(uint32_t id);
+const char *fluxfs_source_replica_path(uint32_t id, uint32_t replica);
+int fluxfs_source_fd(uint32_t id);
+int fluxfs_source_direct_fd(uint32_t id);
+int fluxfs_source_read(uint32_t id, void *buf, size_t size, uint64_t offset);
+void fluxfs_source_advise(uint32_t id, uint64_t offset, uint64_t length, int advice);
+const struct fluxfs_source_backend *fluxfs_source_backend(const char *name);
+void fluxfs_source_set_backend(const struct fluxfs_source_backend *backend);
+
+int fluxfs_io_scheduler_enable(const struct fluxfs_io_share shares[FLUXFS_IO_CLASSES]);
+void fluxfs_io_scheduler_disable(void);
+void fluxfs_io_set_class(int ioClass);
+void fluxfs_io_get_stats(struct fluxfs_io_stats stats[FLUXFS_IO_CLASSES]);
+
+void fluxfs_blob_stats(struct fluxfs_blob_stats *stats);
+
+int fluxfs_block_cache_open(const char *directory, uint64_t maxSize);
+void fluxfs_block_cache_close(void);
+
+char *fluxfs_overlay_path(const char *filePath);
+FILE *fluxfs_overlay_open(const char *filePath);
+int fluxfs_overlay_write(FILE *overlay, const char *buf, size_t size, uint64_t offset);
+int fluxfs_overlay_truncate(FILE *overlay, uint64_t length);
+int fluxfs_overlay_insert(FILE *overlay, const char *buf, size_t size, uint64_t offset);
+int fluxfs_overlay_delete(FILE *overlay, uint64_t offset, uint64_t length);
+int fluxfs_overlay_close(FILE *overlay, const char *filePath);
+int fluxfs_overlay_apply(struct fluxfs_vf *vf, const char *filePath);
+int fluxfs_overlay_compact(const char *filePath);
+
 #endif // !FLUXFS_H
@@ -0,0 +1,254 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "fluxfs.h"
+#include "iosched.h"
+
+// A read waiting for its turn on a device
+struct io_waiter {
+	int ioClass;
+	uint64_t size;
+	uint64_t queuedAt;
+	int ready;
+	pthread_cond_t cond;
+	struct io_waiter *next;
+};
+
+// Queues of one source device. Classes take turns by weighted fair
+// queueing: each read advances its class by size / weight and the class
+// furthest behind goes next, unless a read is past its deadline.
+struct io_device {
+	dev_t device;
+	pthread_mutex_t lock;
+	unsigned inflight;
+	unsigned classInflight[FLUXFS_IO_CLASSES];
+	double virtualTime[FLUXFS_IO_CLASSES];
+	struct io_waiter *head[FLUXFS_IO_CLASSES];
+	struct io_waiter *tail[FLUXFS_IO_CLASSES];
+};
+
+struct io_class_stats {
+	atomic_ullong reads;
+	atomic_ullong bytes;
+	atomic_ullong waitMicros;
+	atomic_ullong maxWaitMicros;
+	atomic_ullong late;
+};
+
+static atomic_int enabled = 0;
+static struct fluxfs_io_share shares[FLUXFS_IO_CLASSES];
+// Devices are added once and never removed, so a published slot can be
+// read without the table lock
+static struct io_device devices[FLUXFS_IO_MAX_DEVICES];
+static atomic_uint deviceCount = 0;
+static pthread_mutex_t deviceLock = PTHREAD_MUTEX_INITIALIZER;
+static struct io_class_stats classStats[FLUXFS_IO_CLASSES];
+
+static _Thread_local int threadClass = FLUXFS_IO_INTERACTIVE;
+
+static uint64_t monotonic_micros(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+// Turn on scheduling of source reads with a share for every class. Reads
+// of threads that never set a class are interactive. Returns 1 on an
+// invalid share.
+int fluxfs_io_scheduler_enable(const struct fluxfs_io_share ioShares[FLUXFS_IO_CLASSES]) {
+	for (int c = 0; c < FLUXFS_IO_CLASSES; c++) {
+		if (ioShares[c].weight == 0 || ioShares[c].depth == 0) {
+			return 1;
+		}
+	}
+	memcpy(shares, ioShares, sizeof(shares));
+	atomic_store(&enabled, 1);
+	return 0;
+}
+
+int io_scheduler_enabled(void) {
+	return atomic_load(&enabled);
+}
+
+// Turn scheduling off. Reads already queued still go in turn, later ones
+// go straight through. Devices left idle start their classes even again,
+// so a later enable does not inherit the old turns.
+void fluxfs_io_scheduler_disable(void) {
+	atomic_store(&enabled, 0);
+	unsigned count = atomic_load(&deviceCount);
+	for (unsigned i = 0; i < count; i++) {
+		struct io_device *device = &devices[i];
+		pthread_mutex_lock(&device->lock);
+		if (device->inflight == 0) {
+			memset(device->virtualTime, 0, sizeof(device->virtualTime));
+		}
+		pthread_mutex_unlock(&device->lock);
+	}
+}
+
+// Set the class of the source reads of the calling thread
+void fluxfs_io_set_class(int ioClass) {
+	if (ioClass >= 0 && ioClass < FLUXFS_IO_CLASSES) {
+		threadClass = ioClass;
+	}
+}
+
+void fluxfs_io_get_stats(struct fluxfs_io_stats stats[FLUXFS_IO_CLASSES]) {
+	for (int c = 0; c < FLUXFS_IO_CLASSES; c++) {
+		stats[c].reads = atomic_load(&classStats[c].reads);
+		stats[c].bytes = atomic_load(&classStats[c].bytes);
+		stats[c].waitMicros = atomic_load(&classStats[c].waitMicros);
+		stats[c].maxWaitMicros = atomic_load(&classStats[c].maxWaitMicros);
+		stats[c].late = atomic_load(&classStats[c].late);
+	}
+}
+
+static struct io_device *find_device(dev_t device) {
+	unsigned count = atomic_load(&deviceCount);
+	for (unsigned i = 0; i < count; i++) {
+		if (devices[i].device == device) {
+			return &devices[i];
+		}
+	}
+
+	pthread_mutex_lock(&deviceLock);
+	count = atomic_load(&deviceCount);
+	for (unsigned i = 0; i < count; i++) {
+		if (devices[i].device == device) {
+			pthread_mutex_unlock(&deviceLock);
+			return &devices[i];
+		}
+	}
+	struct io_device *found = NULL;
+	if (count < FLUXFS_IO_MAX_DEVICES) {
+		found = &devices[count];
+		memset(found, 0, sizeof(*found));
+		found->device = device;
+		pthread_mutex_init(&found->lock, NULL);
+		atomic_store(&deviceCount, count + 1);
+	}
+	pthread_mutex_unlock(&deviceLock);
+	return found;
+}
+
+// A class that was idle starts level with the busy ones, so it cannot
+// spend the time it was idle in one burst
+static void activate_class(struct io_device *device, int ioClass) {
+	int busy = 0;
+	double least = 0;
+	for (int c = 0; c < FLUXFS_IO_CLASSES; c++) {
+		if (c != ioClass && (device->head[c] || device->classInflight[c])) {
+			if (!busy || device->virtualTime[c] < least) {
+				least = device->virtualTime[c];
+			}
+			busy = 1;
+		}
+	}
+	if (busy && device->virtualTime[ioClass] < least) {
+		device->virtualTime[ioClass] = least;
+	}
+}
+
+// Start queued reads while the device has room, called with it locked
+static void dispatch(struct io_device *device) {
+	uint64_t now = monotonic_micros();
+	while (device->inflight < FLUXFS_IO_DEVICE_DEPTH) {
+		int next = -1;
+		for (int c = 0; c < FLUXFS_IO_CLASSES && next < 0; c++) {
+			struct io_waiter *waiter = device->head[c];
+			if (waiter && shares[c].deadline && device->classInflight[c] < shares[c].depth &&
+				now - waiter->queuedAt >= shares[c].deadline * 1000ull) {
+				next = c;
+			}
+		}
+		if (next < 0) {
+			for (int c = 0; c < FLUXFS_IO_CLASSES; c++) {
+				if (device->head[c] && device->classInflight[c] < shares[c].depth &&
+					(next < 0 || device->virtualTime[c] < device->virtualTime[next])) {
+					next = c;
+				}
+			}
+		}
+		if (next < 0) {
+			break;
+		}
+
+		struct io_waiter *waiter = device->head[next];
+		device->head[next] = waiter->next;
+		if (!device->head[next]) {
+			device->tail[next] = NULL;
+		}
+		device->inflight++;
+		device->classInflight[next]++;
+		device->virtualTime[next] += (double)waiter->size / shares[next].weight;
+		waiter->ready = 1;
+		pthread_cond_signal(&waiter->cond);
+	}
+}
+
+static void record_wait(int ioClass, uint64_t size, uint64_t waited) {
+	struct io_class_stats *stats = &classStats[ioClass];
+	atomic_fetch_add(&stats->reads, 1);
+	atomic_fetch_add(&stats->bytes, size);
+	atomic_fetch_add(&stats->waitMicros, waited);
+	unsigned long long max = atomic_load(&stats->maxWaitMicros);
+	while (waited > max && !atomic_compare_exchange_weak(&stats->maxWaitMicros, &max, waited)) {
+	}
+	if (shares[ioClass].deadline && waited > shares[ioClass].deadline * 1000ull) {
+		atomic_fetch_add(&stats->late, 1);
+	}
+}
+
+struct io_device *io_begin(dev_t dev, uint64_t size) {
+	if (!atomic_load(&enabled)) {
+		return NULL;
+	}
+	struct io_device *device = find_device(dev);
+	if (!device) {
+		return NULL;
+	}
+
+	struct io_waiter waiter;
+	memset(&waiter, 0, sizeof(waiter));
+	waiter.ioClass = threadClass;
+	waiter.size = size;
+	waiter.queuedAt = monotonic_micros();
+	pthread_cond_init(&waiter.cond, NULL);
+
+	pthread_mutex_lock(&device->lock);
+	if (!device->head[waiter.ioClass] && !device->classInflight[waiter.ioClass]) {
+		activate_class(device, waiter.ioClass);
+	}
+	if (device->tail[waiter.ioClass]) {
+		device->tail[waiter.ioClass]->next = &waiter;
+	} else {
+		device->head[waiter.ioClass] = &waiter;
+	}
+	device->tail[waiter.ioClass] = &waiter;
+	dispatch(device);
+	while (!waiter.ready) {
+		pthread_cond_wait(&waiter.cond, &device->lock);
+	}
+	pthread_mutex_unlock(&device->lock);
+	pthread_cond_destroy(&waiter.cond);
+
+	record_wait(waiter.ioClass, size, monotonic_micros() - waiter.queuedAt);
+	return device;
+}
+
+void io_end(struct io_device *device) {
+	if (!device) {
+		return;
+	}
+	pthread_mutex_lock(&device->lock);
+	device->inflight--;
+	device->classInflight[threadClass]--;
+	dispatch(device);
+	pthread_mutex_unlock(&device->lock);
+}
@@ -0,0 +1,20 @@
+#ifndef FLUXFS_IOSCHED_H
+#define FLUXFS_IOSCHED_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct io_device;
+
+// Wait for a turn to read size bytes from a device, in the class of the
+// calling thread. Returns the device to pass to io_end, NULL while the
+// scheduler is off.
+struct io_device *io_begin(dev_t device, uint64_t size);
+
+// Finish a read started with io_begin, letting the next one go
+void io_end(struct io_device *device);
+
+// Whether reads queue on their devices
+int io_scheduler_enabled(void);
+
+#endif // !FLUXFS_IOSCHED_H
@@ -0,0 +1,177 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+// A small LZ77 codec for embedded data chunks.
+//
+// A block is a series of sequences. Each sequence starts with a token byte,
+// the high nibble is the literal count and the low nibble is the match
+// length minus LZ_MIN_MATCH. A nibble of 15 is followed by extra length
+// bytes that are added until a byte below 255 is read. The literals follow,
+// then a uint16_t little-endian match offset and the match length bytes.
+// The last sequence has literals only and ends the block.
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+static uint32_t lz_hash(const uint8_t *p) {
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Bytes needed to store a length in a nibble plus extra bytes
+static size_t lz_length_size(size_t len) {
+	if (len < 15) {
+		return 0;
+	}
+	return (len - 15) / 255 + 1;
+}
+
+static uint8_t *lz_write_length(uint8_t *op, size_t len) {
+	if (len < 15) {
+		return op;
+	}
+	len -= 15;
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static uint8_t *lz_write_sequence(uint8_t *op, const uint8_t *literals, size_t litLen, size_t offset, size_t matchLen) {
+	size_t matchCode = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+	*op++ = ((litLen < 15 ? litLen : 15) << 4) | (matchCode < 15 ? matchCode : 15);
+	op = lz_write_length(op, litLen);
+	memcpy(op, literals, litLen);
+	op += litLen;
+	if (matchLen) {
+		*op++ = offset & 0xFF;
+		*op++ = offset >> 8;
+		op = lz_write_length(op, matchCode);
+	}
+	return op;
+}
+
+size_t lz_compress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstCap) {
+	uint32_t *table = calloc(1 << LZ_HASH_BITS, sizeof(uint32_t));
+	if (!table) {
+		return 0;
+	}
+
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *end = src + srcLen;
+	uint8_t *op = dst;
+	uint8_t *opEnd = dst + dstCap;
+
+	while (srcLen >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+		uint32_t h = lz_hash(ip);
+		size_t pos = ip - src;
+		uint32_t ref = table[h];
+		table[h] = pos + 1;
+
+		if (ref == 0 || pos - (ref - 1) > LZ_MAX_OFFSET || memcmp(src + ref - 1, ip, LZ_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		const uint8_t *match = src + ref - 1;
+		size_t matchLen = LZ_MIN_MATCH;
+		while (ip + matchLen < end && match[matchLen] == ip[matchLen]) {
+			matchLen++;
+		}
+
+		size_t litLen = ip - anchor;
+		size_t need = 1 + lz_length_size(litLen) + litLen + 2 + lz_length_size(matchLen - LZ_MIN_MATCH);
+		if (need > (size_t)(opEnd - op)) {
+			free(table);
+			return 0;
+		}
+		op = lz_write_sequence(op, anchor, litLen, ip - match, matchLen);
+		ip += matchLen;
+		anchor = ip;
+	}
+
+	size_t litLen = end - anchor;
+	if (1 + lz_length_size(litLen) + litLen > (size_t)(opEnd - op)) {
+		free(table);
+		return 0;
+	}
+	op = lz_write_sequence(op, anchor, litLen, 0, 0);
+
+	free(table);
+	return op - dst;
+}
+
+// Read extra length bytes, returns 1 if the input ends first
+static int lz_read_length(const uint8_t **ip, const uint8_t *end, size_t *len) {
+	if (*len != 15) {
+		return 0;
+	}
+	uint8_t byte;
+	do {
+		if (*ip >= end) {
+			return 1;
+		}
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+int lz_decompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen) {
+	const uint8_t *ip = src;
+	const uint8_t *end = src + srcLen;
+	uint8_t *op = dst;
+	uint8_t *opEnd = dst + dstLen;
+
+	while (ip < end) {
+		uint8_t token = *ip++;
+
+		size_t litLen = token >> 4;
+		if (lz_read_length(&ip, end, &litLen) ||
+			litLen > (size_t)(end - ip) || litLen > (size_t)(opEnd - op)) {
+			return 1;
+		}
+		memcpy(op, ip, litLen);
+		ip += litLen;
+		op += litLen;
+
+		if (ip == end) {
+			break;
+		}
+
+		if (end - ip < 2) {
+			return 1;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t matchLen = token & 15;
+		if (lz_read_length(&ip, end, &matchLen)) {
+			return 1;
+		}
+		matchLen += LZ_MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - dst) || matchLen > (size_t)(opEnd - op)) {
+			return 1;
+		}
+
+		const uint8_t *match = op - offset;
+		if (offset >= matchLen) {
+			memcpy(op, match, matchLen);
+			op += matchLen;
+		} else {
+			// Overlapping match repeats the last offset bytes
+			for (size_t i = 0; i < matchLen; i++) {
+				*op++ = *match++;
+			}
+		}
+	}
+
+	return op == opEnd ? 0 : 1;
+}
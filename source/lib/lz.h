@@ -0,0 +1,13 @@
+#ifndef FLUXFS_LZ_H
+#define FLUXFS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Returns the compressed size, or 0 if the output does not fit in dstCap
+size_t lz_compress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstCap);
+
+// Returns 0 if exactly dstLen bytes were decoded from src, 1 if src is corrupt
+int lz_decompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen);
+
+#endif // !FLUXFS_LZ_H
@@ -5,146 +5,721 @@
 #include <strings.h>
 #include <stdint.h>
 #include <inttypes.h>
-#include <setjmp.h>
+#include <endian.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "fluxfs.h"
+#include "lz.h"
+#include "source.h"
+#include "vf.h"
+#include "blob.h"
+#include "pack.h"
+
+// Reader status values
+#define FLUXFS_READ_EOF 1
+#define FLUXFS_READ_INVALID 2
+
+// Bytes of a file read by the first try, enough for most headers
+#define VF_HEADER_READ_SIZE (64 * 1024)
+
+// Bytes of a file without an index decoded at a time, grown for an entry
+// larger than this
+#define VF_DECODE_WINDOW (1024 * 1024)
+
+// Bytes of a virtual file being decoded. A read past the end or of an
+// invalid value sets status and moves to the end, so every later read
+// fails too and a decoder checks status once per entry instead of after
+// every field.
+struct vf_reader {
+	uint8_t *at;
+	uint8_t *end;
+	int status;
+};
+
+static inline void reader_init(struct vf_reader *reader, uint8_t *bytes, uint64_t length) {
+	reader->at = bytes;
+	reader->end = bytes + length;
+	reader->status = 0;
+}
+
+static inline void reader_fail(struct vf_reader *reader, int status) {
+	if (!reader->status) {
+		reader->status = status;
+	}
+	reader->at = reader->end;
+}
+
+// The next length bytes, NULL if fewer are left
+static inline uint8_t *get_bytes(struct vf_reader *reader, uint64_t length) {
+	if (length > (uint64_t)(reader->end - reader->at)) {
+		reader_fail(reader, FLUXFS_READ_EOF);
+		return NULL;
+	}
+	uint8_t *bytes = reader->at;
+	reader->at += length;
+	return bytes;
+}
+
+static inline uint8_t get_uint8(struct vf_reader *reader) {
+	if (reader->at == reader->end) {
+		reader_fail(reader, FLUXFS_READ_EOF);
+		return 0;
+	}
+	return *reader->at++;
+}
+
+// A little-endian field of 1, 2, 4 or 8 bytes
+static inline uint64_t get_fixed(struct vf_reader *reader, unsigned size) {
+	const uint8_t *bytes = get_bytes(reader, size);
+	if (!bytes) {
+		return 0;
+	}
+	uint16_t value16;
+	uint32_t value32;
+	uint64_t value64;
+	switch (size) {
+	case 1:
+		return bytes[0];
+	case 2:
+		memcpy(&value16, bytes, 2);
+		return le16toh(value16);
+	case 4:
+		memcpy(&value32, bytes, 4);
+		return le32toh(value32);
+	default:
+		memcpy(&value64, bytes, 8);
+		return le64toh(value64);
+	}
+}
+
+// An unsigned LEB128 value, rejecting encodings longer than 64 bits
+static inline uint64_t get_varint(struct vf_reader *reader) {
+	const uint8_t *bytes = reader->at;
+	size_t left = reader->end - bytes;
+	// Most lengths, indexes and chunk sizes fit in one or two bytes
+	if (left && bytes[0] < 0x80) {
+		reader->at++;
+		return bytes[0];
+	}
+	size_t limit = left < 10 ? left : 10;
+	uint64_t value = 0;
+	for (size_t i = 0; i < limit; i++) {
+		value |= (uint64_t)(bytes[i] & 0x7F) << (7 * i);
+		if ((bytes[i] & 0x80) == 0) {
+			if (i == 9 && bytes[i] > 1) {
+				break;
+			}
+			reader->at += i + 1;
+			return value;
+		}
+	}
+	reader_fail(reader, limit == 10 ? FLUXFS_READ_INVALID : FLUXFS_READ_EOF);
+	return 0;
+}
+
+// A length prefixed string, NULL-terminated in place at the end of its
+// stored length, which is returned in length
+char *get_string(struct vf_reader *reader, uint8_t version, uint64_t *length) {
+	uint64_t len = version == FLUXFS_VF_VERSION_1 ? get_fixed(reader, 2) : get_varint(reader);
+	if (len == 0 || (version != FLUXFS_VF_VERSION_1 && len > (uint64_t)PATH_MAX * FLUXFS_MAX_REPLICAS)) {
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return NULL;
+	}
+	char *str = (char *)get_bytes(reader, len);
+	if (str) {
+		str[len - 1] = 0;
+		*length = len;
+	}
+	return str;
+}
+
+// The fields before the first entry. Strings point into the bytes read.
+struct vf_header {
+	uint64_t fileSize;
+	// 0 if the signature is not that of a virtual file
+	uint8_t version;
+	char *vpath;
+	uint64_t pathCount;
+	uint8_t *paths;
+	uint8_t *entries;
+};
+
+// Decode the header and check that every path string is complete. Returns
+// the status of the reader.
+int read_header(struct vf_reader *reader, struct vf_header *header) {
+	header->version = 0;
+	const uint8_t *signature = get_bytes(reader, sizeof("FluxFS VF"));
+	if (!signature || memcmp(signature, "FluxFS VF", sizeof("FluxFS VF")) != 0) {
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return reader->status;
+	}
+
+	// A version 1 virtual path length always counts the NULL character,
+	// so a zero length marks a versioned header
+	if (reader->end - reader->at >= 2 && reader->at[0] == 0 && reader->at[1] == 0) {
+		reader->at += 2;
+		if (get_uint8(reader) != FLUXFS_VF_VERSION_2) {
+			reader_fail(reader, FLUXFS_READ_INVALID);
+			return reader->status;
+		}
+		header->version = FLUXFS_VF_VERSION_2;
+	} else {
+		header->version = FLUXFS_VF_VERSION_1;
+	}
 
-uint8_t read_uint8(FILE *file, jmp_buf *env) {
-	uint8_t value;
-	if (fread(&value, sizeof(uint8_t), 1, file) == 0) {
-		longjmp(*env, 1);
+	uint64_t length;
+	header->vpath = get_string(reader, header->version, &length);
+	header->pathCount = header->version == FLUXFS_VF_VERSION_1 ? get_uint8(reader) : get_varint(reader);
+	if (header->pathCount > UINT32_MAX) {
+		reader_fail(reader, FLUXFS_READ_INVALID);
+	}
+	header->paths = reader->at;
+	for (uint64_t i = 0; i < header->pathCount && !reader->status; i++) {
+		get_string(reader, header->version, &length);
 	}
-	return value;
+	header->entries = reader->at;
+	return reader->status;
 }
 
-uint16_t read_uint16(FILE *file, jmp_buf *env) {
-	uint16_t value;
-	if (fread(&value, sizeof(uint16_t), 1, file) == 0) {
-		longjmp(*env, 1);
+// Read length bytes at position into a malloc'd buffer, NULL if they
+// cannot be read
+uint8_t *read_range(FILE *file, uint64_t position, uint64_t length) {
+	uint8_t *bytes = length <= SIZE_MAX ? malloc(length ? length : 1) : NULL;
+	if (!bytes) {
+		perror("malloc failed");
+		return NULL;
+	}
+	if (fseek(file, position, SEEK_SET) != 0 || fread(bytes, 1, length, file) != length) {
+		free(bytes);
+		return NULL;
 	}
-	return value;
+	return bytes;
 }
 
-uint32_t read_uint32(FILE *file, jmp_buf *env) {
-	uint32_t value;
-	if (fread(&value, sizeof(uint32_t), 1, file) == 0) {
-		longjmp(*env, 1);
+// Read the start of a file and decode its header, reading more of the file
+// while the header runs past the bytes read. bytes receives the malloc'd
+// bytes and length their count. Returns 1 after printing the error.
+int load_header(FILE *file, const char *filePath, struct vf_header *header, uint8_t **bytes, uint64_t *length) {
+	*bytes = NULL;
+	long end = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+	if (end < 0) {
+		perror(filePath);
+		return 1;
+	}
+	header->fileSize = end;
+
+	uint64_t want = header->fileSize < VF_HEADER_READ_SIZE ? header->fileSize : VF_HEADER_READ_SIZE;
+	for (;;) {
+		*bytes = read_range(file, 0, want);
+		if (!*bytes) {
+			fprintf(stderr, "Failed to read %s\n", filePath);
+			return 1;
+		}
+		struct vf_reader reader;
+		reader_init(&reader, *bytes, want);
+		int status = read_header(&reader, header);
+		if (status == FLUXFS_READ_EOF && want < header->fileSize) {
+			free(*bytes);
+			want = header->fileSize / 4 > want ? want * 4 : header->fileSize;
+			continue;
+		}
+		*length = want;
+		if (header->version == 0) {
+			fprintf(stderr, "%s is not a FluxFS virtual file (invalid signature)\n", filePath);
+		} else if (status != 0) {
+			fprintf(stderr, "%s is not a valid FluxFS virtual file\n", filePath);
+		}
+		return status != 0;
 	}
-	return value;
 }
 
-uint64_t read_uint64(FILE *file, jmp_buf *env) {
-	uint64_t value;
-	if (fread(&value, sizeof(uint64_t), 1, file) == 0) {
-		longjmp(*env, 1);
+// Hand the malloc'd bytes of a large data entry to the blob store, so VFs
+// embedding the same bytes hold them once
+void share_data(struct vf_entry *entry) {
+	if (entry->length >= FLUXFS_BLOB_MIN_SIZE) {
+		uint8_t *bytes = blob_adopt(entry->data.bytes, entry->length);
+		if (bytes) {
+			entry->data.bytes = bytes;
+			entry->shared = 1;
+		}
 	}
-	return value;
 }
 
-void read_string(FILE *file, jmp_buf *env, char *buffer, size_t bufLength) {
-	if (bufLength == 0) {
+void read_data(struct vf_reader *reader, struct vf_entry *entry) {
+	const uint8_t *bytes = get_bytes(reader, entry->length);
+	if (!bytes) {
+		return;
+	}
+	entry->data.bytes = malloc(entry->length);
+	if (!entry->data.bytes && entry->length) {
+		perror("malloc failed");
+		reader_fail(reader, FLUXFS_READ_INVALID);
 		return;
 	}
+	memcpy(entry->data.bytes, bytes, entry->length);
+	share_data(entry);
+}
 
-	size_t i = 0;
-	buffer[i] = read_uint8(file, env);
-	while (buffer[i] != 0) {
+// Write an unsigned LEB128 value
+void write_varint(FILE *file, uint64_t value) {
+	uint8_t bytes[10];
+	int i = 0;
+	do {
+		bytes[i] = value & 0x7F;
+		value >>= 7;
+		if (value) {
+			bytes[i] |= 0x80;
+		}
 		i++;
-		if (i >= bufLength) {
-			// Force null-termination to avoid overflow
-			buffer[i - 1] = 0;
-			return;
+	} while (value);
+	fwrite(bytes, i, 1, file);
+}
+
+// Number of uncompressed bytes in a chunk of a compressed entry
+uint64_t chunk_length(struct vf_entry *entry, uint32_t chunk) {
+	uint64_t start = (uint64_t)chunk * entry->data.compressed->chunkSize;
+	uint64_t length = entry->length - start;
+	return length < entry->data.compressed->chunkSize ? length : entry->data.compressed->chunkSize;
+}
+
+void read_compressed(struct vf_reader *reader, struct vf_entry *entry) {
+	struct vf_compressed *compressed = calloc(1, sizeof(struct vf_compressed));
+	if (!compressed) {
+		perror("malloc failed");
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return;
+	}
+	entry->data.compressed = compressed;
+
+	uint64_t chunkSize = get_varint(reader);
+	if (chunkSize == 0 || chunkSize > FLUXFS_COMPRESSED_MAX_CHUNK_SIZE) {
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return;
+	}
+	// Every chunk size takes at least a byte
+	uint64_t chunkCount = entry->length / chunkSize + (entry->length % chunkSize != 0);
+	if (chunkCount > UINT32_MAX) {
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return;
+	}
+	if (chunkCount > (uint64_t)(reader->end - reader->at)) {
+		reader_fail(reader, FLUXFS_READ_EOF);
+		return;
+	}
+	compressed->chunkSize = chunkSize;
+	compressed->chunkCount = chunkCount;
+	compressed->chunkOffsets = malloc((chunkCount + 1) * sizeof(uint64_t));
+	compressed->chunkRaw = malloc(chunkCount + 1);
+	if (!compressed->chunkOffsets || !compressed->chunkRaw) {
+		perror("malloc failed");
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return;
+	}
+
+	// Each chunk size is stored shifted left by one with the raw flag in bit 0
+	uint64_t payloadSize = 0;
+	for (uint32_t i = 0; i < chunkCount; i++) {
+		uint64_t value = get_varint(reader);
+		uint64_t size = value >> 1;
+		compressed->chunkRaw[i] = value & 1;
+		if ((compressed->chunkRaw[i] && size != chunk_length(entry, i)) || size > FLUXFS_COMPRESSED_MAX_CHUNK_SIZE * 2) {
+			reader_fail(reader, FLUXFS_READ_INVALID);
 		}
-		buffer[i] = read_uint8(file, env);
+		compressed->chunkOffsets[i] = payloadSize;
+		payloadSize += size;
+	}
+	compressed->chunkOffsets[chunkCount] = payloadSize;
+
+	const uint8_t *payload = get_bytes(reader, payloadSize);
+	if (!payload) {
+		return;
+	}
+	compressed->payload = malloc(payloadSize ? payloadSize : 1);
+	if (!compressed->payload) {
+		perror("malloc failed");
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return;
 	}
+	memcpy(compressed->payload, payload, payloadSize);
 }
 
-uint64_t read_length(FILE *file, jmp_buf *env, int lenSize) {
-	if (lenSize == 0) {
-		return read_uint8(file, env);
-	} else if (lenSize == 1) {
-		return read_uint16(file, env);
-	} else if (lenSize == 2) {
-		return read_uint32(file, env);
-	} else {
-		return read_uint64(file, env);
+void write_compressed(FILE *file, struct vf_entry *entry) {
+	struct vf_compressed *compressed = entry->data.compressed;
+	write_varint(file, compressed->chunkSize);
+	for (uint32_t i = 0; i < compressed->chunkCount; i++) {
+		uint64_t size = compressed->chunkOffsets[i + 1] - compressed->chunkOffsets[i];
+		write_varint(file, (size << 1) | compressed->chunkRaw[i]);
 	}
+	fwrite(compressed->payload, 1, compressed->chunkOffsets[compressed->chunkCount], file);
 }
 
-uint64_t read_offset(FILE *file, jmp_buf *env, int offsetSize) {
-	return read_length(file, env, offsetSize);
+struct vf_chunk_cache {
+	pthread_mutex_t lock;
+	uint64_t clock;
+	struct {
+		struct vf_entry *entry;
+		uint32_t chunk;
+		uint64_t lastUse;
+		uint8_t *bytes;
+	} slots[FLUXFS_CHUNK_CACHE_SLOTS];
+};
+
+int ensure_chunk_cache(struct fluxfs_vf *vf) {
+	if (vf->chunkCache) {
+		return 0;
+	}
+	vf->chunkCache = calloc(1, sizeof(struct vf_chunk_cache));
+	if (!vf->chunkCache) {
+		return 1;
+	}
+	pthread_mutex_init(&vf->chunkCache->lock, NULL);
+	return 0;
 }
 
-void read_data(FILE *file, jmp_buf *env, struct vf_entry *entry) {
-	entry->data.bytes = malloc(entry->length);
-	for (uint64_t i = 0; i < entry->length; i++) {
-		entry->data.bytes[i] = read_uint8(file, env);
+void free_chunk_cache(struct vf_chunk_cache *cache) {
+	if (cache) {
+		for (int i = 0; i < FLUXFS_CHUNK_CACHE_SLOTS; i++) {
+			free(cache->slots[i].bytes);
+		}
+		pthread_mutex_destroy(&cache->lock);
+		free(cache);
 	}
 }
 
-void fluxfs_free_vf(struct fluxfs_vf *vf) {
-	if (vf) {
-		if (vf->vpath) {
-			free(vf->vpath);
+// Drop the cached chunks of an entry that is about to be freed
+void forget_cached_chunks(struct vf_chunk_cache *cache, struct vf_entry *entry) {
+	if (!cache) {
+		return;
+	}
+	pthread_mutex_lock(&cache->lock);
+	for (int i = 0; i < FLUXFS_CHUNK_CACHE_SLOTS; i++) {
+		if (cache->slots[i].entry == entry) {
+			cache->slots[i].entry = NULL;
+			cache->slots[i].lastUse = 0;
 		}
-		if (vf->strings) {
-			for (uint8_t i = 0; i < vf->strings->cnt; i++) {
-				if (vf->files[i]) {
-					fclose(vf->files[i]);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+// Copy bytes out of a compressed entry, decompressing only the chunks touched
+int read_compressed_range(struct fluxfs_vf *vf, struct vf_entry *entry, uint8_t *buf, uint64_t entryOffset, size_t size) {
+	struct vf_compressed *compressed = entry->data.compressed;
+	struct vf_chunk_cache *cache = vf->chunkCache;
+
+	while (size) {
+		uint32_t chunk = entryOffset / compressed->chunkSize;
+		uint64_t chunkOffset = entryOffset % compressed->chunkSize;
+		uint64_t length = chunk_length(entry, chunk);
+		size_t bytesToCopy = (size < length - chunkOffset) ? size : length - chunkOffset;
+		uint8_t *payload = compressed->payload + compressed->chunkOffsets[chunk];
+
+		if (compressed->chunkRaw[chunk]) {
+			memcpy(buf, payload + chunkOffset, bytesToCopy);
+		} else {
+			pthread_mutex_lock(&cache->lock);
+			int slot = 0;
+			for (int i = 0; i < FLUXFS_CHUNK_CACHE_SLOTS; i++) {
+				if (cache->slots[i].entry == entry && cache->slots[i].chunk == chunk) {
+					slot = i;
+					break;
 				}
-				if (vf->strings->paths[i]) {
-					free(vf->strings->paths[i]);
+				if (cache->slots[i].lastUse < cache->slots[slot].lastUse) {
+					slot = i;
 				}
 			}
-			free(vf->strings);
-		}
-		struct vf_entry *current = vf->head;
-		while (current) {
-			if (current->type == 0) {
-				free(current->data.bytes);
+			if (cache->slots[slot].entry != entry || cache->slots[slot].chunk != chunk) {
+				// Reuse the least recently used slot
+				cache->slots[slot].entry = NULL;
+				uint8_t *bytes = realloc(cache->slots[slot].bytes, compressed->chunkSize);
+				if (!bytes) {
+					pthread_mutex_unlock(&cache->lock);
+					return -1;
+				}
+				cache->slots[slot].bytes = bytes;
+				uint64_t payloadSize = compressed->chunkOffsets[chunk + 1] - compressed->chunkOffsets[chunk];
+				if (lz_decompress(payload, payloadSize, bytes, length) != 0) {
+					pthread_mutex_unlock(&cache->lock);
+					return -1;
+				}
+				cache->slots[slot].entry = entry;
+				cache->slots[slot].chunk = chunk;
 			}
-			struct vf_entry *next = current->next;
-			free(current);
-			current = next;
+			cache->slots[slot].lastUse = ++cache->clock;
+			memcpy(buf, cache->slots[slot].bytes + chunkOffset, bytesToCopy);
+			pthread_mutex_unlock(&cache->lock);
 		}
-		free(vf);
+
+		buf += bytesToCopy;
+		size -= bytesToCopy;
+		entryOffset += bytesToCopy;
 	}
+
+	return 0;
 }
 
-char *fluxfs_get_vpath(const char *filePath) {
-	FILE *file = fopen(filePath, "rb");
-	if (!file) {
-		perror("Error opening file");
+void read_pattern(struct vf_reader *reader, struct vf_entry *entry) {
+	uint64_t patternLength = get_varint(reader);
+	if (patternLength == 0 || patternLength > FLUXFS_MAX_PATTERN_LENGTH) {
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return;
+	}
+	const uint8_t *bytes = get_bytes(reader, patternLength);
+	if (!bytes) {
+		return;
+	}
+	entry->data.pattern = malloc(sizeof(struct vf_pattern) + patternLength);
+	if (!entry->data.pattern) {
+		perror("malloc failed");
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return;
+	}
+	entry->data.pattern->length = patternLength;
+	memcpy(entry->data.pattern->bytes, bytes, patternLength);
+}
+
+// Fill a buffer with a repeating pattern, starting phase bytes into it
+void fill_pattern(uint8_t *buf, size_t size, const struct vf_pattern *pattern, uint64_t phase) {
+	size_t filled = pattern->length - phase;
+	if (filled >= size) {
+		memcpy(buf, pattern->bytes + phase, size);
+		return;
+	}
+	memcpy(buf, pattern->bytes + phase, filled);
+	size_t wrap = (size - filled < phase) ? size - filled : phase;
+	memcpy(buf + filled, pattern->bytes, wrap);
+	filled += wrap;
+
+	// The filled part is now whole periods, so keep doubling it
+	while (filled < size) {
+		size_t copy = (filled < size - filled) ? filled : size - filled;
+		memcpy(buf + filled, buf, copy);
+		filled += copy;
+	}
+}
+
+// Make room for a patch after the last one and return where its bytes go.
+// A patch touching the last one is merged into it. Returns NULL when out
+// of memory.
+uint8_t *reserve_patch(struct vf_patched *patched, uint64_t offset, uint64_t length) {
+	uint8_t *bytes = realloc(patched->bytes, patched->byteCount + length);
+	if (!bytes) {
 		return NULL;
 	}
+	patched->bytes = bytes;
 
-	char *vpath = NULL;
-	jmp_buf env;
+	struct vf_patch *last = patched->patchCount ? &patched->patches[patched->patchCount - 1] : NULL;
+	if (last && last->offset + last->length == offset) {
+		last->length += length;
+	} else {
+		if (patched->patchCount == patched->patchCapacity) {
+			uint32_t capacity = patched->patchCapacity ? patched->patchCapacity * 2 : 4;
+			struct vf_patch *patches = realloc(patched->patches, capacity * sizeof(struct vf_patch));
+			if (!patches) {
+				return NULL;
+			}
+			patched->patches = patches;
+			patched->patchCapacity = capacity;
+		}
+		struct vf_patch *patch = &patched->patches[patched->patchCount++];
+		patch->offset = offset;
+		patch->start = patched->byteCount;
+		patch->length = length;
+	}
 
-	if (setjmp(env) == 1) {
-		fclose(file);
-		return vpath;
+	uint8_t *start = patched->bytes + patched->byteCount;
+	patched->byteCount += length;
+	return start;
+}
+
+// Index of the first patch ending after entryOffset, patchCount if none does
+uint32_t find_patch(const struct vf_patched *patched, uint64_t entryOffset) {
+	uint32_t low = 0;
+	uint32_t high = patched->patchCount;
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+		if (patched->patches[middle].offset + patched->patches[middle].length <= entryOffset) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
 	}
+	return low;
+}
 
-	char signature[10];
-	read_string(file, &env, signature, 10);
-	if (strcmp(signature, "FluxFS VF") != 0) {
-		fprintf(stderr, "%s is not a FluxFS virtual file (invalid signature)", filePath);
-		fclose(file);
-		return NULL;
+// Copy the patches over size bytes read from the source, entryOffset bytes into the entry
+void apply_patches(const struct vf_patched *patched, uint8_t *buf, uint64_t entryOffset, size_t size) {
+	uint64_t end = entryOffset + size;
+	for (uint32_t i = find_patch(patched, entryOffset); i < patched->patchCount && patched->patches[i].offset < end; i++) {
+		const struct vf_patch *patch = &patched->patches[i];
+		uint64_t from = patch->offset > entryOffset ? patch->offset : entryOffset;
+		uint64_t to = patch->offset + patch->length < end ? patch->offset + patch->length : end;
+		memcpy(buf + (from - entryOffset), patched->bytes + patch->start + (from - patch->offset), to - from);
+	}
+}
+
+void free_patched(struct vf_patched *patched) {
+	if (patched) {
+		free(patched->patches);
+		free(patched->bytes);
+		free(patched);
 	}
+}
 
-	uint16_t pathLen = read_uint16(file, &env);
-	vpath = malloc(pathLen);
-	if (!vpath) {
+// Patches are stored as the gap after the previous patch, the length and the bytes
+void read_patched(struct vf_reader *reader, struct vf_entry *entry) {
+	struct vf_patched *patched = calloc(1, sizeof(struct vf_patched));
+	if (!patched) {
 		perror("malloc failed");
-		fclose(file);
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return;
+	}
+	entry->data.patched = patched;
+
+	patched->offset = get_varint(reader);
+	uint64_t pathIndex = get_varint(reader);
+	uint64_t patchCount = get_varint(reader);
+	if (pathIndex > UINT32_MAX || patchCount > entry->length || patchCount > UINT32_MAX) {
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return;
+	}
+	entry->pathIndex = pathIndex;
+
+	uint64_t end = 0;
+	for (uint64_t i = 0; i < patchCount && !reader->status; i++) {
+		uint64_t gap = get_varint(reader);
+		uint64_t length = get_varint(reader);
+		if (reader->status) {
+			return;
+		}
+		if (length == 0 || gap > entry->length - end || length > entry->length - end - gap) {
+			reader_fail(reader, FLUXFS_READ_INVALID);
+			return;
+		}
+		const uint8_t *bytes = get_bytes(reader, length);
+		if (!bytes) {
+			return;
+		}
+		uint8_t *patch = reserve_patch(patched, end + gap, length);
+		if (!patch) {
+			perror("malloc failed");
+			reader_fail(reader, FLUXFS_READ_INVALID);
+			return;
+		}
+		memcpy(patch, bytes, length);
+		end += gap + length;
+	}
+}
+
+void write_patched(FILE *file, struct vf_entry *entry) {
+	struct vf_patched *patched = entry->data.patched;
+	write_varint(file, patched->offset);
+	write_varint(file, entry->pathIndex);
+	write_varint(file, patched->patchCount);
+	uint64_t end = 0;
+	for (uint32_t i = 0; i < patched->patchCount; i++) {
+		struct vf_patch *patch = &patched->patches[i];
+		write_varint(file, patch->offset - end);
+		write_varint(file, patch->length);
+		fwrite(patched->bytes + patch->start, 1, patch->length, file);
+		end = patch->offset + patch->length;
+	}
+}
+
+void free_entry(struct vf_entry *entry) {
+	if (entry->type == FLUXFS_ENTRY_DATA && entry->shared) {
+		blob_release(entry->data.bytes);
+	} else if (entry->type == FLUXFS_ENTRY_DATA) {
+		free(entry->data.bytes);
+	} else if (entry->type == FLUXFS_ENTRY_PATTERN) {
+		free(entry->data.pattern);
+	} else if (entry->type == FLUXFS_ENTRY_PATCH) {
+		free_patched(entry->data.patched);
+	} else if (entry->type == FLUXFS_ENTRY_COMPRESSED && entry->data.compressed) {
+		free(entry->data.compressed->chunkOffsets);
+		free(entry->data.compressed->chunkRaw);
+		free(entry->data.compressed->payload);
+		free(entry->data.compressed);
+	}
+	free(entry);
+}
+
+void append_entry(struct fluxfs_vf *vf, struct vf_entry *entry) {
+	entry->next = NULL;
+	if (vf->tail) {
+		vf->tail->next = entry;
+	} else {
+		vf->head = entry;
+	}
+	vf->tail = entry;
+	vf->size += entry->length;
+}
+
+void free_entry_list(struct vf_entry *entry) {
+	while (entry) {
+		struct vf_entry *next = entry->next;
+		free_entry(entry);
+		entry = next;
+	}
+}
+
+// Approximate heap memory of an entry. Shared embedded bytes belong to the
+// blob store.
+size_t entry_memory(struct vf_entry *entry) {
+	size_t total = sizeof(struct vf_entry);
+	if (entry->type == FLUXFS_ENTRY_DATA && !entry->shared) {
+		total += entry->length;
+	} else if (entry->type == FLUXFS_ENTRY_COMPRESSED) {
+		struct vf_compressed *compressed = entry->data.compressed;
+		total += compressed->chunkOffsets[compressed->chunkCount] + compressed->chunkCount * (sizeof(uint64_t) + 1);
+	} else if (entry->type == FLUXFS_ENTRY_PATTERN) {
+		total += entry->data.pattern->length;
+	} else if (entry->type == FLUXFS_ENTRY_PATCH) {
+		struct vf_patched *patched = entry->data.patched;
+		total += sizeof(struct vf_patched) + patched->patchCapacity * sizeof(struct vf_patch) + patched->byteCount;
+	}
+	return total;
+}
+
+void free_index(struct vf_index *index);
+
+void fluxfs_free_vf(struct fluxfs_vf *vf) {
+	if (vf) {
+		if (vf->vpath) {
+			free(vf->vpath);
+		}
+		for (uint32_t i = 0; i < vf->sourceCount; i++) {
+			fluxfs_source_release(vf->sources[i]);
+		}
+		free(vf->sources);
+		free_entry_list(vf->head);
+		free_index(vf->index);
+		free_chunk_cache(vf->chunkCache);
+		free(vf);
+	}
+}
+
+char *fluxfs_get_vpath(const char *filePath) {
+	char *baseDir;
+	FILE *file = open_vf(filePath, &baseDir);
+	if (!file) {
 		return NULL;
 	}
-	read_string(file, &env, vpath, pathLen);
+	free(baseDir);
+
+	struct vf_header header;
+	uint8_t *bytes;
+	uint64_t length;
+	char *vpath = NULL;
+	if (load_header(file, filePath, &header, &bytes, &length) == 0) {
+		vpath = strdup(header.vpath);
+	}
+	free(bytes);
+	fclose(file);
 
 	return vpath;
 }
@@ -161,120 +736,609 @@ uint64_t fluxfs_get_vf_size(const char *filePath) {
 	return size;
 }
 
-struct fluxfs_vf *fluxfs_load_vf(const char *filePath) {
-	char oldCwd[PATH_MAX];
-	if (!getcwd(oldCwd, sizeof(oldCwd))) {
-		perror("getcwd failed");
-		return NULL;
+// How a type byte is decoded, one table per format version
+struct entry_format {
+	uint8_t type;
+	// Version 1 field widths in bytes
+	uint8_t lengthSize;
+	uint8_t offsetSize;
+	// Version 1 path index, 7 when an index byte follows the offset
+	uint8_t pathIndex;
+	uint8_t flags;
+};
+
+#define ENTRY_FORMAT_VALID 1
+#define ENTRY_FORMAT_CHECKSUM 2
+
+static struct entry_format entryFormats[2][256];
+static pthread_once_t entryFormatsOnce = PTHREAD_ONCE_INIT;
+
+static void init_entry_formats(void) {
+	for (int byte = 0; byte < 256; byte++) {
+		// Version 1 packs the field sizes and path index in the type byte
+		struct entry_format *format = &entryFormats[0][byte];
+		format->type = byte & 1;
+		format->lengthSize = 1 << ((byte >> 1) & 3);
+		format->offsetSize = 1 << ((byte >> 3) & 3);
+		format->pathIndex = byte >> 5;
+		format->flags = ENTRY_FORMAT_VALID;
+
+		format = &entryFormats[1][byte];
+		format->type = byte & ~FLUXFS_TYPE_CHECKSUM;
+		if (format->type <= FLUXFS_ENTRY_BLOB) {
+			format->flags = ENTRY_FORMAT_VALID | (byte & FLUXFS_TYPE_CHECKSUM ? ENTRY_FORMAT_CHECKSUM : 0);
+		}
 	}
+}
 
-	char pathCopy[PATH_MAX];
-	strncpy(pathCopy, filePath, PATH_MAX);
-	char *dir = dirname(pathCopy);
-	if (chdir(dir) != 0) {
-		perror("chdir failed");
-		return NULL;
+// Decode an entry. Version 1 fields are sized by the type byte, every
+// version 2 field after it is a varint. Returns the status of the reader.
+int read_entry(struct vf_reader *reader, uint8_t version, struct vf_entry *entry) {
+	const struct entry_format *format = &entryFormats[version != FLUXFS_VF_VERSION_1][get_uint8(reader)];
+	if (!(format->flags & ENTRY_FORMAT_VALID)) {
+		reader_fail(reader, FLUXFS_READ_INVALID);
+		return reader->status;
 	}
+	entry->type = format->type;
 
-	FILE *file = fopen(basename((char *)filePath), "rb");
-	if (!file) {
-		perror("Error opening file");
-		chdir(oldCwd);
-		return NULL;
+	if (version == FLUXFS_VF_VERSION_1) {
+		entry->length = get_fixed(reader, format->lengthSize);
+		if (entry->type == FLUXFS_ENTRY_DATA) {
+			read_data(reader, entry);
+		} else {
+			entry->data.offset = get_fixed(reader, format->offsetSize);
+			entry->pathIndex = format->pathIndex == 7 ? get_uint8(reader) : format->pathIndex;
+		}
+		return reader->status;
 	}
 
-	struct fluxfs_vf *vf = NULL;
-	jmp_buf env;
+	entry->length = get_varint(reader);
+	switch (entry->type) {
+	case FLUXFS_ENTRY_DATA:
+		read_data(reader, entry);
+		break;
+	case FLUXFS_ENTRY_REFERENCE: {
+		entry->data.offset = get_varint(reader);
+		uint64_t pathIndex = get_varint(reader);
+		if (pathIndex > UINT32_MAX) {
+			reader_fail(reader, FLUXFS_READ_INVALID);
+		}
+		entry->pathIndex = pathIndex;
+		break;
+	}
+	case FLUXFS_ENTRY_COMPRESSED:
+		read_compressed(reader, entry);
+		break;
+	case FLUXFS_ENTRY_PATTERN:
+		read_pattern(reader, entry);
+		break;
+	case FLUXFS_ENTRY_PATCH:
+		read_patched(reader, entry);
+		break;
+	case FLUXFS_ENTRY_BLOB:
+		// Held by the hash until load_blob replaces it by the packed bytes
+		entry->data.offset = get_fixed(reader, 8);
+		break;
+	}
+	if (format->flags & ENTRY_FORMAT_CHECKSUM) {
+		entry->checksum = get_fixed(reader, 4);
+		entry->flags |= FLUXFS_ENTRY_FLAG_CHECKSUM;
+	}
+	return reader->status;
+}
 
-	if (setjmp(env) == 1) {
-		fclose(file);
-		chdir(oldCwd);
-		return vf;
+// Entries starting every FLUXFS_INDEX_PAGE_ENTRIES-th entry
+struct vf_index_page {
+	// Virtual offset of the first entry
+	uint64_t virtualOffset;
+	// Position of the first entry in the file
+	uint64_t filePosition;
+	// Decoded entries, NULL until the page is first used or after it was
+	// dropped
+	struct vf_entry *head;
+};
+
+struct vf_index {
+	// Kept open to decode pages, the file is replaced by a rename when saved
+	FILE *file;
+	// Directory of the file, where its blob pack is
+	char *baseDir;
+	// Position of the index section, where the entries end
+	uint64_t position;
+	uint64_t pageEntries;
+	uint64_t entryCount;
+	uint32_t pageCount;
+	struct vf_index_page *pages;
+	// Serializes decoding pages, so readers on several threads can share a VF
+	pthread_mutex_t lock;
+	// Memory of the decoded pages, read without the lock
+	atomic_size_t pageMemory;
+};
+
+// Last bytes of a file with an index section
+struct vf_index_footer {
+	// Position of the FLUXFS_TYPE_INDEX byte
+	uint64_t position;
+	char signature[8];
+};
+
+void free_index(struct vf_index *index) {
+	if (index) {
+		for (uint32_t i = 0; i < index->pageCount; i++) {
+			free_entry_list(index->pages[i].head);
+		}
+		if (index->file) {
+			fclose(index->file);
+		}
+		free(index->baseDir);
+		free(index->pages);
+		pthread_mutex_destroy(&index->lock);
+		free(index);
 	}
+}
 
-	vf = malloc(sizeof(struct fluxfs_vf));
-	if (!vf) {
-		perror("malloc failed");
-		goto error;
+// Position of the index section, or 0 if the file has none
+uint64_t find_index(FILE *file, uint64_t entriesStart) {
+	struct vf_index_footer footer;
+	if (fseek(file, -(long)sizeof(footer), SEEK_END) != 0 || fread(&footer, sizeof(footer), 1, file) != 1 ||
+		memcmp(footer.signature, FLUXFS_INDEX_SIGNATURE, sizeof(footer.signature)) != 0 ||
+		footer.position < entriesStart || footer.position > (uint64_t)ftell(file) - sizeof(footer)) {
+		return 0;
 	}
-	memset(vf, 0, sizeof(struct fluxfs_vf));
+	return footer.position;
+}
 
-	struct vf_strings *strings = malloc(sizeof(struct vf_strings));
-	if (!strings) {
+// Read the index section at position, the entries start at entriesStart.
+// Returns 1 if it is not complete and consistent.
+int read_index(FILE *file, struct fluxfs_vf *vf, uint64_t position, uint64_t entriesStart, uint64_t fileSize) {
+	struct vf_index *index = calloc(1, sizeof(struct vf_index));
+	if (!index) {
 		perror("malloc failed");
-		goto error;
+		return 1;
 	}
-	vf->strings = strings;
-
-	char signature[10];
-	read_string(file, &env, signature, 10);
-	if (strcmp(signature, "FluxFS VF") != 0) {
-		fprintf(stderr, "%s is not a FluxFS virtual file (invalid signature)", filePath);
-		goto error;
+	pthread_mutex_init(&index->lock, NULL);
+	atomic_init(&index->pageMemory, 0);
+	vf->index = index;
+	index->position = position;
+
+	// find_index checked that the footer follows the index
+	uint64_t length = fileSize - sizeof(struct vf_index_footer) - position;
+	uint8_t *bytes = read_range(file, position, length);
+	if (!bytes) {
+		return 1;
 	}
-
-	uint16_t pathLen = read_uint16(file, &env);
-	vf->vpath = malloc(pathLen);
-	if (!vf->vpath) {
+	struct vf_reader reader;
+	reader_init(&reader, bytes, length);
+	if (get_uint8(&reader) != FLUXFS_TYPE_INDEX) {
+		reader_fail(&reader, FLUXFS_READ_INVALID);
+	}
+	index->pageEntries = get_varint(&reader);
+	index->entryCount = get_varint(&reader);
+	vf->size = get_varint(&reader);
+	if (reader.status || index->pageEntries == 0 || index->entryCount == 0) {
+		free(bytes);
+		return 1;
+	}
+	// Every entry takes at least two bytes and every page two index bytes,
+	// which bounds the page count
+	uint64_t pageCount = (index->entryCount - 1) / index->pageEntries + 1;
+	if (pageCount > (position - entriesStart) / 2 || pageCount > (uint64_t)(reader.end - reader.at) / 2 || pageCount > UINT32_MAX) {
+		free(bytes);
+		return 1;
+	}
+	index->pages = calloc(pageCount, sizeof(struct vf_index_page));
+	if (!index->pages) {
 		perror("malloc failed");
-		goto error;
+		free(bytes);
+		return 1;
 	}
-	read_string(file, &env, vf->vpath, pathLen);
-
-	strings->cnt = read_uint8(file, &env);
-	for (int i = 0; i < strings->cnt; i++) {
-		pathLen = read_uint16(file, &env);
-		strings->paths[i] = malloc(pathLen);
-		if (!strings->paths[i]) {
-			perror("malloc failed");
-			goto error;
-		}
-		read_string(file, &env, strings->paths[i], pathLen);
-		vf->files[i] = fopen(strings->paths[i], "rb");
-		if (!vf->files[i]) {
-			fprintf(stderr, "Error opening file: %s\n", vf->strings->paths[i]);
-			goto error;
+	index->pageCount = pageCount;
+
+	// Offsets and positions are stored as increases over the previous page
+	uint64_t virtualOffset = 0;
+	uint64_t filePosition = entriesStart;
+	for (uint32_t i = 0; i < index->pageCount; i++) {
+		uint64_t offsetStep = get_varint(&reader);
+		uint64_t positionStep = get_varint(&reader);
+		if ((i == 0 && (offsetStep || positionStep)) || (i > 0 && positionStep == 0) ||
+			offsetStep > vf->size - virtualOffset || positionStep >= position - filePosition) {
+			reader_fail(&reader, FLUXFS_READ_INVALID);
+			break;
 		}
+		virtualOffset += offsetStep;
+		filePosition += positionStep;
+		index->pages[i].virtualOffset = virtualOffset;
+		index->pages[i].filePosition = filePosition;
 	}
+	int failed = reader.status || reader.at != reader.end;
+	free(bytes);
+	return failed;
+}
 
-	while (!feof(file)) {
-		struct vf_entry *entry = malloc(sizeof(struct vf_entry));
-		if (!entry) {
-			perror("malloc failed");
-			goto error;
-		}
-		memset(entry, 0, sizeof(struct vf_entry));
-		entry->type = read_uint8(file, &env);
-		uint8_t type = entry->type & 1;
-		entry->length = read_length(file, &env, (entry->type >> 1) & 3);
-		vf->size += entry->length;
-		if (type == 0) {
-			read_data(file, &env, entry);
-		} else {
-			entry->data.offset = read_offset(file, &env, (entry->type >> 3) & 3);
-			entry->pathIndex = entry->type >> 5;
-			if (entry->pathIndex == 7) {
-				entry->pathIndex = read_uint8(file, &env);
-			}
-		}
-		entry->type = type;
-		entry->next = NULL;
-		if (vf->tail) {
-			vf->tail->next = entry;
-		} else {
-			vf->head = entry;
-		}
-		vf->tail = entry;
+// Turn a blob entry into a data entry sharing the bytes in the blob pack
+// of baseDir. Returns 1 if the pack does not hold them.
+int load_blob(struct fluxfs_vf *vf, const char *baseDir, struct vf_entry *entry) {
+	if (!vf->blobPack) {
+		vf->blobPack = blob_pack_get(baseDir, 0);
+	}
+	uint8_t *bytes = vf->blobPack ? blob_pack_load(vf->blobPack, entry->data.offset, entry->length) : NULL;
+	if (!bytes) {
+		fprintf(stderr, "Blob %016" PRIx64 " missing from the blob pack in %s\n", entry->data.offset, baseDir);
+		return 1;
 	}
+	entry->type = FLUXFS_ENTRY_DATA;
+	entry->data.bytes = bytes;
+	entry->shared = 1;
+	// Saved back to the pack
+	vf->packBlobs = 1;
+	return 0;
+}
 
-	fclose(file);
-	chdir(oldCwd);
+// Decode the entry at the reader and check it against the VF. Returns NULL
+// if it is truncated, invalid or its blob cannot be loaded.
+struct vf_entry *decode_entry(struct fluxfs_vf *vf, struct vf_reader *reader, const char *baseDir) {
+	struct vf_entry *entry = calloc(1, sizeof(struct vf_entry));
+	if (!entry) {
+		perror("malloc failed");
+		return NULL;
+	}
+	if (read_entry(reader, vf->version, entry) == 0 &&
+		(entry->type == FLUXFS_ENTRY_REFERENCE || entry->type == FLUXFS_ENTRY_PATCH) && entry->pathIndex >= vf->sourceCount) {
+		// References a missing path string
+		reader_fail(reader, FLUXFS_READ_INVALID);
+	}
+	if (reader->status || (entry->type == FLUXFS_ENTRY_COMPRESSED && ensure_chunk_cache(vf) != 0) ||
+		(entry->type == FLUXFS_ENTRY_BLOB && load_blob(vf, baseDir, entry) != 0)) {
+		free_entry(entry);
+		return NULL;
+	}
+	return entry;
+}
+
+// Decode the entries of an index page, called with the index locked.
+// Returns NULL if the page cannot be read or does not add up to the span
+// the index gives it.
+struct vf_entry *decode_page(struct fluxfs_vf *vf, uint32_t page) {
+	struct vf_index *index = vf->index;
+	struct vf_index_page *indexPage = &index->pages[page];
+
+	// The page is read at once and must hold exactly its entries
+	uint64_t first = (uint64_t)page * index->pageEntries;
+	uint64_t count = index->entryCount - first < index->pageEntries ? index->entryCount - first : index->pageEntries;
+	uint64_t end = page + 1 < index->pageCount ? index->pages[page + 1].virtualOffset : vf->size;
+	uint64_t endPosition = page + 1 < index->pageCount ? index->pages[page + 1].filePosition : index->position;
+	uint8_t *bytes = read_range(index->file, indexPage->filePosition, endPosition - indexPage->filePosition);
+	if (!bytes) {
+		return NULL;
+	}
+	struct vf_reader reader;
+	reader_init(&reader, bytes, endPosition - indexPage->filePosition);
+
+	struct vf_entry *head = NULL;
+	struct vf_entry *tail = NULL;
+	uint64_t length = 0;
+	size_t memory = 0;
+	int failed = 0;
+	for (uint64_t i = 0; i < count && !failed; i++) {
+		struct vf_entry *entry = decode_entry(vf, &reader, index->baseDir);
+		failed = !entry || entry->length > end - indexPage->virtualOffset - length;
+		if (entry) {
+			length += entry->length;
+			memory += entry_memory(entry);
+			if (tail) {
+				tail->next = entry;
+			} else {
+				head = entry;
+			}
+			tail = entry;
+		}
+	}
+	free(bytes);
+	if (failed || reader.at != reader.end || length != end - indexPage->virtualOffset) {
+		free_entry_list(head);
+		return NULL;
+	}
+
+	atomic_fetch_add(&index->pageMemory, memory);
+	return head;
+}
+
+// Entries of an index page, decoded on first use. Returns NULL if the page
+// cannot be decoded.
+struct vf_entry *page_entries(struct fluxfs_vf *vf, uint32_t page) {
+	struct vf_index *index = vf->index;
+	struct vf_index_page *indexPage = &index->pages[page];
+	pthread_mutex_lock(&index->lock);
+	if (!indexPage->head) {
+		indexPage->head = decode_page(vf, page);
+	}
+	struct vf_entry *head = indexPage->head;
+	pthread_mutex_unlock(&index->lock);
+	return head;
+}
+
+// Decode every page of an indexed file into the entry list, so it can be
+// changed or walked from head. Files without an index are left as they are.
+int fluxfs_vf_load_entries(struct fluxfs_vf *vf) {
+	struct vf_index *index = vf->index;
+	if (!index) {
+		return 0;
+	}
+	for (uint32_t i = 0; i < index->pageCount; i++) {
+		if (!page_entries(vf, i)) {
+			return 1;
+		}
+	}
+	for (uint32_t i = 0; i < index->pageCount; i++) {
+		if (vf->tail) {
+			vf->tail->next = index->pages[i].head;
+		} else {
+			vf->head = index->pages[i].head;
+		}
+		vf->tail = index->pages[i].head;
+		while (vf->tail->next) {
+			vf->tail = vf->tail->next;
+		}
+		index->pages[i].head = NULL;
+	}
+	vf->index = NULL;
+	free_index(index);
+	return 0;
+}
+
+// Memory held by the decoded pages of an indexed file, 0 for other files.
+// Cheap enough to check after every read.
+size_t fluxfs_vf_page_memory(struct fluxfs_vf *vf) {
+	return vf->index ? atomic_load(&vf->index->pageMemory) : 0;
+}
+
+// Free the decoded pages of an indexed file, they are decoded again when
+// next read. Not to be called alongside reads of the VF.
+void fluxfs_vf_drop_pages(struct fluxfs_vf *vf) {
+	struct vf_index *index = vf->index;
+	if (!index) {
+		return;
+	}
+	for (uint32_t i = 0; i < index->pageCount; i++) {
+		struct vf_entry *entry = index->pages[i].head;
+		while (entry) {
+			struct vf_entry *next = entry->next;
+			forget_cached_chunks(vf->chunkCache, entry);
+			free_entry(entry);
+			entry = next;
+		}
+		index->pages[i].head = NULL;
+	}
+	atomic_store(&index->pageMemory, 0);
+}
+
+// Approximate heap memory of a loaded VF, including its decoded pages.
+// Source paths and descriptors are shared, only the IDs are the VF's own.
+size_t fluxfs_vf_memory(struct fluxfs_vf *vf) {
+	size_t total = sizeof(struct fluxfs_vf) + vf->sourceCapacity * sizeof(uint32_t);
+	for (struct vf_entry *entry = vf->head; entry; entry = entry->next) {
+		total += entry_memory(entry);
+	}
+	if (vf->index) {
+		total += sizeof(struct vf_index) + vf->index->pageCount * sizeof(struct vf_index_page) + fluxfs_vf_page_memory(vf);
+	}
+	return total;
+}
+
+// Position in the entries of a VF, moving across index pages
+struct vf_cursor {
+	struct vf_entry *entry;
+	// Virtual offset where entry starts
+	uint64_t offset;
+	uint32_t page;
+};
+
+// Step to the next entry, decoding the next index page when the current one
+// ends. entry is NULL past the last entry. Returns 1 if a page cannot be read.
+int next_entry(struct fluxfs_vf *vf, struct vf_cursor *cursor) {
+	cursor->offset += cursor->entry->length;
+	cursor->entry = cursor->entry->next;
+	if (!cursor->entry && vf->index && cursor->page + 1 < vf->index->pageCount) {
+		cursor->page++;
+		cursor->entry = page_entries(vf, cursor->page);
+		if (!cursor->entry) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Place the cursor on the entry holding offset. Indexed files start at the
+// last page beginning at or before it. Returns 1 past the end of the file,
+// -1 if a page cannot be read.
+int seek_entry(struct fluxfs_vf *vf, uint64_t offset, struct vf_cursor *cursor) {
+	cursor->page = 0;
+	cursor->offset = 0;
+	cursor->entry = vf->head;
+	if (vf->index) {
+		uint32_t low = 0;
+		uint32_t high = vf->index->pageCount;
+		while (high - low > 1) {
+			uint32_t middle = low + (high - low) / 2;
+			if (vf->index->pages[middle].virtualOffset <= offset) {
+				low = middle;
+			} else {
+				high = middle;
+			}
+		}
+		cursor->page = low;
+		cursor->offset = vf->index->pages[low].virtualOffset;
+		cursor->entry = page_entries(vf, low);
+		if (!cursor->entry) {
+			return -1;
+		}
+	}
+	while (cursor->entry && offset >= cursor->offset + cursor->entry->length) {
+		if (next_entry(vf, cursor) != 0) {
+			return -1;
+		}
+	}
+	return cursor->entry ? 0 : 1;
+}
+
+// Acquire the sources named by the path strings of a header. Version 2
+// strings may hold more replica paths after the first. Returns 1 after
+// printing the error.
+int add_header_sources(struct fluxfs_vf *vf, const struct vf_header *header, const char *baseDir, const char *filePath) {
+	if (header->pathCount) {
+		vf->sources = malloc(header->pathCount * sizeof(uint32_t));
+		if (!vf->sources) {
+			perror("malloc failed");
+			return 1;
+		}
+	}
+	vf->sourceCapacity = header->pathCount;
+
+	// read_header checked that the strings are complete
+	struct vf_reader reader;
+	reader_init(&reader, header->paths, header->entries - header->paths);
+	for (uint64_t i = 0; i < header->pathCount; i++) {
+		uint64_t pathLength;
+		char *path = get_string(&reader, header->version, &pathLength);
+		if (header->version == FLUXFS_VF_VERSION_1) {
+			pathLength = strlen(path) + 1;
+		}
+		const char *replicas[FLUXFS_MAX_REPLICAS];
+		uint32_t replicaCount = 0;
+		for (uint64_t at = 0; at < pathLength; at += strlen(path + at) + 1) {
+			if (replicaCount == FLUXFS_MAX_REPLICAS || path[at] == 0) {
+				fprintf(stderr, "%s is not a valid FluxFS virtual file\n", filePath);
+				return 1;
+			}
+			replicas[replicaCount++] = path + at;
+		}
+		uint32_t id = fluxfs_source_acquire_replicas(baseDir, replicas, replicaCount);
+		if (id == FLUXFS_SOURCE_NONE) {
+			perror("malloc failed");
+			return 1;
+		}
+		vf->sources[vf->sourceCount++] = id;
+		if (fluxfs_source_fd(id) < 0) {
+			fprintf(stderr, "Error opening file: %s\n", fluxfs_source_path(id));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Decoded from memory: the header is read whole, then either the index or
+// the entries in windows of VF_DECODE_WINDOW bytes, so a large file is never
+// held whole beside the entries copied out of it. A file that ends inside an
+// entry is rejected.
+struct fluxfs_vf *fluxfs_load_vf(const char *filePath) {
+	pthread_once(&entryFormatsOnce, init_entry_formats);
+
+	// Path strings are relative to the directory of the virtual file
+	char *baseDir;
+	FILE *file = open_vf(filePath, &baseDir);
+	if (!file) {
+		return NULL;
+	}
+
+	struct fluxfs_vf *vf = NULL;
+	struct vf_header header;
+	uint8_t *bytes;
+	uint64_t length;
+	if (load_header(file, filePath, &header, &bytes, &length) != 0) {
+		goto error;
+	}
+
+	vf = calloc(1, sizeof(struct fluxfs_vf));
+	if (!vf || !(vf->vpath = strdup(header.vpath))) {
+		perror("malloc failed");
+		goto error;
+	}
+	vf->version = header.version;
+	if (add_header_sources(vf, &header, baseDir, filePath) != 0) {
+		goto error;
+	}
+
+	// An indexed file only has its pages decoded when they are read
+	uint64_t entriesStart = header.entries - bytes;
+	uint64_t indexPosition = vf->version == FLUXFS_VF_VERSION_1 ? 0 : find_index(file, entriesStart);
+	if (indexPosition) {
+		if (read_index(file, vf, indexPosition, entriesStart, header.fileSize) != 0) {
+			fprintf(stderr, "%s is not a valid FluxFS virtual file\n", filePath);
+			goto error;
+		}
+		free(bytes);
+		vf->index->file = file;
+		vf->index->baseDir = baseDir;
+		return vf;
+	}
+
+	// Entries are decoded from a window of the file that moves on when the
+	// next entry runs past it, starting with the bytes of the header read
+	struct vf_reader reader;
+	reader_init(&reader, bytes, length);
+	reader.at = header.entries;
+	uint64_t windowPosition = 0;
+	uint64_t windowSize = VF_DECODE_WINDOW;
+	for (;;) {
+		uint8_t *start = reader.at;
+		if (reader.at < reader.end) {
+			// Version 2 entries end at the index type byte when the footer is missing
+			if (vf->version != FLUXFS_VF_VERSION_1 && *reader.at == FLUXFS_TYPE_INDEX) {
+				break;
+			}
+			struct vf_entry *entry = decode_entry(vf, &reader, baseDir);
+			if (entry && entry->length > UINT64_MAX - vf->size) {
+				reader_fail(&reader, FLUXFS_READ_INVALID);
+				free_entry(entry);
+				entry = NULL;
+			}
+			if (entry) {
+				append_entry(vf, entry);
+				continue;
+			}
+			if (reader.status != FLUXFS_READ_EOF) {
+				if (reader.status) {
+					fprintf(stderr, "%s is not a valid FluxFS virtual file\n", filePath);
+				}
+				goto error;
+			}
+		}
+
+		// Read on from the start of the entry cut off by the window
+		uint64_t next = windowPosition + (start - bytes);
+		uint64_t windowEnd = windowPosition + (reader.end - bytes);
+		if (windowEnd == header.fileSize) {
+			if (start < reader.end) {
+				fprintf(stderr, "%s is not a valid FluxFS virtual file\n", filePath);
+				goto error;
+			}
+			break;
+		}
+		if (next + windowSize <= windowEnd) {
+			// One entry is larger than a window
+			windowSize *= 4;
+		}
+		uint64_t want = header.fileSize - next < windowSize ? header.fileSize - next : windowSize;
+		free(bytes);
+		bytes = read_range(file, next, want);
+		if (!bytes) {
+			fprintf(stderr, "Failed to read %s\n", filePath);
+			goto error;
+		}
+		windowPosition = next;
+		reader_init(&reader, bytes, want);
+	}
+
+	free(bytes);
+	fclose(file);
+	free(baseDir);
 	return vf;
 
 	error:
+	free(bytes);
 	fluxfs_free_vf(vf);
 	fclose(file);
-	chdir(oldCwd);
+	free(baseDir);
 	return NULL;
 }
 
@@ -292,97 +1356,672 @@ struct fluxfs_vf *fluxfs_create_vf(char *vpath) {
 		return NULL;
 	}
 
-	struct vf_strings *strings = malloc(sizeof(struct vf_strings));
-	if (!strings) {
-		free(vf->vpath);
-		free(vf);
-		return NULL;
+	vf->version = FLUXFS_VF_VERSION_1;
+
+	return vf;
+}
+
+// Give a held source ID the next path index, taking over the reference.
+// Adding more paths than version 1 can index upgrades the file to version 2.
+uint32_t add_source(struct fluxfs_vf *vf, uint32_t id) {
+	if (vf->sourceCount == vf->sourceCapacity) {
+		uint32_t capacity = vf->sourceCapacity ? vf->sourceCapacity * 2 : 4;
+		uint32_t *sources = realloc(vf->sources, capacity * sizeof(uint32_t));
+		if (!sources) {
+			return UINT32_MAX;
+		}
+		vf->sources = sources;
+		vf->sourceCapacity = capacity;
+	}
+
+	uint32_t i = vf->sourceCount++;
+	vf->sources[i] = id;
+	if (vf->sourceCount > FLUXFS_VF_V1_MAX_PATHS) {
+		vf->version = FLUXFS_VF_VERSION_2;
+	}
+	return i;
+}
+
+// Relative paths are taken from the working directory, saving stores them
+// relative to the virtual file
+uint32_t fluxfs_vf_add_path(struct fluxfs_vf *vf, const char *filePath) {
+	uint32_t id = fluxfs_source_acquire(NULL, filePath);
+	if (id == FLUXFS_SOURCE_NONE) {
+		return UINT32_MAX;
+	}
+	uint32_t i = add_source(vf, id);
+	if (i == UINT32_MAX) {
+		fluxfs_source_release(id);
+	}
+	return i;
+}
+
+// Add a source stored as several identical replicas, reads are spread over
+// them. Replicas are saved in the path string after the first path, which
+// needs version 2.
+uint32_t fluxfs_vf_add_mirrored_path(struct fluxfs_vf *vf, const char *const *paths, uint32_t count) {
+	uint32_t id = fluxfs_source_acquire_replicas(NULL, paths, count);
+	if (id == FLUXFS_SOURCE_NONE) {
+		return UINT32_MAX;
+	}
+	uint32_t i = add_source(vf, id);
+	if (i == UINT32_MAX) {
+		fluxfs_source_release(id);
+	} else if (count > 1) {
+		vf->version = FLUXFS_VF_VERSION_2;
+	}
+	return i;
+}
+
+struct vf_entry *fluxfs_vf_add_data(struct fluxfs_vf *vf, uint64_t length, const char *data) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return NULL;
+	}
+	struct vf_entry *entry = malloc(sizeof(struct vf_entry));
+	if (!entry) {
+		return NULL;
+	}
+	memset(entry, 0, sizeof(struct vf_entry));
+
+	entry->type = 0;
+	entry->length = length;
+	entry->data.bytes = malloc(length);
+	if (!entry->data.bytes) {
+		free(entry);
+		return NULL;
+	}
+	memcpy(entry->data.bytes, data, length);
+	share_data(entry);
+
+	append_entry(vf, entry);
+
+	return entry;
+}
+
+// A compressed entry holding a copy of data
+struct vf_entry *compress_entry(uint64_t length, const char *data) {
+	struct vf_entry *entry = calloc(1, sizeof(struct vf_entry));
+	if (!entry) {
+		return NULL;
+	}
+	entry->type = FLUXFS_ENTRY_COMPRESSED;
+	entry->length = length;
+
+	struct vf_compressed *compressed = calloc(1, sizeof(struct vf_compressed));
+	if (!compressed) {
+		free(entry);
+		return NULL;
+	}
+	entry->data.compressed = compressed;
+	compressed->chunkSize = FLUXFS_COMPRESSED_CHUNK_SIZE;
+	compressed->chunkCount = length / FLUXFS_COMPRESSED_CHUNK_SIZE + (length % FLUXFS_COMPRESSED_CHUNK_SIZE != 0);
+	compressed->chunkOffsets = malloc((compressed->chunkCount + 1) * sizeof(uint64_t));
+	compressed->chunkRaw = malloc(compressed->chunkCount + 1);
+	// Chunks that do not shrink are stored raw, so the payload never outgrows the data
+	compressed->payload = malloc(length ? length : 1);
+	if (!compressed->chunkOffsets || !compressed->chunkRaw || !compressed->payload) {
+		free_entry(entry);
+		return NULL;
+	}
+
+	uint64_t payloadSize = 0;
+	for (uint32_t i = 0; i < compressed->chunkCount; i++) {
+		const uint8_t *src = (const uint8_t *)data + (uint64_t)i * compressed->chunkSize;
+		uint64_t srcLen = chunk_length(entry, i);
+		uint8_t *dst = compressed->payload + payloadSize;
+		size_t size = lz_compress(src, srcLen, dst, srcLen - 1);
+		compressed->chunkRaw[i] = (size == 0);
+		if (size == 0) {
+			memcpy(dst, src, srcLen);
+			size = srcLen;
+		}
+		compressed->chunkOffsets[i] = payloadSize;
+		payloadSize += size;
+	}
+	compressed->chunkOffsets[compressed->chunkCount] = payloadSize;
+
+	uint8_t *payload = realloc(compressed->payload, payloadSize ? payloadSize : 1);
+	if (payload) {
+		compressed->payload = payload;
+	}
+
+	return entry;
+}
+
+// Compressed entries need version 2, adding one upgrades the file
+struct vf_entry *fluxfs_vf_add_compressed_data(struct fluxfs_vf *vf, uint64_t length, const char *data) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return NULL;
+	}
+	if (ensure_chunk_cache(vf) != 0) {
+		return NULL;
+	}
+
+	struct vf_entry *entry = compress_entry(length, data);
+	if (!entry) {
+		return NULL;
+	}
+
+	vf->version = FLUXFS_VF_VERSION_2;
+	append_entry(vf, entry);
+
+	return entry;
+}
+
+// Fill entries need version 2, adding one upgrades the file
+struct vf_entry *fluxfs_vf_add_zero(struct fluxfs_vf *vf, uint64_t length) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return NULL;
+	}
+	struct vf_entry *entry = calloc(1, sizeof(struct vf_entry));
+	if (!entry) {
+		return NULL;
+	}
+	entry->type = FLUXFS_ENTRY_ZERO;
+	entry->length = length;
+
+	vf->version = FLUXFS_VF_VERSION_2;
+	append_entry(vf, entry);
+
+	return entry;
+}
+
+struct vf_entry *fluxfs_vf_add_pattern(struct fluxfs_vf *vf, uint64_t length, const char *pattern, uint32_t patternLength) {
+	if (patternLength == 0 || patternLength > FLUXFS_MAX_PATTERN_LENGTH || fluxfs_vf_load_entries(vf) != 0) {
+		return NULL;
+	}
+
+	struct vf_entry *entry = calloc(1, sizeof(struct vf_entry));
+	if (!entry) {
+		return NULL;
+	}
+	entry->type = FLUXFS_ENTRY_PATTERN;
+	entry->length = length;
+	entry->data.pattern = malloc(sizeof(struct vf_pattern) + patternLength);
+	if (!entry->data.pattern) {
+		free(entry);
+		return NULL;
+	}
+	entry->data.pattern->length = patternLength;
+	memcpy(entry->data.pattern->bytes, pattern, patternLength);
+
+	vf->version = FLUXFS_VF_VERSION_2;
+	append_entry(vf, entry);
+
+	return entry;
+}
+
+struct vf_entry *fluxfs_vf_add_file_offset(struct fluxfs_vf *vf, uint32_t fileIndex, uint64_t length, uint64_t offset) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return NULL;
+	}
+	struct vf_entry *entry = malloc(sizeof(struct vf_entry));
+	if (!entry) {
+		return NULL;
+	}
+	memset(entry, 0, sizeof(struct vf_entry));
+
+	entry->type = 1;
+	entry->pathIndex = fileIndex;
+	entry->length = length;
+	entry->data.offset = offset;
+
+	append_entry(vf, entry);
+
+	return entry;
+}
+
+// Save embedded entries of at least FLUXFS_BLOB_MIN_SIZE bytes to the blob
+// pack in the directory of the file, so files embedding the same bytes
+// store them once. Blob entries need version 2, the file is upgraded.
+void fluxfs_vf_pack_blobs(struct fluxfs_vf *vf) {
+	vf->packBlobs = 1;
+	vf->version = FLUXFS_VF_VERSION_2;
+}
+
+// Continue the reference ending the file over patchLength bytes that differ
+// from its source, then length bytes that match it. The reference becomes a
+// patch entry, so a few changed bytes do not split it. Patch entries need
+// version 2, the file is upgraded.
+int fluxfs_vf_extend_reference(struct fluxfs_vf *vf, const char *patch, uint64_t patchLength, uint64_t length) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return 1;
+	}
+	struct vf_entry *tail = vf->tail;
+	if (!tail || tail->flags || (tail->type != FLUXFS_ENTRY_REFERENCE && tail->type != FLUXFS_ENTRY_PATCH)) {
+		return 1;
+	}
+
+	if (tail->type == FLUXFS_ENTRY_REFERENCE && patchLength) {
+		struct vf_patched *patched = calloc(1, sizeof(struct vf_patched));
+		if (!patched) {
+			return 1;
+		}
+		patched->offset = tail->data.offset;
+		tail->type = FLUXFS_ENTRY_PATCH;
+		tail->data.patched = patched;
+	}
+	if (patchLength) {
+		uint8_t *bytes = reserve_patch(tail->data.patched, tail->length, patchLength);
+		if (!bytes) {
+			return 1;
+		}
+		memcpy(bytes, patch, patchLength);
+		vf->version = FLUXFS_VF_VERSION_2;
+	}
+
+	tail->length += patchLength + length;
+	vf->size += patchLength + length;
+	return 0;
+}
+
+// Path index of a source, adding it if the file does not reference it yet
+uint32_t find_or_add_source(struct fluxfs_vf *vf, uint32_t id) {
+	for (uint32_t i = 0; i < vf->sourceCount; i++) {
+		if (vf->sources[i] == id) {
+			return i;
+		}
+	}
+	fluxfs_source_retain(id);
+	uint32_t i = add_source(vf, id);
+	if (i == UINT32_MAX) {
+		fluxfs_source_release(id);
+	}
+	return i;
+}
+
+// A new entry holding length bytes of entry starting entryOffset bytes into
+// it. Whole entries keep their checksum, references keep their path index.
+struct vf_entry *copy_entry_range(struct fluxfs_vf *vf, struct vf_entry *entry, uint64_t entryOffset, uint64_t length) {
+	if (entry->type == FLUXFS_ENTRY_COMPRESSED) {
+		char *data = malloc(length ? length : 1);
+		if (!data) {
+			return NULL;
+		}
+		struct vf_entry *copy = NULL;
+		if (read_compressed_range(vf, entry, (uint8_t *)data, entryOffset, length) == 0) {
+			copy = compress_entry(length, data);
+		}
+		free(data);
+		return copy;
+	}
+
+	struct vf_entry *copy = calloc(1, sizeof(struct vf_entry));
+	if (!copy) {
+		return NULL;
+	}
+	copy->type = entry->type;
+	copy->length = length;
+
+	if (entry->type == FLUXFS_ENTRY_REFERENCE) {
+		copy->pathIndex = entry->pathIndex;
+		copy->data.offset = entry->data.offset + entryOffset;
+	} else if (entry->type == FLUXFS_ENTRY_DATA) {
+		copy->data.bytes = malloc(length ? length : 1);
+		if (!copy->data.bytes) {
+			free(copy);
+			return NULL;
+		}
+		memcpy(copy->data.bytes, entry->data.bytes + entryOffset, length);
+	} else if (entry->type == FLUXFS_ENTRY_PATCH) {
+		// Keep the patches inside the range, a range without any is a reference
+		struct vf_patched *patched = entry->data.patched;
+		struct vf_patched *clipped = calloc(1, sizeof(struct vf_patched));
+		if (!clipped) {
+			free(copy);
+			return NULL;
+		}
+		uint64_t end = entryOffset + length;
+		for (uint32_t i = find_patch(patched, entryOffset); i < patched->patchCount && patched->patches[i].offset < end; i++) {
+			struct vf_patch *patch = &patched->patches[i];
+			uint64_t from = patch->offset > entryOffset ? patch->offset : entryOffset;
+			uint64_t to = patch->offset + patch->length < end ? patch->offset + patch->length : end;
+			uint8_t *bytes = reserve_patch(clipped, from - entryOffset, to - from);
+			if (!bytes) {
+				free_patched(clipped);
+				free(copy);
+				return NULL;
+			}
+			memcpy(bytes, patched->bytes + patch->start + (from - patch->offset), to - from);
+		}
+		copy->pathIndex = entry->pathIndex;
+		if (clipped->patchCount) {
+			clipped->offset = patched->offset + entryOffset;
+			copy->data.patched = clipped;
+		} else {
+			copy->type = FLUXFS_ENTRY_REFERENCE;
+			copy->data.offset = patched->offset + entryOffset;
+			free_patched(clipped);
+		}
+	} else if (entry->type == FLUXFS_ENTRY_PATTERN) {
+		// Rotate the pattern so it starts at the phase of the first byte
+		struct vf_pattern *pattern = entry->data.pattern;
+		copy->data.pattern = malloc(sizeof(struct vf_pattern) + pattern->length);
+		if (!copy->data.pattern) {
+			free(copy);
+			return NULL;
+		}
+		uint32_t phase = entryOffset % pattern->length;
+		copy->data.pattern->length = pattern->length;
+		memcpy(copy->data.pattern->bytes, pattern->bytes + phase, pattern->length - phase);
+		memcpy(copy->data.pattern->bytes + pattern->length - phase, pattern->bytes, phase);
+	}
+
+	if (entryOffset == 0 && length == entry->length) {
+		copy->flags = entry->flags;
+		copy->checksum = entry->checksum;
+	}
+	return copy;
+}
+
+// Copy part of one src entry to the end of dst
+int append_entry_range(struct fluxfs_vf *dst, struct fluxfs_vf *src, struct vf_entry *entry, uint64_t entryOffset, uint64_t length) {
+	uint32_t pathIndex = 0;
+	if (entry->type == FLUXFS_ENTRY_REFERENCE || entry->type == FLUXFS_ENTRY_PATCH) {
+		pathIndex = find_or_add_source(dst, src->sources[entry->pathIndex]);
+		if (pathIndex == UINT32_MAX) {
+			return 1;
+		}
+	}
+	if (entry->type == FLUXFS_ENTRY_REFERENCE) {
+		uint64_t fileOffset = entry->data.offset + entryOffset;
+		int whole = (entry->flags & FLUXFS_ENTRY_FLAG_CHECKSUM) && entryOffset == 0 && length == entry->length;
+		struct vf_entry *tail = dst->tail;
+		// A range continuing the last reference extends it, unless either has a checksum
+		if (tail && tail->type == FLUXFS_ENTRY_REFERENCE && !tail->flags && !whole && tail->pathIndex == pathIndex &&
+			tail->data.offset + tail->length == fileOffset) {
+			tail->length += length;
+			dst->size += length;
+			return 0;
+		}
+	}
+
+	struct vf_entry *copy = copy_entry_range(src, entry, entryOffset, length);
+	if (!copy) {
+		return 1;
+	}
+	if (copy->type == FLUXFS_ENTRY_COMPRESSED && ensure_chunk_cache(dst) != 0) {
+		free_entry(copy);
+		return 1;
+	}
+	copy->pathIndex = pathIndex;
+	if (copy->type > FLUXFS_ENTRY_REFERENCE || copy->flags) {
+		dst->version = FLUXFS_VF_VERSION_2;
+	}
+	append_entry(dst, copy);
+	return 0;
+}
+
+// Append length bytes of src starting at offset to dst. Embedded bytes are
+// copied and references point straight at the source files, so dst never
+// refers to src. Sources are shared by ID, so dst can be saved anywhere.
+int fluxfs_vf_append_range(struct fluxfs_vf *dst, struct fluxfs_vf *src, uint64_t offset, uint64_t length) {
+	if (dst == src || offset > src->size || length > src->size - offset) {
+		return 1;
+	}
+
+	if (fluxfs_vf_load_entries(dst) != 0) {
+		return 1;
+	}
+
+	struct vf_cursor cursor;
+	if (length == 0) {
+		return 0;
+	}
+	if (seek_entry(src, offset, &cursor) != 0) {
+		return 1;
+	}
+	while (cursor.entry && length) {
+		struct vf_entry *entry = cursor.entry;
+		uint64_t entryOffset = offset - cursor.offset;
+		uint64_t part = entry->length - entryOffset;
+		if (part > length) {
+			part = length;
+		}
+		if (append_entry_range(dst, src, entry, entryOffset, part) != 0) {
+			return 1;
+		}
+		offset += part;
+		length -= part;
+		if (next_entry(src, &cursor) != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Make an entry start at offset by splitting the entry that spans it. prev
+// is set to the entry ending at offset, or NULL when offset is 0.
+int split_at(struct fluxfs_vf *vf, uint64_t offset, struct vf_entry **prev) {
+	struct vf_entry *before = NULL;
+	struct vf_entry *entry = vf->head;
+	uint64_t vfOffset = 0;
+	while (entry && vfOffset + entry->length <= offset) {
+		vfOffset += entry->length;
+		before = entry;
+		entry = entry->next;
+	}
+
+	if (entry && vfOffset < offset) {
+		uint64_t entryOffset = offset - vfOffset;
+		struct vf_entry *first = copy_entry_range(vf, entry, 0, entryOffset);
+		struct vf_entry *second = copy_entry_range(vf, entry, entryOffset, entry->length - entryOffset);
+		if (!first || !second) {
+			if (first) {
+				free_entry(first);
+			}
+			if (second) {
+				free_entry(second);
+			}
+			return 1;
+		}
+		first->next = second;
+		second->next = entry->next;
+		if (before) {
+			before->next = first;
+		} else {
+			vf->head = first;
+		}
+		if (vf->tail == entry) {
+			vf->tail = second;
+		}
+		forget_cached_chunks(vf->chunkCache, entry);
+		free_entry(entry);
+		before = first;
 	}
-	memset(strings, 0, sizeof(struct vf_strings));
-	vf->strings = strings;
 
-	return vf;
+	*prev = before;
+	return 0;
 }
 
-uint8_t fluxfs_vf_add_path(struct fluxfs_vf *vf, const char *filePath) {
-	uint8_t i = vf->strings->cnt;
-	vf->strings->paths[i] = strdup(filePath);
-	vf->strings->cnt++;
-	return i;
+// Free the entries after prev up to and including last
+void remove_entries(struct fluxfs_vf *vf, struct vf_entry *prev, struct vf_entry *last) {
+	struct vf_entry *entry = prev ? prev->next : vf->head;
+	struct vf_entry *after = last ? last->next : vf->head;
+	while (entry != after) {
+		struct vf_entry *next = entry->next;
+		vf->size -= entry->length;
+		forget_cached_chunks(vf->chunkCache, entry);
+		free_entry(entry);
+		entry = next;
+	}
+	if (prev) {
+		prev->next = after;
+	} else {
+		vf->head = after;
+	}
+	if (!after) {
+		vf->tail = prev;
+	}
 }
 
-struct vf_entry *fluxfs_vf_add_data(struct fluxfs_vf *vf, uint64_t length, const char *data) {
-	struct vf_entry *entry = malloc(sizeof(struct vf_entry));
-	if (!entry) {
-		return NULL;
+// Add size bytes of embedded data after prev, or first when it is NULL
+int insert_data(struct fluxfs_vf *vf, struct vf_entry *prev, const char *buf, size_t size) {
+	struct vf_entry *after = prev ? prev->next : vf->head;
+
+	// Sequential writes grow the previous embedded entry
+	if (prev && prev->type == FLUXFS_ENTRY_DATA && prev->length + size <= FLUXFS_WRITE_MERGE_SIZE) {
+		// Shared bytes are read only, the entry gets its own copy
+		uint8_t *bytes = prev->shared ? malloc(prev->length + size) : realloc(prev->data.bytes, prev->length + size);
+		if (!bytes) {
+			return 1;
+		}
+		if (prev->shared) {
+			memcpy(bytes, prev->data.bytes, prev->length);
+			blob_release(prev->data.bytes);
+			prev->shared = 0;
+		}
+		memcpy(bytes + prev->length, buf, size);
+		prev->data.bytes = bytes;
+		prev->length += size;
+		prev->flags = 0;
+		vf->size += size;
+		return 0;
 	}
-	memset(entry, 0, sizeof(struct vf_entry));
 
-	entry->type = 0;
-	entry->length = length;
-	entry->data.bytes = malloc(length);
+	struct vf_entry *entry = calloc(1, sizeof(struct vf_entry));
+	if (!entry) {
+		return 1;
+	}
+	entry->type = FLUXFS_ENTRY_DATA;
+	entry->length = size;
+	entry->data.bytes = malloc(size);
 	if (!entry->data.bytes) {
 		free(entry);
-		return NULL;
+		return 1;
 	}
-	memcpy(entry->data.bytes, data, length);
+	memcpy(entry->data.bytes, buf, size);
 
-	if (vf->tail) {
-		vf->tail->next = entry;
+	entry->next = after;
+	if (prev) {
+		prev->next = entry;
 	} else {
 		vf->head = entry;
 	}
-	vf->tail = entry;
+	if (!after) {
+		vf->tail = entry;
+	}
+	vf->size += size;
+	return 0;
+}
 
-	return entry;
+// Replace size bytes at offset with embedded data, extending the file if
+// needed. Entries outside the range are kept, so a small edit never copies
+// the referenced data around it.
+int fluxfs_vf_write(struct fluxfs_vf *vf, const char *buf, size_t size, uint64_t offset) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return 1;
+	}
+	if (offset > vf->size && fluxfs_vf_truncate(vf, offset) != 0) {
+		return 1;
+	}
+	if (size == 0) {
+		return 0;
+	}
+
+	struct vf_entry *prev, *last;
+	if (split_at(vf, offset, &prev) != 0 || split_at(vf, offset + size, &last) != 0) {
+		return 1;
+	}
+	remove_entries(vf, prev, last);
+	return insert_data(vf, prev, buf, size);
 }
 
-struct vf_entry *fluxfs_vf_add_file_offset(struct fluxfs_vf *vf, uint8_t fileIndex, uint64_t length, uint64_t offset) {
-	struct vf_entry *entry = malloc(sizeof(struct vf_entry));
-	if (!entry) {
-		return NULL;
+// Insert size bytes of embedded data at offset, moving the bytes after it.
+// Past the end of the file this is a write.
+int fluxfs_vf_insert(struct fluxfs_vf *vf, const char *buf, size_t size, uint64_t offset) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return 1;
+	}
+	if (offset >= vf->size) {
+		return fluxfs_vf_write(vf, buf, size, offset);
+	}
+	if (size == 0) {
+		return 0;
 	}
-	memset(entry, 0, sizeof(struct vf_entry));
 
-	entry->type = 1;
-	entry->pathIndex = fileIndex;
-	entry->length = length;
-	entry->data.offset = offset;
+	struct vf_entry *prev;
+	if (split_at(vf, offset, &prev) != 0) {
+		return 1;
+	}
+	return insert_data(vf, prev, buf, size);
+}
 
-	if (vf->tail) {
-		vf->tail->next = entry;
-	} else {
-		vf->head = entry;
+// Remove length bytes at offset, moving the bytes after them. The range is
+// cut at the end of the file.
+int fluxfs_vf_delete(struct fluxfs_vf *vf, uint64_t offset, uint64_t length) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return 1;
+	}
+	if (offset >= vf->size || length == 0) {
+		return 0;
+	}
+	if (length > vf->size - offset) {
+		length = vf->size - offset;
 	}
-	vf->tail = entry;
 
-	return entry;
+	struct vf_entry *prev, *last;
+	if (split_at(vf, offset, &prev) != 0 || split_at(vf, offset + length, &last) != 0) {
+		return 1;
+	}
+	remove_entries(vf, prev, last);
+	return 0;
 }
 
-int fluxfs_save_vf(struct fluxfs_vf *vf, const char *filePath) {
-	FILE *file = fopen(filePath, "wb");
-	if (!file) {
-		perror("Error opening file");
+// Cut the file to length bytes, or extend it with zeros
+int fluxfs_vf_truncate(struct fluxfs_vf *vf, uint64_t length) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return 1;
+	}
+	if (length > vf->size) {
+		return fluxfs_vf_add_zero(vf, length - vf->size) ? 0 : 1;
+	}
+
+	struct vf_entry *prev;
+	if (split_at(vf, length, &prev) != 0) {
 		return 1;
 	}
+	remove_entries(vf, prev, vf->tail);
+	return 0;
+}
 
-	char signature[] = "FluxFS VF";
-	uint16_t stringLen = strlen(signature) + 1;
-	fwrite(signature, stringLen, 1, file);
+// A path string as saved, the replica paths each NULL-terminated
+struct path_string {
+	char *bytes;
+	uint64_t length;
+};
+
+int save_vf_v1(struct fluxfs_vf *vf, FILE *file, struct path_string *paths) {
+	if (vf->sourceCount > FLUXFS_VF_V1_MAX_PATHS) {
+		fprintf(stderr, "Too many path strings for a version 1 virtual file\n");
+		return 1;
+	}
+	for (uint32_t i = 0; i < vf->sourceCount; i++) {
+		if (fluxfs_source_replica_count(vf->sources[i]) > 1) {
+			fprintf(stderr, "Mirrored paths need a version 2 virtual file\n");
+			return 1;
+		}
+	}
 
-	stringLen = strlen(vf->vpath) + 1;
+	uint16_t stringLen = strlen(vf->vpath) + 1;
 	fwrite(&stringLen, 2, 1, file);
 	fwrite(vf->vpath, stringLen, 1, file);
 
-	fwrite(&vf->strings->cnt, 1, 1, file);
-	for (uint8_t i = 0; i < vf->strings->cnt; i++) {
-		stringLen = strlen(vf->strings->paths[i]) + 1;
+	uint8_t pathCount = vf->sourceCount;
+	fwrite(&pathCount, 1, 1, file);
+	for (uint32_t i = 0; i < vf->sourceCount; i++) {
+		stringLen = paths[i].length;
 		fwrite(&stringLen, 2, 1, file);
-		fwrite(vf->strings->paths[i], stringLen, 1, file);
+		fwrite(paths[i].bytes, stringLen, 1, file);
 	}
 
 	struct vf_entry *entry = vf->head;
 	while (entry) {
+		if (entry->type > FLUXFS_ENTRY_REFERENCE || entry->flags) {
+			fprintf(stderr, "Entry type %u needs a version 2 virtual file\n", entry->type);
+			return 1;
+		}
+
 		uint8_t lengthSize;
 		uint8_t offsetSize = 0;
 		uint8_t pathIndex = 0;
@@ -432,9 +2071,7 @@ int fluxfs_save_vf(struct fluxfs_vf *vf, const char *filePath) {
 		}
 
 		if (entry->type == 0) {
-			for (uint64_t i = 0; i < entry->length; i++) {
-				fwrite(&entry->data.bytes[i], 1, 1, file);
-			}
+			fwrite(entry->data.bytes, 1, entry->length, file);
 		} else {
 			if (offsetSize == 0) {
 				uint8_t offset = entry->data.offset;
@@ -450,18 +2087,228 @@ int fluxfs_save_vf(struct fluxfs_vf *vf, const char *filePath) {
 				fwrite(&offset, 8, 1, file);
 			}
 			if (pathIndex == 7) {
-				fwrite(&entry->pathIndex, 1, 1, file);
+				uint8_t index = entry->pathIndex;
+				fwrite(&index, 1, 1, file);
 			}
 		}
 
 		entry = entry->next;
 	}
 
-	fclose(file);
+	return 0;
+}
+
+int save_vf_v2(struct fluxfs_vf *vf, FILE *file, struct path_string *paths, struct blob_pack *pack) {
+	// A zero version 1 path length followed by the version number
+	uint16_t marker = 0;
+	fwrite(&marker, 2, 1, file);
+	uint8_t version = FLUXFS_VF_VERSION_2;
+	fwrite(&version, 1, 1, file);
+
+	uint64_t stringLen = strlen(vf->vpath) + 1;
+	write_varint(file, stringLen);
+	fwrite(vf->vpath, stringLen, 1, file);
+
+	write_varint(file, vf->sourceCount);
+	for (uint32_t i = 0; i < vf->sourceCount; i++) {
+		write_varint(file, paths[i].length);
+		fwrite(paths[i].bytes, paths[i].length, 1, file);
+	}
+
+	// Where every FLUXFS_INDEX_PAGE_ENTRIES-th entry starts, for the index
+	struct vf_index_page *pages = NULL;
+	uint64_t pageCount = 0;
+	uint64_t entryCount = 0;
+	uint64_t virtualOffset = 0;
+
+	struct vf_entry *entry = vf->head;
+	while (entry) {
+		if (entryCount % FLUXFS_INDEX_PAGE_ENTRIES == 0) {
+			struct vf_index_page *grown = realloc(pages, (pageCount + 1) * sizeof(struct vf_index_page));
+			if (!grown) {
+				free(pages);
+				return 1;
+			}
+			pages = grown;
+			pages[pageCount].virtualOffset = virtualOffset;
+			pages[pageCount].filePosition = ftell(file);
+			pageCount++;
+		}
+		entryCount++;
+		virtualOffset += entry->length;
+
+		// Large embedded entries go to the pack, unless it cannot take them
+		uint64_t hash;
+		uint8_t type = entry->type;
+		if (pack && type == FLUXFS_ENTRY_DATA && entry->length >= FLUXFS_BLOB_MIN_SIZE &&
+			blob_pack_store(pack, entry->data.bytes, entry->length, &hash) == 0) {
+			type = FLUXFS_ENTRY_BLOB;
+		}
+		if (entry->flags & FLUXFS_ENTRY_FLAG_CHECKSUM) {
+			type |= FLUXFS_TYPE_CHECKSUM;
+		}
+		fwrite(&type, 1, 1, file);
+		write_varint(file, entry->length);
+		if (type == FLUXFS_ENTRY_BLOB) {
+			fwrite(&hash, 8, 1, file);
+		} else if (entry->type == FLUXFS_ENTRY_DATA) {
+			fwrite(entry->data.bytes, 1, entry->length, file);
+		} else if (entry->type == FLUXFS_ENTRY_REFERENCE) {
+			write_varint(file, entry->data.offset);
+			write_varint(file, entry->pathIndex);
+		} else if (entry->type == FLUXFS_ENTRY_COMPRESSED) {
+			write_compressed(file, entry);
+		} else if (entry->type == FLUXFS_ENTRY_PATTERN) {
+			write_varint(file, entry->data.pattern->length);
+			fwrite(entry->data.pattern->bytes, 1, entry->data.pattern->length, file);
+		} else if (entry->type == FLUXFS_ENTRY_PATCH) {
+			write_patched(file, entry);
+		}
+		if (entry->flags & FLUXFS_ENTRY_FLAG_CHECKSUM) {
+			fwrite(&entry->checksum, 4, 1, file);
+		}
+		entry = entry->next;
+	}
 
+	// Files of more than one page get an index, so they open without
+	// decoding every entry
+	if (pageCount > 1) {
+		struct vf_index_footer footer = { .position = ftell(file), .signature = FLUXFS_INDEX_SIGNATURE };
+		uint8_t type = FLUXFS_TYPE_INDEX;
+		fwrite(&type, 1, 1, file);
+		write_varint(file, FLUXFS_INDEX_PAGE_ENTRIES);
+		write_varint(file, entryCount);
+		write_varint(file, virtualOffset);
+		for (uint64_t i = 0; i < pageCount; i++) {
+			write_varint(file, i ? pages[i].virtualOffset - pages[i - 1].virtualOffset : 0);
+			write_varint(file, i ? pages[i].filePosition - pages[i - 1].filePosition : 0);
+		}
+		fwrite(&footer, sizeof(footer), 1, file);
+	}
+	free(pages);
+
+	return 0;
+}
+
+// Join the replica paths of a source relative to dir, each NULL-terminated
+int relative_replicas(const char *dir, uint32_t id, struct path_string *path) {
+	path->bytes = NULL;
+	path->length = 0;
+	for (uint32_t r = 0; r < fluxfs_source_replica_count(id); r++) {
+		char *relative = relative_path(dir, fluxfs_source_replica_path(id, r));
+		if (!relative) {
+			free(path->bytes);
+			return 1;
+		}
+		size_t len = strlen(relative) + 1;
+		char *bytes = realloc(path->bytes, path->length + len);
+		if (!bytes) {
+			free(relative);
+			free(path->bytes);
+			return 1;
+		}
+		memcpy(bytes + path->length, relative, len);
+		free(relative);
+		path->bytes = bytes;
+		path->length += len;
+	}
 	return 0;
 }
 
+// Path strings of a VF saved at filePath, each relative to its directory
+struct path_string *relative_paths(struct fluxfs_vf *vf, const char *filePath) {
+	char *dir = resolve_path(NULL, filePath);
+	struct path_string *paths = calloc(vf->sourceCount ? vf->sourceCount : 1, sizeof(struct path_string));
+	if (!dir || !paths) {
+		free(dir);
+		free(paths);
+		return NULL;
+	}
+	dirname(dir);
+	for (uint32_t i = 0; i < vf->sourceCount; i++) {
+		if (relative_replicas(dir, vf->sources[i], &paths[i]) != 0) {
+			for (uint32_t j = 0; j < i; j++) {
+				free(paths[j].bytes);
+			}
+			free(paths);
+			paths = NULL;
+			break;
+		}
+	}
+	free(dir);
+	return paths;
+}
+
+int fluxfs_save_vf(struct fluxfs_vf *vf, const char *filePath) {
+	// Pages still to be decoded may come from the file being replaced
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		fprintf(stderr, "Error reading entries\n");
+		return 1;
+	}
+
+	struct path_string *paths = relative_paths(vf, filePath);
+	if (!paths) {
+		perror("Error resolving paths");
+		return 1;
+	}
+
+	// The pack is shared by the files of the directory
+	struct blob_pack *pack = NULL;
+	if (vf->packBlobs && vf->version != FLUXFS_VF_VERSION_1) {
+		char *baseDir = resolve_path(NULL, filePath);
+		if (baseDir) {
+			pack = blob_pack_get(dirname(baseDir), 1);
+			free(baseDir);
+		}
+		if (!pack) {
+			fprintf(stderr, "Error opening the blob pack, embedded data is saved in the file\n");
+		}
+	}
+
+	// Written beside the file and renamed over it, so a reader or a loaded
+	// VF still decoding pages of the old file never sees a partial one
+	size_t len = strlen(filePath);
+	char *tempPath = malloc(len + sizeof(".tmp"));
+	if (tempPath) {
+		memcpy(tempPath, filePath, len);
+		memcpy(tempPath + len, ".tmp", sizeof(".tmp"));
+	}
+
+	int result = 1;
+	FILE *file = tempPath ? fopen(tempPath, "wb") : NULL;
+	if (!file) {
+		perror("Error opening file");
+	} else {
+		char signature[] = "FluxFS VF";
+		fwrite(signature, sizeof(signature), 1, file);
+
+		if (vf->version == FLUXFS_VF_VERSION_1) {
+			result = save_vf_v1(vf, file, paths);
+		} else {
+			result = save_vf_v2(vf, file, paths, pack);
+		}
+
+		if (fclose(file) != 0) {
+			perror("Error writing file");
+			result = 1;
+		}
+		if (result == 0 && rename(tempPath, filePath) != 0) {
+			perror("Error replacing file");
+			result = 1;
+		}
+		if (result != 0) {
+			unlink(tempPath);
+		}
+	}
+
+	free(tempPath);
+	for (uint32_t i = 0; i < vf->sourceCount; i++) {
+		free(paths[i].bytes);
+	}
+	free(paths);
+	return result;
+}
+
 /*int read_from_vf(struct fluxfs_vf *vf, char *buf, size_t size, off_t offset) {
 	uint64_t vf_offset = 0;
 	int bytesRead = 0;
@@ -495,52 +2342,242 @@ int fluxfs_save_vf(struct fluxfs_vf *vf, const char *filePath) {
 	return bytesRead;
 }*/
 
+// Copy size bytes of an entry starting entryOffset bytes into it
+int read_entry_bytes(struct fluxfs_vf *vf, struct vf_entry *entry, uint8_t *buf, uint64_t entryOffset, size_t size) {
+	if (entry->type == FLUXFS_ENTRY_DATA) {
+		memcpy(buf, &entry->data.bytes[entryOffset], size);
+	} else if (entry->type == FLUXFS_ENTRY_COMPRESSED) {
+		return read_compressed_range(vf, entry, buf, entryOffset, size);
+	} else if (entry->type == FLUXFS_ENTRY_ZERO) {
+		memset(buf, 0, size);
+	} else if (entry->type == FLUXFS_ENTRY_PATTERN) {
+		fill_pattern(buf, size, entry->data.pattern, entryOffset % entry->data.pattern->length);
+	} else if (entry->type == FLUXFS_ENTRY_PATCH) {
+		// One read of the source range, then the patches over it
+		if (entry->pathIndex >= vf->sourceCount ||
+			fluxfs_source_read(vf->sources[entry->pathIndex], buf, size, entry->data.patched->offset + entryOffset) != 0) {
+			return -1;
+		}
+		apply_patches(entry->data.patched, buf, entryOffset, size);
+	} else {
+		if (entry->pathIndex >= vf->sourceCount) {
+			return -1;
+		}
+		if (fluxfs_source_read(vf->sources[entry->pathIndex], buf, size, entry->data.offset + entryOffset) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 int fluxfs_read_from_vf(struct fluxfs_vf *vf, char *buf, size_t size, uint64_t offset) {
-	uint64_t vf_offset = 0;
 	int bytesRead = 0;
-	struct vf_entry *entry = vf->head;
+	struct vf_cursor cursor;
+	int found = size ? seek_entry(vf, offset, &cursor) : 1;
+	if (found < 0) {
+		return -1;
+	}
 
-	while (entry && size) {
-		if (offset >= vf_offset && offset < (vf_offset + entry->length)) {
-			size_t entryOffset = offset - vf_offset;
-			size_t availableBytes = entry->length - entryOffset;
-			size_t bytesToRead = (size < availableBytes) ? size : availableBytes;
+	while (found == 0 && cursor.entry && size) {
+		struct vf_entry *entry = cursor.entry;
+		size_t entryOffset = offset - cursor.offset;
+		size_t availableBytes = entry->length - entryOffset;
+		size_t bytesToRead = (size < availableBytes) ? size : availableBytes;
 
-			if (entry->type == 0) {
-				memcpy(buf + bytesRead, &entry->data.bytes[entryOffset], bytesToRead);
-			} else {
-				FILE *file = vf->files[entry->pathIndex];
-				uint64_t fileOffset = (offset - vf_offset) + entry->data.offset;
-				if (fseek(file, fileOffset, SEEK_SET) != 0) {
-					return -1;
-				}
-				size_t readBytes = fread(buf + bytesRead, 1, bytesToRead, file);
-				if (readBytes < bytesToRead) {
-					return -1;
-				}
+		if (read_entry_bytes(vf, entry, (uint8_t *)buf + bytesRead, entryOffset, bytesToRead) != 0) {
+			return -1;
+		}
+
+		bytesRead += bytesToRead;
+		size -= bytesToRead;
+		offset += bytesToRead;
+		if (next_entry(vf, &cursor) != 0) {
+			return -1;
+		}
+	}
+
+	return bytesRead;
+}
+
+// Describe the bytes from offset to the end of the entry holding it, so
+// they can be sent without copying: references as a range of a source file
+// descriptor, embedded data as memory. Patch entries are described one run
+// of source or patch bytes at a time. Other entries, and references whose
+// source must be read through fluxfs_source_read, have neither and are read
+// with fluxfs_read_from_vf. Returns 1 past the end of the file.
+int fluxfs_vf_get_segment(struct fluxfs_vf *vf, uint64_t offset, struct fluxfs_segment *segment) {
+	struct vf_cursor cursor;
+	if (seek_entry(vf, offset, &cursor) != 0) {
+		return 1;
+	}
+	struct vf_entry *entry = cursor.entry;
+	uint64_t entryOffset = offset - cursor.offset;
+	segment->length = entry->length - entryOffset;
+	segment->fd = -1;
+	segment->fileOffset = 0;
+	segment->bytes = NULL;
+	if (entry->type == FLUXFS_ENTRY_REFERENCE) {
+		if (entry->pathIndex >= vf->sourceCount) {
+			return 1;
+		}
+		segment->fd = fluxfs_source_direct_fd(vf->sources[entry->pathIndex]);
+		segment->fileOffset = entry->data.offset + entryOffset;
+	} else if (entry->type == FLUXFS_ENTRY_DATA) {
+		segment->bytes = entry->data.bytes + entryOffset;
+	} else if (entry->type == FLUXFS_ENTRY_PATCH) {
+		// Either the bytes of a patch, or the source up to the next one
+		struct vf_patched *patched = entry->data.patched;
+		uint32_t i = find_patch(patched, entryOffset);
+		if (i < patched->patchCount && patched->patches[i].offset <= entryOffset) {
+			struct vf_patch *patch = &patched->patches[i];
+			segment->bytes = patched->bytes + patch->start + (entryOffset - patch->offset);
+			segment->length = patch->offset + patch->length - entryOffset;
+		} else {
+			if (entry->pathIndex >= vf->sourceCount) {
+				return 1;
+			}
+			segment->fd = fluxfs_source_direct_fd(vf->sources[entry->pathIndex]);
+			segment->fileOffset = patched->offset + entryOffset;
+			if (i < patched->patchCount) {
+				segment->length = patched->patches[i].offset - entryOffset;
 			}
+		}
+	}
+	return 0;
+}
 
-			bytesRead += bytesToRead;
-			size -= bytesToRead;
-			offset += bytesToRead;
+// Call fn with the source ranges behind a virtual range, in file order.
+// Entries without a source are skipped. Returns 1 if the entries cannot be
+// read.
+int fluxfs_vf_source_ranges(struct fluxfs_vf *vf, uint64_t offset, uint64_t length, fluxfs_range_fn fn, void *arg) {
+	struct vf_cursor cursor;
+	if (length == 0) {
+		return 0;
+	}
+	int found = seek_entry(vf, offset, &cursor);
+	if (found != 0) {
+		return found < 0;
+	}
+	while (cursor.entry && length) {
+		struct vf_entry *entry = cursor.entry;
+		uint64_t entryOffset = offset - cursor.offset;
+		uint64_t part = entry->length - entryOffset;
+		if (part > length) {
+			part = length;
+		}
+		if (entry->type == FLUXFS_ENTRY_REFERENCE && entry->pathIndex < vf->sourceCount) {
+			fn(arg, vf->sources[entry->pathIndex], entry->data.offset + entryOffset, part);
+		} else if (entry->type == FLUXFS_ENTRY_PATCH && entry->pathIndex < vf->sourceCount) {
+			fn(arg, vf->sources[entry->pathIndex], entry->data.patched->offset + entryOffset, part);
+		}
+		offset += part;
+		length -= part;
+		if (next_entry(vf, &cursor) != 0) {
+			return 1;
 		}
+	}
+	return 0;
+}
 
-		vf_offset += entry->length;
+static void advise_range(void *arg, uint32_t source, uint64_t offset, uint64_t length) {
+	fluxfs_source_advise(source, offset, length, *(int *)arg);
+}
+
+// Pass posix_fadvise advice to the source ranges behind a virtual range,
+// such as POSIX_FADV_WILLNEED to start reading ahead
+void fluxfs_vf_advise(struct fluxfs_vf *vf, uint64_t offset, uint64_t length, int advice) {
+	fluxfs_vf_source_ranges(vf, offset, length, advise_range, &advice);
+}
+
+// CRC32C of the bytes an entry contributes, returns 1 if they cannot be read
+int checksum_entry(struct fluxfs_vf *vf, struct vf_entry *entry, uint32_t *crc) {
+	size_t bufSize = FLUXFS_CHECKSUM_BLOCK_SIZE;
+	if (entry->length < bufSize) {
+		bufSize = entry->length ? entry->length : 1;
+	}
+	uint8_t *buf = malloc(bufSize);
+	if (!buf) {
+		return 1;
+	}
+
+	*crc = 0;
+	for (uint64_t done = 0; done < entry->length;) {
+		size_t size = (entry->length - done < bufSize) ? entry->length - done : bufSize;
+		if (read_entry_bytes(vf, entry, buf, done, size) != 0) {
+			free(buf);
+			return 1;
+		}
+		*crc = fluxfs_crc32c(*crc, buf, size);
+		done += size;
+	}
+
+	free(buf);
+	return 0;
+}
+
+// Record a checksum for every reference and patch entry of a loaded virtual
+// file, checksums need version 2 so the file is upgraded
+int fluxfs_vf_compute_checksums(struct fluxfs_vf *vf) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return 1;
+	}
+	struct vf_entry *entry = vf->head;
+	while (entry) {
+		if (entry->type == FLUXFS_ENTRY_REFERENCE || entry->type == FLUXFS_ENTRY_PATCH) {
+			if (checksum_entry(vf, entry, &entry->checksum) != 0) {
+				return 1;
+			}
+			entry->flags |= FLUXFS_ENTRY_FLAG_CHECKSUM;
+		}
 		entry = entry->next;
 	}
 
-	return bytesRead;
+	vf->version = FLUXFS_VF_VERSION_2;
+
+	return 0;
+}
+
+// Returns the number of entries that do not match their checksum, or -1 on a read error
+int fluxfs_vf_verify(struct fluxfs_vf *vf) {
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		return -1;
+	}
+	int mismatches = 0;
+	struct vf_entry *entry = vf->head;
+	while (entry) {
+		if (entry->flags & FLUXFS_ENTRY_FLAG_CHECKSUM) {
+			uint32_t crc;
+			if (checksum_entry(vf, entry, &crc) != 0) {
+				return -1;
+			}
+			if (crc != entry->checksum) {
+				mismatches++;
+			}
+		}
+		entry = entry->next;
+	}
+
+	return mismatches;
 }
 
 void fluxfs_print_vf(struct fluxfs_vf *vf) {
 	printf("Virtual Path: %s\n", vf->vpath);
 	printf("Virtual Size: %" PRIu64 "\n", vf->size);
+	printf("Format Version: %u\n", vf->version);
 	printf("Path Strings:\n");
 	// Print path strings
-	for (uint8_t i = 0; i < vf->strings->cnt; i++) {
-		printf("%s\n", vf->strings->paths[i]);
+	for (uint32_t i = 0; i < vf->sourceCount; i++) {
+		printf("%s\n", fluxfs_source_path(vf->sources[i]));
+		// Further replicas of a mirrored source
+		for (uint32_t r = 1; r < fluxfs_source_replica_count(vf->sources[i]); r++) {
+			printf("  mirror: %s\n", fluxfs_source_replica_path(vf->sources[i], r));
+		}
 	}
 	printf("-------------------------------------------------\n");
+	if (fluxfs_vf_load_entries(vf) != 0) {
+		printf("Entries could not be read\n");
+		return;
+	}
 	// Print entries
 	struct vf_entry *entry = vf->head;
 	while (entry) {
@@ -551,10 +2588,29 @@ void fluxfs_print_vf(struct fluxfs_vf *vf) {
 				printf("%02X ", entry->data.bytes[i]);
 			}
 			printf("\n");
+		} else if (entry->type == FLUXFS_ENTRY_COMPRESSED) {
+			printf("Compressed Data Entry\n");
+			printf("Chunks: %" PRIu32 " x %" PRIu32 "\n", entry->data.compressed->chunkCount, entry->data.compressed->chunkSize);
+			printf("Compressed Size: %" PRIu64 "\n", entry->data.compressed->chunkOffsets[entry->data.compressed->chunkCount]);
+		} else if (entry->type == FLUXFS_ENTRY_ZERO) {
+			printf("Zero Fill Entry\n");
+		} else if (entry->type == FLUXFS_ENTRY_PATTERN) {
+			printf("Pattern Fill Entry\n");
+			for (uint32_t i = 0; i < entry->data.pattern->length; i++) {
+				printf("%02X ", entry->data.pattern->bytes[i]);
+			}
+			printf("\n");
+		} else if (entry->type == FLUXFS_ENTRY_PATCH) {
+			printf("Patched File Offset Entry\n");
+			printf("Offset: %" PRIu64 "\n", entry->data.patched->offset);
+			printf("Patches: %" PRIu32 " (%" PRIu64 " bytes)\n", entry->data.patched->patchCount, entry->data.patched->byteCount);
 		} else {
 			printf("File Offset Entry\n");
 			printf("Offset: %" PRIu64 "\n", entry->data.offset);
 		}
+		if (entry->flags & FLUXFS_ENTRY_FLAG_CHECKSUM) {
+			printf("CRC32C: %08" PRIX32 "\n", entry->checksum);
+		}
 		printf("-------------------------------------------------\n");
 		entry = entry->next;
 	}
@@ -0,0 +1,225 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "fluxfs.h"
+
+// An overlay is a sidecar journal of changes made to a virtual file, named
+// after it with ".overlay" added. It starts with a signature and holds
+// records of a uint8_t type, a uint64_t offset and a uint64_t length. Write
+// and insert records are followed by length bytes, truncate and delete
+// records use the numbers only. Records are only appended, so a record cut
+// short by a crash is ignored. Appends and compaction take an flock on the
+// overlay, so tools and a mount can edit one file.
+
+static const char overlaySignature[] = "FluxFS OV";
+
+char *fluxfs_overlay_path(const char *filePath) {
+	size_t len = strlen(filePath);
+	char *path = malloc(len + sizeof(".overlay"));
+	if (!path) {
+		return NULL;
+	}
+	memcpy(path, filePath, len);
+	memcpy(path + len, ".overlay", sizeof(".overlay"));
+	return path;
+}
+
+// Open the overlay of a virtual file for appending, creating it if needed
+FILE *fluxfs_overlay_open(const char *filePath) {
+	char *path = fluxfs_overlay_path(filePath);
+	if (!path) {
+		return NULL;
+	}
+
+	// An overlay compacted before the lock was taken is gone, start another
+	FILE *overlay;
+	struct stat st;
+	for (;;) {
+		overlay = fopen(path, "ab");
+		if (!overlay) {
+			perror("Error opening overlay");
+			free(path);
+			return NULL;
+		}
+		flock(fileno(overlay), LOCK_EX);
+		if (fstat(fileno(overlay), &st) == 0 && st.st_nlink == 0) {
+			fclose(overlay);
+			continue;
+		}
+		break;
+	}
+	free(path);
+
+	int failed = st.st_size == 0 &&
+		(fwrite(overlaySignature, sizeof(overlaySignature), 1, overlay) != 1 || fflush(overlay) != 0);
+	flock(fileno(overlay), LOCK_UN);
+	if (failed) {
+		fclose(overlay);
+		return NULL;
+	}
+	return overlay;
+}
+
+static int write_record(FILE *overlay, uint8_t type, uint64_t offset, uint64_t length, const char *buf) {
+	// Records after a compaction would be lost with the unlinked overlay
+	struct stat st;
+	flock(fileno(overlay), LOCK_EX);
+	if (fstat(fileno(overlay), &st) != 0 || st.st_nlink == 0) {
+		fprintf(stderr, "Overlay was compacted while open\n");
+		flock(fileno(overlay), LOCK_UN);
+		return 1;
+	}
+	fwrite(&type, 1, 1, overlay);
+	fwrite(&offset, 8, 1, overlay);
+	fwrite(&length, 8, 1, overlay);
+	if (buf && length) {
+		fwrite(buf, 1, length, overlay);
+	}
+	int failed = ferror(overlay) || fflush(overlay) != 0;
+	flock(fileno(overlay), LOCK_UN);
+	if (failed) {
+		perror("Error writing overlay");
+		return 1;
+	}
+	return 0;
+}
+
+int fluxfs_overlay_write(FILE *overlay, const char *buf, size_t size, uint64_t offset) {
+	return write_record(overlay, FLUXFS_OVERLAY_WRITE, offset, size, buf);
+}
+
+int fluxfs_overlay_truncate(FILE *overlay, uint64_t length) {
+	return write_record(overlay, FLUXFS_OVERLAY_TRUNCATE, 0, length, NULL);
+}
+
+int fluxfs_overlay_insert(FILE *overlay, const char *buf, size_t size, uint64_t offset) {
+	return write_record(overlay, FLUXFS_OVERLAY_INSERT, offset, size, buf);
+}
+
+int fluxfs_overlay_delete(FILE *overlay, uint64_t offset, uint64_t length) {
+	return write_record(overlay, FLUXFS_OVERLAY_DELETE, offset, length, NULL);
+}
+
+// Close an overlay opened by a tool, folding it into the virtual file once
+// it holds FLUXFS_OVERLAY_FOLD_SIZE bytes, so loads replay a short journal
+int fluxfs_overlay_close(FILE *overlay, const char *filePath) {
+	struct stat st;
+	int fold = fstat(fileno(overlay), &st) == 0 && st.st_size >= FLUXFS_OVERLAY_FOLD_SIZE;
+	if (fclose(overlay) != 0) {
+		return 1;
+	}
+	return fold ? fluxfs_overlay_compact(filePath) : 0;
+}
+
+// Replay the overlay of a virtual file onto it, a missing overlay is no change
+int fluxfs_overlay_apply(struct fluxfs_vf *vf, const char *filePath) {
+	char *path = fluxfs_overlay_path(filePath);
+	if (!path) {
+		return 1;
+	}
+	FILE *overlay = fopen(path, "rb");
+	free(path);
+	if (!overlay) {
+		return 0;
+	}
+
+	char signature[sizeof(overlaySignature)];
+	if (fread(signature, sizeof(signature), 1, overlay) != 1 || memcmp(signature, overlaySignature, sizeof(signature)) != 0) {
+		fprintf(stderr, "Invalid overlay for %s\n", filePath);
+		fclose(overlay);
+		return 1;
+	}
+
+	int result = 0;
+	for (;;) {
+		uint8_t type;
+		uint64_t offset, length;
+		if (fread(&type, 1, 1, overlay) != 1 || fread(&offset, 8, 1, overlay) != 1 || fread(&length, 8, 1, overlay) != 1) {
+			break;
+		}
+
+		if (type == FLUXFS_OVERLAY_TRUNCATE) {
+			if (fluxfs_vf_truncate(vf, length) != 0) {
+				result = 1;
+				break;
+			}
+		} else if (type == FLUXFS_OVERLAY_DELETE) {
+			if (fluxfs_vf_delete(vf, offset, length) != 0) {
+				result = 1;
+				break;
+			}
+		} else if (type == FLUXFS_OVERLAY_WRITE || type == FLUXFS_OVERLAY_INSERT) {
+			char *buf = malloc(length ? length : 1);
+			if (!buf) {
+				result = 1;
+				break;
+			}
+			if (fread(buf, 1, length, overlay) != length) {
+				free(buf);
+				break;
+			}
+			int changed = type == FLUXFS_OVERLAY_WRITE ? fluxfs_vf_write(vf, buf, length, offset) : fluxfs_vf_insert(vf, buf, length, offset);
+			if (changed != 0) {
+				free(buf);
+				result = 1;
+				break;
+			}
+			free(buf);
+		} else {
+			fprintf(stderr, "Unknown overlay record in %s\n", filePath);
+			result = 1;
+			break;
+		}
+	}
+
+	fclose(overlay);
+	return result;
+}
+
+// Fold the overlay of a virtual file into it and remove the overlay. The
+// file is replaced by a rename, so readers see either version whole.
+int fluxfs_overlay_compact(const char *filePath) {
+	char *path = fluxfs_overlay_path(filePath);
+	if (!path) {
+		return 1;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		free(path);
+		return 0;
+	}
+
+	// Appends wait until the overlay is folded and removed
+	struct stat st;
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &st) != 0 || st.st_nlink == 0) {
+		close(fd);
+		free(path);
+		return 0;
+	}
+
+	struct fluxfs_vf *vf = fluxfs_load_vf(filePath);
+	if (!vf || fluxfs_overlay_apply(vf, filePath) != 0) {
+		fluxfs_free_vf(vf);
+		close(fd);
+		free(path);
+		return 1;
+	}
+
+	int result = fluxfs_save_vf(vf, filePath);
+	fluxfs_free_vf(vf);
+	if (result == 0) {
+		unlink(path);
+	}
+	close(fd);
+
+	free(path);
+	return result;
+}
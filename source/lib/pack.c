@@ -0,0 +1,686 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fluxfs.h"
+#include "source.h"
+#include "pack.h"
+
+// A pack starts with a signature followed by the bytes of its .vf files.
+// The index follows them at an 8 byte boundary, so it can be mapped and
+// used in place: a header, the records sorted by vpath, the record
+// numbers sorted by name and a table of NULL-terminated strings. A footer
+// holding the index position ends the file.
+struct pack_header {
+	uint64_t count;
+	uint64_t stringsLength;
+};
+
+struct pack_footer {
+	uint64_t position;
+	char signature[8];
+};
+
+static const char packSignature[] = FLUXFS_PACK_SIGNATURE;
+
+static void invalid_pack(const char *filePath) {
+	fprintf(stderr, "%s is not a valid FluxFS pack\n", filePath);
+}
+
+// A record name must stay below the directory of the pack: relative, with
+// no empty, . or .. components
+static int valid_name(const char *name) {
+	if (name[0] == 0 || name[0] == '/') {
+		return 0;
+	}
+	for (const char *component = name; ; ) {
+		size_t len = strcspn(component, "/");
+		if (len == 0 || (len == 1 && component[0] == '.') || (len == 2 && component[0] == '.' && component[1] == '.')) {
+			return 0;
+		}
+		if (component[len] == 0) {
+			return 1;
+		}
+		component += len + 1;
+	}
+}
+
+// Check the records point into the pack, their names stay in its directory
+// and both orders are strictly sorted, so lookups can search them
+static int check_index(const struct fluxfs_pack *pack, uint64_t stringsLength, uint64_t position) {
+	for (uint64_t i = 0; i < pack->count; i++) {
+		const struct fluxfs_pack_record *record = &pack->records[i];
+		if (record->offset < sizeof(packSignature) || record->offset > position || record->length > position - record->offset ||
+			record->vpath >= stringsLength || record->name >= stringsLength || pack->byName[i] >= pack->count) {
+			return 1;
+		}
+		if (!valid_name(fluxfs_pack_name(pack, record))) {
+			return 1;
+		}
+		if (i && strcmp(fluxfs_pack_vpath(pack, record - 1), fluxfs_pack_vpath(pack, record)) >= 0) {
+			return 1;
+		}
+		if (i && strcmp(fluxfs_pack_name(pack, &pack->records[pack->byName[i - 1]]),
+			fluxfs_pack_name(pack, &pack->records[pack->byName[i]])) >= 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Map the index of the pack open at fd, which stays open
+static struct fluxfs_pack *map_pack(int fd, const char *filePath) {
+	struct stat st;
+	char signature[sizeof(packSignature)];
+	struct pack_footer footer;
+	struct pack_header header;
+	if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(packSignature) + sizeof(header) + sizeof(footer) ||
+		read_full(fd, (uint8_t *)signature, sizeof(signature), 0) != 0 || memcmp(signature, packSignature, sizeof(signature)) != 0 ||
+		read_full(fd, (uint8_t *)&footer, sizeof(footer), st.st_size - sizeof(footer)) != 0 ||
+		memcmp(footer.signature, FLUXFS_PACK_INDEX_SIGNATURE, sizeof(footer.signature)) != 0 ||
+		footer.position % 8 || footer.position < sizeof(packSignature) ||
+		footer.position > st.st_size - sizeof(footer) - sizeof(header) ||
+		read_full(fd, (uint8_t *)&header, sizeof(header), footer.position) != 0) {
+		invalid_pack(filePath);
+		return NULL;
+	}
+
+	// The sections must fill the index exactly
+	uint64_t indexLength = st.st_size - sizeof(footer) - footer.position - sizeof(header);
+	uint64_t recordSize = sizeof(struct fluxfs_pack_record) + sizeof(uint32_t);
+	if (header.count > UINT32_MAX || header.count > indexLength / recordSize || header.stringsLength == 0 ||
+		header.stringsLength > UINT32_MAX || header.count * recordSize + header.stringsLength != indexLength) {
+		invalid_pack(filePath);
+		return NULL;
+	}
+
+	struct fluxfs_pack *pack = calloc(1, sizeof(struct fluxfs_pack));
+	if (!pack) {
+		return NULL;
+	}
+	uint64_t start = footer.position & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+	pack->mapLength = st.st_size - sizeof(footer) - start;
+	pack->map = mmap(NULL, pack->mapLength, PROT_READ, MAP_SHARED, fd, start);
+	if (pack->map == MAP_FAILED) {
+		perror("Error mapping pack");
+		free(pack);
+		return NULL;
+	}
+
+	const uint8_t *index = (const uint8_t *)pack->map + (footer.position - start) + sizeof(header);
+	pack->count = header.count;
+	pack->records = (const struct fluxfs_pack_record *)index;
+	pack->byName = (const uint32_t *)(index + header.count * sizeof(struct fluxfs_pack_record));
+	pack->strings = (const char *)(index + header.count * recordSize);
+	if (pack->strings[header.stringsLength - 1] != 0 || check_index(pack, header.stringsLength, footer.position) != 0) {
+		invalid_pack(filePath);
+		fluxfs_pack_close(pack);
+		return NULL;
+	}
+	return pack;
+}
+
+// Map the index of a pack. Returns NULL if it cannot be read or is invalid.
+struct fluxfs_pack *fluxfs_pack_open(const char *filePath) {
+	int fd = open(filePath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("Error opening pack");
+		return NULL;
+	}
+	struct fluxfs_pack *pack = map_pack(fd, filePath);
+	close(fd);
+	return pack;
+}
+
+void fluxfs_pack_close(struct fluxfs_pack *pack) {
+	if (pack) {
+		munmap(pack->map, pack->mapLength);
+		free(pack);
+	}
+}
+
+const char *fluxfs_pack_vpath(const struct fluxfs_pack *pack, const struct fluxfs_pack_record *record) {
+	return pack->strings + record->vpath;
+}
+
+const char *fluxfs_pack_name(const struct fluxfs_pack *pack, const struct fluxfs_pack_record *record) {
+	return pack->strings + record->name;
+}
+
+// The record of a virtual path, NULL if the pack has none
+const struct fluxfs_pack_record *fluxfs_pack_find(const struct fluxfs_pack *pack, const char *vpath) {
+	uint64_t low = 0;
+	uint64_t high = pack->count;
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		int order = strcmp(fluxfs_pack_vpath(pack, &pack->records[mid]), vpath);
+		if (order == 0) {
+			return &pack->records[mid];
+		} else if (order < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return NULL;
+}
+
+// The record packed from the .vf at name, relative to the pack directory
+const struct fluxfs_pack_record *fluxfs_pack_find_name(const struct fluxfs_pack *pack, const char *name) {
+	uint64_t low = 0;
+	uint64_t high = pack->count;
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		const struct fluxfs_pack_record *record = &pack->records[pack->byName[mid]];
+		int order = strcmp(fluxfs_pack_name(pack, record), name);
+		if (order == 0) {
+			return record;
+		} else if (order < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return NULL;
+}
+
+// A record while a pack is written
+struct pack_item {
+	struct fluxfs_pack_record record;
+	char *vpath;
+	char *name;
+	uint32_t number;
+};
+
+static int compare_vpaths(const void *a, const void *b) {
+	return strcmp(((const struct pack_item *)a)->vpath, ((const struct pack_item *)b)->vpath);
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp((*(struct pack_item *const *)a)->name, (*(struct pack_item *const *)b)->name);
+}
+
+// Copy the bytes of a .vf to the end of the pack
+static int copy_vf(FILE *pack, const char *vfPath, uint64_t *length) {
+	FILE *file = fopen(vfPath, "rb");
+	if (!file) {
+		perror(vfPath);
+		return 1;
+	}
+	char buf[64 * 1024];
+	size_t got;
+	*length = 0;
+	while ((got = fread(buf, 1, sizeof(buf), file)) > 0) {
+		if (fwrite(buf, 1, got, pack) != got) {
+			fclose(file);
+			return 1;
+		}
+		*length += got;
+	}
+	int failed = ferror(file);
+	fclose(file);
+	return failed;
+}
+
+// Add one .vf to a pack being written, its overlay folded in first
+static int pack_vf(FILE *pack, const char *packDir, const char *vfPath, struct pack_item *item) {
+	char *resolved = resolve_path(NULL, vfPath);
+	size_t dirLength = strcmp(packDir, "/") == 0 ? 0 : strlen(packDir);
+	if (!resolved || strncmp(resolved, packDir, dirLength) != 0 || resolved[dirLength] != '/') {
+		fprintf(stderr, "%s is not below the directory of the pack\n", vfPath);
+		free(resolved);
+		return 1;
+	}
+	item->name = strdup(resolved + dirLength + 1);
+	free(resolved);
+
+	struct fluxfs_vf *vf = NULL;
+	if (!item->name || fluxfs_overlay_compact(vfPath) != 0 || !(vf = fluxfs_load_vf(vfPath)) ||
+		!(item->vpath = strdup(vf->vpath))) {
+		fprintf(stderr, "Failed to pack %s\n", vfPath);
+		fluxfs_free_vf(vf);
+		return 1;
+	}
+	item->record.size = vf->size;
+	fluxfs_free_vf(vf);
+
+	// Records start at 8 byte boundaries like the index
+	static const char padding[8];
+	long position = ftell(pack);
+	if (position < 0 || fwrite(padding, 1, -position & 7, pack) != (size_t)(-position & 7)) {
+		return 1;
+	}
+	item->record.offset = position + (-position & 7);
+	return copy_vf(pack, vfPath, &item->record.length);
+}
+
+// Write the index of the packed records and its footer
+static int write_index(FILE *pack, struct pack_item *items, size_t count) {
+	long position = ftell(pack);
+	static const char padding[8];
+	if (position < 0 || fwrite(padding, 1, -position & 7, pack) != (size_t)(-position & 7)) {
+		return 1;
+	}
+	struct pack_footer footer;
+	footer.position = position + (-position & 7);
+	memcpy(footer.signature, FLUXFS_PACK_INDEX_SIGNATURE, sizeof(footer.signature));
+
+	struct pack_item **byName = malloc((count ? count : 1) * sizeof(struct pack_item *));
+	if (!byName) {
+		return 1;
+	}
+	struct pack_header header = { count, 0 };
+	for (size_t i = 0; i < count; i++) {
+		items[i].number = i;
+		items[i].record.vpath = header.stringsLength;
+		header.stringsLength += strlen(items[i].vpath) + 1;
+		items[i].record.name = header.stringsLength;
+		header.stringsLength += strlen(items[i].name) + 1;
+		byName[i] = &items[i];
+	}
+	qsort(byName, count, sizeof(struct pack_item *), compare_names);
+
+	// An empty pack still holds one string, so the table is never empty
+	if (count == 0) {
+		header.stringsLength = 1;
+	}
+	int failed = header.stringsLength > UINT32_MAX || fwrite(&header, sizeof(header), 1, pack) != 1;
+	for (size_t i = 0; i < count && !failed; i++) {
+		failed = fwrite(&items[i].record, sizeof(struct fluxfs_pack_record), 1, pack) != 1;
+	}
+	for (size_t i = 0; i < count && !failed; i++) {
+		failed = fwrite(&byName[i]->number, sizeof(uint32_t), 1, pack) != 1;
+	}
+	for (size_t i = 0; i < count && !failed; i++) {
+		failed = fwrite(items[i].vpath, strlen(items[i].vpath) + 1, 1, pack) != 1 ||
+			fwrite(items[i].name, strlen(items[i].name) + 1, 1, pack) != 1;
+	}
+	if (count == 0) {
+		failed |= fputc(0, pack) == EOF;
+	}
+	failed |= fwrite(&footer, sizeof(footer), 1, pack) != 1;
+	free(byName);
+	return failed;
+}
+
+// Write the .vf files at vfPaths to a pack, replacing it. The files must
+// be in the directory of the pack or below it and have distinct vpaths.
+int fluxfs_pack_create(const char *filePath, char *const *vfPaths, size_t count) {
+	char *packDir = resolve_path(NULL, filePath);
+	size_t len = strlen(filePath);
+	char *tempPath = malloc(len + sizeof(".tmp"));
+	struct pack_item *items = calloc(count ? count : 1, sizeof(struct pack_item));
+	FILE *pack = NULL;
+	int failed = !packDir || !tempPath || !items || count > UINT32_MAX;
+	if (!failed) {
+		dirname(packDir);
+		memcpy(tempPath, filePath, len);
+		memcpy(tempPath + len, ".tmp", sizeof(".tmp"));
+		pack = fopen(tempPath, "wb");
+		if (!pack) {
+			perror("Error creating pack");
+			failed = 1;
+		}
+	}
+
+	failed |= pack && fwrite(packSignature, sizeof(packSignature), 1, pack) != 1;
+	for (size_t i = 0; i < count && !failed; i++) {
+		failed = pack_vf(pack, packDir, vfPaths[i], &items[i]);
+	}
+	if (!failed) {
+		qsort(items, count, sizeof(struct pack_item), compare_vpaths);
+		for (size_t i = 1; i < count && !failed; i++) {
+			if (strcmp(items[i - 1].vpath, items[i].vpath) == 0) {
+				fprintf(stderr, "%s and %s have the same virtual path %s\n", items[i - 1].name, items[i].name, items[i].vpath);
+				failed = 1;
+			}
+		}
+		failed |= write_index(pack, items, count);
+	}
+
+	// Replaced in one step, so a mounted pack is never seen half written
+	if (pack) {
+		failed |= fclose(pack) != 0;
+		if (!failed && rename(tempPath, filePath) != 0) {
+			perror("Error replacing pack");
+			failed = 1;
+		}
+		if (failed) {
+			unlink(tempPath);
+		}
+	}
+
+	for (size_t i = 0; items && i < count; i++) {
+		free(items[i].vpath);
+		free(items[i].name);
+	}
+	free(items);
+	free(tempPath);
+	free(packDir);
+	return failed;
+}
+
+// Create the missing directories of the parent of path
+static int make_parents(char *path) {
+	for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = 0;
+		int failed = mkdir(path, 0755) != 0 && errno != EEXIST;
+		*slash = '/';
+		if (failed) {
+			perror(path);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Write every record of a pack back to its .vf file
+int fluxfs_pack_extract(const char *filePath) {
+	struct fluxfs_pack *pack = fluxfs_pack_open(filePath);
+	char *packDir = resolve_path(NULL, filePath);
+	int fd = open(filePath, O_RDONLY | O_CLOEXEC);
+	uint8_t *buf = malloc(64 * 1024);
+	int failed = !pack || !packDir || fd < 0 || !buf;
+	size_t dirLength = 0;
+	if (packDir) {
+		dirname(packDir);
+		dirLength = strcmp(packDir, "/") == 0 ? 0 : strlen(packDir);
+	}
+
+	for (uint64_t i = 0; i < (pack ? pack->count : 0) && !failed; i++) {
+		const struct fluxfs_pack_record *record = &pack->records[i];
+		char *vfPath = resolve_path(packDir, fluxfs_pack_name(pack, record));
+		// check_index only lets names below the pack directory through
+		if (vfPath && (strncmp(vfPath, packDir, dirLength) != 0 || vfPath[dirLength] != '/')) {
+			fprintf(stderr, "%s is not below the directory of the pack\n", vfPath);
+			free(vfPath);
+			failed = 1;
+			break;
+		}
+		FILE *file = vfPath && make_parents(vfPath) == 0 ? fopen(vfPath, "wb") : NULL;
+		if (!file) {
+			perror(vfPath ? vfPath : "Error extracting pack");
+			free(vfPath);
+			failed = 1;
+			break;
+		}
+		for (uint64_t done = 0; done < record->length && !failed; ) {
+			size_t size = record->length - done < 64 * 1024 ? record->length - done : 64 * 1024;
+			failed = read_full(fd, buf, size, record->offset + done) != 0 || fwrite(buf, 1, size, file) != size;
+			done += size;
+		}
+		failed |= fclose(file) != 0;
+		free(vfPath);
+	}
+
+	free(buf);
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(packDir);
+	fluxfs_pack_close(pack);
+	return failed;
+}
+
+// The pack holding a record path, and where the record name starts in the
+// resolved path. NULL if no directory of the path is a pack.
+static char *find_pack(const char *resolved, const char **name) {
+	static const char marker[] = FLUXFS_PACK_EXTENSION "/";
+	for (const char *p = strstr(resolved, marker); p; p = strstr(p + 1, marker)) {
+		size_t len = p - resolved + sizeof(FLUXFS_PACK_EXTENSION) - 1;
+		char *packPath = strndup(resolved, len);
+		struct stat st;
+		if (packPath && stat(packPath, &st) == 0 && S_ISREG(st.st_mode)) {
+			*name = resolved + len + 1;
+			return packPath;
+		}
+		free(packPath);
+	}
+	return NULL;
+}
+
+// The stat of a .vf, or of the pack holding it
+int fluxfs_vf_stat(const char *filePath, struct stat *st) {
+	char *resolved = resolve_path(NULL, filePath);
+	if (!resolved) {
+		return -1;
+	}
+	const char *name;
+	char *packPath = find_pack(resolved, &name);
+	int result = stat(packPath ? packPath : resolved, st);
+	free(packPath);
+	free(resolved);
+	return result;
+}
+
+// A pack opened for its records, kept while it is unchanged so opening a
+// record only searches the mapped index
+struct open_pack {
+	char *path;
+	int fd;
+	struct fluxfs_pack *pack;
+	// The file the index was read from
+	dev_t device;
+	ino_t inode;
+	off_t size;
+	struct timespec mtime;
+	// Open records, and one for the list while the pack is current
+	unsigned refs;
+	struct open_pack *next;
+};
+
+static struct open_pack *openPacks = NULL;
+static pthread_mutex_t openPacksLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_pack(struct open_pack *entry) {
+	pthread_mutex_lock(&openPacksLock);
+	unsigned refs = --entry->refs;
+	pthread_mutex_unlock(&openPacksLock);
+	if (refs == 0) {
+		fluxfs_pack_close(entry->pack);
+		close(entry->fd);
+		free(entry->path);
+		free(entry);
+	}
+}
+
+// The open pack at path, opened again once the file changed or was
+// replaced. Release it with release_pack.
+static struct open_pack *get_pack(const char *packPath) {
+	struct stat st;
+	if (stat(packPath, &st) != 0) {
+		perror(packPath);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&openPacksLock);
+	struct open_pack **link = &openPacks;
+	while (*link && strcmp((*link)->path, packPath) != 0) {
+		link = &(*link)->next;
+	}
+	struct open_pack *entry = *link;
+	if (entry && entry->device == st.st_dev && entry->inode == st.st_ino && entry->size == st.st_size &&
+		entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		entry->refs++;
+		pthread_mutex_unlock(&openPacksLock);
+		return entry;
+	}
+	// Records still open keep reading the old file
+	struct open_pack *stale = NULL;
+	if (entry) {
+		*link = entry->next;
+		stale = entry;
+	}
+	pthread_mutex_unlock(&openPacksLock);
+	if (stale) {
+		release_pack(stale);
+	}
+
+	entry = calloc(1, sizeof(struct open_pack));
+	int fd = entry ? open(packPath, O_RDONLY | O_CLOEXEC) : -1;
+	if (fd < 0 || fstat(fd, &st) != 0 || !(entry->path = strdup(packPath)) || !(entry->pack = map_pack(fd, packPath))) {
+		if (fd < 0 && entry) {
+			perror("Error opening pack");
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+		if (entry) {
+			free(entry->path);
+		}
+		free(entry);
+		return NULL;
+	}
+	entry->fd = fd;
+	entry->device = st.st_dev;
+	entry->inode = st.st_ino;
+	entry->size = st.st_size;
+	entry->mtime = st.st_mtim;
+	entry->refs = 2;
+	// Another thread may have opened the pack meanwhile, the newer entry
+	// takes its place
+	pthread_mutex_lock(&openPacksLock);
+	for (link = &openPacks; *link && strcmp((*link)->path, packPath) != 0; link = &(*link)->next) {
+	}
+	stale = *link;
+	if (stale) {
+		*link = stale->next;
+	}
+	entry->next = openPacks;
+	openPacks = entry;
+	pthread_mutex_unlock(&openPacksLock);
+	if (stale) {
+		release_pack(stale);
+	}
+	return entry;
+}
+
+// A pack record read through stdio, positions start at the record
+struct record_file {
+	struct open_pack *pack;
+	int fd;
+	uint64_t start;
+	uint64_t length;
+	uint64_t position;
+};
+
+static ssize_t record_read(void *cookie, char *buf, size_t size) {
+	struct record_file *record = cookie;
+	if (record->position >= record->length) {
+		return 0;
+	}
+	if (size > record->length - record->position) {
+		size = record->length - record->position;
+	}
+	ssize_t got = pread(record->fd, buf, size, record->start + record->position);
+	if (got > 0) {
+		record->position += got;
+	}
+	return got;
+}
+
+static int record_seek(void *cookie, off64_t *offset, int whence) {
+	struct record_file *record = cookie;
+	int64_t base = whence == SEEK_SET ? 0 : (whence == SEEK_CUR ? (int64_t)record->position : (int64_t)record->length);
+	if (base + *offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	record->position = base + *offset;
+	*offset = record->position;
+	return 0;
+}
+
+static int record_close(void *cookie) {
+	struct record_file *record = cookie;
+	release_pack(record->pack);
+	free(record);
+	return 0;
+}
+
+static FILE *open_record(const char *packPath, const char *name, char **baseDir) {
+	struct open_pack *pack = get_pack(packPath);
+	const struct fluxfs_pack_record *record = pack ? fluxfs_pack_find_name(pack->pack, name) : NULL;
+	struct record_file *cookie = record ? calloc(1, sizeof(struct record_file)) : NULL;
+	if (pack && !record) {
+		fprintf(stderr, "%s does not hold %s\n", packPath, name);
+	}
+	if (!cookie) {
+		if (pack) {
+			release_pack(pack);
+		}
+		return NULL;
+	}
+	cookie->pack = pack;
+	cookie->fd = pack->fd;
+	cookie->start = record->offset;
+	cookie->length = record->length;
+
+	cookie_io_functions_t functions = { record_read, NULL, record_seek, record_close };
+	FILE *file = fopencookie(cookie, "rb", functions);
+	if (!file) {
+		perror("Error opening pack");
+		release_pack(pack);
+		free(cookie);
+		return NULL;
+	}
+
+	// Path strings start from where the .vf was before it was packed, below
+	// the directory the pack really is in
+	char *packDir = strdup(packPath);
+	char *realDir = packDir ? realpath(dirname(packDir), NULL) : NULL;
+	*baseDir = realDir ? resolve_path(realDir, name) : NULL;
+	free(realDir);
+	free(packDir);
+	if (!*baseDir) {
+		fclose(file);
+		return NULL;
+	}
+	dirname(*baseDir);
+	return file;
+}
+
+FILE *open_vf(const char *filePath, char **baseDir) {
+	char *resolved = resolve_path(NULL, filePath);
+	if (!resolved) {
+		perror("Error resolving path");
+		return NULL;
+	}
+
+	const char *name;
+	char *packPath = find_pack(resolved, &name);
+	if (packPath) {
+		FILE *file = open_record(packPath, name, baseDir);
+		free(packPath);
+		free(resolved);
+		return file;
+	}
+
+	FILE *file = fopen(filePath, "rb");
+	if (!file) {
+		perror("Error opening file");
+		free(resolved);
+		return NULL;
+	}
+	// Path strings are relative to the directory the file is really in, so
+	// ".." from a symlinked directory leaves its target as it would after
+	// changing into it
+	*baseDir = realpath(dirname(resolved), NULL);
+	free(resolved);
+	if (!*baseDir) {
+		perror("Error resolving path");
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
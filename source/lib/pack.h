@@ -0,0 +1,11 @@
+#ifndef FLUXFS_PACK_H
+#define FLUXFS_PACK_H
+
+#include <stdio.h>
+
+// Open a .vf for reading, or its record when a directory of the path is a
+// pack. baseDir receives the malloc'd directory its path strings are
+// relative to. Returns NULL after printing the error.
+FILE *open_vf(const char *filePath, char **baseDir);
+
+#endif // !FLUXFS_PACK_H
@@ -0,0 +1,584 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "fluxfs.h"
+#include "source.h"
+#include "blockcache.h"
+#include "iosched.h"
+
+// Sources live in pages that are never moved or freed, so an ID held by a
+// VF can be looked up without the table lock
+#define SOURCE_PAGE_SIZE 256
+#define SOURCE_MAX_PAGES 4096
+// Seconds a replica that failed or was missing is skipped
+#define REPLICA_RETRY_SECONDS 30
+
+// One copy of a source
+struct replica {
+	// Points into the paths of the source
+	const char *path;
+	// Opened by the backend of the source, NULL if it could not be opened
+	_Atomic(struct fluxfs_source_file *) file;
+	// Device holding the replica, set before file
+	dev_t device;
+	// Reads in progress, the queue depth seen by the daemon
+	atomic_uint inflight;
+	// Moving average of the read time in microseconds
+	atomic_uint latency;
+	// Monotonic second before which the replica is not used
+	atomic_llong retryAt;
+};
+
+struct source {
+	// Absolute replica paths with . and .. removed, each NULL-terminated,
+	// NULL while the slot is free
+	char *paths;
+	size_t pathsLength;
+	struct replica *replicas;
+	uint32_t replicaCount;
+	// Backend chosen when the source was first named
+	const struct fluxfs_source_backend *backend;
+	// Device, inode, size and mtime of the first replica opened, hashed.
+	// Names this version of the file in the block cache, 0 if none opened.
+	uint64_t identity;
+	uint64_t size;
+	uint32_t refs;
+	// Next source in the same hash bucket, or in the free list
+	uint32_t next;
+};
+
+static struct source *pages[SOURCE_MAX_PAGES];
+static uint32_t sourceSlots = 0;
+static uint32_t freeSources = FLUXFS_SOURCE_NONE;
+static uint32_t *buckets = NULL;
+static uint32_t bucketCount = 0;
+static uint32_t sourceCount = 0;
+static pthread_mutex_t sourceLock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(const struct fluxfs_source_backend *) currentBackend = &fluxfs_pread_backend;
+
+static struct source *get_source(uint32_t id) {
+	return &pages[id / SOURCE_PAGE_SIZE][id % SOURCE_PAGE_SIZE];
+}
+
+static uint32_t hash_source_paths(const char *paths, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ (uint8_t)paths[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static long long monotonic_seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+// Double the buckets once there are more sources than buckets
+static int grow_buckets(void) {
+	uint32_t count = bucketCount ? bucketCount * 2 : 64;
+	uint32_t *grown = malloc(count * sizeof(uint32_t));
+	if (!grown) {
+		return 1;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		grown[i] = FLUXFS_SOURCE_NONE;
+	}
+	for (uint32_t b = 0; b < bucketCount; b++) {
+		uint32_t id = buckets[b];
+		while (id != FLUXFS_SOURCE_NONE) {
+			struct source *source = get_source(id);
+			uint32_t next = source->next;
+			uint32_t *head = &grown[hash_source_paths(source->paths, source->pathsLength) & (count - 1)];
+			source->next = *head;
+			*head = id;
+			id = next;
+		}
+	}
+	free(buckets);
+	buckets = grown;
+	bucketCount = count;
+	return 0;
+}
+
+// Open a replica with the backend of its source and note its device.
+// Returns NULL if it cannot be opened.
+static struct fluxfs_source_file *open_replica(struct source *source, struct replica *replica, struct stat *st) {
+	struct fluxfs_source_file *file = source->backend->open(replica->path);
+	if (!file) {
+		return NULL;
+	}
+	if (file->fd >= 0 && fstat(file->fd, st) == 0) {
+		replica->device = st->st_dev;
+	} else {
+		st->st_ino = 0;
+	}
+	return file;
+}
+
+// Open the replicas that are not open yet, the first one opened gives the
+// identity. Called with the table locked.
+static void open_source(struct source *source) {
+	for (uint32_t i = 0; i < source->replicaCount; i++) {
+		struct replica *replica = &source->replicas[i];
+		if (atomic_load(&replica->file)) {
+			continue;
+		}
+		struct stat st;
+		struct fluxfs_source_file *file = open_replica(source, replica, &st);
+		if (file && st.st_ino && !source->identity) {
+			uint64_t values[] = { st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+			uint64_t identity = 1469598103934665603ull;
+			for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); v++) {
+				identity = (identity ^ values[v]) * 1099511628211ull;
+				identity ^= identity >> 29;
+			}
+			source->identity = identity ? identity : 1;
+			source->size = st.st_size;
+		}
+		atomic_store(&replica->retryAt, file ? 0 : monotonic_seconds() + REPLICA_RETRY_SECONDS);
+		atomic_store(&replica->file, file);
+	}
+}
+
+// Take a free slot, adding a page when none is left
+static uint32_t new_source(void) {
+	if (freeSources != FLUXFS_SOURCE_NONE) {
+		uint32_t id = freeSources;
+		freeSources = get_source(id)->next;
+		return id;
+	}
+	if (sourceSlots % SOURCE_PAGE_SIZE == 0) {
+		uint32_t page = sourceSlots / SOURCE_PAGE_SIZE;
+		if (page == SOURCE_MAX_PAGES) {
+			return FLUXFS_SOURCE_NONE;
+		}
+		pages[page] = calloc(SOURCE_PAGE_SIZE, sizeof(struct source));
+		if (!pages[page]) {
+			return FLUXFS_SOURCE_NONE;
+		}
+	}
+	return sourceSlots++;
+}
+
+// Empty, . and .. components are removed without touching the file system,
+// so symbolic links are kept as named
+char *resolve_path(const char *baseDir, const char *path) {
+	char cwd[PATH_MAX];
+	if (path[0] != '/' && !baseDir) {
+		if (!getcwd(cwd, sizeof(cwd))) {
+			return NULL;
+		}
+		baseDir = cwd;
+	}
+
+	size_t baseLen = path[0] == '/' ? 0 : strlen(baseDir);
+	char *joined = malloc(baseLen + strlen(path) + 3);
+	if (!joined) {
+		return NULL;
+	}
+	if (baseLen) {
+		memcpy(joined, baseDir, baseLen);
+	}
+	joined[baseLen] = '/';
+	strcpy(joined + baseLen + 1, path);
+
+	// Rewrite in place, out never passes in
+	char *out = joined;
+	const char *in = joined;
+	while (*in) {
+		while (*in == '/') {
+			in++;
+		}
+		size_t len = strcspn(in, "/");
+		if (len == 0 || (len == 1 && in[0] == '.')) {
+			in += len;
+			continue;
+		}
+		if (len == 2 && in[0] == '.' && in[1] == '.') {
+			while (out > joined && *--out != '/') {
+			}
+			in += len;
+			continue;
+		}
+		*out++ = '/';
+		memmove(out, in, len);
+		out += len;
+		in += len;
+	}
+	if (out == joined) {
+		*out++ = '/';
+	}
+	*out = '\0';
+	return joined;
+}
+
+char *relative_path(const char *fromDir, const char *to) {
+	size_t common = 0;
+	size_t i = 0;
+	while (fromDir[i] && fromDir[i] == to[i]) {
+		i++;
+		if (to[i - 1] == '/') {
+			common = i;
+		}
+	}
+	if (fromDir[i] == 0 && (to[i] == '/' || to[i] == 0)) {
+		common = i + (to[i] == '/');
+	}
+
+	// Each directory of fromDir below the common prefix becomes "..", when
+	// fromDir is all common its terminator is at i
+	const char *rest = fromDir + (common > i ? i : common);
+	size_t ups = 0;
+	for (const char *p = rest; *p; p++) {
+		if (*p == '/' && p[1]) {
+			ups++;
+		}
+	}
+	if (*rest) {
+		ups++;
+	}
+
+	char *rel = malloc(ups * 3 + strlen(to + common) + 1);
+	if (!rel) {
+		return NULL;
+	}
+	rel[0] = 0;
+	for (size_t u = 0; u < ups; u++) {
+		strcat(rel, "../");
+	}
+	strcat(rel, to + common);
+	return rel;
+}
+
+// Get the ID of a source file, resolving a relative path against baseDir
+// or the working directory. Every VF referencing the same file shares one
+// entry and descriptor. Release the ID with fluxfs_source_release.
+uint32_t fluxfs_source_acquire(const char *baseDir, const char *path) {
+	return fluxfs_source_acquire_replicas(baseDir, &path, 1);
+}
+
+// Get the ID of a source stored as several identical replicas, such as
+// copies on different disks. Reads are spread over the replicas and move
+// to another one when a replica is missing or fails.
+uint32_t fluxfs_source_acquire_replicas(const char *baseDir, const char *const *paths, uint32_t count) {
+	if (count == 0 || count > FLUXFS_MAX_REPLICAS) {
+		return FLUXFS_SOURCE_NONE;
+	}
+
+	// The resolved paths, each NULL-terminated, are the key of the source
+	char *resolved[FLUXFS_MAX_REPLICAS];
+	size_t length = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		resolved[i] = resolve_path(baseDir, paths[i]);
+		if (!resolved[i]) {
+			while (i--) {
+				free(resolved[i]);
+			}
+			return FLUXFS_SOURCE_NONE;
+		}
+		length += strlen(resolved[i]) + 1;
+	}
+	char *joined = malloc(length);
+	struct replica *replicas = calloc(count, sizeof(struct replica));
+	size_t used = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		size_t len = strlen(resolved[i]) + 1;
+		if (joined && replicas) {
+			memcpy(joined + used, resolved[i], len);
+			replicas[i].path = joined + used;
+			atomic_init(&replicas[i].file, NULL);
+		}
+		used += len;
+		free(resolved[i]);
+	}
+	if (!joined || !replicas) {
+		free(joined);
+		free(replicas);
+		return FLUXFS_SOURCE_NONE;
+	}
+
+	pthread_mutex_lock(&sourceLock);
+	uint32_t hash = hash_source_paths(joined, length);
+	uint32_t id = bucketCount ? buckets[hash & (bucketCount - 1)] : FLUXFS_SOURCE_NONE;
+	while (id != FLUXFS_SOURCE_NONE && (get_source(id)->pathsLength != length ||
+		memcmp(get_source(id)->paths, joined, length) != 0)) {
+		id = get_source(id)->next;
+	}
+
+	if (id != FLUXFS_SOURCE_NONE) {
+		struct source *source = get_source(id);
+		source->refs++;
+		// Replicas created since the source was first named
+		open_source(source);
+		pthread_mutex_unlock(&sourceLock);
+		free(joined);
+		free(replicas);
+		return id;
+	}
+
+	if ((sourceCount >= bucketCount && grow_buckets() != 0) || (id = new_source()) == FLUXFS_SOURCE_NONE) {
+		pthread_mutex_unlock(&sourceLock);
+		free(joined);
+		free(replicas);
+		return FLUXFS_SOURCE_NONE;
+	}
+
+	struct source *source = get_source(id);
+	source->paths = joined;
+	source->pathsLength = length;
+	source->replicas = replicas;
+	source->replicaCount = count;
+	source->backend = atomic_load(&currentBackend);
+	source->identity = 0;
+	source->size = 0;
+	open_source(source);
+	source->refs = 1;
+	uint32_t *head = &buckets[hash & (bucketCount - 1)];
+	source->next = *head;
+	*head = id;
+	sourceCount++;
+	pthread_mutex_unlock(&sourceLock);
+
+	return id;
+}
+
+// Take another reference to an ID already held
+void fluxfs_source_retain(uint32_t id) {
+	pthread_mutex_lock(&sourceLock);
+	get_source(id)->refs++;
+	pthread_mutex_unlock(&sourceLock);
+}
+
+// Drop a reference, the files are closed and the ID reused once none are left
+void fluxfs_source_release(uint32_t id) {
+	pthread_mutex_lock(&sourceLock);
+	struct source *source = get_source(id);
+	if (--source->refs == 0) {
+		uint32_t *link = &buckets[hash_source_paths(source->paths, source->pathsLength) & (bucketCount - 1)];
+		while (*link != id) {
+			link = &get_source(*link)->next;
+		}
+		*link = source->next;
+
+		for (uint32_t i = 0; i < source->replicaCount; i++) {
+			struct fluxfs_source_file *file = atomic_exchange(&source->replicas[i].file, NULL);
+			if (file) {
+				source->backend->close(file);
+			}
+		}
+		free(source->replicas);
+		source->replicas = NULL;
+		free(source->paths);
+		source->paths = NULL;
+		source->next = freeSources;
+		freeSources = id;
+		sourceCount--;
+	}
+	pthread_mutex_unlock(&sourceLock);
+}
+
+// Path of the first replica
+const char *fluxfs_source_path(uint32_t id) {
+	return get_source(id)->paths;
+}
+
+uint32_t fluxfs_source_replica_count(uint32_t id) {
+	return get_source(id)->replicaCount;
+}
+
+const char *fluxfs_source_replica_path(uint32_t id, uint32_t replica) {
+	return get_source(id)->replicas[replica].path;
+}
+
+// Pick the replica expected to answer first, by reads in flight times the
+// average read time. Replicas in tried, failed recently or missing are
+// skipped. A missing replica is opened again once its retry time passed.
+static int pick_replica(struct source *source, uint32_t tried) {
+	long long now = monotonic_seconds();
+	int best = -1;
+	uint64_t bestCost = UINT64_MAX;
+	for (uint32_t i = 0; i < source->replicaCount; i++) {
+		struct replica *replica = &source->replicas[i];
+		if ((tried & (1u << i)) || atomic_load(&replica->retryAt) > now) {
+			continue;
+		}
+		if (!atomic_load(&replica->file)) {
+			struct stat st;
+			struct fluxfs_source_file *file = open_replica(source, replica, &st);
+			struct fluxfs_source_file *expected = NULL;
+			if (!file) {
+				atomic_store(&replica->retryAt, now + REPLICA_RETRY_SECONDS);
+				continue;
+			}
+			if (!atomic_compare_exchange_strong(&replica->file, &expected, file)) {
+				source->backend->close(file);
+			}
+		}
+		uint64_t cost = (uint64_t)(atomic_load(&replica->inflight) + 1) * (atomic_load(&replica->latency) + 1);
+		if (cost < bestCost) {
+			bestCost = cost;
+			best = i;
+		}
+	}
+	if (best < 0) {
+		// Every replica failed recently, try any that is open
+		for (uint32_t i = 0; i < source->replicaCount && best < 0; i++) {
+			if (!(tried & (1u << i)) && atomic_load(&source->replicas[i].file)) {
+				best = i;
+			}
+		}
+	}
+	return best;
+}
+
+// The opened file of the best replica, NULL if none could be opened
+static struct fluxfs_source_file *best_file(struct source *source) {
+	if (source->replicaCount == 1) {
+		return atomic_load(&source->replicas[0].file);
+	}
+	int replica = pick_replica(source, 0);
+	return replica < 0 ? NULL : atomic_load(&source->replicas[replica].file);
+}
+
+// Descriptor of the best replica, -1 if none could be opened. Reads should
+// use pread or fluxfs_source_read, the descriptor is shared.
+int fluxfs_source_fd(uint32_t id) {
+	struct fluxfs_source_file *file = best_file(get_source(id));
+	return file ? file->fd : -1;
+}
+
+// Descriptor to copy a source from directly, such as with sendfile. -1 when
+// its reads have to go through fluxfs_source_read: to use the block cache,
+// to queue on the I/O scheduler or to move between replicas.
+int fluxfs_source_direct_fd(uint32_t id) {
+	struct source *source = get_source(id);
+	if (source->replicaCount != 1 || (source->identity && block_cache_enabled()) || io_scheduler_enabled()) {
+		return -1;
+	}
+	struct fluxfs_source_file *file = atomic_load(&source->replicas[0].file);
+	return file ? file->fd : -1;
+}
+
+// Pass a POSIX_FADV_ hint for a range to the backend of the best replica
+void fluxfs_source_advise(uint32_t id, uint64_t offset, uint64_t length, int advice) {
+	struct source *source = get_source(id);
+	struct fluxfs_source_file *file = best_file(source);
+	if (file) {
+		source->backend->advise(file, offset, length, advice);
+	}
+}
+
+// Choose the backend of the sources named from now on. Sources already open
+// keep theirs until they are released.
+void fluxfs_source_set_backend(const struct fluxfs_source_backend *backend) {
+	atomic_store(&currentBackend, backend ? backend : &fluxfs_pread_backend);
+}
+
+int read_full(int fd, uint8_t *buf, size_t size, uint64_t offset) {
+	while (size) {
+		ssize_t got = pread(fd, buf, size, offset);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return 1;
+		}
+		buf += got;
+		size -= got;
+		offset += got;
+	}
+	return 0;
+}
+
+// Read exactly size bytes through a backend, returns 1 and sets *error on
+// an error, 1 alone at end of file
+static int read_file(const struct fluxfs_source_backend *backend, struct fluxfs_source_file *file,
+	uint8_t *buf, size_t size, uint64_t offset, int *error) {
+	while (size) {
+		ssize_t got = backend->read_at(file, buf, size, offset);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			*error = got < 0;
+			return 1;
+		}
+		buf += got;
+		size -= got;
+		offset += got;
+	}
+	return 0;
+}
+
+// Read from the replicas, timing each read. A replica that returns an error
+// is skipped for a while and the read moves to the next one. Reads queue
+// on the device of their replica while the I/O scheduler is on. Returns 1
+// if no replica could supply the bytes.
+int read_source(uint32_t id, uint8_t *buf, size_t size, uint64_t offset) {
+	struct source *source = get_source(id);
+	if (source->replicaCount == 1) {
+		struct fluxfs_source_file *file = atomic_load(&source->replicas[0].file);
+		int error = 0;
+		if (!file) {
+			return 1;
+		}
+		struct io_device *device = io_begin(source->replicas[0].device, size);
+		int result = read_file(source->backend, file, buf, size, offset, &error);
+		io_end(device);
+		return result;
+	}
+
+	uint32_t tried = 0;
+	for (;;) {
+		int index = pick_replica(source, tried);
+		if (index < 0) {
+			return 1;
+		}
+		struct replica *replica = &source->replicas[index];
+		struct timespec start;
+		struct timespec end;
+		// The time queued is not the replica's latency
+		struct io_device *device = io_begin(replica->device, size);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		atomic_fetch_add(&replica->inflight, 1);
+		int error = 0;
+		int result = read_file(source->backend, atomic_load(&replica->file), buf, size, offset, &error);
+		atomic_fetch_sub(&replica->inflight, 1);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		io_end(device);
+
+		if (result == 0) {
+			uint64_t micros = (end.tv_sec - start.tv_sec) * 1000000ull + (end.tv_nsec - start.tv_nsec) / 1000;
+			unsigned latency = atomic_load(&replica->latency);
+			atomic_store(&replica->latency, latency ? (unsigned)((latency * 7ull + micros) / 8) : (unsigned)micros + 1);
+			return 0;
+		}
+		if (!error) {
+			// Past the end, every replica holds the same bytes
+			return 1;
+		}
+		atomic_store(&replica->retryAt, monotonic_seconds() + REPLICA_RETRY_SECONDS);
+		tried |= 1u << index;
+	}
+}
+
+// Read exactly size bytes at offset, from the block cache when one is open.
+// Returns 1 on an error or end of file.
+int fluxfs_source_read(uint32_t id, void *buf, size_t size, uint64_t offset) {
+	struct source *source = get_source(id);
+	if (source->identity && block_cache_enabled()) {
+		return block_cache_read(source->identity, source->size, id, buf, size, offset);
+	}
+	return read_source(id, buf, size, offset);
+}
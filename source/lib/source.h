@@ -0,0 +1,26 @@
+#ifndef FLUXFS_SOURCE_H
+#define FLUXFS_SOURCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Absolute form of path, relative paths are joined to baseDir or the working
+// directory when it is NULL. Returns a malloc'd string or NULL.
+char *resolve_path(const char *baseDir, const char *path);
+
+// Path of to relative to the directory fromDir, both resolved
+char *relative_path(const char *fromDir, const char *to);
+
+struct fluxfs_source_backend;
+
+// The default backend, reading with pread
+extern const struct fluxfs_source_backend fluxfs_pread_backend;
+
+// pread exactly size bytes, returns 1 on an error or end of file
+int read_full(int fd, uint8_t *buf, size_t size, uint64_t offset);
+
+// Read exactly size bytes of a source from its replicas, bypassing the block
+// cache. Returns 1 if no replica could supply them.
+int read_source(uint32_t id, uint8_t *buf, size_t size, uint64_t offset);
+
+#endif // !FLUXFS_SOURCE_H
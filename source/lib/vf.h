@@ -0,0 +1,16 @@
+#ifndef FLUXFS_VF_H
+#define FLUXFS_VF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fluxfs.h"
+
+// Copy size bytes of an entry starting entryOffset bytes into it. Safe to
+// call from several threads on a VF whose entries are all loaded.
+int read_entry_bytes(struct fluxfs_vf *vf, struct vf_entry *entry, uint8_t *buf, uint64_t entryOffset, size_t size);
+
+// Index of the first patch ending after entryOffset, patchCount if none does
+uint32_t find_patch(const struct vf_patched *patched, uint64_t entryOffset);
+
+#endif // !FLUXFS_VF_H
@@ -0,0 +1,744 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "../lib/fluxfs.h"
+
+// Default bytes per indexed source block, matches of at least twice this are always found
+#define MKVF_DEFAULT_BLOCK 1024
+// Target bytes scanned per work item
+#define MKVF_CHUNK_SIZE (64 * 1024 * 1024)
+// Shorter matches cost more as entries than as embedded bytes
+#define MKVF_MIN_REFERENCE 32
+// Longest run of changed bytes kept as a patch inside a reference
+#define MKVF_MAX_PATCH 64
+// Index values pack the source number above a 48-bit offset
+#define MKVF_OFFSET_BITS 48
+#define MKVF_MAX_SOURCES (1 << 15)
+// Most -m options
+#define MKVF_MAX_MIRRORS 256
+
+struct mkvf_file {
+	const char *path;
+	const uint8_t *data;
+	uint64_t size;
+};
+
+struct mkvf_match {
+	uint64_t target;
+	uint64_t source;
+	uint64_t length;
+	uint32_t file;
+};
+
+struct mkvf_matches {
+	struct mkvf_match *items;
+	size_t count;
+	size_t capacity;
+};
+
+// Open addressing table from block hash to source position, with a bit
+// filter in front of it so most misses never touch the table
+struct mkvf_index {
+	uint64_t *keys;
+	uint64_t *values;
+	uint64_t mask;
+	uint64_t *filter;
+	uint64_t filterMask;
+};
+
+struct mkvf_state {
+	struct mkvf_file target;
+	struct mkvf_file *sources;
+	uint32_t sourceCount;
+	size_t block;
+	struct mkvf_index index;
+	struct mkvf_matches *chunkMatches;
+	uint64_t chunkCount;
+	uint64_t nextItem;
+	uint64_t itemCount;
+};
+
+static uint64_t buz_table[256];
+static size_t (*match_forward)(const uint8_t *a, const uint8_t *b, size_t max);
+static size_t (*match_backward)(const uint8_t *a, const uint8_t *b, size_t max);
+
+static uint64_t rotl(uint64_t value, unsigned shift) {
+	shift &= 63;
+	return shift ? (value << shift) | (value >> (64 - shift)) : value;
+}
+
+static void buz_init(void) {
+	// splitmix64 from a fixed seed so every run builds the same table
+	uint64_t seed = 0x9E3779B97F4A7C15ull;
+	for (int i = 0; i < 256; i++) {
+		uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		buz_table[i] = z ^ (z >> 31);
+	}
+}
+
+static uint64_t buz_hash(const uint8_t *p, size_t len) {
+	uint64_t h = 0;
+	for (size_t i = 0; i < len; i++) {
+		h = rotl(h, 1) ^ buz_table[p[i]];
+	}
+	return h;
+}
+
+// Slide the window one byte, dropping out and taking in
+static uint64_t buz_roll(uint64_t h, uint8_t out, uint8_t in, size_t len) {
+	return rotl(h, 1) ^ rotl(buz_table[out], len) ^ buz_table[in];
+}
+
+// Length of the common prefix of a and b, up to max bytes
+static size_t match_forward_scalar(const uint8_t *a, const uint8_t *b, size_t max) {
+	size_t i = 0;
+	while (i + 8 <= max) {
+		uint64_t va, vb;
+		memcpy(&va, a + i, 8);
+		memcpy(&vb, b + i, 8);
+		if (va != vb) {
+			return i + (__builtin_ctzll(va ^ vb) >> 3);
+		}
+		i += 8;
+	}
+	while (i < max && a[i] == b[i]) {
+		i++;
+	}
+	return i;
+}
+
+// Length of the common suffix of the bytes before a and b, up to max bytes
+static size_t match_backward_scalar(const uint8_t *a, const uint8_t *b, size_t max) {
+	size_t i = 0;
+	while (i + 8 <= max) {
+		uint64_t va, vb;
+		memcpy(&va, a - i - 8, 8);
+		memcpy(&vb, b - i - 8, 8);
+		if (va != vb) {
+			return i + (__builtin_clzll(va ^ vb) >> 3);
+		}
+		i += 8;
+	}
+	while (i < max && a[-(ptrdiff_t)i - 1] == b[-(ptrdiff_t)i - 1]) {
+		i++;
+	}
+	return i;
+}
+
+#if defined(__x86_64__)
+static size_t match_forward_sse2(const uint8_t *a, const uint8_t *b, size_t max) {
+	size_t i = 0;
+	while (i + 16 <= max) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		if (mask != 0xFFFF) {
+			return i + __builtin_ctz(~mask);
+		}
+		i += 16;
+	}
+	return i + match_forward_scalar(a + i, b + i, max - i);
+}
+
+static size_t match_backward_sse2(const uint8_t *a, const uint8_t *b, size_t max) {
+	size_t i = 0;
+	while (i + 16 <= max) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a - i - 16));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b - i - 16));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		if (mask != 0xFFFF) {
+			return i + __builtin_clz(~mask << 16);
+		}
+		i += 16;
+	}
+	return i + match_backward_scalar(a - i, b - i, max - i);
+}
+
+__attribute__((target("avx2")))
+static size_t match_forward_avx2(const uint8_t *a, const uint8_t *b, size_t max) {
+	size_t i = 0;
+	while (i + 32 <= max) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (mask != 0xFFFFFFFF) {
+			return i + __builtin_ctz(~mask);
+		}
+		i += 32;
+	}
+	return i + match_forward_sse2(a + i, b + i, max - i);
+}
+
+__attribute__((target("avx2")))
+static size_t match_backward_avx2(const uint8_t *a, const uint8_t *b, size_t max) {
+	size_t i = 0;
+	while (i + 32 <= max) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a - i - 32));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b - i - 32));
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (mask != 0xFFFFFFFF) {
+			return i + __builtin_clz(~mask);
+		}
+		i += 32;
+	}
+	return i + match_backward_sse2(a - i, b - i, max - i);
+}
+#endif
+
+static void match_init(void) {
+	match_forward = match_forward_scalar;
+	match_backward = match_backward_scalar;
+#if defined(__x86_64__)
+	match_forward = match_forward_sse2;
+	match_backward = match_backward_sse2;
+	if (__builtin_cpu_supports("avx2")) {
+		match_forward = match_forward_avx2;
+		match_backward = match_backward_avx2;
+	}
+#endif
+}
+
+static int map_file(struct mkvf_file *file, const char *path) {
+	file->path = path;
+	file->data = NULL;
+	file->size = 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		perror(path);
+		close(fd);
+		return 1;
+	}
+	file->size = st.st_size;
+	if (file->size) {
+		void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			perror(path);
+			close(fd);
+			return 1;
+		}
+		file->data = data;
+	}
+	close(fd);
+	return 0;
+}
+
+static int index_create(struct mkvf_index *index, uint64_t blocks) {
+	uint64_t capacity = 1024;
+	while (capacity < blocks * 2) {
+		capacity <<= 1;
+	}
+	uint64_t filterBits = 1 << 20;
+	while (filterBits < blocks * 8) {
+		filterBits <<= 1;
+	}
+
+	index->mask = capacity - 1;
+	index->filterMask = filterBits - 1;
+	index->keys = calloc(capacity, sizeof(uint64_t));
+	index->values = malloc(capacity * sizeof(uint64_t));
+	index->filter = calloc(filterBits / 64, sizeof(uint64_t));
+	if (!index->keys || !index->values || !index->filter) {
+		return 1;
+	}
+	// Above any position, so the first insert of a key lowers it
+	memset(index->values, 0xff, capacity * sizeof(uint64_t));
+	return 0;
+}
+
+// Zero marks an empty slot, so hashes are never stored as zero
+static uint64_t index_key(uint64_t hash) {
+	return hash ? hash : 1;
+}
+
+// Safe to call from several threads. Of the blocks with a hash the lowest
+// value wins, the first source and offset, whichever thread inserts first,
+// so the same inputs always give the same VF.
+static void index_insert(struct mkvf_index *index, uint64_t hash, uint64_t value) {
+	uint64_t key = index_key(hash);
+	uint64_t bit = (key >> 7) & index->filterMask;
+	__atomic_fetch_or(&index->filter[bit / 64], 1ull << (bit % 64), __ATOMIC_RELAXED);
+
+	uint64_t slot = (key * 0x9E3779B97F4A7C15ull) >> 20 & index->mask;
+	for (;;) {
+		uint64_t expected = 0;
+		if (__atomic_compare_exchange_n(&index->keys[slot], &expected, key, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+			expected == key) {
+			uint64_t seen = __atomic_load_n(&index->values[slot], __ATOMIC_RELAXED);
+			while (value < seen && !__atomic_compare_exchange_n(&index->values[slot], &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			}
+			return;
+		}
+		slot = (slot + 1) & index->mask;
+	}
+}
+
+static int index_lookup(struct mkvf_index *index, uint64_t hash, uint64_t *value) {
+	uint64_t key = index_key(hash);
+	uint64_t bit = (key >> 7) & index->filterMask;
+	if (!(index->filter[bit / 64] & (1ull << (bit % 64)))) {
+		return 0;
+	}
+
+	uint64_t slot = (key * 0x9E3779B97F4A7C15ull) >> 20 & index->mask;
+	while (index->keys[slot]) {
+		if (index->keys[slot] == key) {
+			*value = index->values[slot];
+			return 1;
+		}
+		slot = (slot + 1) & index->mask;
+	}
+	return 0;
+}
+
+// Work items are numbered across all sources, one item per MKVF_CHUNK_SIZE of a source
+static int next_item(struct mkvf_state *state, uint64_t *item) {
+	*item = __atomic_fetch_add(&state->nextItem, 1, __ATOMIC_RELAXED);
+	return *item < state->itemCount;
+}
+
+static void *index_worker(void *arg) {
+	struct mkvf_state *state = arg;
+	uint64_t item;
+	while (next_item(state, &item)) {
+		// Find the source and range of this item
+		uint32_t file = 0;
+		uint64_t start = item;
+		while (file < state->sourceCount) {
+			uint64_t items = (state->sources[file].size + MKVF_CHUNK_SIZE - 1) / MKVF_CHUNK_SIZE;
+			if (start < items) {
+				break;
+			}
+			start -= items;
+			file++;
+		}
+		struct mkvf_file *source = &state->sources[file];
+		uint64_t end = (start + 1) * MKVF_CHUNK_SIZE;
+
+		// Blocks are aligned to the start of the source, not to the item
+		uint64_t offset = (start * MKVF_CHUNK_SIZE + state->block - 1) / state->block * state->block;
+		for (; offset < end && offset + state->block <= source->size; offset += state->block) {
+			uint64_t hash = buz_hash(source->data + offset, state->block);
+			index_insert(&state->index, hash, ((uint64_t)file << MKVF_OFFSET_BITS) | offset);
+		}
+	}
+	return NULL;
+}
+
+static int add_match(struct mkvf_matches *matches, struct mkvf_match *match) {
+	if (matches->count == matches->capacity) {
+		size_t capacity = matches->capacity ? matches->capacity * 2 : 256;
+		struct mkvf_match *items = realloc(matches->items, capacity * sizeof(struct mkvf_match));
+		if (!items) {
+			return 1;
+		}
+		matches->items = items;
+		matches->capacity = capacity;
+	}
+	matches->items[matches->count++] = *match;
+	return 0;
+}
+
+// Roll a window across one chunk of the target and extend every verified hit
+static void scan_chunk(struct mkvf_state *state, uint64_t chunk) {
+	const uint8_t *target = state->target.data;
+	uint64_t targetSize = state->target.size;
+	size_t block = state->block;
+	uint64_t pos = chunk * MKVF_CHUNK_SIZE;
+	uint64_t end = pos + MKVF_CHUNK_SIZE;
+	uint64_t floor = pos;
+	struct mkvf_matches *matches = &state->chunkMatches[chunk];
+
+	if (end > targetSize) {
+		end = targetSize;
+	}
+	if (pos + block > targetSize) {
+		return;
+	}
+
+	uint64_t hash = buz_hash(target + pos, block);
+	while (pos < end) {
+		uint64_t value;
+		if (index_lookup(&state->index, hash, &value)) {
+			uint32_t file = value >> MKVF_OFFSET_BITS;
+			uint64_t offset = value & ((1ull << MKVF_OFFSET_BITS) - 1);
+			struct mkvf_file *source = &state->sources[file];
+			uint64_t max = targetSize - pos;
+			if (source->size - offset < max) {
+				max = source->size - offset;
+			}
+
+			size_t length = match_forward(target + pos, source->data + offset, max);
+			if (length >= block) {
+				uint64_t maxBack = pos - floor < offset ? pos - floor : offset;
+				size_t back = match_backward(target + pos, source->data + offset, maxBack);
+				struct mkvf_match match = {
+					.target = pos - back,
+					.source = offset - back,
+					.length = back + length,
+					.file = file
+				};
+				if (add_match(matches, &match) != 0) {
+					perror("Memory allocation failed");
+					return;
+				}
+
+				pos += length;
+				floor = pos;
+				if (pos + block > targetSize) {
+					return;
+				}
+				hash = buz_hash(target + pos, block);
+				continue;
+			}
+		}
+
+		if (pos + block >= targetSize) {
+			return;
+		}
+		hash = buz_roll(hash, target[pos], target[pos + block], block);
+		pos++;
+	}
+}
+
+static void *scan_worker(void *arg) {
+	struct mkvf_state *state = arg;
+	uint64_t chunk;
+	while (next_item(state, &chunk)) {
+		scan_chunk(state, chunk);
+	}
+	return NULL;
+}
+
+static void run_workers(struct mkvf_state *state, int threads, void *(*worker)(void *), uint64_t items) {
+	state->nextItem = 0;
+	state->itemCount = items;
+
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	if (!workers) {
+		worker(state);
+		return;
+	}
+	int started = 0;
+	while (started < threads && pthread_create(&workers[started], NULL, worker, state) == 0) {
+		started++;
+	}
+	if (started == 0) {
+		worker(state);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+}
+
+static int add_embedded(struct fluxfs_vf *vf, const uint8_t *data, uint64_t length, int compress) {
+	if (length == 0) {
+		return 0;
+	}
+	struct vf_entry *entry;
+	if (compress) {
+		entry = fluxfs_vf_add_compressed_data(vf, length, (const char *)data);
+	} else {
+		entry = fluxfs_vf_add_data(vf, length, (const char *)data);
+	}
+	return entry ? 0 : 1;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [options] -o <output.vf> <target> <source>...\n", name);
+	printf("  Builds a virtual file of target that references every range it shares with the sources\n");
+	printf("  -o <file>      Virtual file to write\n");
+	printf("  -p <vpath>     Virtual path of the file (default: target file name)\n");
+	printf("  -b <bytes>     Source block size, matches of twice this are always found (default %d)\n", MKVF_DEFAULT_BLOCK);
+	printf("  -j <threads>   Worker threads (default: online CPUs)\n");
+	printf("  -c             Compress embedded data\n");
+	printf("  -s             Record a checksum for every reference\n");
+	printf("  -d             Store embedded data in the blob pack of the output directory\n");
+	printf("  -m <file>      Mirror of the source with the same file name, reads are spread over both\n");
+}
+
+int main(int argc, char *argv[]) {
+	const char *output = NULL;
+	const char *vpath = NULL;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int compress = 0;
+	int checksums = 0;
+	int packBlobs = 0;
+	const char *mirrors[MKVF_MAX_MIRRORS];
+	int mirrorCount = 0;
+
+	struct mkvf_state state;
+	memset(&state, 0, sizeof(state));
+	state.block = MKVF_DEFAULT_BLOCK;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "o:p:b:j:csdm:h")) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'p':
+			vpath = optarg;
+			break;
+		case 'b':
+			state.block = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'c':
+			compress = 1;
+			break;
+		case 's':
+			checksums = 1;
+			break;
+		case 'd':
+			packBlobs = 1;
+			break;
+		case 'm':
+			if (mirrorCount == MKVF_MAX_MIRRORS) {
+				fprintf(stderr, "Too many mirrors\n");
+				return EXIT_FAILURE;
+			}
+			mirrors[mirrorCount++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (!output || argc - optind < 2 || state.block < 16 || threads < 1 || argc - optind - 1 > MKVF_MAX_SOURCES) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	buz_init();
+	match_init();
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (map_file(&state.target, argv[optind]) != 0) {
+		return EXIT_FAILURE;
+	}
+	state.sourceCount = argc - optind - 1;
+	state.sources = calloc(state.sourceCount, sizeof(struct mkvf_file));
+	if (!state.sources) {
+		perror("Memory allocation failed");
+		return EXIT_FAILURE;
+	}
+
+	uint64_t blocks = 0;
+	uint64_t indexItems = 0;
+	for (uint32_t i = 0; i < state.sourceCount; i++) {
+		if (map_file(&state.sources[i], argv[optind + 1 + i]) != 0) {
+			return EXIT_FAILURE;
+		}
+		if (state.sources[i].size >> MKVF_OFFSET_BITS) {
+			fprintf(stderr, "%s is too large\n", state.sources[i].path);
+			return EXIT_FAILURE;
+		}
+		blocks += state.sources[i].size / state.block;
+		indexItems += (state.sources[i].size + MKVF_CHUNK_SIZE - 1) / MKVF_CHUNK_SIZE;
+	}
+
+	if (index_create(&state.index, blocks) != 0) {
+		perror("Memory allocation failed");
+		return EXIT_FAILURE;
+	}
+	run_workers(&state, threads, index_worker, indexItems);
+
+	state.chunkCount = (state.target.size + MKVF_CHUNK_SIZE - 1) / MKVF_CHUNK_SIZE;
+	state.chunkMatches = calloc(state.chunkCount ? state.chunkCount : 1, sizeof(struct mkvf_matches));
+	if (!state.chunkMatches) {
+		perror("Memory allocation failed");
+		return EXIT_FAILURE;
+	}
+	run_workers(&state, threads, scan_worker, state.chunkCount);
+
+	if (!vpath) {
+		char targetCopy[PATH_MAX];
+		snprintf(targetCopy, sizeof(targetCopy), "%s", state.target.path);
+		vpath = strdup(basename(targetCopy));
+	}
+	struct fluxfs_vf *vf = fluxfs_create_vf((char *)vpath);
+	if (!vf) {
+		fprintf(stderr, "Failed to create virtual file\n");
+		return EXIT_FAILURE;
+	}
+
+	uint32_t *pathIndex = malloc(state.sourceCount * sizeof(uint32_t));
+	if (!pathIndex) {
+		perror("Memory allocation failed");
+		return EXIT_FAILURE;
+	}
+	int mirrorUsed[MKVF_MAX_MIRRORS] = { 0 };
+	for (uint32_t i = 0; i < state.sourceCount; i++) {
+		// Saving stores the paths relative to the output
+		char *replicas[FLUXFS_MAX_REPLICAS];
+		uint32_t replicaCount = 0;
+		replicas[replicaCount++] = realpath(state.sources[i].path, NULL);
+		if (!replicas[0]) {
+			perror(state.sources[i].path);
+			return EXIT_FAILURE;
+		}
+		for (int m = 0; m < mirrorCount; m++) {
+			char sourceCopy[PATH_MAX];
+			char mirrorCopy[PATH_MAX];
+			snprintf(sourceCopy, sizeof(sourceCopy), "%s", state.sources[i].path);
+			snprintf(mirrorCopy, sizeof(mirrorCopy), "%s", mirrors[m]);
+			if (mirrorUsed[m] || strcmp(basename(sourceCopy), basename(mirrorCopy)) != 0) {
+				continue;
+			}
+			if (replicaCount == FLUXFS_MAX_REPLICAS) {
+				fprintf(stderr, "Too many mirrors of %s\n", state.sources[i].path);
+				return EXIT_FAILURE;
+			}
+			replicas[replicaCount] = realpath(mirrors[m], NULL);
+			if (!replicas[replicaCount]) {
+				perror(mirrors[m]);
+				return EXIT_FAILURE;
+			}
+			replicaCount++;
+			mirrorUsed[m] = 1;
+		}
+		pathIndex[i] = fluxfs_vf_add_mirrored_path(vf, (const char *const *)replicas, replicaCount);
+		for (uint32_t r = 0; r < replicaCount; r++) {
+			free(replicas[r]);
+		}
+		if (pathIndex[i] == UINT32_MAX) {
+			perror("Memory allocation failed");
+			return EXIT_FAILURE;
+		}
+	}
+	for (int m = 0; m < mirrorCount; m++) {
+		if (!mirrorUsed[m]) {
+			fprintf(stderr, "%s does not mirror any source\n", mirrors[m]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Chunks are in target order, so trimming each match against the end of
+	// the last one leaves a sorted list without overlaps
+	uint64_t cursor = 0;
+	uint64_t referenced = 0;
+	struct mkvf_match last = { 0 };
+	int haveLast = 0;
+	int failed = 0;
+	for (uint64_t c = 0; c < state.chunkCount && !failed; c++) {
+		struct mkvf_matches *matches = &state.chunkMatches[c];
+		for (size_t m = 0; m < matches->count && !failed; m++) {
+			struct mkvf_match match = matches->items[m];
+			if (match.target + match.length <= cursor) {
+				continue;
+			}
+			if (match.target < cursor) {
+				uint64_t trim = cursor - match.target;
+				match.target += trim;
+				match.source += trim;
+				match.length -= trim;
+			}
+			if (match.length < MKVF_MIN_REFERENCE) {
+				continue;
+			}
+
+			uint64_t gap = match.target - cursor;
+			if (haveLast && last.file == match.file && last.source + last.length == match.source && gap == 0) {
+				// Continues the previous reference
+				vf->tail->length += match.length;
+				vf->size += match.length;
+			} else if (haveLast && last.file == match.file && last.source + last.length + gap == match.source && gap <= MKVF_MAX_PATCH) {
+				// A few rewritten bytes, such as timestamps, patch the previous reference
+				failed |= fluxfs_vf_extend_reference(vf, (const char *)state.target.data + cursor, gap, match.length);
+			} else {
+				failed |= add_embedded(vf, state.target.data + cursor, match.target - cursor, compress);
+				failed |= !fluxfs_vf_add_file_offset(vf, pathIndex[match.file], match.length, match.source);
+			}
+			referenced += match.length;
+			cursor = match.target + match.length;
+			last = match;
+			haveLast = 1;
+		}
+	}
+	failed |= add_embedded(vf, state.target.data + cursor, state.target.size - cursor, compress);
+	if (failed) {
+		fprintf(stderr, "Failed to add entries\n");
+		return EXIT_FAILURE;
+	}
+
+	// References are checksummed from the target, which holds the same bytes
+	size_t entries = 0;
+	uint64_t vfOffset = 0;
+	for (struct vf_entry *entry = vf->head; entry; entry = entry->next) {
+		if (checksums && (entry->type == FLUXFS_ENTRY_REFERENCE || entry->type == FLUXFS_ENTRY_PATCH)) {
+			entry->checksum = fluxfs_crc32c(0, state.target.data + vfOffset, entry->length);
+			entry->flags |= FLUXFS_ENTRY_FLAG_CHECKSUM;
+			vf->version = FLUXFS_VF_VERSION_2;
+		}
+		vfOffset += entry->length;
+		entries++;
+	}
+
+	if (packBlobs) {
+		fluxfs_vf_pack_blobs(vf);
+	}
+	if (fluxfs_save_vf(vf, output) != 0) {
+		fprintf(stderr, "Failed to save virtual file\n");
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	struct stat st;
+	stat(output, &st);
+
+	printf("Target: %" PRIu64 " bytes\n", state.target.size);
+	printf("Referenced: %" PRIu64 " bytes\n", referenced);
+	printf("Embedded: %" PRIu64 " bytes\n", state.target.size - referenced);
+	printf("Entries: %zu\n", entries);
+	printf("Virtual file: %s (%lld bytes) in %.1f s\n", output, (long long)st.st_size, seconds);
+
+	fluxfs_free_vf(vf);
+	free(pathIndex);
+	for (uint64_t c = 0; c < state.chunkCount; c++) {
+		free(state.chunkMatches[c].items);
+	}
+	free(state.chunkMatches);
+	free(state.index.keys);
+	free(state.index.values);
+	free(state.index.filter);
+	for (uint32_t i = 0; i < state.sourceCount; i++) {
+		if (state.sources[i].data) {
+			munmap((void *)state.sources[i].data, state.sources[i].size);
+		}
+	}
+	free(state.sources);
+	if (state.target.data) {
+		munmap((void *)state.target.data, state.target.size);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "../lib/fluxfs.h"
+
+static char **vfPaths = NULL;
+static size_t vfCount = 0;
+
+static void usage(const char *name) {
+	printf("Usage: %s [options] <pack.vfpack> [directory]...\n", name);
+	printf("  Bundles the .vf files below the directories, by default the directory of\n");
+	printf("  the pack, into one pack that fluxfs mounts without opening each file\n");
+	printf("  -x             Write the records of the pack back to .vf files\n");
+	printf("  -l             List the records of the pack\n");
+	printf("  -r             Remove the .vf files once packed, or the pack once extracted\n");
+}
+
+static int addVfPath(char *path) {
+	char **temp = realloc(vfPaths, (vfCount + 1) * sizeof(char *));
+	if (!temp) {
+		perror("Memory allocation failed");
+		free(path);
+		return 1;
+	}
+	vfPaths = temp;
+	vfPaths[vfCount++] = path;
+	return 0;
+}
+
+static int scanDirectory(const char *dirPath) {
+	DIR *dir = opendir(dirPath);
+	if (!dir) {
+		perror(dirPath);
+		return 1;
+	}
+
+	int failed = 0;
+	struct dirent *entry;
+	while (!failed && (entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		size_t pathLength = strlen(dirPath) + strlen(entry->d_name) + 2;
+		char *path = malloc(pathLength);
+		if (!path) {
+			perror("Memory allocation failed");
+			failed = 1;
+			break;
+		}
+		snprintf(path, pathLength, "%s/%s", dirPath, entry->d_name);
+
+		struct stat st;
+		size_t len = strlen(entry->d_name);
+		if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+			failed = scanDirectory(path);
+		} else if (len > 3 && strcmp(entry->d_name + len - 3, ".vf") == 0 && S_ISREG(st.st_mode)) {
+			failed = addVfPath(path);
+			continue;
+		}
+		free(path);
+	}
+	closedir(dir);
+	return failed;
+}
+
+static int listPack(const char *packPath) {
+	struct fluxfs_pack *pack = fluxfs_pack_open(packPath);
+	if (!pack) {
+		return 1;
+	}
+	for (uint64_t i = 0; i < pack->count; i++) {
+		const struct fluxfs_pack_record *record = &pack->records[i];
+		printf("%s  %" PRIu64 " bytes  %s\n", fluxfs_pack_vpath(pack, record), record->size, fluxfs_pack_name(pack, record));
+	}
+	fluxfs_pack_close(pack);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int extract = 0;
+	int list = 0;
+	int removeFiles = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "xlrh")) != -1) {
+		switch (opt) {
+		case 'x':
+			extract = 1;
+			break;
+		case 'l':
+			list = 1;
+			break;
+		case 'r':
+			removeFiles = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc || extract + list > 1 || ((extract || list) && argc - optind != 1)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *packPath = argv[optind];
+
+	if (list) {
+		return listPack(packPath) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	if (extract) {
+		if (fluxfs_pack_extract(packPath) != 0) {
+			fprintf(stderr, "Failed to extract %s\n", packPath);
+			return EXIT_FAILURE;
+		}
+		if (removeFiles && unlink(packPath) != 0) {
+			perror(packPath);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	int failed = 0;
+	if (argc - optind == 1) {
+		char *packDir = strdup(packPath);
+		char *slash = packDir ? strrchr(packDir, '/') : NULL;
+		if (slash) {
+			*slash = 0;
+		}
+		failed = !packDir || scanDirectory(slash ? (*packDir ? packDir : "/") : ".");
+		free(packDir);
+	}
+	for (int i = optind + 1; i < argc && !failed; i++) {
+		failed = scanDirectory(argv[i]);
+	}
+
+	failed = failed || fluxfs_pack_create(packPath, vfPaths, vfCount) != 0;
+	if (failed) {
+		fprintf(stderr, "Failed to create %s\n", packPath);
+	} else {
+		printf("Packed %zu virtual files into %s\n", vfCount, packPath);
+	}
+	for (size_t i = 0; i < vfCount; i++) {
+		// The overlay was folded in before packing
+		if (!failed && removeFiles && unlink(vfPaths[i]) != 0) {
+			perror(vfPaths[i]);
+		}
+		free(vfPaths[i]);
+	}
+	free(vfPaths);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
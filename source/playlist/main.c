@@ -0,0 +1,758 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../lib/fluxfs.h"
+
+// Blu-ray transport stream packets carry a 4 byte arrival timestamp
+#define M2TS_PACKET_SIZE 192
+// Packets read at a time while looking for a timestamp
+#define M2TS_SCAN_PACKETS 4096
+// Give up looking for a video timestamp after this many bytes
+#define M2TS_SCAN_LIMIT (32 * 1024 * 1024)
+#define DVD_SECTOR_SIZE 2048
+#define DVD_MAX_VOBS 9
+
+// One contiguous byte range of a source file
+struct playlist_range {
+	char *path;
+	uint64_t offset;
+	uint64_t length;
+};
+
+struct playlist {
+	char name[64];
+	const char *extension;
+	double seconds;
+	struct playlist_range *ranges;
+	size_t count;
+};
+
+struct options {
+	const char *outputDir;
+	const char *prefix;
+	double minSeconds;
+	int keepDuplicates;
+};
+
+static struct options opts;
+
+static char **discs = NULL;
+static size_t disc_count = 0;
+static size_t next_disc = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int failures = 0;
+
+static uint16_t be16(const uint8_t *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t be32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint8_t *read_file(const char *path, size_t *size) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	rewind(file);
+	uint8_t *data = length > 0 ? malloc(length) : NULL;
+	if (!data || fread(data, 1, length, file) != (size_t)length) {
+		free(data);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	*size = length;
+	return data;
+}
+
+static int add_range(struct playlist *playlist, const char *path, uint64_t offset, uint64_t length) {
+	if (length == 0) {
+		return 0;
+	}
+	// Contiguous ranges of one file become a single reference
+	if (playlist->count) {
+		struct playlist_range *last = &playlist->ranges[playlist->count - 1];
+		if (strcmp(last->path, path) == 0 && last->offset + last->length == offset) {
+			last->length += length;
+			return 0;
+		}
+	}
+	struct playlist_range *ranges = realloc(playlist->ranges, (playlist->count + 1) * sizeof(struct playlist_range));
+	if (!ranges) {
+		return 1;
+	}
+	playlist->ranges = ranges;
+	ranges[playlist->count].path = strdup(path);
+	ranges[playlist->count].offset = offset;
+	ranges[playlist->count].length = length;
+	if (!ranges[playlist->count].path) {
+		return 1;
+	}
+	playlist->count++;
+	return 0;
+}
+
+static void free_playlist(struct playlist *playlist) {
+	for (size_t i = 0; i < playlist->count; i++) {
+		free(playlist->ranges[i].path);
+	}
+	free(playlist->ranges);
+	playlist->ranges = NULL;
+	playlist->count = 0;
+}
+
+// Two playlists are duplicates if they play the same ranges
+static int same_ranges(struct playlist *a, struct playlist *b) {
+	if (a->count != b->count) {
+		return 0;
+	}
+	for (size_t i = 0; i < a->count; i++) {
+		if (strcmp(a->ranges[i].path, b->ranges[i].path) != 0 ||
+			a->ranges[i].offset != b->ranges[i].offset ||
+			a->ranges[i].length != b->ranges[i].length) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// --- Blu-ray -----------------------------------------------------------------
+
+struct m2ts_clip {
+	int fd;
+	uint64_t size;
+	int videoPid;
+};
+
+// PTS of the PES packet starting in a transport packet, or -1
+static int64_t packet_pts(const uint8_t *packet, int *pid, int *videoStream) {
+	const uint8_t *ts = packet + 4;
+	*videoStream = 0;
+	if (ts[0] != 0x47 || !(ts[1] & 0x40)) {
+		return -1;
+	}
+	*pid = ((ts[1] & 0x1F) << 8) | ts[2];
+
+	int payload = 4;
+	int adaptation = (ts[3] >> 4) & 3;
+	if (adaptation == 2) {
+		return -1;
+	}
+	if (adaptation == 3) {
+		payload += 1 + ts[4];
+	}
+	if (payload + 14 > 188) {
+		return -1;
+	}
+
+	const uint8_t *pes = ts + payload;
+	if (pes[0] != 0 || pes[1] != 0 || pes[2] != 1) {
+		return -1;
+	}
+	uint8_t streamId = pes[3];
+	*videoStream = (streamId >= 0xE0 && streamId <= 0xEF) || streamId == 0xFD;
+	if (!(pes[7] & 0x80)) {
+		return -1;
+	}
+	const uint8_t *p = pes + 9;
+	return ((int64_t)((p[0] >> 1) & 7) << 30) | (p[1] << 22) | ((p[2] >> 1) << 15) | (p[3] << 7) | (p[4] >> 1);
+}
+
+// Find the first video PES start at or after packet, its PTS and position
+static int find_video_pts(struct m2ts_clip *clip, uint64_t packet, int64_t *pts, uint64_t *position) {
+	uint8_t *buf = malloc(M2TS_SCAN_PACKETS * M2TS_PACKET_SIZE);
+	if (!buf) {
+		return 1;
+	}
+
+	uint64_t pos = packet * M2TS_PACKET_SIZE;
+	uint64_t limit = pos + M2TS_SCAN_LIMIT;
+	while (pos < clip->size && pos < limit) {
+		ssize_t bytesRead = pread(clip->fd, buf, M2TS_SCAN_PACKETS * M2TS_PACKET_SIZE, pos);
+		if (bytesRead < M2TS_PACKET_SIZE) {
+			break;
+		}
+		for (ssize_t i = 0; i + M2TS_PACKET_SIZE <= bytesRead; i += M2TS_PACKET_SIZE) {
+			int pid, video;
+			int64_t value = packet_pts(buf + i, &pid, &video);
+			if (value < 0 || !video) {
+				continue;
+			}
+			if (clip->videoPid < 0) {
+				clip->videoPid = pid;
+			}
+			if (pid == clip->videoPid) {
+				*pts = value;
+				*position = pos + i;
+				free(buf);
+				return 0;
+			}
+		}
+		pos += bytesRead - bytesRead % M2TS_PACKET_SIZE;
+	}
+
+	free(buf);
+	return 1;
+}
+
+// Byte offset of the first video PES whose PTS reaches target, found by a
+// binary search over packets followed by a short linear scan
+static uint64_t m2ts_offset(struct m2ts_clip *clip, int64_t target) {
+	uint64_t packets = clip->size / M2TS_PACKET_SIZE;
+	int64_t pts;
+	uint64_t position;
+
+	if (find_video_pts(clip, 0, &pts, &position) != 0 || pts >= target) {
+		return 0;
+	}
+
+	uint64_t lo = 0;
+	uint64_t hi = packets;
+	while (hi - lo > M2TS_SCAN_PACKETS) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (find_video_pts(clip, mid, &pts, &position) != 0 || pts >= target) {
+			hi = mid;
+		} else {
+			lo = mid;
+		}
+	}
+
+	uint64_t packet = lo;
+	while (packet < packets && find_video_pts(clip, packet, &pts, &position) == 0) {
+		if (pts >= target) {
+			return position;
+		}
+		packet = position / M2TS_PACKET_SIZE + 1;
+	}
+	return packets * M2TS_PACKET_SIZE;
+}
+
+static int parse_mpls(const char *disc, const char *mplsPath, struct playlist *playlist) {
+	size_t size;
+	uint8_t *data = read_file(mplsPath, &size);
+	if (!data) {
+		return 1;
+	}
+	if (size < 20 || memcmp(data, "MPLS", 4) != 0) {
+		free(data);
+		return 1;
+	}
+
+	uint32_t listStart = be32(data + 8);
+	if (listStart > size || size - listStart < 10) {
+		free(data);
+		return 1;
+	}
+	uint16_t items = be16(data + listStart + 6);
+	size_t pos = listStart + 10;
+
+	for (uint16_t i = 0; i < items; i++) {
+		if (pos + 22 > size) {
+			free(data);
+			return 1;
+		}
+		uint16_t length = be16(data + pos);
+		const uint8_t *item = data + pos + 2;
+		// Clips are named by five digits, anything else would leave the
+		// STREAM directory
+		char clipName[6];
+		memcpy(clipName, item, 5);
+		clipName[5] = 0;
+		if (strspn(clipName, "0123456789") != 5) {
+			fprintf(stderr, "%s: invalid clip name\n", mplsPath);
+			free(data);
+			return 1;
+		}
+		int64_t inTime = be32(item + 12);
+		int64_t outTime = be32(item + 16);
+		pos += 2 + length;
+
+		char clipPath[PATH_MAX];
+		snprintf(clipPath, sizeof(clipPath), "%s/BDMV/STREAM/%s.m2ts", disc, clipName);
+		if (access(clipPath, R_OK) != 0) {
+			snprintf(clipPath, sizeof(clipPath), "%s/BDMV/STREAM/%s.M2TS", disc, clipName);
+		}
+
+		struct m2ts_clip clip = { .fd = open(clipPath, O_RDONLY), .videoPid = -1 };
+		struct stat st;
+		if (clip.fd < 0 || fstat(clip.fd, &st) != 0) {
+			fprintf(stderr, "%s: cannot open clip %s\n", mplsPath, clipPath);
+			if (clip.fd >= 0) {
+				close(clip.fd);
+			}
+			free(data);
+			return 1;
+		}
+		clip.size = st.st_size;
+
+		// Playlist times use the 45 kHz clock, PTS uses 90 kHz
+		uint64_t start = m2ts_offset(&clip, inTime * 2);
+		uint64_t end = m2ts_offset(&clip, outTime * 2);
+		close(clip.fd);
+
+		playlist->seconds += (outTime - inTime) / 45000.0;
+		if (end > start && add_range(playlist, clipPath, start, end - start) != 0) {
+			free(data);
+			return 1;
+		}
+	}
+
+	free(data);
+	return 0;
+}
+
+// --- DVD ---------------------------------------------------------------------
+
+static int bcd(uint8_t value) {
+	return (value >> 4) * 10 + (value & 0x0F);
+}
+
+// PGC playback time is BCD hours, minutes, seconds and frames
+static double dvd_time(const uint8_t *p) {
+	double fps = ((p[3] >> 6) == 3) ? 29.97 : 25.0;
+	return bcd(p[0]) * 3600 + bcd(p[1]) * 60 + bcd(p[2]) + bcd(p[3] & 0x3F) / fps;
+}
+
+// Cells address sectors of the title VOBs laid end to end
+static int add_sectors(struct playlist *playlist, char vobs[][PATH_MAX], uint64_t *vobSizes, int vobCount, uint64_t offset, uint64_t length) {
+	for (int v = 0; v < vobCount && length; v++) {
+		if (offset >= vobSizes[v]) {
+			offset -= vobSizes[v];
+			continue;
+		}
+		uint64_t part = vobSizes[v] - offset < length ? vobSizes[v] - offset : length;
+		if (add_range(playlist, vobs[v], offset, part) != 0) {
+			return 1;
+		}
+		length -= part;
+		offset = 0;
+	}
+	return length ? 1 : 0;
+}
+
+static int parse_pgc(const uint8_t *pgc, size_t available, struct playlist *playlist, char vobs[][PATH_MAX], uint64_t *vobSizes, int vobCount) {
+	if (available < 0xEC) {
+		return 1;
+	}
+	uint8_t cells = pgc[3];
+	uint16_t cellTable = be16(pgc + 0xE8);
+	playlist->seconds = dvd_time(pgc + 4);
+	if (cellTable + (size_t)cells * 24 > available) {
+		return 1;
+	}
+
+	for (uint8_t c = 0; c < cells; c++) {
+		const uint8_t *cell = pgc + cellTable + c * 24;
+		int blockMode = cell[0] >> 6;
+		int blockType = (cell[0] >> 4) & 3;
+		// Only the first angle of an angle block plays by default
+		if (blockType == 1 && blockMode != 1) {
+			continue;
+		}
+		uint64_t first = be32(cell + 8);
+		uint64_t last = be32(cell + 20);
+		if (last < first) {
+			return 1;
+		}
+		uint64_t offset = first * DVD_SECTOR_SIZE;
+		uint64_t length = (last - first + 1) * DVD_SECTOR_SIZE;
+		if (add_sectors(playlist, vobs, vobSizes, vobCount, offset, length) != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// --- Output ------------------------------------------------------------------
+
+static int write_playlist(const char *disc, const char *discName, struct playlist *playlist) {
+	char outputDir[PATH_MAX];
+	if (opts.outputDir) {
+		snprintf(outputDir, sizeof(outputDir), "%s/%s", opts.outputDir, discName);
+		mkdir(opts.outputDir, 0755);
+		mkdir(outputDir, 0755);
+	} else {
+		snprintf(outputDir, sizeof(outputDir), "%s", disc);
+	}
+	char *absoluteDir = realpath(outputDir, NULL);
+	if (!absoluteDir) {
+		perror(outputDir);
+		return 1;
+	}
+
+	char vpath[PATH_MAX];
+	snprintf(vpath, sizeof(vpath), "%s%s/%s.%s", opts.prefix, discName, playlist->name, playlist->extension);
+	struct fluxfs_vf *vf = fluxfs_create_vf(vpath);
+	if (!vf) {
+		free(absoluteDir);
+		return 1;
+	}
+
+	int result = 0;
+	for (size_t i = 0; i < playlist->count && result == 0; i++) {
+		struct playlist_range *range = &playlist->ranges[i];
+		char *absolute = realpath(range->path, NULL);
+		if (!absolute) {
+			result = 1;
+		} else {
+			// Reuse the path string of an earlier range of the same file
+			uint32_t index = 0;
+			while (index < vf->sourceCount && strcmp(fluxfs_source_path(vf->sources[index]), absolute) != 0) {
+				index++;
+			}
+			if (index == vf->sourceCount) {
+				index = fluxfs_vf_add_path(vf, absolute);
+			}
+			if (index == UINT32_MAX || !fluxfs_vf_add_file_offset(vf, index, range->length, range->offset)) {
+				result = 1;
+			}
+		}
+		free(absolute);
+	}
+
+	char vfPath[PATH_MAX * 2];
+	snprintf(vfPath, sizeof(vfPath), "%s/%s.vf", absoluteDir, playlist->name);
+	if (result == 0) {
+		result = fluxfs_save_vf(vf, vfPath);
+	}
+	if (result == 0) {
+		pthread_mutex_lock(&lock);
+		printf("%s -> %s (%.0f s)\n", vfPath, vpath, playlist->seconds);
+		pthread_mutex_unlock(&lock);
+	}
+
+	fluxfs_free_vf(vf);
+	free(absoluteDir);
+	return result;
+}
+
+// Keep a playlist unless it is too short or repeats one already kept
+static int keep_playlist(struct playlist *kept, size_t keptCount, struct playlist *playlist) {
+	if (playlist->count == 0 || playlist->seconds < opts.minSeconds) {
+		return 0;
+	}
+	for (size_t i = 0; i < keptCount && !opts.keepDuplicates; i++) {
+		if (same_ranges(&kept[i], playlist)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Sorted names in a directory with the given suffix, ignoring case
+static char **list_files(const char *dirPath, const char *suffix, size_t *count) {
+	*count = 0;
+	DIR *dir = opendir(dirPath);
+	if (!dir) {
+		return NULL;
+	}
+	char **names = NULL;
+	struct dirent *entry;
+	size_t suffixLen = strlen(suffix);
+	while ((entry = readdir(dir)) != NULL) {
+		size_t len = strlen(entry->d_name);
+		if (len <= suffixLen || strcasecmp(entry->d_name + len - suffixLen, suffix) != 0) {
+			continue;
+		}
+		char **temp = realloc(names, (*count + 1) * sizeof(char *));
+		if (!temp) {
+			break;
+		}
+		names = temp;
+		names[(*count)++] = strdup(entry->d_name);
+	}
+	closedir(dir);
+	qsort(names, *count, sizeof(char *), compare_names);
+	return names;
+}
+
+static int process_bluray(const char *disc, const char *discName) {
+	char playlistDir[PATH_MAX];
+	snprintf(playlistDir, sizeof(playlistDir), "%s/BDMV/PLAYLIST", disc);
+	size_t count;
+	char **names = list_files(playlistDir, ".mpls", &count);
+
+	struct playlist *kept = calloc(count ? count : 1, sizeof(struct playlist));
+	size_t keptCount = 0;
+	int result = 0;
+	for (size_t i = 0; i < count && kept; i++) {
+		char mplsPath[PATH_MAX * 2];
+		snprintf(mplsPath, sizeof(mplsPath), "%s/%s", playlistDir, names[i]);
+
+		struct playlist playlist = { .extension = "m2ts" };
+		snprintf(playlist.name, sizeof(playlist.name), "%.*s", (int)(strlen(names[i]) - 5), names[i]);
+		if (parse_mpls(disc, mplsPath, &playlist) != 0) {
+			fprintf(stderr, "%s: cannot be parsed\n", mplsPath);
+			free_playlist(&playlist);
+			result = 1;
+		} else if (keep_playlist(kept, keptCount, &playlist)) {
+			result |= write_playlist(disc, discName, &playlist);
+			kept[keptCount++] = playlist;
+		} else {
+			free_playlist(&playlist);
+		}
+		free(names[i]);
+	}
+
+	for (size_t i = 0; i < keptCount; i++) {
+		free_playlist(&kept[i]);
+	}
+	free(kept);
+	free(names);
+	return result;
+}
+
+static int process_dvd_title_set(const char *disc, const char *discName, const char *videoTs, int titleSet, struct playlist *kept, size_t *keptCount) {
+	char ifoPath[PATH_MAX];
+	snprintf(ifoPath, sizeof(ifoPath), "%s/VTS_%02d_0.IFO", videoTs, titleSet);
+	size_t size;
+	uint8_t *ifo = read_file(ifoPath, &size);
+	if (!ifo) {
+		return 0;
+	}
+	if (size < 0x100 || memcmp(ifo, "DVDVIDEO-VTS", 12) != 0) {
+		free(ifo);
+		return 1;
+	}
+
+	// Title VOBs 1 to 9, menus live in VOB 0
+	char vobs[DVD_MAX_VOBS][PATH_MAX];
+	uint64_t vobSizes[DVD_MAX_VOBS];
+	int vobCount = 0;
+	for (int v = 1; v <= DVD_MAX_VOBS; v++) {
+		struct stat st;
+		snprintf(vobs[vobCount], PATH_MAX, "%s/VTS_%02d_%d.VOB", videoTs, titleSet, v);
+		if (stat(vobs[vobCount], &st) != 0) {
+			break;
+		}
+		vobSizes[vobCount++] = st.st_size;
+	}
+
+	uint64_t pgcit = (uint64_t)be32(ifo + 0xCC) * DVD_SECTOR_SIZE;
+	if (pgcit + 8 > size) {
+		free(ifo);
+		return 1;
+	}
+	uint16_t pgcCount = be16(ifo + pgcit);
+
+	int result = 0;
+	for (uint16_t p = 0; p < pgcCount; p++) {
+		size_t search = pgcit + 8 + p * 8;
+		if (search + 8 > size) {
+			result = 1;
+			break;
+		}
+		uint64_t pgcOffset = pgcit + be32(ifo + search + 4);
+		if (pgcOffset >= size) {
+			result = 1;
+			break;
+		}
+
+		struct playlist playlist = { .extension = "mpg" };
+		snprintf(playlist.name, sizeof(playlist.name), "VTS_%02d_PGC_%02u", titleSet, p + 1);
+		if (parse_pgc(ifo + pgcOffset, size - pgcOffset, &playlist, vobs, vobSizes, vobCount) != 0) {
+			fprintf(stderr, "%s: program chain %u cannot be parsed\n", ifoPath, p + 1);
+			free_playlist(&playlist);
+			result = 1;
+		} else if (keep_playlist(kept, *keptCount, &playlist)) {
+			result |= write_playlist(disc, discName, &playlist);
+			kept[(*keptCount)++] = playlist;
+		} else {
+			free_playlist(&playlist);
+		}
+	}
+
+	free(ifo);
+	return result;
+}
+
+static int process_dvd(const char *disc, const char *discName) {
+	char videoTs[PATH_MAX];
+	snprintf(videoTs, sizeof(videoTs), "%s/VIDEO_TS", disc);
+
+	// A DVD has at most 99 title sets of at most 999 program chains
+	size_t capacity = 1024;
+	struct playlist *kept = calloc(capacity, sizeof(struct playlist));
+	size_t keptCount = 0;
+	int result = 0;
+	if (!kept) {
+		return 1;
+	}
+	for (int titleSet = 1; titleSet <= 99 && keptCount + 999 <= capacity; titleSet++) {
+		result |= process_dvd_title_set(disc, discName, videoTs, titleSet, kept, &keptCount);
+	}
+
+	for (size_t i = 0; i < keptCount; i++) {
+		free_playlist(&kept[i]);
+	}
+	free(kept);
+	return result;
+}
+
+static int is_dir(const char *path) {
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void add_disc(const char *path) {
+	char **temp = realloc(discs, (disc_count + 1) * sizeof(char *));
+	if (!temp) {
+		perror("Memory allocation failed");
+		return;
+	}
+	discs = temp;
+	discs[disc_count++] = strdup(path);
+}
+
+// A disc backup is a directory holding BDMV or VIDEO_TS
+static void find_discs(const char *dir_path) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/BDMV/PLAYLIST", dir_path);
+	int bluray = is_dir(path);
+	snprintf(path, sizeof(path), "%s/VIDEO_TS", dir_path);
+	if (bluray || is_dir(path)) {
+		add_disc(dir_path);
+		return;
+	}
+
+	DIR *dir = opendir(dir_path);
+	if (!dir) {
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+		if (is_dir(path)) {
+			find_discs(path);
+		}
+	}
+	closedir(dir);
+}
+
+static void *disc_worker(__attribute__((unused)) void *arg) {
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		if (next_disc >= disc_count) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		const char *disc = discs[next_disc++];
+		pthread_mutex_unlock(&lock);
+
+		char pathCopy[PATH_MAX];
+		snprintf(pathCopy, sizeof(pathCopy), "%s", disc);
+		const char *discName = basename(pathCopy);
+
+		char path[PATH_MAX];
+		int result = 0;
+		snprintf(path, sizeof(path), "%s/BDMV/PLAYLIST", disc);
+		if (is_dir(path)) {
+			result |= process_bluray(disc, discName);
+		}
+		snprintf(path, sizeof(path), "%s/VIDEO_TS", disc);
+		if (is_dir(path)) {
+			result |= process_dvd(disc, discName);
+		}
+
+		if (result) {
+			pthread_mutex_lock(&lock);
+			failures++;
+			pthread_mutex_unlock(&lock);
+		}
+	}
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [options] <disc backup or library directory>...\n", name);
+	printf("  Writes a virtual file for every Blu-ray playlist and DVD program chain\n");
+	printf("  -o <dir>       Write virtual files under dir/<disc> (default: inside each disc)\n");
+	printf("  -p <prefix>    Prefix of the virtual paths (default: none)\n");
+	printf("  -m <seconds>   Skip playlists shorter than this (default 120)\n");
+	printf("  -d             Keep playlists that repeat another playlist\n");
+	printf("  -j <threads>   Discs processed at once (default 4)\n");
+}
+
+int main(int argc, char *argv[]) {
+	int threads = 4;
+	opts.prefix = "";
+	opts.minSeconds = 120;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "o:p:m:dj:h")) != -1) {
+		switch (opt) {
+		case 'o':
+			opts.outputDir = optarg;
+			break;
+		case 'p':
+			opts.prefix = optarg;
+			break;
+		case 'm':
+			opts.minSeconds = atof(optarg);
+			break;
+		case 'd':
+			opts.keepDuplicates = 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc || threads < 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		find_discs(argv[i]);
+	}
+	if (disc_count == 0) {
+		printf("No disc backups found.\n");
+		return EXIT_FAILURE;
+	}
+
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	if (!workers) {
+		perror("Memory allocation failed");
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_create(&workers[i], NULL, disc_worker, NULL);
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+
+	printf("%zu discs, %d with errors\n", disc_count, failures);
+
+	for (size_t i = 0; i < disc_count; i++) {
+		free(discs[i]);
+	}
+	free(discs);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
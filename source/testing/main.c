@@ -1,9 +1,28 @@
 
+#define _GNU_SOURCE // memmem
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "../lib/fluxfs.h"
+#include "../lib/source.h"
+#include "../lib/iosched.h"
+#include "../lib/blob.h"
+#include "../fluxfs/file.h"
+#include "../fluxfs/tree.h"
+#include "../fluxfs/http.h"
 
 // Simple file to use as a data reference
 int createSourceFile() {
@@ -76,6 +95,48 @@ int createVirtualFile(const char *filePath) {
 	return EXIT_SUCCESS;
 }
 
+// Same content as createVirtualFile, but with enough paths to need version 2
+int createVirtualFileV2(const char *filePath) {
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/bytes-v2.bin");
+	if (!vf) {
+		fprintf(stderr, "Failed to create virtual file\n");
+		return EXIT_FAILURE;
+	}
+
+	// Version 1 can only index 255 paths
+	uint32_t fileIndex = 0;
+	for (int i = 0; i < 300; i++) {
+		fileIndex = fluxfs_vf_add_path(vf, "source.bin");
+	}
+
+	char data1[] = {
+		0x45, 0x80, 0xF3, 0x12, 0x00,
+		0x5F, 0x1A, 0x31, 0x10, 0xF3
+	};
+	fluxfs_vf_add_data(vf, 10, data1);
+
+	// Reference the last path using two entries
+	fluxfs_vf_add_file_offset(vf, fileIndex, 4, 5);
+	fluxfs_vf_add_file_offset(vf, fileIndex, 6, 9);
+
+	char data2[] = {
+		0x78, 0x40, 0x21, 0x37, 0x98,
+		0xA2, 0xB9, 0x11, 0x23, 0x77
+	};
+	fluxfs_vf_add_data(vf, 10, data2);
+
+	if (fluxfs_save_vf(vf, filePath) != EXIT_SUCCESS) {
+		fprintf(stderr, "Failed to save virtual file\n");
+		fluxfs_free_vf(vf);
+		return EXIT_FAILURE;
+	}
+	fluxfs_free_vf(vf);
+
+	printf("Test file written to %s\n", filePath);
+
+	return EXIT_SUCCESS;
+}
+
 // The bytes that would be read from virfile.vf
 static char expected_bytes[] = {
 	0x45, 0x80, 0xF3, 0x12, 0x00,
@@ -121,6 +182,1452 @@ int test_vf(struct fluxfs_vf *vf) {
 	return EXIT_SUCCESS;
 }
 
+// Compressed entries must read back the same bytes at any offset and size
+int test_compressed(void) {
+	printf("Compressed Read Test:\n");
+
+	// Several chunks of repetitive text with a little noise
+	size_t length = 200000;
+	char *data = malloc(length);
+	if (!data) {
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < length; i++) {
+		data[i] = "FluxFS compressed chunk "[i % 24];
+		if (i % 997 == 0) {
+			data[i] = (char)(i * 31);
+		}
+	}
+
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/compressed.bin");
+	if (!vf) {
+		free(data);
+		return EXIT_FAILURE;
+	}
+	uint32_t fileIndex = fluxfs_vf_add_path(vf, "source.bin");
+	fluxfs_vf_add_compressed_data(vf, length, data);
+	fluxfs_vf_add_file_offset(vf, fileIndex, 10, 5);
+	if (fluxfs_save_vf(vf, "fluxfs-compressed.vf") != EXIT_SUCCESS) {
+		fluxfs_free_vf(vf);
+		free(data);
+		return EXIT_FAILURE;
+	}
+	fluxfs_free_vf(vf);
+
+	vf = fluxfs_load_vf("fluxfs-compressed.vf");
+	if (!vf || vf->size != length + 10) {
+		printf("Compressed Load Failed\n");
+		fluxfs_free_vf(vf);
+		free(data);
+		return EXIT_FAILURE;
+	}
+
+	// Reads of a prime size cross chunk boundaries at varying offsets
+	char buffer[4099];
+	for (uint64_t offset = 0; offset < length; offset += sizeof(buffer)) {
+		size_t size = (length - offset < sizeof(buffer)) ? length - offset : sizeof(buffer);
+		if (fluxfs_read_from_vf(vf, buffer, size, offset) != (int)size || memcmp(buffer, data + offset, size) != 0) {
+			printf("Compressed Read Failed At Offset: %" PRIu64 "\n", offset);
+			fluxfs_free_vf(vf);
+			free(data);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// A read spanning the compressed entry and the reference after it
+	fluxfs_read_from_vf(vf, buffer, 4, length - 2);
+	if (memcmp(buffer, data + length - 2, 2) != 0 || buffer[2] != (char)0xFF || buffer[3] != 0x12) {
+		printf("Compressed Read Failed At End\n");
+		fluxfs_free_vf(vf);
+		free(data);
+		return EXIT_FAILURE;
+	}
+	printf("Compressed Read Successful\n");
+
+	fluxfs_free_vf(vf);
+	free(data);
+
+	return EXIT_SUCCESS;
+}
+
+// Fill entries must produce their bytes without any stored payload
+int test_fill(void) {
+	printf("Fill Read Test:\n");
+
+	// Null transport stream packet header as the pattern
+	char pattern[] = { 0x47, 0x1F, 0xFF, 0x10, 0xFF };
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/fill.bin");
+	if (!vf) {
+		return EXIT_FAILURE;
+	}
+	fluxfs_vf_add_zero(vf, 1000);
+	fluxfs_vf_add_pattern(vf, 5003, pattern, sizeof(pattern));
+	fluxfs_vf_add_data(vf, 5, pattern);
+	if (fluxfs_save_vf(vf, "fluxfs-fill.vf") != EXIT_SUCCESS) {
+		fluxfs_free_vf(vf);
+		return EXIT_FAILURE;
+	}
+	fluxfs_free_vf(vf);
+
+	vf = fluxfs_load_vf("fluxfs-fill.vf");
+	if (!vf || vf->size != 6008) {
+		printf("Fill Load Failed\n");
+		fluxfs_free_vf(vf);
+		return EXIT_FAILURE;
+	}
+
+	char buffer[37];
+	for (uint64_t offset = 0; offset < vf->size; offset += sizeof(buffer)) {
+		int bytesRead = fluxfs_read_from_vf(vf, buffer, sizeof(buffer), offset);
+		for (int i = 0; i < bytesRead; i++) {
+			uint64_t pos = offset + i;
+			char expected;
+			if (pos < 1000) {
+				expected = 0;
+			} else if (pos < 6003) {
+				expected = pattern[(pos - 1000) % sizeof(pattern)];
+			} else {
+				expected = pattern[pos - 6003];
+			}
+			if (buffer[i] != expected) {
+				printf("Fill Read Failed At Offset: %" PRIu64 "\n", pos);
+				fluxfs_free_vf(vf);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	printf("Fill Read Successful\n");
+
+	fluxfs_free_vf(vf);
+
+	return EXIT_SUCCESS;
+}
+
+// Checksums recorded at build time must catch a changed source file
+int test_checksums(void) {
+	printf("Checksum Test:\n");
+
+	char source[64];
+	for (size_t i = 0; i < sizeof(source); i++) {
+		source[i] = i * 7;
+	}
+	FILE *file = fopen("checksum.bin", "wb");
+	if (!file) {
+		return EXIT_FAILURE;
+	}
+	fwrite(source, 1, sizeof(source), file);
+	fclose(file);
+
+	if (fluxfs_crc32c(0, "123456789", 9) != 0xE3069283) {
+		printf("CRC32C Check Value Failed\n");
+		return EXIT_FAILURE;
+	}
+
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/checksum.bin");
+	if (!vf) {
+		return EXIT_FAILURE;
+	}
+	uint32_t fileIndex = fluxfs_vf_add_path(vf, "checksum.bin");
+	fluxfs_vf_add_file_offset(vf, fileIndex, 32, 16);
+	fluxfs_save_vf(vf, "fluxfs-checksum.vf");
+	fluxfs_free_vf(vf);
+
+	// Checksums are computed from the sources of a loaded file
+	vf = fluxfs_load_vf("fluxfs-checksum.vf");
+	if (!vf || fluxfs_vf_compute_checksums(vf) != 0 || fluxfs_save_vf(vf, "fluxfs-checksum.vf") != 0) {
+		fluxfs_free_vf(vf);
+		return EXIT_FAILURE;
+	}
+	fluxfs_free_vf(vf);
+
+	vf = fluxfs_load_vf("fluxfs-checksum.vf");
+	if (!vf || !(vf->head->flags & FLUXFS_ENTRY_FLAG_CHECKSUM) || fluxfs_vf_verify(vf) != 0) {
+		printf("Checksum Verify Failed\n");
+		fluxfs_free_vf(vf);
+		return EXIT_FAILURE;
+	}
+	fluxfs_free_vf(vf);
+
+	// Change one referenced byte
+	source[40] ^= 1;
+	file = fopen("checksum.bin", "wb");
+	if (!file) {
+		return EXIT_FAILURE;
+	}
+	fwrite(source, 1, sizeof(source), file);
+	fclose(file);
+
+	vf = fluxfs_load_vf("fluxfs-checksum.vf");
+	if (!vf || fluxfs_vf_verify(vf) != 1) {
+		printf("Checksum Mismatch Not Detected\n");
+		fluxfs_free_vf(vf);
+		return EXIT_FAILURE;
+	}
+	fluxfs_free_vf(vf);
+	printf("Checksum Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+// Ranges of other files must splice into one flat file
+int test_append_range(void) {
+	printf("Append Range Test:\n");
+
+	struct fluxfs_vf *bytes = fluxfs_load_vf("fluxfs.vf");
+	struct fluxfs_vf *fill = fluxfs_load_vf("fluxfs-fill.vf");
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/spliced.bin");
+	if (!bytes || !fill || !vf) {
+		fluxfs_free_vf(bytes);
+		fluxfs_free_vf(fill);
+		fluxfs_free_vf(vf);
+		return EXIT_FAILURE;
+	}
+
+	// The two reference ranges are contiguous in source.bin
+	int failed = fluxfs_vf_append_range(vf, bytes, 5, 13);
+	failed |= fluxfs_vf_append_range(vf, bytes, 18, 12);
+	failed |= fluxfs_vf_append_range(vf, fill, 998, 12);
+	failed |= !fluxfs_vf_append_range(vf, bytes, 25, 6);
+	if (failed || fluxfs_save_vf(vf, "fluxfs-spliced.vf") != EXIT_SUCCESS) {
+		printf("Append Range Failed\n");
+		fluxfs_free_vf(bytes);
+		fluxfs_free_vf(fill);
+		fluxfs_free_vf(vf);
+		return EXIT_FAILURE;
+	}
+	fluxfs_free_vf(vf);
+
+	char expected[37];
+	fluxfs_read_from_vf(bytes, expected, 25, 5);
+	fluxfs_read_from_vf(fill, expected + 25, 12, 998);
+
+	vf = fluxfs_load_vf("fluxfs-spliced.vf");
+	char buffer[37];
+	int references = 0;
+	for (struct vf_entry *entry = vf ? vf->head : NULL; entry; entry = entry->next) {
+		references += (entry->type == FLUXFS_ENTRY_REFERENCE);
+	}
+	if (!vf || vf->size != sizeof(expected) || references != 1 ||
+		fluxfs_read_from_vf(vf, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+		memcmp(buffer, expected, sizeof(expected)) != 0) {
+		printf("Append Range Read Failed\n");
+		fluxfs_free_vf(bytes);
+		fluxfs_free_vf(fill);
+		fluxfs_free_vf(vf);
+		return EXIT_FAILURE;
+	}
+	printf("Append Range Successful\n");
+
+	fluxfs_free_vf(bytes);
+	fluxfs_free_vf(fill);
+	fluxfs_free_vf(vf);
+
+	return EXIT_SUCCESS;
+}
+
+// Source paths are saved relative to the directory of the VF, including a
+// source directly inside it as fluxfs-mkvf and fluxfs-playlist write
+int test_relative_paths(void) {
+	printf("Relative Path Test:\n");
+
+	static const char *cases[][3] = {
+		{ "/out", "/out/source.bin", "source.bin" },
+		{ "/out/", "/out/source.bin", "source.bin" },
+		{ "/out", "/out", "" },
+		{ "/out/vf", "/out/source.bin", "../source.bin" },
+		{ "/outer", "/out/source.bin", "../out/source.bin" },
+		{ "/", "/out/source.bin", "out/source.bin" },
+		// fluxfs-playlist writes into the disc or a per disc output directory
+		{ "/disc", "/disc/BDMV/STREAM/00001.m2ts", "BDMV/STREAM/00001.m2ts" },
+		{ "/vf/disc", "/disc/BDMV/STREAM/00001.m2ts", "../../disc/BDMV/STREAM/00001.m2ts" },
+		{ "/disc/BDMV/STREAM", "/disc/BDMV/STREAM/00001.m2ts", "00001.m2ts" },
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		char *relative = relative_path(cases[i][0], cases[i][1]);
+		if (!relative || strcmp(relative, cases[i][2]) != 0) {
+			printf("Relative Path Failed: %s from %s gave %s\n", cases[i][1], cases[i][0], relative ? relative : "NULL");
+			free(relative);
+			return EXIT_FAILURE;
+		}
+		free(relative);
+	}
+	printf("Relative Path Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+// VFs naming the same source share one interned ID, and paths are saved
+// relative to wherever the VF is written
+int test_sources(void) {
+	printf("Source Table Test:\n");
+
+	mkdir("nested", 0755);
+	struct fluxfs_vf *a = fluxfs_load_vf("fluxfs.vf");
+	struct fluxfs_vf *b = fluxfs_create_vf("files/nested.bin");
+	uint32_t index = b ? fluxfs_vf_add_path(b, "nested/../source.bin") : UINT32_MAX;
+	int failed = !a || index == UINT32_MAX || a->sources[0] != b->sources[index];
+	failed |= !failed && !fluxfs_vf_add_file_offset(b, index, 10, 5);
+	failed |= !failed && fluxfs_save_vf(b, "nested/fluxfs-nested.vf") != EXIT_SUCCESS;
+	fluxfs_free_vf(b);
+	b = failed ? NULL : fluxfs_load_vf("nested/fluxfs-nested.vf");
+
+	const char *path = b ? fluxfs_source_path(b->sources[0]) : "";
+	size_t pathLen = strlen(path);
+	char expected[10];
+	char buffer[10];
+	if (!b || a->sources[0] != b->sources[0] || path[0] != '/' || pathLen < 11 ||
+		strcmp(path + pathLen - 11, "/source.bin") != 0 ||
+		fluxfs_read_from_vf(a, expected, sizeof(expected), 10) != sizeof(expected) ||
+		fluxfs_read_from_vf(b, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+		memcmp(buffer, expected, sizeof(expected)) != 0) {
+		printf("Source Table Failed\n");
+		fluxfs_free_vf(a);
+		fluxfs_free_vf(b);
+		return EXIT_FAILURE;
+	}
+	fluxfs_free_vf(b);
+
+	// Paths of a VF reached through a symlinked directory start from the
+	// directory it links to
+	mkdir("linked", 0755);
+	unlink("nested/link");
+	b = fluxfs_create_vf("files/linked.bin");
+	index = b ? fluxfs_vf_add_path(b, "source.bin") : UINT32_MAX;
+	failed = index == UINT32_MAX || !fluxfs_vf_add_file_offset(b, index, 10, 5);
+	failed |= !failed && fluxfs_save_vf(b, "linked/fluxfs-linked.vf") != EXIT_SUCCESS;
+	failed |= !failed && symlink("../linked", "nested/link") != 0;
+	fluxfs_free_vf(b);
+	b = failed ? NULL : fluxfs_load_vf("nested/link/fluxfs-linked.vf");
+	if (!b || a->sources[0] != b->sources[0] || fluxfs_read_from_vf(b, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+		memcmp(buffer, expected, sizeof(expected)) != 0) {
+		printf("Source Table Symlink Failed\n");
+		fluxfs_free_vf(a);
+		fluxfs_free_vf(b);
+		return EXIT_FAILURE;
+	}
+	printf("Source Table Successful\n");
+
+	fluxfs_free_vf(a);
+	fluxfs_free_vf(b);
+
+	return EXIT_SUCCESS;
+}
+
+// A mirrored source loads and reads while its first replica is missing,
+// and saving keeps every replica
+int test_mirrors(void) {
+	printf("Mirror Test:\n");
+
+	remove("missing.bin");
+	const char *replicas[] = { "missing.bin", "source.bin" };
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/mirror.bin");
+	uint32_t index = vf ? fluxfs_vf_add_mirrored_path(vf, replicas, 2) : UINT32_MAX;
+	int failed = index == UINT32_MAX || !fluxfs_vf_add_file_offset(vf, index, 10, 5);
+	failed |= !failed && fluxfs_save_vf(vf, "fluxfs-mirror.vf") != EXIT_SUCCESS;
+	fluxfs_free_vf(vf);
+	vf = failed ? NULL : fluxfs_load_vf("fluxfs-mirror.vf");
+
+	struct fluxfs_vf *plain = fluxfs_load_vf("fluxfs.vf");
+	char expected[10];
+	char buffer[10];
+	if (!vf || !plain || vf->version != FLUXFS_VF_VERSION_2 ||
+		fluxfs_source_replica_count(vf->sources[0]) != 2 ||
+		strstr(fluxfs_source_replica_path(vf->sources[0], 0), "/missing.bin") == NULL ||
+		fluxfs_read_from_vf(plain, expected, sizeof(expected), 10) != sizeof(expected) ||
+		fluxfs_read_from_vf(vf, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+		memcmp(buffer, expected, sizeof(expected)) != 0) {
+		printf("Mirror Test Failed\n");
+		fluxfs_free_vf(vf);
+		fluxfs_free_vf(plain);
+		return EXIT_FAILURE;
+	}
+	printf("Mirror Test Successful\n");
+
+	fluxfs_free_vf(vf);
+	fluxfs_free_vf(plain);
+
+	return EXIT_SUCCESS;
+}
+
+// A file of several index pages opens without decoding its entries, reads
+// decode the pages they touch and match the file before it was saved
+struct indexReader {
+	struct fluxfs_vf *vf;
+	const char *expected;
+	int size;
+	int failed;
+};
+
+// Reads the pages of a shared VF backwards, racing the other readers to
+// decode them
+static void *readIndexPages(void *arg) {
+	struct indexReader *reader = arg;
+	char buffer[900];
+	for (int offset = reader->size - 1000; offset > 0; offset -= 333) {
+		reader->failed |= fluxfs_read_from_vf(reader->vf, buffer, sizeof(buffer), offset) != sizeof(buffer) ||
+			memcmp(buffer, reader->expected + offset, sizeof(buffer)) != 0;
+	}
+	return NULL;
+}
+
+int test_index(void) {
+	printf("Index Test:\n");
+
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/indexed.bin");
+	uint32_t index = vf ? fluxfs_vf_add_path(vf, "source.bin") : UINT32_MAX;
+	const int entryCount = FLUXFS_INDEX_PAGE_ENTRIES * 2 + 100;
+	for (int i = 0; i < entryCount && index != UINT32_MAX; i++) {
+		char data[3] = { i, i >> 8, 0x55 };
+		if (i % 2) {
+			fluxfs_vf_add_file_offset(vf, index, 1 + i % 7, i % 17);
+		} else {
+			fluxfs_vf_add_data(vf, 1 + i % 3, data);
+		}
+	}
+	static char expected[8 * (FLUXFS_INDEX_PAGE_ENTRIES * 2 + 100)];
+	static char buffer[sizeof(expected)];
+	int size = vf ? fluxfs_read_from_vf(vf, expected, sizeof(expected), 0) : -1;
+	int failed = index == UINT32_MAX || size <= 0;
+	if (!failed) {
+		vf->version = FLUXFS_VF_VERSION_2;
+		failed = fluxfs_save_vf(vf, "fluxfs-index.vf") != EXIT_SUCCESS;
+	}
+	fluxfs_free_vf(vf);
+	vf = failed ? NULL : fluxfs_load_vf("fluxfs-index.vf");
+
+	// Backwards across page boundaries, then the whole file
+	failed = !vf || vf->index == NULL || vf->head != NULL || vf->size != (uint64_t)size;
+	for (int offset = size - 1000; offset > 0 && !failed; offset -= 777) {
+		failed = fluxfs_read_from_vf(vf, buffer, 900, offset) != 900 || memcmp(buffer, expected + offset, 900) != 0;
+	}
+	failed |= !failed && (fluxfs_read_from_vf(vf, buffer, sizeof(buffer), 0) != size || memcmp(buffer, expected, size) != 0);
+
+	// Several threads reading one VF decode each page once between them
+	struct fluxfs_vf *shared = failed ? NULL : fluxfs_load_vf("fluxfs-index.vf");
+	struct indexReader readers[4];
+	pthread_t threads[4];
+	int started = 0;
+	for (int i = 0; i < 4 && shared; i++) {
+		readers[i] = (struct indexReader){ shared, expected, size, 0 };
+		if (pthread_create(&threads[i], NULL, readIndexPages, &readers[i]) == 0) {
+			started++;
+		}
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+		failed |= readers[i].failed;
+	}
+	failed |= !shared || started == 0;
+
+	// Decoded pages are counted and can be dropped, to be decoded again
+	size_t pages = shared ? fluxfs_vf_page_memory(shared) : 0;
+	failed |= pages == 0 || fluxfs_vf_memory(shared) < pages;
+	if (shared) {
+		fluxfs_vf_drop_pages(shared);
+		failed |= fluxfs_vf_page_memory(shared) != 0;
+		failed |= fluxfs_read_from_vf(shared, buffer, sizeof(buffer), 0) != size || memcmp(buffer, expected, size) != 0;
+		failed |= fluxfs_vf_page_memory(shared) != pages;
+	}
+	fluxfs_free_vf(shared);
+
+	// Decoding every page gives back the plain entry list
+	int entries = 0;
+	failed |= !failed && fluxfs_vf_load_entries(vf) != 0;
+	for (struct vf_entry *entry = failed ? NULL : vf->head; entry; entry = entry->next) {
+		entries++;
+	}
+	failed |= vf && (vf->index != NULL || entries != entryCount);
+
+	// Saving a changed file over it leaves another VF still decoding its
+	// pages intact
+	struct fluxfs_vf *reader = failed ? NULL : fluxfs_load_vf("fluxfs-index.vf");
+	failed |= !reader || fluxfs_vf_delete(vf, 0, 1000) != 0 || fluxfs_save_vf(vf, "fluxfs-index.vf") != EXIT_SUCCESS || access("fluxfs-index.vf.tmp", F_OK) == 0;
+	failed |= !failed && (fluxfs_read_from_vf(reader, buffer, sizeof(buffer), 0) != size || memcmp(buffer, expected, size) != 0);
+	fluxfs_free_vf(reader);
+	fluxfs_free_vf(vf);
+
+	if (failed) {
+		printf("Index Test Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("Index Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+// A reference with a few changed bytes stays one patch entry, and writes
+// split it into pieces that keep their patches
+int test_patch(void) {
+	printf("Patch Test:\n");
+
+	char source[25];
+	FILE *file = fopen("source.bin", "rb");
+	size_t sourceSize = file ? fread(source, 1, sizeof(source), file) : 0;
+	if (file) {
+		fclose(file);
+	}
+
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/patched.bin");
+	uint32_t index = vf ? fluxfs_vf_add_path(vf, "source.bin") : UINT32_MAX;
+	int failed = sourceSize != sizeof(source) || index == UINT32_MAX || !fluxfs_vf_add_file_offset(vf, index, 5, 2) ||
+		fluxfs_vf_extend_reference(vf, "AB", 2, 6) != 0 || fluxfs_vf_extend_reference(vf, "C", 1, 4) != 0;
+	failed |= !failed && fluxfs_save_vf(vf, "fluxfs-patch.vf") != EXIT_SUCCESS;
+	fluxfs_free_vf(vf);
+	vf = failed ? NULL : fluxfs_load_vf("fluxfs-patch.vf");
+
+	char expected[18];
+	char buffer[18];
+	memcpy(expected, source + 2, sizeof(expected));
+	memcpy(expected + 5, "AB", 2);
+	expected[13] = 'C';
+	failed = !vf || !vf->head || vf->head->next || vf->head->type != FLUXFS_ENTRY_PATCH ||
+		fluxfs_read_from_vf(vf, buffer, sizeof(buffer), 0) != sizeof(buffer) || memcmp(buffer, expected, sizeof(buffer)) != 0;
+
+	// Split across the first patch
+	failed |= !failed && fluxfs_vf_write(vf, "x", 1, 6) != 0;
+	expected[6] = 'x';
+	failed |= !failed && (fluxfs_read_from_vf(vf, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+		memcmp(buffer, expected, sizeof(buffer)) != 0);
+	fluxfs_free_vf(vf);
+
+	if (failed) {
+		printf("Patch Test Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("Patch Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+// An exported file holds the same bytes as the virtual file it came from
+int test_export(void) {
+	printf("Export Test:\n");
+
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/export.bin");
+	uint32_t index = vf ? fluxfs_vf_add_path(vf, "source.bin") : UINT32_MAX;
+	int failed = index == UINT32_MAX || !fluxfs_vf_add_data(vf, 3, "abc") || !fluxfs_vf_add_file_offset(vf, index, 10, 4) ||
+		!fluxfs_vf_add_zero(vf, 5000) || !fluxfs_vf_add_pattern(vf, 7, "xy", 2) ||
+		!fluxfs_vf_add_file_offset(vf, index, 4, 0) || fluxfs_vf_extend_reference(vf, "P", 1, 5) != 0;
+	failed |= !failed && fluxfs_save_vf(vf, "fluxfs-export.vf") != EXIT_SUCCESS;
+	fluxfs_free_vf(vf);
+	vf = failed ? NULL : fluxfs_load_vf("fluxfs-export.vf");
+
+	char expected[5030];
+	char buffer[5031];
+	struct fluxfs_export_stats stats;
+	failed = !vf || vf->size != sizeof(expected) || fluxfs_vf_export(vf, "fluxfs-export.bin", 2, &stats) != 0 ||
+		fluxfs_read_from_vf(vf, expected, sizeof(expected), 0) != sizeof(expected);
+	fluxfs_free_vf(vf);
+
+	// Zeros stay a hole and the patched byte is written over its source byte
+	FILE *file = failed ? NULL : fopen("fluxfs-export.bin", "rb");
+	failed |= !file || fread(buffer, 1, sizeof(buffer), file) != sizeof(expected) || memcmp(buffer, expected, sizeof(expected)) != 0 ||
+		stats.cloned + stats.copied + stats.written != sizeof(expected) - 5000 + 1;
+	if (file) {
+		fclose(file);
+	}
+
+	if (failed) {
+		printf("Export Test Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("Export Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+// Equal embedded data is held once, in memory and in the blob pack
+int test_blobs(void) {
+	printf("Blob Test:\n");
+
+	char data[FLUXFS_BLOB_MIN_SIZE * 2];
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = (char)(i * 7 + 3);
+	}
+	remove(FLUXFS_BLOB_PACK_NAME);
+
+	struct fluxfs_blob_stats before, after;
+	fluxfs_blob_stats(&before);
+	struct fluxfs_vf *first = fluxfs_create_vf("files/blob-1.bin");
+	struct fluxfs_vf *second = fluxfs_create_vf("files/blob-2.bin");
+	int failed = !first || !second || !fluxfs_vf_add_data(first, sizeof(data), data) ||
+		!fluxfs_vf_add_data(second, sizeof(data), data) || !fluxfs_vf_add_zero(second, 10);
+	fluxfs_blob_stats(&after);
+	failed |= after.savedBytes - before.savedBytes != sizeof(data) || first->head->data.bytes != second->head->data.bytes;
+
+	// Both files refer to one packed copy
+	if (!failed) {
+		fluxfs_vf_pack_blobs(first);
+		fluxfs_vf_pack_blobs(second);
+		failed |= fluxfs_save_vf(first, "fluxfs-blob-1.vf") != EXIT_SUCCESS ||
+			fluxfs_save_vf(second, "fluxfs-blob-2.vf") != EXIT_SUCCESS;
+	}
+	fluxfs_free_vf(first);
+	fluxfs_free_vf(second);
+	struct stat st;
+	failed |= !failed && (stat(FLUXFS_BLOB_PACK_NAME, &st) != 0 || st.st_size != 8 + 16 + sizeof(data) ||
+		stat("fluxfs-blob-1.vf", &st) != 0 || st.st_size >= (off_t)sizeof(data));
+
+	first = failed ? NULL : fluxfs_load_vf("fluxfs-blob-1.vf");
+	second = failed ? NULL : fluxfs_load_vf("fluxfs-blob-2.vf");
+	char buffer[sizeof(data)];
+	failed = !first || !second || fluxfs_read_from_vf(first, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+		memcmp(buffer, data, sizeof(data)) != 0;
+
+	// A write copies the shared bytes first
+	failed |= !failed && fluxfs_vf_write(first, "x", 1, 5) != 0;
+	failed |= !failed && (fluxfs_read_from_vf(second, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+		memcmp(buffer, data, sizeof(data)) != 0);
+	failed |= !failed && (fluxfs_read_from_vf(first, buffer, 6, 0) != 6 || buffer[5] != 'x');
+	fluxfs_free_vf(first);
+	fluxfs_free_vf(second);
+
+	// Growing the pack extends its one mapping instead of mapping it again
+	struct blob_pack *pack = failed ? NULL : blob_pack_get(".", 1);
+	failed |= !pack;
+	for (int i = 0; i < 64 && !failed; i++) {
+		uint64_t hash;
+		data[0] = (char)i;
+		failed = blob_pack_store(pack, (uint8_t *)data, sizeof(data), &hash) != 0;
+		uint8_t *bytes = failed ? NULL : blob_pack_load(pack, hash, sizeof(data));
+		failed = !bytes || memcmp(bytes, data, sizeof(data)) != 0;
+		if (bytes) {
+			blob_release(bytes);
+		}
+	}
+	int mappings = 0;
+	FILE *maps = fopen("/proc/self/maps", "r");
+	char line[4096];
+	while (maps && fgets(line, sizeof(line), maps)) {
+		mappings += strstr(line, FLUXFS_BLOB_PACK_NAME) != NULL;
+	}
+	if (maps) {
+		fclose(maps);
+	}
+	failed |= mappings == 0 || mappings > 4;
+
+	if (failed) {
+		printf("Blob Test Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("Blob Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+// Records of a pack load like the .vf files they were packed from
+int test_pack(void) {
+	printf("Pack Test:\n");
+
+	char *vfPaths[] = { "fluxfs-patch.vf", "fluxfs-export.vf" };
+	struct fluxfs_pack *pack = NULL;
+	int failed = fluxfs_pack_create("fluxfs-test" FLUXFS_PACK_EXTENSION, vfPaths, 2) != 0 ||
+		!(pack = fluxfs_pack_open("fluxfs-test" FLUXFS_PACK_EXTENSION)) || pack->count != 2;
+
+	const struct fluxfs_pack_record *record = failed ? NULL : fluxfs_pack_find(pack, "files/export.bin");
+	failed |= !record || record->size != 5030 || strcmp(fluxfs_pack_name(pack, record), "fluxfs-export.vf") != 0 ||
+		fluxfs_pack_find_name(pack, "fluxfs-patch.vf") == NULL || fluxfs_pack_find(pack, "files/missing.bin") != NULL;
+	fluxfs_pack_close(pack);
+
+	// Relative sources still resolve from the directory of the pack
+	struct fluxfs_vf *packed = failed ? NULL : fluxfs_load_vf("fluxfs-test" FLUXFS_PACK_EXTENSION "/fluxfs-export.vf");
+	struct fluxfs_vf *vf = fluxfs_load_vf("fluxfs-export.vf");
+	char expected[5030];
+	char buffer[5030];
+	struct stat st;
+	failed = !packed || !vf || strcmp(packed->vpath, vf->vpath) != 0 ||
+		fluxfs_read_from_vf(vf, expected, sizeof(expected), 0) != sizeof(expected) ||
+		fluxfs_read_from_vf(packed, buffer, sizeof(buffer), 0) != sizeof(buffer) || memcmp(buffer, expected, sizeof(buffer)) != 0 ||
+		fluxfs_vf_stat("fluxfs-test" FLUXFS_PACK_EXTENSION "/fluxfs-export.vf", &st) != 0;
+	fluxfs_free_vf(packed);
+	fluxfs_free_vf(vf);
+
+	// A record named outside the directory of the pack is rejected
+	FILE *file = fopen("fluxfs-test" FLUXFS_PACK_EXTENSION, "r+b");
+	char *bytes = file ? malloc(st.st_size) : NULL;
+	failed |= !bytes || fread(bytes, 1, st.st_size, file) != (size_t)st.st_size;
+	char *name = NULL;
+	for (char *at = bytes; !failed && (at = memmem(at, bytes + st.st_size - at, "fluxfs-export.vf", 17)); at++) {
+		name = at;
+	}
+	failed |= !name || fseek(file, name - bytes, SEEK_SET) != 0 || fwrite("../luxfs-export.", 1, 16, file) != 16;
+	if (file) {
+		fclose(file);
+	}
+	free(bytes);
+	pack = failed ? NULL : fluxfs_pack_open("fluxfs-test" FLUXFS_PACK_EXTENSION);
+	failed |= pack != NULL;
+	fluxfs_pack_close(pack);
+
+	if (failed) {
+		printf("Pack Test Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("Pack Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+static void *serveHttp(void *arg) {
+	http_serve("127.0.0.1", *(unsigned *)arg);
+	return NULL;
+}
+
+// Send requests to the server on the loopback address and read the
+// responses until it closes the connection. Returns the bytes read.
+static size_t http_exchange(unsigned port, const char *request, char *response, size_t size) {
+	struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	// The server may still be starting
+	int fd = -1;
+	for (int tries = 0; tries < 200 && fd < 0; tries++) {
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+			close(fd);
+			fd = -1;
+			usleep(10000);
+		}
+	}
+	if (fd < 0 || send(fd, request, strlen(request), MSG_NOSIGNAL) != (ssize_t)strlen(request)) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 0;
+	}
+	size_t used = 0;
+	ssize_t received;
+	while (used < size && (received = recv(fd, response + used, size - used, 0)) > 0) {
+		used += received;
+	}
+	close(fd);
+	return used;
+}
+
+// Parse the response at *at, moving it past the body. Returns the status,
+// or 0 if the response is incomplete.
+static int http_response(const char **at, const char *end, const char **head, const char **body, size_t *length) {
+	const char *headEnd = memmem(*at, end - *at, "\r\n\r\n", 4);
+	int status;
+	if (!headEnd || sscanf(*at, "HTTP/1.1 %d", &status) != 1) {
+		return 0;
+	}
+	const char *field = memmem(*at, headEnd - *at, "Content-Length: ", 16);
+	*length = field ? strtoull(field + 16, NULL, 10) : 0;
+	*head = *at;
+	*body = headEnd + 4;
+	if (*length > (size_t)(end - *body)) {
+		return 0;
+	}
+	*at = *body + *length;
+	return status;
+}
+
+// The HTTP server answers GET, HEAD, single ranges, unsatisfiable ranges
+// and pipelined requests over a loopback connection
+int test_http(void) {
+	printf("HTTP Test:\n");
+
+	static struct fluxfs_file files[2];
+	const char *paths[] = { "fluxfs.vf", "fluxfs-compressed.vf" };
+	const char *vpaths[] = { "http/plain.bin", "http/compressed.bin" };
+	struct tree_builder *builder = tree_builder_create();
+	int failed = !builder;
+	for (int i = 0; i < 2 && !failed; i++) {
+		files[i].real_path = (char *)paths[i];
+		files[i].size = fluxfs_get_vf_size(paths[i]);
+		pthread_mutex_init(&files[i].lock, NULL);
+		failed = tree_builder_add(builder, vpaths[i], &files[i]) != 0;
+	}
+	struct tree *tree = builder ? tree_builder_finish(builder) : NULL;
+	failed |= !tree;
+	if (tree) {
+		tree_publish(tree);
+	}
+
+	// A port the system picked as free
+	static unsigned port;
+	int probe = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_in address = { .sin_family = AF_INET };
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addressLength = sizeof(address);
+	failed |= probe < 0 || bind(probe, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+		getsockname(probe, (struct sockaddr *)&address, &addressLength) != 0;
+	port = ntohs(address.sin_port);
+	if (probe >= 0) {
+		close(probe);
+	}
+	pthread_t server;
+	failed |= failed || pthread_create(&server, NULL, serveHttp, &port) != 0;
+	if (!failed) {
+		pthread_detach(server);
+	}
+
+	// The compressed file is sent in several chunks through the buffer
+	static char expected[2][256 * 1024];
+	size_t sizes[2];
+	for (int i = 0; i < 2 && !failed; i++) {
+		struct fluxfs_vf *vf = fluxfs_load_vf(paths[i]);
+		sizes[i] = vf ? vf->size : 0;
+		failed = !vf || sizes[i] < 16 || sizes[i] > sizeof(expected[i]) ||
+			fluxfs_read_from_vf(vf, expected[i], sizes[i], 0) != (int)sizes[i];
+		fluxfs_free_vf(vf);
+	}
+
+	static char response[sizeof(expected[0]) + 4096];
+	char request[512];
+	const char *at, *end, *head, *body;
+	size_t length;
+	for (int i = 0; i < 2 && !failed; i++) {
+		snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n", vpaths[i]);
+		at = response;
+		end = response + http_exchange(port, request, response, sizeof(response));
+		failed = http_response(&at, end, &head, &body, &length) != 200 || length != sizes[i] ||
+			memcmp(body, expected[i], length) != 0 || at != end;
+	}
+
+	if (!failed) {
+		snprintf(request, sizeof(request), "HEAD /%s HTTP/1.1\r\nConnection: close\r\n\r\n", vpaths[0]);
+		at = response;
+		end = response + http_exchange(port, request, response, sizeof(response));
+		const char *headEnd = memmem(response, end - response, "\r\n\r\n", 4);
+		failed = !headEnd || headEnd + 4 != end || strncmp(response, "HTTP/1.1 200", 12) != 0;
+		char field[64];
+		snprintf(field, sizeof(field), "Content-Length: %zu\r\n", sizes[0]);
+		failed |= !memmem(response, end - response, field, strlen(field));
+	}
+
+	if (!failed) {
+		snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nRange: bytes=2-9\r\nConnection: close\r\n\r\n", vpaths[0]);
+		at = response;
+		end = response + http_exchange(port, request, response, sizeof(response));
+		char field[64];
+		snprintf(field, sizeof(field), "Content-Range: bytes 2-9/%zu\r\n", sizes[0]);
+		failed = http_response(&at, end, &head, &body, &length) != 206 || length != 8 ||
+			memcmp(body, expected[0] + 2, 8) != 0 || !memmem(head, body - head, field, strlen(field));
+	}
+
+	if (!failed) {
+		snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nRange: bytes=%zu-\r\nConnection: close\r\n\r\n", vpaths[0], sizes[0]);
+		at = response;
+		end = response + http_exchange(port, request, response, sizeof(response));
+		failed = http_response(&at, end, &head, &body, &length) != 416 || length != 0;
+	}
+
+	// Both requests sent at once are answered in order on one connection
+	if (!failed) {
+		snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nRange: bytes=0-3\r\n\r\n"
+			"GET /%s HTTP/1.1\r\nRange: bytes=4-7\r\nConnection: close\r\n\r\n", vpaths[0], vpaths[1]);
+		at = response;
+		end = response + http_exchange(port, request, response, sizeof(response));
+		failed = http_response(&at, end, &head, &body, &length) != 206 || length != 4 || memcmp(body, expected[0], 4) != 0;
+		failed |= http_response(&at, end, &head, &body, &length) != 206 || length != 4 || memcmp(body, expected[1] + 4, 4) != 0;
+		failed |= at != end;
+	}
+
+	// With the I/O scheduler on, references are read through it instead of
+	// being copied straight from the source
+	if (!failed) {
+		struct fluxfs_io_share shares[FLUXFS_IO_CLASSES] = {
+			[FLUXFS_IO_STREAMING] = { .weight = 8, .depth = 2 },
+			[FLUXFS_IO_INTERACTIVE] = { .weight = 4, .depth = 1 },
+			[FLUXFS_IO_BACKGROUND] = { .weight = 1, .depth = 1 },
+		};
+		struct fluxfs_io_stats before[FLUXFS_IO_CLASSES];
+		struct fluxfs_io_stats after[FLUXFS_IO_CLASSES];
+		failed = fluxfs_io_scheduler_enable(shares) != 0;
+		fluxfs_io_get_stats(before);
+		snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nConnection: close\r\n\r\n", vpaths[0]);
+		at = response;
+		end = response + http_exchange(port, request, response, sizeof(response));
+		fluxfs_io_get_stats(after);
+		fluxfs_io_scheduler_disable();
+		failed |= http_response(&at, end, &head, &body, &length) != 200 || length != sizes[0] ||
+			memcmp(body, expected[0], length) != 0;
+		failed |= after[FLUXFS_IO_INTERACTIVE].reads == before[FLUXFS_IO_INTERACTIVE].reads;
+	}
+
+	if (failed) {
+		printf("HTTP Test Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("HTTP Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+// A file without an index larger than the decode window, with entries
+// across its edges and one entry larger than the window, decodes whole
+int test_windowed(void) {
+	printf("Windowed Decode Test:\n");
+
+	const size_t bigLength = 3 * 1024 * 1024;
+	size_t total = 4099 * 1000 + bigLength;
+	char *expected = malloc(total);
+	char *buffer = malloc(total);
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/windowed.bin");
+	int failed = !expected || !buffer || !vf;
+	size_t at = 0;
+	for (int i = 0; i < 4100 && !failed; i++) {
+		size_t length = i == 4000 ? bigLength : 1000;
+		for (size_t b = 0; b < length; b++) {
+			expected[at + b] = (char)(i * 31 + b);
+		}
+		failed = !fluxfs_vf_add_data(vf, length, expected + at);
+		at += length;
+	}
+	failed |= !failed && fluxfs_save_vf(vf, "fluxfs-windowed.vf") != EXIT_SUCCESS;
+	fluxfs_free_vf(vf);
+
+	vf = failed ? NULL : fluxfs_load_vf("fluxfs-windowed.vf");
+	failed |= !vf || vf->index != NULL || vf->size != total ||
+		fluxfs_read_from_vf(vf, buffer, total, 0) != (int)total || memcmp(buffer, expected, total) != 0;
+	fluxfs_free_vf(vf);
+
+	// Cut inside the large entry, the entries after it take at most 1020
+	// bytes each
+	struct stat st;
+	failed |= stat("fluxfs-windowed.vf", &st) != 0 || truncate("fluxfs-windowed.vf", st.st_size - 99 * 1020 - 1000) != 0;
+	vf = failed ? NULL : fluxfs_load_vf("fluxfs-windowed.vf");
+	failed |= vf != NULL;
+	fluxfs_free_vf(vf);
+	remove("fluxfs-windowed.vf");
+	free(expected);
+	free(buffer);
+
+	if (failed) {
+		printf("Windowed Decode Test Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("Windowed Decode Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+// A file cut inside its last entry is rejected, cut before it loads without it
+int test_truncated(void) {
+	printf("Truncated Entry Test:\n");
+
+	char data[100];
+	memset(data, 'x', sizeof(data));
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/cut.bin");
+	int failed = !vf || !fluxfs_vf_add_data(vf, sizeof(data), data) || fluxfs_save_vf(vf, "fluxfs-cut.vf") != EXIT_SUCCESS;
+	fluxfs_free_vf(vf);
+
+	// The entry is a type byte, a one byte length and the data
+	struct stat st;
+	failed |= stat("fluxfs-cut.vf", &st) != 0;
+	for (off_t cut = 1; cut <= (off_t)sizeof(data) + 2 && !failed; cut++) {
+		failed = truncate("fluxfs-cut.vf", st.st_size - cut) != 0;
+		vf = failed ? NULL : fluxfs_load_vf("fluxfs-cut.vf");
+		failed |= cut <= (off_t)sizeof(data) + 1 ? vf != NULL : !vf || vf->size != 0;
+		fluxfs_free_vf(vf);
+	}
+	remove("fluxfs-cut.vf");
+
+	if (failed) {
+		printf("Truncated Entry Test Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("Truncated Entry Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+// Wraps the pread backend, failing every read of a file named fault and
+// returning the others in short pieces
+struct faultFile {
+	struct fluxfs_source_file file;
+	struct fluxfs_source_file *inner;
+	int fail;
+};
+
+static const struct fluxfs_source_backend *faultInner;
+static atomic_int faultCount;
+
+static struct fluxfs_source_file *fault_open(const char *path) {
+	struct faultFile *fault = malloc(sizeof(struct faultFile));
+	if (!fault) {
+		return NULL;
+	}
+	fault->inner = faultInner->open(path);
+	if (!fault->inner) {
+		free(fault);
+		return NULL;
+	}
+	fault->file.fd = fault->inner->fd;
+	fault->fail = strstr(path, "fault") != NULL;
+	return &fault->file;
+}
+
+static ssize_t fault_read_at(struct fluxfs_source_file *file, void *buf, size_t size, uint64_t offset) {
+	struct faultFile *fault = (struct faultFile *)file;
+	if (fault->fail) {
+		atomic_fetch_add(&faultCount, 1);
+		errno = EIO;
+		return -1;
+	}
+	return faultInner->read_at(fault->inner, buf, size > 1 ? size / 2 : size, offset);
+}
+
+static void fault_advise(struct fluxfs_source_file *file, uint64_t offset, uint64_t length, int advice) {
+	struct faultFile *fault = (struct faultFile *)file;
+	faultInner->advise(fault->inner, offset, length, advice);
+}
+
+static void fault_close(struct fluxfs_source_file *file) {
+	struct faultFile *fault = (struct faultFile *)file;
+	faultInner->close(fault->inner);
+	free(fault);
+}
+
+static const struct fluxfs_source_backend faultBackend = {
+	"fault", fault_open, fault_read_at, fault_advise, fault_close
+};
+
+// A backend plugged in for the sources opened after it, here one that fails
+// a replica and returns short reads, and the mmap backend on a mapped file
+int test_source_backends(void) {
+	printf("Source Backend Test:\n");
+
+	char expected[10];
+	char buffer[10];
+	struct fluxfs_vf *plain = fluxfs_load_vf("fluxfs.vf");
+	int failed = !plain || fluxfs_read_from_vf(plain, expected, sizeof(expected), 10) != sizeof(expected);
+	fluxfs_free_vf(plain);
+
+	// Opens fine, every read of it fails
+	FILE *fault = fopen("fault-source.bin", "wb");
+	failed |= !fault;
+	if (fault) {
+		fclose(fault);
+	}
+
+	faultInner = fluxfs_source_backend("pread");
+	fluxfs_source_set_backend(&faultBackend);
+	const char *replicas[] = { "fault-source.bin", "source.bin" };
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/fault.bin");
+	uint32_t index = vf ? fluxfs_vf_add_mirrored_path(vf, replicas, 2) : UINT32_MAX;
+	failed |= index == UINT32_MAX || !fluxfs_vf_add_file_offset(vf, index, 10, 5) ||
+		fluxfs_read_from_vf(vf, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+		memcmp(buffer, expected, sizeof(expected)) != 0 || atomic_load(&faultCount) == 0;
+	fluxfs_free_vf(vf);
+
+	// Large enough to be mapped, the bytes at its end are known
+	fluxfs_source_set_backend(fluxfs_source_backend("mmap"));
+	int fd = open("mapped.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	failed |= fd < 0 || ftruncate(fd, FLUXFS_MMAP_MIN_SIZE + sizeof(expected)) != 0 ||
+		pwrite(fd, expected, sizeof(expected), FLUXFS_MMAP_MIN_SIZE) != sizeof(expected);
+	if (fd >= 0) {
+		close(fd);
+	}
+	vf = fluxfs_create_vf("files/mapped.bin");
+	index = vf ? fluxfs_vf_add_path(vf, "mapped.bin") : UINT32_MAX;
+	failed |= index == UINT32_MAX || !fluxfs_vf_add_file_offset(vf, index, 20, FLUXFS_MMAP_MIN_SIZE - 10) ||
+		fluxfs_read_from_vf(vf, buffer, sizeof(buffer), 10) != sizeof(buffer) ||
+		memcmp(buffer, expected, sizeof(expected)) != 0 || fluxfs_read_from_vf(vf, buffer, 10, 0) != 10 ||
+		memcmp(buffer, "\0\0\0\0\0\0\0\0\0\0", 10) != 0;
+	fluxfs_vf_advise(vf, 0, 20, POSIX_FADV_WILLNEED);
+	fluxfs_free_vf(vf);
+	fluxfs_source_set_backend(NULL);
+	remove("mapped.bin");
+
+	if (failed) {
+		printf("Source Backend Test Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("Source Backend Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+struct ioReader {
+	struct fluxfs_vf *vf;
+	int ioClass;
+	int failed;
+};
+
+static void *readInClass(void *arg) {
+	struct ioReader *reader = arg;
+	char buffer[5030];
+	fluxfs_io_set_class(reader->ioClass);
+	for (int i = 0; i < 200; i++) {
+		reader->failed |= fluxfs_read_from_vf(reader->vf, buffer, sizeof(buffer), 0) != sizeof(buffer);
+	}
+	return NULL;
+}
+
+// Readers of every class share one device through the scheduler and each
+// read is counted in the class of its thread
+// Reads held in flight on a device no source is on, to watch the order the
+// scheduler lets them go in
+struct ioLoad {
+	int ioClass;
+	uint64_t size;
+	// Reads to make, 0 to read until ioStop
+	int reads;
+	uint64_t lastWaitMicros;
+};
+static const dev_t ioTestDevice = (dev_t)-2;
+static atomic_int ioStop;
+static atomic_int ioDispatched[FLUXFS_IO_CLASSES];
+static atomic_int ioInflight[FLUXFS_IO_CLASSES];
+static atomic_int ioMaxInflight[FLUXFS_IO_CLASSES];
+static atomic_int ioDeviceInflight;
+static atomic_int ioDeviceMaxInflight;
+
+static uint64_t test_micros(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+static void raise_max(atomic_int *max, int value) {
+	int seen = atomic_load(max);
+	while (value > seen && !atomic_compare_exchange_weak(max, &seen, value)) {
+	}
+}
+
+static void *loadInClass(void *arg) {
+	struct ioLoad *load = arg;
+	fluxfs_io_set_class(load->ioClass);
+	for (int i = 0; load->reads ? i < load->reads : !atomic_load(&ioStop); i++) {
+		uint64_t queued = test_micros();
+		struct io_device *device = io_begin(ioTestDevice, load->size);
+		load->lastWaitMicros = test_micros() - queued;
+		atomic_fetch_add(&ioDispatched[load->ioClass], 1);
+		raise_max(&ioMaxInflight[load->ioClass], atomic_fetch_add(&ioInflight[load->ioClass], 1) + 1);
+		raise_max(&ioDeviceMaxInflight, atomic_fetch_add(&ioDeviceInflight, 1) + 1);
+		usleep(100);
+		atomic_fetch_sub(&ioDeviceInflight, 1);
+		atomic_fetch_sub(&ioInflight[load->ioClass], 1);
+		io_end(device);
+	}
+	return NULL;
+}
+
+static int dispatched_total(void) {
+	int total = 0;
+	for (int c = 0; c < FLUXFS_IO_CLASSES; c++) {
+		total += atomic_load(&ioDispatched[c]);
+	}
+	return total;
+}
+
+// Run loads under shares. With counts, every load reads until measure
+// reads past the warmup, and counts gets the reads of each class among
+// them. Without, the last load starts after the warmup and runs its set
+// reads while the others go on. Returns 1 if that took cap reads in all.
+static int run_io_loads(const struct fluxfs_io_share shares[FLUXFS_IO_CLASSES], struct ioLoad *loads, int count,
+	int warmup, int measure, int counts[FLUXFS_IO_CLASSES], int cap) {
+	atomic_store(&ioStop, 0);
+	atomic_store(&ioDeviceMaxInflight, 0);
+	for (int c = 0; c < FLUXFS_IO_CLASSES; c++) {
+		atomic_store(&ioDispatched[c], 0);
+		atomic_store(&ioMaxInflight[c], 0);
+	}
+	if (fluxfs_io_scheduler_enable(shares) != 0) {
+		return 1;
+	}
+
+	pthread_t threads[count];
+	for (int i = 0; i < count - 1; i++) {
+		pthread_create(&threads[i], NULL, loadInClass, &loads[i]);
+	}
+	if (!counts) {
+		// The last load starts once the others queue up
+		while (dispatched_total() < warmup) {
+			usleep(500);
+		}
+	}
+	pthread_create(&threads[count - 1], NULL, loadInClass, &loads[count - 1]);
+	int capped = 0;
+	if (counts) {
+		int start[FLUXFS_IO_CLASSES];
+		while (dispatched_total() < warmup) {
+			usleep(500);
+		}
+		int started = 0;
+		for (int c = 0; c < FLUXFS_IO_CLASSES; c++) {
+			start[c] = atomic_load(&ioDispatched[c]);
+			started += start[c];
+		}
+		while (dispatched_total() < started + measure) {
+			usleep(500);
+		}
+		for (int c = 0; c < FLUXFS_IO_CLASSES; c++) {
+			counts[c] = atomic_load(&ioDispatched[c]) - start[c];
+		}
+	} else {
+		// The last load makes a set number of reads
+		pthread_join(threads[count - 1], NULL);
+		capped = dispatched_total() >= cap;
+	}
+	atomic_store(&ioStop, 1);
+	for (int i = 0; i < (counts ? count : count - 1); i++) {
+		pthread_join(threads[i], NULL);
+	}
+	fluxfs_io_scheduler_disable();
+	return capped;
+}
+
+int test_io_scheduler(void) {
+	printf("I/O Scheduler Test:\n");
+
+	struct fluxfs_io_share shares[FLUXFS_IO_CLASSES] = {
+		[FLUXFS_IO_STREAMING] = { .weight = 8, .depth = 2, .deadline = 1 },
+		[FLUXFS_IO_INTERACTIVE] = { .weight = 4, .depth = 1 },
+		[FLUXFS_IO_BACKGROUND] = { .weight = 1, .depth = 1 },
+	};
+	struct fluxfs_io_stats before[FLUXFS_IO_CLASSES];
+	struct fluxfs_io_stats after[FLUXFS_IO_CLASSES];
+	struct ioReader readers[6];
+	pthread_t threads[6];
+
+	// Each reader has its own VF, like readers of different titles
+	int failed = fluxfs_io_scheduler_enable(shares) != 0;
+	fluxfs_io_get_stats(before);
+	for (int i = 0; i < 6; i++) {
+		readers[i].vf = fluxfs_load_vf("fluxfs-export.vf");
+		readers[i].ioClass = i % FLUXFS_IO_CLASSES;
+		readers[i].failed = !readers[i].vf;
+	}
+	for (int i = 0; i < 6; i++) {
+		pthread_create(&threads[i], NULL, readInClass, &readers[i]);
+	}
+	for (int i = 0; i < 6; i++) {
+		pthread_join(threads[i], NULL);
+		failed |= readers[i].failed;
+		fluxfs_free_vf(readers[i].vf);
+	}
+	fluxfs_io_get_stats(after);
+
+	// Two readers of 200 reads per class, each read touches the source twice
+	for (int c = 0; c < FLUXFS_IO_CLASSES; c++) {
+		failed |= after[c].reads - before[c].reads != 800 || after[c].maxWaitMicros < before[c].maxWaitMicros;
+	}
+	fluxfs_io_scheduler_disable();
+	failed |= io_begin(ioTestDevice, 1) != NULL;
+
+	// Every class kept queued splits the device by weight, 8:4:1 of 650
+	struct ioLoad loads[18];
+	for (int i = 0; i < 18; i++) {
+		loads[i] = (struct ioLoad){ .ioClass = i % FLUXFS_IO_CLASSES, .size = 4096 };
+	}
+	struct fluxfs_io_share even[FLUXFS_IO_CLASSES] = {
+		[FLUXFS_IO_STREAMING] = { .weight = 8, .depth = FLUXFS_IO_DEVICE_DEPTH },
+		[FLUXFS_IO_INTERACTIVE] = { .weight = 4, .depth = FLUXFS_IO_DEVICE_DEPTH },
+		[FLUXFS_IO_BACKGROUND] = { .weight = 1, .depth = FLUXFS_IO_DEVICE_DEPTH },
+	};
+	int counts[FLUXFS_IO_CLASSES];
+	failed |= run_io_loads(even, loads, 18, 100, 650, counts, 0) != 0;
+	failed |= counts[FLUXFS_IO_STREAMING] < 320 || counts[FLUXFS_IO_STREAMING] > 480;
+	failed |= counts[FLUXFS_IO_INTERACTIVE] < 160 || counts[FLUXFS_IO_INTERACTIVE] > 240;
+	failed |= counts[FLUXFS_IO_BACKGROUND] < 30 || counts[FLUXFS_IO_BACKGROUND] > 70;
+	if (failed) {
+		printf("I/O Scheduler Shares %d:%d:%d\n", counts[0], counts[1], counts[2]);
+	}
+
+	// No class has more reads in flight than its depth
+	struct fluxfs_io_share capped[FLUXFS_IO_CLASSES] = {
+		[FLUXFS_IO_STREAMING] = { .weight = 8, .depth = 1 },
+		[FLUXFS_IO_INTERACTIVE] = { .weight = 4, .depth = 2 },
+		[FLUXFS_IO_BACKGROUND] = { .weight = 1, .depth = 1 },
+	};
+	failed |= run_io_loads(capped, loads, 18, 0, 300, counts, 0) != 0;
+	for (int c = 0; c < FLUXFS_IO_CLASSES; c++) {
+		failed |= atomic_load(&ioMaxInflight[c]) > (int)capped[c].depth;
+	}
+	failed |= atomic_load(&ioDeviceMaxInflight) > FLUXFS_IO_DEVICE_DEPTH;
+
+	// A background read far behind in its turns still goes once it is
+	// past its deadline, while the other classes keep the device busy
+	struct fluxfs_io_share deadline[FLUXFS_IO_CLASSES] = {
+		[FLUXFS_IO_STREAMING] = { .weight = 8, .depth = 2 },
+		[FLUXFS_IO_INTERACTIVE] = { .weight = 8, .depth = 2 },
+		[FLUXFS_IO_BACKGROUND] = { .weight = 1, .depth = 1, .deadline = 5 },
+	};
+	for (int i = 0; i < 8; i++) {
+		loads[i] = (struct ioLoad){ .ioClass = i % 2 ? FLUXFS_IO_INTERACTIVE : FLUXFS_IO_STREAMING, .size = 4096 };
+	}
+	loads[8] = (struct ioLoad){ .ioClass = FLUXFS_IO_BACKGROUND, .size = 1ull << 30, .reads = 2 };
+	failed |= run_io_loads(deadline, loads, 9, 100, 0, NULL, 100000) != 0;
+	failed |= loads[8].lastWaitMicros < 5000 || loads[8].lastWaitMicros > 1000000;
+
+	if (failed) {
+		printf("I/O Scheduler Test Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("I/O Scheduler Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+// Fill tier.bin with bytes derived from seed, keeping its mtime if asked
+static int writeTierSource(unsigned seed, const struct timespec *mtime) {
+	FILE *file = fopen("tier.bin", mtime ? "r+b" : "wb");
+	if (!file) {
+		return EXIT_FAILURE;
+	}
+	for (unsigned i = 0; i < 300000; i++) {
+		fputc((i * seed) >> 3, file);
+	}
+	fclose(file);
+	if (mtime) {
+		struct timespec times[2] = { *mtime, *mtime };
+		if (utimensat(AT_FDCWD, "tier.bin", times, 0) != 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+// Blocks read twice are kept in the cache directory and served from it,
+// also after the cache is reopened
+int test_block_cache(void) {
+	printf("Block Cache Test:\n");
+
+	struct stat st;
+	struct fluxfs_vf *vf = fluxfs_create_vf("files/tier.bin");
+	if (writeTierSource(7, NULL) != EXIT_SUCCESS || stat("tier.bin", &st) != 0 || !vf) {
+		fluxfs_free_vf(vf);
+		return EXIT_FAILURE;
+	}
+	// Crosses the end of the first block
+	fluxfs_vf_add_file_offset(vf, fluxfs_vf_add_path(vf, "tier.bin"), 1000, FLUXFS_BLOCK_CACHE_BLOCK_SIZE - 500);
+	int failed = fluxfs_save_vf(vf, "fluxfs-tier.vf");
+	fluxfs_free_vf(vf);
+	vf = failed ? NULL : fluxfs_load_vf("fluxfs-tier.vf");
+
+	char expected[1000];
+	char buffer[1000];
+	failed = !vf || fluxfs_block_cache_open("blockcache", 4 * 1024 * 1024) != 0;
+	for (int i = 0; i < 2 && !failed; i++) {
+		failed = fluxfs_read_from_vf(vf, expected, sizeof(expected), 0) != sizeof(expected);
+	}
+
+	// Change the source behind the cache, same size and mtime
+	failed |= writeTierSource(13, &st.st_mtim) != EXIT_SUCCESS;
+	failed |= fluxfs_read_from_vf(vf, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+		memcmp(buffer, expected, sizeof(expected)) != 0;
+	fluxfs_block_cache_close();
+	failed |= fluxfs_block_cache_open("blockcache", 4 * 1024 * 1024) != 0;
+	failed |= fluxfs_read_from_vf(vf, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+		memcmp(buffer, expected, sizeof(expected)) != 0;
+	fluxfs_block_cache_close();
+
+	// Without the cache the source is read
+	failed |= fluxfs_read_from_vf(vf, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+		memcmp(buffer, expected, sizeof(expected)) == 0;
+	fluxfs_free_vf(vf);
+
+	if (failed) {
+		printf("Block Cache Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("Block Cache Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
+// Writes go to an overlay and are folded into the file without copying its references
+int test_overlay(void) {
+	printf("Overlay Test:\n");
+
+	createVirtualFile("fluxfs-overlay.vf");
+	remove("fluxfs-overlay.vf.overlay");
+
+	struct fluxfs_vf *vf = fluxfs_load_vf("fluxfs-overlay.vf");
+	if (!vf) {
+		return EXIT_FAILURE;
+	}
+	char expected[40];
+	memset(expected, 0, sizeof(expected));
+	fluxfs_read_from_vf(vf, expected, 30, 0);
+	fluxfs_free_vf(vf);
+
+	// Overwrite across the first data entry and the reference, cut the end,
+	// then write past the end leaving a hole. An insert moves the rest on
+	// and a delete takes the written end off again.
+	FILE *overlay = fluxfs_overlay_open("fluxfs-overlay.vf");
+	if (!overlay) {
+		return EXIT_FAILURE;
+	}
+	fluxfs_overlay_write(overlay, "ABCDEFGH", 8, 8);
+	fluxfs_overlay_truncate(overlay, 26);
+	fluxfs_overlay_write(overlay, "xy", 2, 28);
+	fluxfs_overlay_insert(overlay, "12", 2, 2);
+	fluxfs_overlay_delete(overlay, 30, 2);
+	if (fluxfs_overlay_close(overlay, "fluxfs-overlay.vf") != 0) {
+		return EXIT_FAILURE;
+	}
+	memcpy(expected + 8, "ABCDEFGH", 8);
+	memset(expected + 26, 0, 2);
+	memmove(expected + 4, expected + 2, 26);
+	memcpy(expected + 2, "12", 2);
+
+	for (int pass = 0; pass < 2; pass++) {
+		vf = fluxfs_load_vf("fluxfs-overlay.vf");
+		if (!vf || fluxfs_overlay_apply(vf, "fluxfs-overlay.vf") != 0) {
+			fluxfs_free_vf(vf);
+			return EXIT_FAILURE;
+		}
+
+		char buffer[30];
+		int references = 0;
+		for (struct vf_entry *entry = vf->head; entry; entry = entry->next) {
+			references += (entry->type == FLUXFS_ENTRY_REFERENCE);
+		}
+		if (vf->size != 30 || references != 1 ||
+			fluxfs_read_from_vf(vf, buffer, sizeof(buffer), 0) != sizeof(buffer) ||
+			memcmp(buffer, expected, sizeof(buffer)) != 0) {
+			printf("Overlay Read Failed In Pass %d\n", pass + 1);
+			fluxfs_free_vf(vf);
+			return EXIT_FAILURE;
+		}
+		fluxfs_free_vf(vf);
+
+		// The second pass reads the compacted file
+		if (pass == 0 && fluxfs_overlay_compact("fluxfs-overlay.vf") != 0) {
+			printf("Overlay Compaction Failed\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	// A journal grown past FLUXFS_OVERLAY_FOLD_SIZE is folded on close. The
+	// first write covers the whole file.
+	const int writes = FLUXFS_OVERLAY_FOLD_SIZE / 65536 + 2;
+	size_t foldedSize = (writes - 1) * 1000 + 65536;
+	char *folded = calloc(1, foldedSize);
+	char *chunk = malloc(65536);
+	char *buffer = malloc(foldedSize);
+	overlay = folded && chunk && buffer ? fluxfs_overlay_open("fluxfs-overlay.vf") : NULL;
+	int failed = !overlay;
+	for (int i = 0; i < writes && !failed; i++) {
+		memset(chunk, 'a' + i % 26, 65536);
+		failed = fluxfs_overlay_write(overlay, chunk, 65536, i * 1000) != 0;
+		memcpy(folded + i * 1000, chunk, 65536);
+	}
+	failed |= !failed && access("fluxfs-overlay.vf.overlay", F_OK) != 0;
+	if (overlay) {
+		failed |= fluxfs_overlay_close(overlay, "fluxfs-overlay.vf") != 0;
+	}
+	failed |= access("fluxfs-overlay.vf.overlay", F_OK) == 0;
+	vf = failed ? NULL : fluxfs_load_vf("fluxfs-overlay.vf");
+	failed |= !vf || vf->size != foldedSize || fluxfs_read_from_vf(vf, buffer, foldedSize, 0) != (int)foldedSize ||
+		memcmp(buffer, folded, foldedSize) != 0;
+	fluxfs_free_vf(vf);
+	free(folded);
+	free(chunk);
+	free(buffer);
+	if (failed) {
+		printf("Overlay Fold Failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("Overlay Test Successful\n");
+
+	return EXIT_SUCCESS;
+}
+
 int main() {
 	createSourceFile();
 	createVirtualFile("fluxfs.vf");
@@ -133,9 +1640,85 @@ int main() {
 	}
 
 	fluxfs_print_vf(vf);
-	test_vf(vf);
+	int result = test_vf(vf);
 
 	fluxfs_free_vf(vf);
 
-	return EXIT_SUCCESS;
+	createVirtualFileV2("fluxfs-v2.vf");
+	printf("-------------------------------------------------\n");
+
+	vf = fluxfs_load_vf("fluxfs-v2.vf");
+	if (!vf) {
+		fprintf(stderr, "Failed to load version 2 virtual file\n");
+		return EXIT_FAILURE;
+	}
+	if (vf->version != FLUXFS_VF_VERSION_2 || vf->sourceCount != 300) {
+		fprintf(stderr, "Version 2 header mismatch\n");
+		result = EXIT_FAILURE;
+	}
+	if (test_vf(vf) != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+
+	fluxfs_free_vf(vf);
+
+	if (test_compressed() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_fill() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_checksums() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_append_range() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_overlay() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_relative_paths() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_sources() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_block_cache() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_mirrors() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_index() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_patch() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_export() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_io_scheduler() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_blobs() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_pack() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_source_backends() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_truncated() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_windowed() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+	if (test_http() != EXIT_SUCCESS) {
+		result = EXIT_FAILURE;
+	}
+
+	return result;
 }
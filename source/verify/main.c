@@ -0,0 +1,534 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../lib/fluxfs.h"
+
+// Bytes read from a source at a time
+#define VERIFY_BLOCK_SIZE (4 * 1024 * 1024)
+
+// A checksummed reference range of one source file
+struct verify_task {
+	const char *source;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t checksum;
+	const char *vfPath;
+	size_t entryIndex;
+};
+
+// All tasks of one source, in offset order
+struct verify_source {
+	const char *path;
+	dev_t device;
+	struct verify_task *tasks;
+	size_t count;
+	int claimed;
+};
+
+struct verify_device {
+	dev_t device;
+	int active;
+};
+
+struct verify_state {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct verify_source *sources;
+	size_t sourceCount;
+	size_t claimedCount;
+	struct verify_device *devices;
+	size_t deviceCount;
+	int streamsPerDevice;
+	int keepCache;
+	int verbose;
+	uint64_t bytesVerified;
+	size_t failures;
+};
+
+static struct verify_task *tasks = NULL;
+static size_t task_count = 0;
+
+static char **vf_paths = NULL;
+static size_t vf_count = 0;
+
+// Resolved source paths, freed once verification is done
+static char **source_paths = NULL;
+static size_t source_path_count = 0;
+
+static int add_task(struct verify_task *task) {
+	struct verify_task *temp = realloc(tasks, (task_count + 1) * sizeof(struct verify_task));
+	if (!temp) {
+		perror("Memory allocation failed");
+		return 1;
+	}
+	tasks = temp;
+	tasks[task_count++] = *task;
+	return 0;
+}
+
+static void add_vf_path(char *path) {
+	char **temp = realloc(vf_paths, (vf_count + 1) * sizeof(char *));
+	if (!temp) {
+		perror("Memory allocation failed");
+		free(path);
+		return;
+	}
+	vf_paths = temp;
+	vf_paths[vf_count++] = path;
+}
+
+// Check the records of a pack like the .vf files they were packed from
+static void add_pack_paths(const char *pack_path) {
+	struct fluxfs_pack *pack = fluxfs_pack_open(pack_path);
+	for (uint64_t i = 0; pack && i < pack->count; i++) {
+		const char *name = fluxfs_pack_name(pack, &pack->records[i]);
+		size_t path_len = strlen(pack_path) + strlen(name) + 2;
+		char *path = malloc(path_len);
+		if (!path) {
+			perror("Memory allocation failed");
+			break;
+		}
+		snprintf(path, path_len, "%s/%s", pack_path, name);
+		add_vf_path(path);
+	}
+	fluxfs_pack_close(pack);
+}
+
+static int is_pack(const char *path) {
+	size_t len = strlen(path);
+	size_t ext_len = sizeof(FLUXFS_PACK_EXTENSION) - 1;
+	return len > ext_len && strcmp(path + len - ext_len, FLUXFS_PACK_EXTENSION) == 0;
+}
+
+static void scan_directory(const char *dir_path) {
+	DIR *dir = opendir(dir_path);
+	if (!dir) {
+		perror("Could not open directory");
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+
+		size_t path_len = strlen(dir_path) + strlen(entry->d_name) + 2;
+		char *full_path = malloc(path_len);
+		if (!full_path) {
+			perror("Memory allocation failed");
+			continue;
+		}
+		snprintf(full_path, path_len, "%s/%s", dir_path, entry->d_name);
+
+		struct stat path_stat;
+		if (stat(full_path, &path_stat) == 0) {
+			if (S_ISDIR(path_stat.st_mode)) {
+				scan_directory(full_path);
+			} else if (S_ISREG(path_stat.st_mode)) {
+				size_t len = strlen(entry->d_name);
+				if (len > 3 && strcmp(entry->d_name + len - 3, ".vf") == 0) {
+					add_vf_path(full_path);
+					continue;
+				} else if (is_pack(entry->d_name)) {
+					add_pack_paths(full_path);
+				}
+			}
+		}
+		free(full_path);
+	}
+	closedir(dir);
+}
+
+// Canonical path of a source, so links to one file share its tasks
+static char *resolve_source(const char *source) {
+	char *resolved = realpath(source, NULL);
+	if (!resolved) {
+		return NULL;
+	}
+
+	char **temp = realloc(source_paths, (source_path_count + 1) * sizeof(char *));
+	if (!temp) {
+		free(resolved);
+		return NULL;
+	}
+	source_paths = temp;
+	source_paths[source_path_count++] = resolved;
+	return resolved;
+}
+
+// Check entries that are not plain references while the file is loaded,
+// and queue the reference entries for the scheduled pass
+static size_t collect_vf(const char *vfPath, size_t *unchecked) {
+	struct fluxfs_vf *vf = fluxfs_load_vf(vfPath);
+	if (!vf || fluxfs_vf_load_entries(vf) != 0) {
+		printf("FAILED %s: cannot be loaded\n", vfPath);
+		fluxfs_free_vf(vf);
+		return 1;
+	}
+
+	// Resolved path of each replica by path index
+	char **resolved = calloc(vf->sourceCount ? vf->sourceCount * FLUXFS_MAX_REPLICAS : 1, sizeof(char *));
+	if (!resolved) {
+		fluxfs_free_vf(vf);
+		return 1;
+	}
+
+	size_t failures = 0;
+	size_t entryIndex = 0;
+	uint64_t vfOffset = 0;
+	int checked = 0;
+	char *buf = NULL;
+
+	for (struct vf_entry *entry = vf->head; entry; entry = entry->next, entryIndex++) {
+		uint64_t entryOffset = vfOffset;
+		vfOffset += entry->length;
+		if (!(entry->flags & FLUXFS_ENTRY_FLAG_CHECKSUM)) {
+			continue;
+		}
+		checked = 1;
+
+		if (entry->type == FLUXFS_ENTRY_REFERENCE) {
+			// Every replica of a mirrored source must hold the same bytes
+			uint32_t id = vf->sources[entry->pathIndex];
+			for (uint32_t r = 0; r < fluxfs_source_replica_count(id); r++) {
+				size_t index = (size_t)entry->pathIndex * FLUXFS_MAX_REPLICAS + r;
+				const char *source = fluxfs_source_replica_path(id, r);
+				if (!resolved[index]) {
+					resolved[index] = resolve_source(source);
+				}
+				if (!resolved[index]) {
+					printf("FAILED %s entry %zu: %s is missing\n", vfPath, entryIndex, source);
+					failures++;
+					continue;
+				}
+				struct verify_task task = {
+					.source = resolved[index],
+					.offset = entry->data.offset,
+					.length = entry->length,
+					.checksum = entry->checksum,
+					.vfPath = vfPath,
+					.entryIndex = entryIndex
+				};
+				if (add_task(&task) != 0) {
+					failures++;
+				}
+			}
+			continue;
+		}
+
+		if (!buf) {
+			buf = malloc(VERIFY_BLOCK_SIZE);
+			if (!buf) {
+				failures++;
+				break;
+			}
+		}
+		uint32_t crc = 0;
+		for (uint64_t done = 0; done < entry->length;) {
+			size_t size = (entry->length - done < VERIFY_BLOCK_SIZE) ? entry->length - done : VERIFY_BLOCK_SIZE;
+			if (fluxfs_read_from_vf(vf, buf, size, entryOffset + done) != (int)size) {
+				crc = ~entry->checksum;
+				break;
+			}
+			crc = fluxfs_crc32c(crc, buf, size);
+			done += size;
+		}
+		if (crc != entry->checksum) {
+			printf("FAILED %s entry %zu: %s does not match its checksum\n", vfPath, entryIndex,
+				entry->type == FLUXFS_ENTRY_PATCH ? "patched source range" : "embedded data");
+			failures++;
+		}
+	}
+
+	if (!checked) {
+		(*unchecked)++;
+	}
+
+	free(resolved);
+	free(buf);
+	fluxfs_free_vf(vf);
+
+	return failures;
+}
+
+static int compare_tasks(const void *a, const void *b) {
+	const struct verify_task *ta = a;
+	const struct verify_task *tb = b;
+	int cmp = strcmp(ta->source, tb->source);
+	if (cmp != 0) {
+		return cmp;
+	}
+	if (ta->offset != tb->offset) {
+		return ta->offset < tb->offset ? -1 : 1;
+	}
+	return 0;
+}
+
+// Group the sorted tasks by source file and find the device of each source
+static void build_sources(struct verify_state *state) {
+	for (size_t i = 0; i < task_count; i++) {
+		if (i > 0 && strcmp(tasks[i].source, tasks[i - 1].source) == 0) {
+			state->sources[state->sourceCount - 1].count++;
+			continue;
+		}
+
+		struct verify_source *source = &state->sources[state->sourceCount++];
+		memset(source, 0, sizeof(struct verify_source));
+		source->path = tasks[i].source;
+		source->tasks = &tasks[i];
+		source->count = 1;
+
+		struct stat st;
+		if (stat(source->path, &st) == 0) {
+			source->device = st.st_dev;
+		}
+
+		size_t d = 0;
+		while (d < state->deviceCount && state->devices[d].device != source->device) {
+			d++;
+		}
+		if (d == state->deviceCount) {
+			state->devices[state->deviceCount].device = source->device;
+			state->devices[state->deviceCount].active = 0;
+			state->deviceCount++;
+		}
+	}
+}
+
+static struct verify_device *find_device(struct verify_state *state, dev_t device) {
+	for (size_t i = 0; i < state->deviceCount; i++) {
+		if (state->devices[i].device == device) {
+			return &state->devices[i];
+		}
+	}
+	return NULL;
+}
+
+static void verify_source(struct verify_state *state, struct verify_source *source, uint8_t *buf) {
+	int fd = open(source->path, O_RDONLY);
+	if (fd < 0) {
+		pthread_mutex_lock(&state->lock);
+		for (size_t i = 0; i < source->count; i++) {
+			printf("FAILED %s entry %zu: cannot open %s\n", source->tasks[i].vfPath, source->tasks[i].entryIndex, source->path);
+		}
+		state->failures += source->count;
+		pthread_mutex_unlock(&state->lock);
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	for (size_t i = 0; i < source->count; i++) {
+		struct verify_task *task = &source->tasks[i];
+		uint32_t crc = 0;
+		int readError = 0;
+
+		for (uint64_t done = 0; done < task->length;) {
+			size_t size = (task->length - done < VERIFY_BLOCK_SIZE) ? task->length - done : VERIFY_BLOCK_SIZE;
+			off_t offset = task->offset + done;
+			ssize_t bytesRead = pread(fd, buf, size, offset);
+			if (bytesRead <= 0) {
+				readError = 1;
+				break;
+			}
+			crc = fluxfs_crc32c(crc, buf, bytesRead);
+			done += bytesRead;
+			if (!state->keepCache) {
+				// A sweep should not push hot titles out of the page cache
+				posix_fadvise(fd, offset, bytesRead, POSIX_FADV_DONTNEED);
+			}
+		}
+
+		pthread_mutex_lock(&state->lock);
+		if (readError) {
+			printf("FAILED %s entry %zu: read error in %s at %" PRIu64 "\n", task->vfPath, task->entryIndex, source->path, task->offset);
+			state->failures++;
+		} else if (crc != task->checksum) {
+			printf("FAILED %s entry %zu: %s changed at %" PRIu64 " (%" PRIu64 " bytes)\n", task->vfPath, task->entryIndex, source->path, task->offset, task->length);
+			state->failures++;
+		} else {
+			state->bytesVerified += task->length;
+			if (state->verbose) {
+				printf("OK %s entry %zu\n", task->vfPath, task->entryIndex);
+			}
+		}
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	close(fd);
+}
+
+// Each worker claims a whole source file so it is read front to back,
+// with at most streamsPerDevice sources read from one device at a time
+static void *verify_worker(void *arg) {
+	struct verify_state *state = arg;
+	uint8_t *buf = malloc(VERIFY_BLOCK_SIZE);
+	if (!buf) {
+		perror("Memory allocation failed");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	while (state->claimedCount < state->sourceCount) {
+		struct verify_source *source = NULL;
+		for (size_t i = 0; i < state->sourceCount; i++) {
+			struct verify_source *candidate = &state->sources[i];
+			if (!candidate->claimed && find_device(state, candidate->device)->active < state->streamsPerDevice) {
+				source = candidate;
+				break;
+			}
+		}
+		if (!source) {
+			pthread_cond_wait(&state->cond, &state->lock);
+			continue;
+		}
+
+		struct verify_device *device = find_device(state, source->device);
+		source->claimed = 1;
+		state->claimedCount++;
+		device->active++;
+		pthread_mutex_unlock(&state->lock);
+
+		verify_source(state, source, buf);
+
+		pthread_mutex_lock(&state->lock);
+		device->active--;
+		pthread_cond_broadcast(&state->cond);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	free(buf);
+	return NULL;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [options] <directory, .vf or .vfpack file>...\n", name);
+	printf("  Verifies virtual files against the checksums recorded when they were built\n");
+	printf("  -j <threads>   Worker threads (default 8)\n");
+	printf("  -d <streams>   Sources read at once from one device (default 1)\n");
+	printf("  -k             Keep verified data in the page cache\n");
+	printf("  -v             Print every verified entry\n");
+}
+
+int main(int argc, char *argv[]) {
+	int threads = 8;
+	struct verify_state state;
+	memset(&state, 0, sizeof(state));
+	state.streamsPerDevice = 1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "j:d:kvh")) != -1) {
+		switch (opt) {
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'd':
+			state.streamsPerDevice = atoi(optarg);
+			break;
+		case 'k':
+			state.keepCache = 1;
+			break;
+		case 'v':
+			state.verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc || threads < 1 || state.streamsPerDevice < 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		struct stat path_stat;
+		if (stat(argv[i], &path_stat) != 0) {
+			perror(argv[i]);
+			continue;
+		}
+		if (S_ISDIR(path_stat.st_mode)) {
+			scan_directory(argv[i]);
+		} else if (is_pack(argv[i])) {
+			add_pack_paths(argv[i]);
+		} else {
+			add_vf_path(strdup(argv[i]));
+		}
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	size_t unchecked = 0;
+	for (size_t i = 0; i < vf_count; i++) {
+		state.failures += collect_vf(vf_paths[i], &unchecked);
+	}
+
+	qsort(tasks, task_count, sizeof(struct verify_task), compare_tasks);
+
+	state.sources = malloc((task_count ? task_count : 1) * sizeof(struct verify_source));
+	state.devices = malloc((task_count ? task_count : 1) * sizeof(struct verify_device));
+	if (!state.sources || !state.devices) {
+		perror("Memory allocation failed");
+		return EXIT_FAILURE;
+	}
+	build_sources(&state);
+
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.cond, NULL);
+
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	if (!workers) {
+		perror("Memory allocation failed");
+		return EXIT_FAILURE;
+	}
+	int started = 0;
+	while (started < threads && pthread_create(&workers[started], NULL, verify_worker, &state) == 0) {
+		started++;
+	}
+	if (started == 0) {
+		verify_worker(&state);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("Verified %zu virtual files, %zu source files, %" PRIu64 " bytes in %.1f s (%.1f MB/s)\n",
+		vf_count, state.sourceCount, state.bytesVerified, seconds,
+		seconds > 0 ? state.bytesVerified / seconds / 1e6 : 0.0);
+	if (unchecked) {
+		printf("%zu virtual files have no checksums\n", unchecked);
+	}
+	printf("%zu failures\n", state.failures);
+
+	for (size_t i = 0; i < source_path_count; i++) {
+		free(source_paths[i]);
+	}
+	free(source_paths);
+	for (size_t i = 0; i < vf_count; i++) {
+		free(vf_paths[i]);
+	}
+	free(vf_paths);
+	free(tasks);
+	free(state.sources);
+	free(state.devices);
+	free(workers);
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.lock);
+
+	return state.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}